@@ -0,0 +1,247 @@
+/*
+ * Body codec (IoTClient::bodyCodec): the LZ block codec alone on JSON
+ * telemetry, log lines and random bytes cut into parts as the protocol does,
+ * with the default and the small window. Ratio, then compress and decompress
+ * rates over the input bytes.
+ *
+ * Then a 64 KiB JSON STREAMING over the loopback connection without and with
+ * the codec: wire bytes per body and body MB/s, each part checked on arrival.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "iot_protocol.h"
+#include "extras/host/iot_loopback_client.h"
+#include "iot_bench.h"
+
+#define BENCH_BODY (64 * 1024)
+
+static uint32_t seed = 12345;
+
+static uint32_t nextRandom()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static std::vector<uint8_t> jsonBody()
+{
+    std::string text = "[";
+    char record[192];
+    for (uint32_t i = 0; text.size() < BENCH_BODY; i++)
+    {
+        snprintf(record, sizeof(record),
+                 "{\"device\":\"thermostat-%04u\",\"ts\":%u,\"temperature\":%u.%u,\"humidity\":%u,\"battery\":%u,\"status\":\"%s\"},",
+                 i % 16, 1700000000 + i * 5, 18 + nextRandom() % 8, nextRandom() % 10, 40 + nextRandom() % 20,
+                 nextRandom() % 100, (nextRandom() % 8) ? "ok" : "degraded");
+        text += record;
+    }
+    return std::vector<uint8_t>(text.begin(), text.begin() + BENCH_BODY);
+}
+
+static std::vector<uint8_t> logBody()
+{
+    static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+    static const char *messages[] = {"wifi connected", "reading sent", "sensor sampled", "retrying publish", "heap low"};
+    std::string text;
+    char line[128];
+    for (uint32_t i = 0; text.size() < BENCH_BODY; i++)
+    {
+        snprintf(line, sizeof(line), "2024-05-17T10:%02u:%02u.%03uZ %-5s [core%u] %s (rssi=-%u)\n",
+                 (i / 60) % 60, i % 60, nextRandom() % 1000, levels[nextRandom() % 5], nextRandom() % 2,
+                 messages[nextRandom() % 5], 40 + nextRandom() % 40);
+        text += line;
+    }
+    return std::vector<uint8_t>(text.begin(), text.begin() + BENCH_BODY);
+}
+
+static std::vector<uint8_t> randomBody()
+{
+    std::vector<uint8_t> body(BENCH_BODY);
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        body[i] = (uint8_t)nextRandom();
+    }
+    return body;
+}
+
+/* Compresses and decompresses `body` in `part` byte blocks (stored when they do not shrink, as the protocol sends them) */
+static void benchCodec(const char *label, const std::vector<uint8_t> &body, size_t part, size_t window)
+{
+    std::vector<uint16_t> table(iotLzTableSize(window) / sizeof(uint16_t));
+    std::vector<uint8_t> blocks(body.size() + body.size() / part * 8 + 64);
+    std::vector<size_t> lengths; /* 0 = stored */
+    std::vector<uint8_t> out(part);
+
+    char name[64];
+    snprintf(name, sizeof(name), "compress %s [%zu B parts, %zu window]", label, part, window);
+    size_t encoded = 0;
+    IoTBenchResult compress = iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                                          {
+                                              lengths.clear();
+                                              encoded = 0;
+                                              size_t at = 0;
+                                              for (size_t offset = 0; offset < body.size(); offset += part)
+                                              {
+                                                  size_t length = iotLzCompress(&body[offset], part, &blocks[at], part - 1, &table[0], window);
+                                                  lengths.push_back(length);
+                                                  at += length;
+                                                  encoded += IOT_BODY_BLOCK_HEADER + ((length != 0) ? length : part);
+                                                  frames++;
+                                              }
+                                              bytes += body.size(); });
+
+    if (std::count(lengths.begin(), lengths.end(), (size_t)0) == (ptrdiff_t)lengths.size())
+    {
+        printf("%-40s %12.3f ratio %10.1f MB/s in, every part stored\n", "",
+               (double)encoded / body.size(), compress.bytes / compress.seconds / (1024.0 * 1024.0));
+        return;
+    }
+
+    snprintf(name, sizeof(name), "decompress %s [%zu B parts]", label, part);
+    IoTBenchResult decompress = iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                                            {
+                                                size_t at = 0;
+                                                for (size_t i = 0; i < lengths.size(); i++)
+                                                {
+                                                    if (lengths[i] != 0)
+                                                    {
+                                                        size_t length = 0;
+                                                        IOT_BENCH_CHECK(iotLzDecompress(&blocks[at], lengths[i], &out[0], part, &length) && length == part);
+                                                        IOT_BENCH_CHECK(frames > 0 || memcmp(&out[0], &body[i * part], part) == 0);
+                                                        at += lengths[i];
+                                                    }
+                                                    frames++;
+                                                }
+                                                bytes += body.size(); });
+
+    printf("%-40s %12.3f ratio %10.1f MB/s in %8.1f MB/s out\n", "",
+           (double)encoded / body.size(),
+           compress.bytes / compress.seconds / (1024.0 * 1024.0),
+           decompress.bytes / decompress.seconds / (1024.0 * 1024.0));
+}
+
+struct BenchPeer
+{
+    IoTLoopbackClient client;
+    IoTClient iotClient;
+    IoTProtocol protocol;
+};
+
+static std::vector<uint8_t> uploaded;
+static uint64_t bytesReceived = 0;
+
+static void receive(IoTRequest *request, Next *next)
+{
+    if (request->method != EIoTMethod::STREAMING)
+    {
+        (*next)();
+        return;
+    }
+    IOT_BENCH_CHECK(request->offset + request->bodyLength <= uploaded.size());
+    IOT_BENCH_CHECK(memcmp(request->body, &uploaded[request->offset], request->bodyLength) == 0);
+    bytesReceived += request->bodyLength;
+    (*next)();
+}
+
+static void setupPeers(BenchPeer *a, BenchPeer *b, EIoTBodyCodec codec, uint32_t window)
+{
+    IoTLoopbackClient::join(&a->client, &b->client);
+    BenchPeer *peers[] = {a, b};
+    for (size_t i = 0; i < 2; i++)
+    {
+        peers[i]->iotClient = IoTClient();
+        peers[i]->iotClient.client = &peers[i]->client;
+        peers[i]->iotClient.vectoredWriter = &peers[i]->client;
+        peers[i]->iotClient.bodyCodec = codec;
+        peers[i]->iotClient.bodyCodecWindow = window;
+        peers[i]->protocol.decodeMode = EIoTDecodeMode::VIEW;
+        peers[i]->protocol.listen(&peers[i]->iotClient);
+    }
+    b->protocol.use(receive);
+
+    /* One BUFFER_SIZE exchange tells each side what the other decodes, a second one switches a's frames */
+    a->protocol.bufferSizeRequest(&a->iotClient, a->iotClient.bufferSize);
+    for (int i = 0; i < 4; i++)
+    {
+        b->protocol.loop();
+        a->protocol.loop();
+    }
+    IOT_BENCH_CHECK(a->iotClient.sendCodec == codec && b->iotClient.receiveCodec == codec);
+}
+
+static void benchUpload(const char *label, EIoTBodyCodec codec, uint32_t window, size_t segment)
+{
+    std::unique_ptr<BenchPeer> peers[] = {std::unique_ptr<BenchPeer>(new BenchPeer()), std::unique_ptr<BenchPeer>(new BenchPeer())};
+    BenchPeer &a = *peers[0];
+    BenchPeer &b = *peers[1];
+    setupPeers(&a, &b, codec, window);
+    a.client.segmentOutput(segment);
+    static char path[] = "/upload";
+
+    char name[80];
+    snprintf(name, sizeof(name), "STREAMING 64 KiB %s [%s]", label, (codec == EIoTBodyCodec::NONE) ? "plain" : "lz");
+    uint64_t wire = 0;
+    IoTBenchResult result = iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                                        {
+                                            IoTLoopbackPipe *output = a.client.output();
+                                            uint64_t written = output->bytesWritten;
+                                            uint64_t expected = bytesReceived + uploaded.size();
+
+                                            IoTRequest request = {
+                                                IOT_VERSION,
+                                                EIoTMethod::STREAMING,
+                                                0,
+                                                path,
+                                                IoTHeaders(),
+                                                &uploaded[0],
+                                                uploaded.size(),
+                                                0,
+                                                0,
+                                                &a.iotClient};
+                                            a.protocol.streaming(&request, NULL);
+                                            while (bytesReceived < expected)
+                                            {
+                                                b.protocol.loop();
+                                            }
+                                            IOT_BENCH_CHECK(bytesReceived == expected);
+
+                                            wire = output->bytesWritten - written;
+                                            frames++;
+                                            bytes += uploaded.size(); });
+
+    printf("%-40s %12llu wire B/body %9.3f of the body %5u decode errors\n", "",
+           (unsigned long long)wire, (double)wire / uploaded.size(), b.iotClient.codecStats.errors);
+    IOT_BENCH_CHECK(b.iotClient.codecStats.errors == 0);
+    (void)result;
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> json = jsonBody();
+    std::vector<uint8_t> logs = logBody();
+    std::vector<uint8_t> noise = randomBody();
+
+    benchCodec("json", json, 1024, IOT_LZ_DEFAULT_WINDOW);
+    benchCodec("json", json, 1024, 1024);
+    benchCodec("json", json, 8192, IOT_LZ_DEFAULT_WINDOW);
+    benchCodec("json", json, 8192, 1024);
+    benchCodec("logs", logs, 1024, IOT_LZ_DEFAULT_WINDOW);
+    benchCodec("logs", logs, 8192, IOT_LZ_DEFAULT_WINDOW);
+    benchCodec("random", noise, 1024, IOT_LZ_DEFAULT_WINDOW);
+
+    uploaded = json;
+    benchUpload("json", EIoTBodyCodec::NONE, 0, 0);
+    benchUpload("json", EIoTBodyCodec::LZ, 0, 0);
+    benchUpload("json, 1024 window", EIoTBodyCodec::LZ, 1024, 0);
+    benchUpload("json, 100 B segments", EIoTBodyCodec::LZ, 0, 100);
+    uploaded = noise;
+    benchUpload("random", EIoTBodyCodec::NONE, 0, 0);
+    benchUpload("random", EIoTBodyCodec::LZ, 0, 0);
+
+    return 0;
+}
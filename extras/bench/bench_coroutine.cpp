@@ -0,0 +1,202 @@
+/*
+ * Awaitable exchanges (iot_coroutine.h, C++20) against the callback API over
+ * the in-memory loopback connection.
+ */
+
+#include "iot_protocol.h"
+#include "iot_coroutine.h"
+#include "extras/host/iot_loopback_client.h"
+#include "iot_bench.h"
+
+struct BenchPeer
+{
+    IoTLoopbackClient client;
+    IoTClient iotClient;
+    IoTProtocol protocol;
+};
+
+static BenchPeer *server = NULL;
+
+static char pathEcho[] = "/echo";
+static char pathDownload[] = "/download";
+
+static uint8_t requestBody[64] = {'{', '}'};
+static uint8_t responseBody[32] = {'o', 'k'};
+static uint8_t downloadBody[60000]; /* RESPONSE Body Length is 2 bytes */
+
+static uint64_t completed = 0;
+static bool running = true;
+
+static void serverMiddleware(IoTRequest *request, Next *next)
+{
+    if (request->method == EIoTMethod::REQUEST)
+    {
+        bool download = (strcmp(request->path, pathDownload) == 0);
+        IoTRequest response = {
+            IOT_VERSION,
+            EIoTMethod::RESPONSE,
+            request->id,
+            NULL,
+            IoTHeaders(),
+            download ? downloadBody : responseBody,
+            download ? sizeof(downloadBody) : sizeof(responseBody),
+            0,
+            0,
+            request->iotClient};
+        server->protocol.response(&response);
+    }
+
+    (*next)();
+}
+
+static IoTRequest makeRequest(IoTClient *iotClient, char *path)
+{
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::REQUEST,
+        0,
+        path,
+        IoTHeaders(),
+        requestBody,
+        sizeof(requestBody),
+        0,
+        0,
+        iotClient};
+    return request;
+}
+
+static void pump(BenchPeer *client, uint64_t expected)
+{
+    while (completed < expected)
+    {
+        server->protocol.loop();
+        client->protocol.loop();
+    }
+}
+
+/* Baseline: OnResponse sends the next request */
+static void benchCallbacks(const char *name, BenchPeer *client)
+{
+    static OnResponse onResponse = [](IoTRequest *response)
+    {
+        IOT_BENCH_CHECK(response->bodyLength == sizeof(responseBody));
+        completed++;
+    };
+
+    iotBenchRun(name, [client](uint64_t &frames, uint64_t &bytes)
+                {
+                    uint64_t expected = completed + 1;
+                    IoTRequest request = makeRequest(&client->iotClient, pathEcho);
+                    IoTRequestResponse requestResponse = {&onResponse, NULL, NULL, 0};
+                    client->protocol.request(&request, &requestResponse);
+                    pump(client, expected);
+
+                    frames += 2;
+                    bytes += sizeof(requestBody) + sizeof(responseBody); });
+}
+
+static IoTTask requester(IoTAsync *async, IoTClient *iotClient)
+{
+    while (running)
+    {
+        IoTRequest request = makeRequest(iotClient, pathEcho);
+        IoTAwaitResult result = co_await async->request(&request);
+        IOT_BENCH_CHECK(!result.timedOut() && result.response->bodyLength == sizeof(responseBody));
+        completed++;
+    }
+}
+
+/* `concurrency` coroutines, each chaining round trips */
+static void benchAwait(const char *name, BenchPeer *client, size_t concurrency)
+{
+    static IoTAsync *async = NULL;
+    async = new IoTAsync(&client->protocol);
+
+    running = true;
+    for (size_t i = 0; i < concurrency; i++)
+    {
+        requester(async, &client->iotClient);
+    }
+
+    iotBenchRun(name, [client, concurrency](uint64_t &frames, uint64_t &bytes)
+                {
+                    pump(client, completed + concurrency);
+
+                    frames += 2 * concurrency;
+                    bytes += (sizeof(requestBody) + sizeof(responseBody)) * concurrency; });
+
+    /* Let every coroutine see `running` and return */
+    running = false;
+    pump(client, completed + concurrency);
+    IOT_BENCH_CHECK(client->iotClient.requestResponse.size() == 0);
+    delete async;
+}
+
+static IoTTask downloader(IoTAsync *async, IoTClient *iotClient)
+{
+    IoTRequest request = makeRequest(iotClient, pathDownload);
+    IoTResponseStream stream = async->stream(&request);
+
+    size_t received = 0;
+    while (IoTRequest *part = co_await stream.next())
+    {
+        IOT_BENCH_CHECK(part->totalBodyLength == sizeof(downloadBody));
+        IOT_BENCH_CHECK(memcmp(part->body, downloadBody + received, part->bodyLength) == 0);
+        received += part->bodyLength;
+    }
+    IOT_BENCH_CHECK(!stream.timedOut() && received == sizeof(downloadBody));
+    completed++;
+}
+
+static void benchStream(const char *name, BenchPeer *client)
+{
+    static IoTAsync *async = NULL;
+    async = new IoTAsync(&client->protocol);
+
+    iotBenchRun(name, [client](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = server->client.output();
+                    uint64_t writes = wire->writes;
+                    uint64_t written = wire->bytesWritten;
+
+                    uint64_t expected = completed + 1;
+                    downloader(async, &client->iotClient);
+                    pump(client, expected);
+
+                    frames += wire->writes - writes;
+                    bytes += wire->bytesWritten - written; });
+
+    delete async;
+}
+
+int main(int argc, char **argv)
+{
+    static BenchPeer a;
+    static BenchPeer b;
+    IoTLoopbackClient::join(&a.client, &b.client);
+    a.iotClient = IoTClient();
+    a.iotClient.client = &a.client;
+    a.iotClient.vectoredWriter = &a.client;
+    a.protocol.decodeMode = EIoTDecodeMode::VIEW;
+    a.protocol.listen(&a.iotClient);
+    b.iotClient = IoTClient();
+    b.iotClient.client = &b.client;
+    b.iotClient.vectoredWriter = &b.client;
+    b.protocol.decodeMode = EIoTDecodeMode::VIEW;
+    b.protocol.listen(&b.iotClient);
+
+    server = &b;
+    server->protocol.use(serverMiddleware);
+
+    for (size_t i = 0; i < sizeof(downloadBody); i++)
+    {
+        downloadBody[i] = (uint8_t)i;
+    }
+
+    benchCallbacks("REQUEST/RESPONSE callbacks", &a);
+    benchAwait("REQUEST/RESPONSE co_await x1", &a, 1);
+    benchAwait("REQUEST/RESPONSE co_await x16", &a, 16);
+    benchStream("60 KB multipart RESPONSE stream co_await", &a);
+
+    return 0;
+}
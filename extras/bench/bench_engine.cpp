@@ -0,0 +1,182 @@
+/*
+ * Requests/s of IoTEpollEngine against a local load generator, for a growing
+ * number of I/O and worker threads.
+ *
+ * Each generator thread runs its own IoTProtocol over IoTSocketClient
+ * connections to 127.0.0.1 and keeps BENCH_DEPTH REQUESTs in flight on each of
+ * them; the engine echoes the body back from its workers. The generators share
+ * the machine with the engine, so the numbers only scale while there are
+ * cores left for both.
+ *
+ * Not linked with iot_bench_alloc.cpp: its shared counter would be the
+ * contention being measured.
+ */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "iot_protocol.h"
+#include "extras/host/iot_epoll_engine.h"
+#include "extras/host/iot_socket_client.h"
+#include "iot_bench.h"
+
+#define BENCH_CONNECTIONS 8 /* Per generator thread */
+#define BENCH_DEPTH 16      /* REQUESTs in flight per connection */
+
+static char pathEcho[] = "/echo";
+static uint8_t requestBody[64] = {'{', '}'};
+
+struct LoadConnection
+{
+    IoTSocketClient socket;
+    IoTClient iotClient;
+};
+
+/* One load generator thread: connects, keeps BENCH_DEPTH requests in flight per connection until `stop` */
+static void generate(uint16_t port, std::atomic<bool> *stop, std::atomic<uint64_t> *completed)
+{
+    IoTProtocol protocol(5000);
+    IoTHeapAllocator heap; /* The shared one keeps unsynchronized stats */
+    protocol.allocator = &heap;
+    std::vector<std::unique_ptr<LoadConnection>> connections;
+    uint64_t local = 0;
+
+    OnResponse onResponse;
+    OnTimeout onTimeout = [](IoTRequest *request)
+    {
+        IOT_BENCH_CHECK(!"request timed out");
+    };
+    auto sendOne = [&](IoTClient *iotClient)
+    {
+        IoTRequest request = {
+            IOT_VERSION,
+            EIoTMethod::REQUEST,
+            0,
+            pathEcho,
+            IoTHeaders(),
+            requestBody,
+            sizeof(requestBody),
+            0,
+            0,
+            iotClient};
+        IoTRequestResponse requestResponse = {&onResponse, &onTimeout, NULL, 0};
+        protocol.request(&request, &requestResponse);
+    };
+    onResponse = [&](IoTRequest *response)
+    {
+        IOT_BENCH_CHECK(response->bodyLength == sizeof(requestBody) && memcmp(response->body, requestBody, sizeof(requestBody)) == 0);
+        local++;
+        if ((local & 255) == 0)
+        {
+            completed->fetch_add(256, std::memory_order_relaxed);
+        }
+        if (!stop->load(std::memory_order_relaxed))
+        {
+            sendOne(response->iotClient);
+        }
+    };
+
+    for (size_t i = 0; i < BENCH_CONNECTIONS; i++)
+    {
+        LoadConnection *connection = new LoadConnection();
+        connections.emplace_back(connection);
+        IOT_BENCH_CHECK(connection->socket.connect("127.0.0.1", port));
+        connection->iotClient = IoTClient();
+        connection->iotClient.client = &connection->socket;
+        connection->iotClient.vectoredWriter = &connection->socket;
+        connection->iotClient.maxPendingRequests = BENCH_DEPTH * 2;
+        connection->iotClient.outboundCapacity = 64 * 1024;
+        protocol.listen(&connection->iotClient);
+    }
+    for (auto &connection : connections)
+    {
+        for (size_t i = 0; i < BENCH_DEPTH; i++)
+        {
+            sendOne(&connection->iotClient);
+        }
+    }
+
+    while (!stop->load(std::memory_order_relaxed))
+    {
+        protocol.loop();
+    }
+
+    for (auto &connection : connections)
+    {
+        protocol.unlisten(&connection->iotClient);
+    }
+}
+
+static double run(const char *name, size_t ioThreads, size_t workerThreads, size_t generators)
+{
+    IoTEngineConfig config;
+    config.ioThreads = ioThreads;
+    config.workerThreads = workerThreads;
+    IoTEpollEngine engine(config);
+    engine.onRequest = [](IoTRequest *request, IoTEngineReply *reply)
+    {
+        reply->send(request->body, request->bodyLength);
+    };
+    IOT_BENCH_CHECK(engine.start());
+
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> completed(0);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < generators; i++)
+    {
+        threads.emplace_back(generate, engine.port(), &stop, &completed);
+    }
+
+    /* Warm up (connections accepted, pipelines full), then measure */
+    delay(100);
+    uint64_t before = completed.load();
+    uint64_t started = iotMicros();
+    delay((unsigned long)(iotBenchSeconds() * 1000));
+    double seconds = (iotMicros() - started) / 1e6;
+    double rate = (completed.load() - before) / seconds;
+
+    stop.store(true);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    IoTEngineStats stats = engine.stats();
+    engine.stop();
+
+    IOT_BENCH_CHECK(stats.accepted == generators * BENCH_CONNECTIONS);
+    printf("%-40s %12.0f requests/s (%zu generators x %d connections x %d in flight)\n",
+           name, rate, generators, BENCH_CONNECTIONS, BENCH_DEPTH);
+    fflush(stdout);
+    return rate;
+}
+
+int main(int argc, char **argv)
+{
+    size_t cores = std::thread::hardware_concurrency();
+    if (cores == 0)
+    {
+        cores = 1;
+    }
+    const char *env = getenv("IOT_BENCH_THREADS");
+    size_t maxThreads = (env != NULL) ? (size_t)atoi(env) : cores;
+    printf("%zu hardware threads\n", cores);
+
+    char name[64];
+    run("inline handlers, 1 I/O thread", 1, 0, 1);
+
+    double baseline = 0;
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        snprintf(name, sizeof(name), "%zu I/O + %zu worker threads", threads, threads);
+        double rate = run(name, threads, threads, threads);
+        if (baseline == 0)
+        {
+            baseline = rate;
+        }
+        printf("%-40s %12.2fx\n", "", rate / baseline);
+    }
+
+    return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Header parsing cost for frames with 1, 16 and 255 headers: the single-pass
+ * tokenizer against the former rescanning loop, header lookup, then full
+ * decode over the loopback connection.
+ *
+ * Then the same frames and a typical device request with the header table
+ * (IoTClient::headerCompression): header bytes per frame as version 1 text
+ * and as sent, and the decode rate.
+ */
+
+#include <string>
+
+#include "iot_protocol.h"
+#include "extras/host/iot_loopback_client.h"
+#include "iot_bench.h"
+
+/* Former onData loop: a scalar scan for IOT_RS then another for IOT_ETX, from the header start, per header */
+static int scalarIndexOf(const uint8_t *buffer, size_t bufLen, uint8_t value, size_t start)
+{
+    for (size_t i = start; i < bufLen; i++)
+    {
+        if (buffer[i] == value)
+            return (int)i;
+    }
+    return -1;
+}
+
+static size_t rescanHeaders(const uint8_t *buffer, size_t bufLen, size_t offset, size_t headerSize, std::vector<IoTHeaderSpan> *headers)
+{
+    int indexRS = -1;
+    int indexETX = -1;
+
+    while ((indexRS = scalarIndexOf(buffer, bufLen, IOT_RS, offset)) != -1 &&
+           (indexETX = scalarIndexOf(buffer, bufLen, IOT_ETX, offset + 1)) != -1)
+    {
+        IoTHeaderSpan header = {offset, (size_t)indexRS, (size_t)indexETX};
+        headers->push_back(header);
+        offset = indexETX + 1;
+        if (headers->size() == headerSize)
+            break;
+    }
+    return offset;
+}
+
+static std::vector<std::string> keys;
+static std::vector<std::string> values;
+
+static std::vector<uint8_t> headerBlock(size_t count)
+{
+    std::vector<uint8_t> block;
+    for (size_t i = 0; i < count; i++)
+    {
+        block.insert(block.end(), keys[i].begin(), keys[i].end());
+        block.push_back(IOT_RS);
+        block.insert(block.end(), values[i].begin(), values[i].end());
+        block.push_back(IOT_ETX);
+    }
+    /* Body bytes after the block */
+    block.insert(block.end(), 64, 'b');
+    return block;
+}
+
+static void benchTokenizer(size_t count)
+{
+    std::vector<uint8_t> block = headerBlock(count);
+    std::vector<IoTHeaderSpan> headers;
+    headers.reserve(256);
+    char name[64];
+
+    snprintf(name, sizeof(name), "rescan   %3zu headers (%zu B)", count, block.size() - 64);
+    iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    headers.clear();
+                    rescanHeaders(block.data(), block.size(), 0, count, &headers);
+                    IOT_BENCH_CHECK(headers.size() == count);
+                    frames++;
+                    bytes += block.size() - 64; });
+
+    snprintf(name, sizeof(name), "tokenize %3zu headers (%zu B)", count, block.size() - 64);
+    iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTHeaderTokenizer tokenizer;
+                    resetHeaderTokenizer(&tokenizer, 0);
+                    headers.clear();
+                    IOT_BENCH_CHECK(tokenizeHeaders(block.data(), block.size(), IOT_RS, IOT_ETX, &tokenizer, &headers, count));
+                    IOT_BENCH_CHECK(headers.size() == count && tokenizer.offset == block.size() - 64);
+                    frames++;
+                    bytes += block.size() - 64; });
+
+    /* The same headers once they are all in the table: a slot byte each */
+    std::vector<uint8_t> slots;
+    for (size_t i = 0; i < count; i++)
+    {
+        slots.push_back((uint8_t)(IOT_HEADER_INDEXED | (i % IOT_HEADER_TABLE_ENTRIES)));
+    }
+    slots.insert(slots.end(), 64, 'b');
+
+    snprintf(name, sizeof(name), "tokenize %3zu headers [slots] (%zu B)", count, count);
+    iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTHeaderTokenizer tokenizer;
+                    resetHeaderTokenizer(&tokenizer, 0);
+                    headers.clear();
+                    IOT_BENCH_CHECK(tokenizeTableHeaders(slots.data(), slots.size(), IOT_RS, IOT_ETX, &tokenizer, &headers, count));
+                    IOT_BENCH_CHECK(headers.size() == count && tokenizer.offset == count);
+                    frames++;
+                    bytes += count; });
+}
+
+/* getHeader on a 16 header request: former std::map strcmp walk against IoTHeaders */
+static void benchLookup()
+{
+    static char contentType[] = "content-type";
+    static char json[] = "application/json";
+
+    std::map<char *, char *> map;
+    IoTHeaders headers;
+    for (size_t i = 0; i < 15; i++)
+    {
+        map.insert(std::make_pair((char *)keys[i].c_str(), (char *)values[i].c_str()));
+        headers.insert(std::make_pair((char *)keys[i].c_str(), (char *)values[i].c_str()));
+    }
+    map.insert(std::make_pair(contentType, json));
+    headers.insert(std::make_pair(contentType, json));
+
+    iotBenchRun("lookup content-type, std::map walk", [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    const char *value = NULL;
+                    for (auto header = map.begin(); header != map.end(); ++header)
+                    {
+                        if (strcmp(header->first, "content-type") == 0)
+                        {
+                            value = header->second;
+                            break;
+                        }
+                    }
+                    IOT_BENCH_CHECK(value == json);
+                    frames++; });
+
+    iotBenchRun("lookup content-type, IoTHeaders by name", [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    IOT_BENCH_CHECK(headers.get("content-type") == json);
+                    frames++; });
+
+    iotBenchRun("lookup content-type, IoTHeaders by key ID", [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    IOT_BENCH_CHECK(headers.get(EIoTHeaderKey::CONTENT_TYPE) == json);
+                    frames++; });
+}
+
+struct BenchPeer
+{
+    IoTLoopbackClient client;
+    IoTClient iotClient;
+    IoTProtocol protocol;
+};
+
+static uint64_t signalsReceived = 0;
+static size_t expectedHeaders = 0;
+
+static void countingMiddleware(IoTRequest *request, Next *next)
+{
+    IOT_BENCH_CHECK(request->headers.size() == expectedHeaders);
+    signalsReceived++;
+    (*next)();
+}
+
+static void benchDecode(BenchPeer *client, BenchPeer *server, const IoTHeaders &headers, const char *label)
+{
+    static char path[] = "/headers";
+    static uint8_t body[16] = {0};
+
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::SIGNAL,
+        0,
+        path,
+        headers,
+        body,
+        sizeof(body),
+        0,
+        0,
+        &client->iotClient};
+    expectedHeaders = headers.size();
+    IoTHeaderStats before = client->iotClient.headerStats;
+    bool table = client->iotClient.headerCompression;
+
+    char name[64];
+    snprintf(name, sizeof(name), "SIGNAL decode %s [view%s]", label, table ? ", table" : "");
+    IoTBenchResult result = iotBenchRun(name, [&](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = client->client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t expected = signalsReceived + 1;
+
+                    client->protocol.signal(&request);
+                    while (signalsReceived < expected)
+                    {
+                        server->protocol.loop();
+                    }
+
+                    frames++;
+                    bytes += wire->bytesWritten - written; });
+
+    if (table)
+    {
+        IoTHeaderStats *stats = &client->iotClient.headerStats;
+        uint64_t sent = stats->frames - before.frames;
+        printf("  %.1f header B/frame as text, %.1f sent (%.0f%% saved), %.0f ns/frame, %u table entries\n",
+               (double)(stats->plainBytes - before.plainBytes) / sent,
+               (double)(stats->encodedBytes - before.encodedBytes) / sent,
+               100.0 * (1.0 - (double)(stats->encodedBytes - before.encodedBytes) / (double)(stats->plainBytes - before.plainBytes)),
+               1e9 * result.seconds / result.frames,
+               stats->inserted);
+    }
+    else
+    {
+        printf("  %.0f ns/frame\n", 1e9 * result.seconds / result.frames);
+    }
+}
+
+static void setupPeers(BenchPeer *a, BenchPeer *b, bool headerCompression)
+{
+    IoTLoopbackClient::join(&a->client, &b->client);
+    BenchPeer *peers[] = {a, b};
+    for (size_t i = 0; i < 2; i++)
+    {
+        peers[i]->iotClient = IoTClient();
+        peers[i]->iotClient.client = &peers[i]->client;
+        peers[i]->iotClient.vectoredWriter = &peers[i]->client;
+        peers[i]->iotClient.bufferSize = 8192; /* 255 headers do not fit the default 1024 */
+        peers[i]->protocol.decodeMode = EIoTDecodeMode::VIEW;
+        peers[i]->protocol.listen(&peers[i]->iotClient);
+    }
+    a->iotClient.headerCompression = headerCompression;
+    b->protocol.use(countingMiddleware);
+}
+
+int main(int argc, char **argv)
+{
+    for (size_t i = 0; i < 255; i++)
+    {
+        keys.push_back("x-key-" + std::to_string(i));
+        values.push_back("value-" + std::to_string(i * 7919));
+    }
+
+    const size_t counts[] = {1, 16, 255};
+    for (size_t i = 0; i < 3; i++)
+    {
+        benchTokenizer(counts[i]);
+    }
+
+    benchLookup();
+
+    /* What a device sends with every reading */
+    static char contentType[] = "content-type", json[] = "application/json";
+    static char device[] = "device", deviceId[] = "thermostat-0042";
+    static char token[] = "token", tokenValue[] = "8f3a61c2d9e04b7f9a1c5e2d7b6f0a94";
+    static char version[] = "version", versionValue[] = "1.4.2";
+    static char userAgent[] = "user-agent", agent[] = "iot-protocol-cpp/1.0";
+    static char firmware[] = "x-firmware", firmwareValue[] = "esp32-2.0.14";
+    IoTHeaders typical;
+    typical.insert(std::make_pair(contentType, json));
+    typical.insert(std::make_pair(device, deviceId));
+    typical.insert(std::make_pair(token, tokenValue));
+    typical.insert(std::make_pair(version, versionValue));
+    typical.insert(std::make_pair(userAgent, agent));
+    typical.insert(std::make_pair(firmware, firmwareValue));
+
+    static BenchPeer a, b, c, d;
+    setupPeers(&a, &b, false);
+    setupPeers(&c, &d, true);
+
+    BenchPeer *pairs[][2] = {{&a, &b}, {&c, &d}};
+    for (size_t p = 0; p < 2; p++)
+    {
+        benchDecode(pairs[p][0], pairs[p][1], typical, "device headers");
+        for (size_t i = 0; i < 3; i++)
+        {
+            IoTHeaders headers;
+            for (size_t h = 0; h < counts[i]; h++)
+            {
+                headers.insert(std::make_pair((char *)keys[h].c_str(), (char *)values[h].c_str()));
+            }
+            char label[32];
+            snprintf(label, sizeof(label), "%3zu headers", counts[i]);
+            benchDecode(pairs[p][0], pairs[p][1], headers, label);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,723 @@
+/*
+ * Encode/decode throughput of IoTProtocol::send / IoTProtocol::onData over an
+ * in-memory loopback connection.
+ */
+
+#include "iot_protocol.h"
+#include "extras/host/iot_loopback_client.h"
+#ifdef __unix__
+#include "extras/host/iot_file_sink.h"
+#include "extras/host/iot_file_source.h"
+#endif
+#include "iot_bench.h"
+
+struct BenchPeer
+{
+    IoTLoopbackClient client;
+    IoTClient iotClient;
+    IoTProtocol protocol;
+};
+
+static BenchPeer *server = NULL;
+
+static uint64_t signalsReceived = 0;
+static uint64_t responsesReceived = 0;
+static uint64_t streamingBytesReceived = 0;
+
+static char pathTelemetry[] = "/telemetry";
+static char pathUpload[] = "/upload";
+static char headerKey[] = "type";
+static char headerValue[] = "temperature";
+
+static uint8_t signalBody[16] = {'2', '1', '.', '5'};
+static uint8_t requestBody[64] = {'{', '}'};
+static uint8_t responseBody[32] = {'o', 'k'};
+static uint8_t streamingBody[64 * 1024];
+
+static void serverMiddleware(IoTRequest *request, Next *next)
+{
+    switch (request->method)
+    {
+    case EIoTMethod::SIGNAL:
+        IOT_BENCH_CHECK(strcmp(request->path, pathTelemetry) == 0);
+        IOT_BENCH_CHECK(request->bodyLength == sizeof(signalBody) && memcmp(request->body, signalBody, sizeof(signalBody)) == 0);
+        signalsReceived++;
+        break;
+    case EIoTMethod::REQUEST:
+    {
+        IoTRequest response = {
+            IOT_VERSION,
+            EIoTMethod::RESPONSE,
+            request->id,
+            NULL,
+            IoTHeaders(),
+            responseBody,
+            sizeof(responseBody),
+            0,
+            0,
+            request->iotClient};
+        server->protocol.response(&response);
+        break;
+    }
+    case EIoTMethod::STREAMING:
+    {
+        /* Each part holds the body bytes at its offset (uploads are prefixes of streamingBody) */
+        size_t offset = request->offset;
+        IOT_BENCH_CHECK(request->bodyLength > 0 && offset + request->bodyLength <= sizeof(streamingBody));
+        IOT_BENCH_CHECK(memcmp(request->body, streamingBody + offset, request->bodyLength) == 0);
+        streamingBytesReceived += request->bodyLength;
+        break;
+    }
+    default:
+        break;
+    }
+
+    (*next)();
+}
+
+static void setupPeers(BenchPeer *a, BenchPeer *b)
+{
+    IoTLoopbackClient::join(&a->client, &b->client);
+
+    a->iotClient = IoTClient();
+    a->iotClient.client = &a->client;
+    a->protocol.listen(&a->iotClient);
+
+    b->iotClient = IoTClient();
+    b->iotClient.client = &b->client;
+    b->protocol.listen(&b->iotClient);
+}
+
+static IoTRequest makeRequest(IoTClient *iotClient, char *path, uint8_t *body, size_t bodyLength)
+{
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::SIGNAL,
+        0,
+        path,
+        IoTHeaders(),
+        body,
+        bodyLength,
+        0,
+        0,
+        iotClient};
+    request.headers.insert(std::make_pair(headerKey, headerValue));
+    return request;
+}
+
+static void benchSignal(const char *name, BenchPeer *client)
+{
+    iotBenchRun(name, [client](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = client->client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t expected = signalsReceived + 1;
+
+                    IoTRequest request = makeRequest(&client->iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+                    client->protocol.signal(&request);
+                    while (signalsReceived < expected)
+                    {
+                        server->protocol.loop();
+                    }
+
+                    frames++;
+                    bytes += wire->bytesWritten - written; });
+}
+
+/* Same frame as benchSignal, prefix compiled once */
+static void benchSignalTemplate(const char *name, BenchPeer *client)
+{
+    IoTRequest compiled = makeRequest(&client->iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+    IoTRequestTemplate requestTemplate = client->protocol.compile(&compiled);
+
+    iotBenchRun(name, [client, &requestTemplate](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = client->client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t expected = signalsReceived + 1;
+
+                    IoTRequest request = IoTRequest();
+                    request.body = signalBody;
+                    request.bodyLength = sizeof(signalBody);
+                    request.iotClient = &client->iotClient;
+                    client->protocol.send(&requestTemplate, &request);
+                    while (signalsReceived < expected)
+                    {
+                        server->protocol.loop();
+                    }
+
+                    frames++;
+                    bytes += wire->bytesWritten - written; });
+
+    client->protocol.freeTemplate(&requestTemplate);
+}
+
+static void benchSignalBurst(const char *name, BenchPeer *client, uint32_t burst)
+{
+    iotBenchRun(name, [client, burst](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = client->client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t expected = signalsReceived + burst;
+
+                    for (uint32_t i = 0; i < burst; i++)
+                    {
+                        IoTRequest request = makeRequest(&client->iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+                        client->protocol.signal(&request);
+                    }
+
+                    /* One loop() drains the whole burst, or frameBudget frames of it */
+                    uint32_t calls = 0;
+                    while (signalsReceived < expected)
+                    {
+                        server->protocol.loop();
+                        calls++;
+                        IOT_BENCH_CHECK(server->protocol.frameBudget == 0 || server->iotClient.readStats.lastFrames <= server->protocol.frameBudget);
+                    }
+                    uint32_t budget = (server->protocol.frameBudget == 0) ? burst : server->protocol.frameBudget;
+                    IOT_BENCH_CHECK(calls == (burst + budget - 1) / budget);
+
+                    frames += burst;
+                    bytes += wire->bytesWritten - written; });
+}
+
+/*
+ * Burst of small SIGNALs with write coalescing (`micros` deadline, 0 = off):
+ * transport writes per frame. `flush` writes the burst out right away,
+ * otherwise the client's loop() does once the deadline passed.
+ */
+static void benchSignalCoalescing(BenchPeer *client, uint32_t burst, uint32_t micros, bool flush)
+{
+    client->iotClient.coalescer.micros = micros;
+    client->iotClient.coalesceStats = IoTCoalesceStats();
+    uint64_t writes = 0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "SIGNAL burst x%u [%s]", burst,
+             (micros == 0) ? "write per frame" : (flush ? "coalesced, flush" : "coalesced, deadline"));
+    IoTBenchResult result = iotBenchRun(name, [client, burst, flush, &writes](uint64_t &frames, uint64_t &bytes)
+                                        {
+                                            IoTLoopbackPipe *wire = client->client.output();
+                                            uint64_t written = wire->bytesWritten;
+                                            uint64_t writesBefore = wire->writes;
+                                            uint64_t expected = signalsReceived + burst;
+
+                                            for (uint32_t i = 0; i < burst; i++)
+                                            {
+                                                IoTRequest request = makeRequest(&client->iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+                                                client->protocol.signal(&request);
+                                            }
+                                            if (flush)
+                                            {
+                                                client->protocol.flush(&client->iotClient);
+                                            }
+                                            while (signalsReceived < expected)
+                                            {
+                                                client->protocol.loop();
+                                                server->protocol.loop();
+                                            }
+                                            IOT_BENCH_CHECK(signalsReceived == expected);
+
+                                            writes += wire->writes - writesBefore;
+                                            frames += burst;
+                                            bytes += wire->bytesWritten - written; });
+
+    IoTCoalesceStats *stats = &client->iotClient.coalesceStats;
+    printf("%-40s %12.3f writes/frame %8.1f frames/write %8.1f us added/frame\n", "",
+           (double)writes / result.frames, stats->framesPerWrite(), stats->delayPerFrame());
+    client->iotClient.coalescer.micros = 0;
+}
+
+static void benchRequestResponse(const char *name, BenchPeer *client)
+{
+    OnResponse onResponse = [](IoTRequest *response)
+    {
+        responsesReceived++;
+    };
+
+    iotBenchRun(name, [client, &onResponse](uint64_t &frames, uint64_t &bytes)
+                {
+                    uint64_t written = client->client.output()->bytesWritten + server->client.output()->bytesWritten;
+                    uint64_t expected = responsesReceived + 1;
+
+                    IoTRequest request = makeRequest(&client->iotClient, pathTelemetry, requestBody, sizeof(requestBody));
+                    IoTRequestResponse requestResponse = {&onResponse, NULL, NULL, 0};
+                    client->protocol.request(&request, &requestResponse);
+                    while (responsesReceived < expected)
+                    {
+                        server->protocol.loop();
+                        client->protocol.loop();
+                    }
+
+                    frames += 2;
+                    bytes += client->client.output()->bytesWritten + server->client.output()->bytesWritten - written; });
+}
+
+/* `source` NULL = streamingBody in memory */
+static void benchStreaming(const char *name, BenchPeer *client, IoTBodySource *source = NULL)
+{
+    iotBenchRun(name, [client, source](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = client->client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t writes = wire->writes;
+                    uint64_t expected = streamingBytesReceived + sizeof(streamingBody);
+
+                    IoTRequest request = makeRequest(&client->iotClient, pathUpload, streamingBody, sizeof(streamingBody));
+                    if (source != NULL)
+                    {
+                        request.body = NULL;
+                        request.bodySource = source;
+                    }
+                    client->protocol.streaming(&request, NULL);
+                    while (streamingBytesReceived < expected)
+                    {
+                        server->protocol.loop();
+                    }
+                    IOT_BENCH_CHECK(streamingBytesReceived == expected);
+
+                    frames += wire->writes - writes;
+                    bytes += wire->bytesWritten - written; });
+}
+
+/*
+ * Producer faster than the transport: the peer only takes `window` unread
+ * bytes, trySend queues on the outbound buffer until it reports WOULD_BLOCK,
+ * then both loops drain it.
+ */
+static void benchBackpressure(size_t window, uint32_t outboundCapacity)
+{
+    static BenchPeer c;
+    static BenchPeer d;
+    c.iotClient.outboundCapacity = outboundCapacity;
+    setupPeers(&c, &d);
+    c.iotClient.vectoredWriter = &c.client;
+    c.client.limitOutput(window);
+    d.protocol.use(serverMiddleware);
+
+    static uint64_t highWaters = 0;
+    static OnHighWater onHighWater = [](IoTClient *iotClient, size_t queued)
+    {
+        IOT_BENCH_CHECK(queued >= iotClient->outboundHighWater);
+        highWaters++;
+    };
+    c.iotClient.onHighWater = &onHighWater;
+
+    BenchPeer *previous = server;
+    server = &d;
+
+    uint64_t wouldBlock = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "SIGNAL trySend [%zu B window, %u B queue]", window, outboundCapacity);
+    iotBenchRun(name, [&wouldBlock](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = c.client.output();
+                    uint64_t written = wire->bytesWritten;
+
+                    uint64_t sent = 0;
+                    IoTRequest request = makeRequest(&c.iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+                    while (c.protocol.trySend(&request, NULL) == EIoTSendResult::QUEUED)
+                    {
+                        sent++;
+                    }
+                    wouldBlock++;
+                    IOT_BENCH_CHECK(sent > 0 && !c.iotClient.outbound.empty());
+
+                    uint64_t expected = signalsReceived + sent;
+                    while (signalsReceived < expected)
+                    {
+                        d.protocol.loop();
+                        c.protocol.loop();
+                    }
+                    IOT_BENCH_CHECK(signalsReceived == expected && c.iotClient.outbound.empty());
+
+                    frames += sent;
+                    bytes += wire->bytesWritten - written; });
+    printf("%-40s %12llu would-block  %10llu high-water\n", "", (unsigned long long)wouldBlock, (unsigned long long)highWaters);
+    IOT_BENCH_CHECK(highWaters == wouldBlock);
+
+    server = previous;
+}
+
+/*
+ * A REQUEST sent right behind a 64 KiB STREAMING on the same connection.
+ * Without a stream window its response waits for the whole body; with one
+ * the parts take turns with it and go on as the receiver grants credit.
+ */
+static void benchRequestDuringStreaming(uint32_t streamWindow)
+{
+    static BenchPeer c;
+    static BenchPeer d;
+    static bool routed = false;
+    setupPeers(&c, &d);
+    c.iotClient.vectoredWriter = &c.client;
+    d.iotClient.vectoredWriter = &d.client;
+    c.iotClient.streamWindow = streamWindow;
+    d.iotClient.streamWindow = streamWindow;
+    if (!routed)
+    {
+        d.protocol.use(serverMiddleware);
+        routed = true;
+    }
+
+    BenchPeer *previous = server;
+    server = &d;
+
+    static unsigned long respondedAt = 0;
+    static OnResponse onResponse = [](IoTRequest *response)
+    {
+        responsesReceived++;
+        respondedAt = iotMicros();
+    };
+
+    uint64_t latency = 0;
+    uint64_t samples = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "REQUEST behind STREAMING [%u B window]", streamWindow);
+    iotBenchRun(name, [&latency, &samples](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = c.client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t writes = wire->writes;
+                    uint64_t expectedBytes = streamingBytesReceived + sizeof(streamingBody);
+                    uint64_t expected = responsesReceived + 1;
+
+                    unsigned long startedAt = iotMicros();
+                    IoTRequest upload = makeRequest(&c.iotClient, pathUpload, streamingBody, sizeof(streamingBody));
+                    c.protocol.streaming(&upload, NULL);
+                    IoTRequest request = makeRequest(&c.iotClient, pathTelemetry, requestBody, sizeof(requestBody));
+                    IoTRequestResponse requestResponse = {&onResponse, NULL, NULL, 0};
+                    c.protocol.request(&request, &requestResponse);
+                    while (responsesReceived < expected || streamingBytesReceived < expectedBytes)
+                    {
+                        d.protocol.loop();
+                        c.protocol.loop();
+                    }
+                    IOT_BENCH_CHECK(streamingBytesReceived == expectedBytes && c.iotClient.streams.empty());
+                    latency += respondedAt - startedAt;
+                    samples++;
+
+                    frames += wire->writes - writes;
+                    bytes += wire->bytesWritten - written; });
+    printf("%-40s %12.1f us response  %10llu credits\n", "", (double)latency / (double)(samples > 0 ? samples : 1),
+           (unsigned long long)c.iotClient.streamStats.creditsReceived);
+    IOT_BENCH_CHECK(c.iotClient.streamStats.dropped == 0);
+
+    server = previous;
+}
+
+/*
+ * Slow transport (`window` unread bytes): a 12 KiB STREAMING is queued part by
+ * part, then a SIGNAL. The SIGNAL waits in its class queue, ahead of the bulk
+ * parts, so only the part being written is in front of it.
+ */
+static void benchPriority(size_t window)
+{
+    static BenchPeer c;
+    static BenchPeer d;
+    setupPeers(&c, &d);
+    c.iotClient.outboundCapacity = 16 * 1024; /* Queues are allocated on first use */
+    c.iotClient.outboundHighWater = 12 * 1024;
+    c.iotClient.vectoredWriter = &c.client;
+    c.client.limitOutput(window);
+    d.protocol.use(serverMiddleware);
+
+    BenchPeer *previous = server;
+    server = &d;
+
+    static uint64_t bulkAhead = 0;
+    static uint64_t uploadStart = 0;
+    static IoTMiddleware order = [](IoTRequest *request, Next *next)
+    {
+        if (request->method == EIoTMethod::SIGNAL)
+        {
+            bulkAhead += streamingBytesReceived - uploadStart;
+        }
+        (*next)();
+    };
+    d.protocol.use(order);
+
+    char name[64];
+    snprintf(name, sizeof(name), "SIGNAL behind 12 KiB STREAMING [%zu B window]", window);
+    iotBenchRun(name, [](uint64_t &frames, uint64_t &bytes)
+                {
+                    IoTLoopbackPipe *wire = c.client.output();
+                    uint64_t written = wire->bytesWritten;
+                    uint64_t writes = wire->writes;
+                    uploadStart = streamingBytesReceived;
+                    uint64_t expectedBytes = streamingBytesReceived + 12 * 1024;
+                    uint64_t expected = signalsReceived + 1;
+
+                    IoTRequest upload = makeRequest(&c.iotClient, pathUpload, streamingBody, 12 * 1024);
+                    upload.method = EIoTMethod::STREAMING;
+                    IOT_BENCH_CHECK(c.protocol.trySend(&upload, NULL) == EIoTSendResult::QUEUED);
+                    IoTRequest signal = makeRequest(&c.iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+                    IOT_BENCH_CHECK(c.protocol.trySend(&signal, NULL) == EIoTSendResult::QUEUED);
+                    while (signalsReceived < expected || streamingBytesReceived < expectedBytes)
+                    {
+                        d.protocol.loop();
+                        c.protocol.loop();
+                    }
+
+                    frames += wire->writes - writes;
+                    bytes += wire->bytesWritten - written; });
+
+    const char *classes[IOT_PRIORITY_CLASSES] = {"control", "interactive", "bulk"};
+    for (uint8_t i = 0; i < IOT_PRIORITY_CLASSES; i++)
+    {
+        IoTPriorityStats *stats = &c.iotClient.priorityStats[i];
+        if (stats->queued == 0)
+            continue;
+        printf("%-40s %12.1f us wait (%s)  %10u us max  %llu queued / %llu direct\n", "", (double)stats->waitMicros / (double)stats->queued,
+               classes[i], stats->maxWaitMicros, (unsigned long long)stats->queued, (unsigned long long)stats->direct);
+    }
+    IoTPriorityStats *interactive = &c.iotClient.priorityStats[(uint8_t)EIoTPriority::INTERACTIVE - 1];
+    printf("%-40s %12.1f B of the upload ahead of the SIGNAL\n", "", (double)bulkAhead / (double)(interactive->queued + interactive->direct));
+
+    server = previous;
+}
+
+/* loop() cost with `pending` requests in flight and none due, then all of them expiring */
+static void benchPending(size_t pending)
+{
+    static BenchPeer c;
+    static BenchPeer d;
+    IoTLoopbackClient::join(&c.client, &d.client);
+    c.iotClient = IoTClient();
+    c.iotClient.client = &c.client;
+    c.iotClient.vectoredWriter = &c.client;
+    c.iotClient.maxPendingRequests = (uint16_t)pending;
+    c.protocol.listen(&c.iotClient);
+
+    uint64_t timedOut = 0;
+    OnTimeout onTimeout = [&timedOut](IoTRequest *request)
+    {
+        timedOut++;
+    };
+
+    unsigned long timeouts[] = {3600000, 20};
+    for (size_t round = 0; round < 2; round++)
+    {
+        for (size_t i = 1; i <= pending; i++)
+        {
+            IoTRequest request = makeRequest(&c.iotClient, pathTelemetry, requestBody, sizeof(requestBody));
+            request.id = (uint16_t)i;
+            IoTRequestResponse requestResponse = {NULL, &onTimeout, NULL, timeouts[round]};
+            c.protocol.request(&request, &requestResponse);
+        }
+        IOT_BENCH_CHECK(c.iotClient.requestResponse.size() == pending);
+
+        if (round == 0)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "loop() with %zu pending, none due", pending);
+            iotBenchRun(name, [](uint64_t &frames, uint64_t &bytes)
+                        {
+                            c.protocol.loop();
+                            frames++; });
+            IOT_BENCH_CHECK(timedOut == 0);
+            c.iotClient.requestResponse.clear();
+        }
+    }
+
+    delay(40);
+    c.protocol.loop();
+    IOT_BENCH_CHECK(timedOut == pending && c.iotClient.requestResponse.size() == 0);
+}
+
+/* One gateway protocol with `count` idle device connections: loop() cost, then every alive timer firing once */
+static void benchIdleClients(size_t count)
+{
+    IoTLoopbackClient *devices = new IoTLoopbackClient[count];
+    IoTLoopbackClient *connections = new IoTLoopbackClient[count];
+    IoTClient *iotClients = new IoTClient[count]();
+    IoTProtocol *gateway = new IoTProtocol();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        IoTLoopbackClient::join(&connections[i], &devices[i]);
+        iotClients[i].client = &connections[i];
+        iotClients[i].aliveInterval = 1;
+        iotClients[i].maxPendingRequests = 2;
+        gateway->listen(&iotClients[i]);
+    }
+    unsigned long listened = iotMillis();
+
+    char name[64];
+    snprintf(name, sizeof(name), "loop() over %zu idle clients", count);
+    uint64_t ticks = 0;
+    unsigned long budget = (unsigned long)(iotBenchSeconds() * 1000);
+    if (budget > 500)
+    {
+        budget = 500; /* Before the first alive request is due */
+    }
+    IoTBenchResult result = {0, 0, 0, 0};
+    uint64_t started = iotMicros();
+    while (iotMillis() - listened < budget)
+    {
+        gateway->loop();
+        ticks++;
+    }
+    result.seconds = (iotMicros() - started) / 1e6;
+    printf("%-40s %12.0f loops/s   %10.2f ns/client\n", name, ticks / result.seconds, result.seconds * 1e9 / ticks / count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        IOT_BENCH_CHECK(connections[i].output()->bytesWritten == 0);
+    }
+
+    /* aliveInterval elapsed: each connection sends exactly one ALIVE_REQUEST (2 bytes) */
+    while (iotMillis() - listened < 1100)
+    {
+        gateway->loop();
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        IOT_BENCH_CHECK(connections[i].output()->bytesWritten == 2);
+    }
+
+    delete gateway;
+    delete[] iotClients;
+    delete[] connections;
+    delete[] devices;
+}
+
+/* After warm-up, SIGNAL and REQUEST/RESPONSE must not reach the protocol's global heap allocator */
+static void checkSteadyState(BenchPeer *client)
+{
+    IoTAllocatorStats *stats = &(IoTHeapAllocator::shared()->stats);
+    uint64_t allocations = stats->allocations;
+
+    OnResponse onResponse = [](IoTRequest *response)
+    {
+        responsesReceived++;
+    };
+
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t expectedSignals = signalsReceived + 1;
+        IoTRequest signal = makeRequest(&client->iotClient, pathTelemetry, signalBody, sizeof(signalBody));
+        client->protocol.signal(&signal);
+        while (signalsReceived < expectedSignals)
+        {
+            server->protocol.loop();
+        }
+
+        uint64_t expectedResponses = responsesReceived + 1;
+        IoTRequest request = makeRequest(&client->iotClient, pathTelemetry, requestBody, sizeof(requestBody));
+        IoTRequestResponse requestResponse = {&onResponse, NULL, NULL, 0};
+        client->protocol.request(&request, &requestResponse);
+        while (responsesReceived < expectedResponses)
+        {
+            server->protocol.loop();
+            client->protocol.loop();
+        }
+    }
+
+    printf("%-40s %12llu protocol heap allocations (%llu total)\n",
+           "steady state, 1000 SIGNAL + REQUEST",
+           (unsigned long long)(stats->allocations - allocations),
+           (unsigned long long)stats->allocations);
+    IOT_BENCH_CHECK(stats->allocations == allocations);
+}
+
+int main(int argc, char **argv)
+{
+    static BenchPeer a;
+    static BenchPeer b;
+    setupPeers(&a, &b);
+
+    server = &b;
+    server->protocol.use(serverMiddleware);
+
+    for (size_t i = 0; i < sizeof(streamingBody); i++)
+    {
+        streamingBody[i] = (uint8_t)i;
+    }
+
+    benchSignal("SIGNAL (16 B body, 1 header)", &a);
+    benchSignalTemplate("SIGNAL template (16 B body, 1 header)", &a);
+    benchRequestResponse("REQUEST/RESPONSE (64 B / 32 B)", &a);
+    benchStreaming("STREAMING (64 KiB body, multipart)", &a);
+
+    a.protocol.decodeMode = EIoTDecodeMode::VIEW;
+    b.protocol.decodeMode = EIoTDecodeMode::VIEW;
+    a.iotClient.vectoredWriter = &a.client;
+    b.iotClient.vectoredWriter = &b.client;
+
+    benchSignal("SIGNAL [view+writev]", &a);
+    benchSignalTemplate("SIGNAL template [view+writev]", &a);
+    benchRequestResponse("REQUEST/RESPONSE [view+writev]", &a);
+    benchStreaming("STREAMING [view+writev]", &a);
+
+    checkSteadyState(&a);
+
+    /* Same uploads written to a body sink: one copy per byte, the middleware sees the whole body once */
+    static IoTReassemblySink reassembly(sizeof(streamingBody));
+    b.protocol.onBodySink = [](IoTRequest *request) -> IoTBodySink *
+    { return &reassembly; };
+    benchStreaming("STREAMING [view+writev, reassembly sink]", &a);
+#ifdef __unix__
+    static IoTFileSink file(P_tmpdir "/iot_bench_upload");
+    b.protocol.onBodySink = [](IoTRequest *request) -> IoTBodySink *
+    { return &file; };
+    benchStreaming("STREAMING [view+writev, mmap file sink]", &a);
+    remove(file.path.c_str());
+#endif
+    b.protocol.onBodySink = nullptr;
+
+    /* Same uploads pulled part by part while sending */
+    static IoTCallbackSource callbackSource([](size_t offset, uint8_t *buffer, size_t length)
+                                            {
+                                                memcpy(buffer, streamingBody + offset, length);
+                                                return true; });
+    benchStreaming("STREAMING [view+writev, callback source]", &a, &callbackSource);
+#ifdef __unix__
+    FILE *upload = fopen(P_tmpdir "/iot_bench_source", "wb");
+    IOT_BENCH_CHECK(upload != NULL && fwrite(streamingBody, 1, sizeof(streamingBody), upload) == sizeof(streamingBody));
+    fclose(upload);
+    static IoTFileSource fileSource;
+    IOT_BENCH_CHECK(fileSource.open(P_tmpdir "/iot_bench_source") && fileSource.size() == sizeof(streamingBody));
+    benchStreaming("STREAMING [view+writev, mmap file source]", &a, &fileSource);
+    fileSource.close();
+    remove(P_tmpdir "/iot_bench_source");
+#endif
+
+    benchBackpressure(2048, 16 * 1024);
+    benchPriority(1024);
+    benchRequestDuringStreaming(0);
+    benchRequestDuringStreaming(8 * 1024);
+    benchPending(16);
+    benchPending(4096);
+    benchIdleClients(10000);
+
+    benchSignalBurst("SIGNAL burst x256 [view+writev, drain]", &a, 256);
+    b.protocol.frameBudget = 16;
+    benchSignalBurst("SIGNAL burst x256 [view+writev, budget 16]", &a, 256);
+    b.protocol.frameBudget = 0;
+
+    /* Same bursts packed into writes of up to the buffer size */
+    benchSignalCoalescing(&a, 64, 0, true);
+    benchSignalCoalescing(&a, 64, 1000, true);
+    benchSignalCoalescing(&a, 64, 50, false);
+
+    /* Same traffic, delivered in small TCP-like segments that split frames anywhere */
+    a.client.segmentOutput(7);
+    benchSignal("SIGNAL [view+writev, 7 B segments]", &a);
+    a.client.segmentOutput(100);
+    benchStreaming("STREAMING [view+writev, 100 B segments]", &a);
+    a.client.segmentOutput(1500);
+    benchStreaming("STREAMING [view+writev, 1500 B segments]", &a);
+    a.client.segmentOutput(0);
+
+    /* Same uploads with the buffer size tuned: the prefix is repeated by fewer, larger parts */
+    a.iotClient.bufferStats = IoTBufferStats();
+    a.iotClient.bufferTuner.enabled = true;
+    benchStreaming("STREAMING [view+writev, tuned buffer size]", &a);
+    IoTBufferStats *stats = &a.iotClient.bufferStats;
+    printf("%-40s %12u B size  %10.4f overhead  %u resizes  %u us rtt\n", "",
+           a.iotClient.bufferSize, stats->overhead(), stats->resizes, stats->rttMicros);
+    IOT_BENCH_CHECK(a.iotClient.bufferSize <= b.iotClient.maxBufferSize && b.iotClient.receiveBufferSize == a.iotClient.bufferSize);
+
+    return 0;
+}
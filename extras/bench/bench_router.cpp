@@ -0,0 +1,195 @@
+/*
+ * Dispatch cost of 32 routes: one middleware per route, each comparing the
+ * path itself, against an IoTRouter compiled from the same routes. Frames
+ * go straight to runMiddleware (no transport), hitting the first, the last
+ * and a parameterized route.
+ *
+ * Then an 8-stage pipeline of pass-through middlewares: runMiddleware in
+ * NESTED and FLAT mode (EIoTMiddlewareMode) and an IoTChain of the same
+ * stages.
+ */
+
+#include "iot_protocol.h"
+#include "iot_router.h"
+#include "iot_bench.h"
+
+#define BENCH_ROUTES 32
+
+static char paths[BENCH_ROUTES][32];
+static uint64_t handled[BENCH_ROUTES + 1];
+
+/* Baseline: a middleware per route doing its own strcmp */
+template <int N>
+static void routeMiddleware(IoTRequest *request, Next *next)
+{
+    if (request->path != NULL && strcmp(request->path, paths[N]) == 0)
+    {
+        handled[N]++;
+        return;
+    }
+    (*next)();
+}
+
+template <int N>
+static void handler(IoTRequest *request, Next *next)
+{
+    handled[N]++;
+}
+
+static void telemetry(IoTRequest *request, Next *next)
+{
+    const IoTPathParam *id = request->params->get("id");
+    IOT_BENCH_CHECK(id != NULL && id->length == 4 && memcmp(id->value, "a1b2", 4) == 0);
+    handled[BENCH_ROUTES]++;
+}
+
+/* Last: the parameterized route, written by hand */
+static void telemetryMiddleware(IoTRequest *request, Next *next)
+{
+    static const char prefix[] = "/devices/";
+    static const char suffix[] = "/telemetry";
+    const char *path = request->path;
+    if (path != NULL && strncmp(path, prefix, sizeof(prefix) - 1) == 0)
+    {
+        const char *id = path + sizeof(prefix) - 1;
+        const char *end = strchr(id, '/');
+        if (end != NULL && strcmp(end, suffix) == 0)
+        {
+            IOT_BENCH_CHECK(end - id == 4 && memcmp(id, "a1b2", 4) == 0);
+            handled[BENCH_ROUTES]++;
+            return;
+        }
+    }
+    (*next)();
+}
+
+template <int N>
+static void add(IoTProtocol *middlewares, IoTRouter *router)
+{
+    add<N - 1>(middlewares, router);
+    middlewares->use(routeMiddleware<N - 1>);
+    router->use(paths[N - 1], handler<N - 1>);
+}
+
+template <>
+void add<0>(IoTProtocol *middlewares, IoTRouter *router)
+{
+}
+
+#define BENCH_STAGES 8
+
+static uint64_t passed = 0;
+
+template <int N>
+static void passThrough(IoTRequest *request, Next *next)
+{
+    passed++;
+    (*next)();
+}
+
+template <int N>
+static void addStages(IoTProtocol *protocol)
+{
+    addStages<N - 1>(protocol);
+    protocol->use(passThrough<N - 1>);
+}
+
+template <>
+void addStages<0>(IoTProtocol *protocol)
+{
+}
+
+template <typename Run>
+static void benchPipeline(const char *name, Run run)
+{
+    static char path[] = "/telemetry";
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::SIGNAL,
+        0,
+        path,
+        IoTHeaders(),
+        NULL,
+        0,
+        0,
+        0,
+        NULL,
+        true};
+
+    iotBenchRun(name, [&request, run](uint64_t &frames, uint64_t &bytes)
+                {
+                    uint64_t before = passed;
+                    run(&request);
+                    IOT_BENCH_CHECK(passed == before + BENCH_STAGES);
+                    frames++; });
+}
+
+static void benchDispatch(const char *name, IoTProtocol *protocol, char *path, size_t expected)
+{
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::SIGNAL,
+        0,
+        path,
+        IoTHeaders(),
+        NULL,
+        0,
+        0,
+        0,
+        NULL,
+        true};
+
+    iotBenchRun(name, [protocol, &request, expected](uint64_t &frames, uint64_t &bytes)
+                {
+                    uint64_t before = handled[expected];
+                    protocol->runMiddleware(&request, 0);
+                    IOT_BENCH_CHECK(handled[expected] == before + 1);
+                    frames++;
+                    bytes += strlen(request.path); });
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < BENCH_ROUTES; i++)
+    {
+        snprintf(paths[i], sizeof(paths[i]), "/sensors/%s/%d", (i % 2) ? "humidity" : "temperature", i);
+    }
+
+    static IoTProtocol middlewares;
+    static IoTProtocol routed;
+    static IoTRouter router;
+    add<BENCH_ROUTES>(&middlewares, &router);
+    middlewares.use(telemetryMiddleware);
+    router.use("/devices/:id/telemetry", telemetry);
+    router.compile();
+    routed.use("/", &router);
+
+    static char telemetryPath[] = "/devices/a1b2/telemetry";
+
+    benchDispatch("first route [strcmp middlewares]", &middlewares, paths[0], 0);
+    benchDispatch("first route [router]", &routed, paths[0], 0);
+    benchDispatch("last route [strcmp middlewares]", &middlewares, paths[BENCH_ROUTES - 1], BENCH_ROUTES - 1);
+    benchDispatch("last route [router]", &routed, paths[BENCH_ROUTES - 1], BENCH_ROUTES - 1);
+    benchDispatch(":id route [strcmp middlewares]", &middlewares, telemetryPath, BENCH_ROUTES);
+    benchDispatch(":id route [router]", &routed, telemetryPath, BENCH_ROUTES);
+
+    static IoTProtocol nested;
+    static IoTProtocol flat;
+    addStages<BENCH_STAGES>(&nested);
+    addStages<BENCH_STAGES>(&flat);
+    flat.middlewareMode = EIoTMiddlewareMode::FLAT;
+    typedef IoTChain<passThrough<0>, passThrough<1>, passThrough<2>, passThrough<3>,
+                     passThrough<4>, passThrough<5>, passThrough<6>, passThrough<7>>
+        Chain;
+
+    benchPipeline("8 stages [runMiddleware, NESTED]", [](IoTRequest *request)
+                  { nested.runMiddleware(request); });
+    benchPipeline("8 stages [runMiddleware, FLAT]", [](IoTRequest *request)
+                  { flat.runMiddleware(request); });
+    benchPipeline("8 stages [IoTChain]", [](IoTRequest *request)
+                  {
+                      static Next done = []() {};
+                      Chain::run(request, &done); });
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#ifndef __IOT_BENCH_H__
+#define __IOT_BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+/* Number of heap allocations (malloc/calloc/realloc/new) so far, see iot_bench_alloc.cpp */
+size_t iotBenchAllocations();
+
+/* Seconds each scenario runs for, overridable with IOT_BENCH_SECONDS */
+inline double iotBenchSeconds()
+{
+    const char *env = getenv("IOT_BENCH_SECONDS");
+    return (env != NULL) ? atof(env) : 0.5;
+}
+
+struct IoTBenchResult
+{
+    uint64_t frames;
+    uint64_t bytes;
+    size_t allocations;
+    double seconds;
+};
+
+/*
+ * Runs `step` (which returns the frames and bytes it moved) until the time
+ * budget is spent and reports frames/sec, bytes/sec and allocations per frame.
+ */
+template <typename Step>
+IoTBenchResult iotBenchRun(const char *name, Step step)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    IoTBenchResult result = {0, 0, 0, 0};
+    double budget = iotBenchSeconds();
+
+    size_t allocationsBefore = iotBenchAllocations();
+    Clock::time_point start = Clock::now();
+    do
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            step(result.frames, result.bytes);
+        }
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (result.seconds < budget);
+    result.allocations = iotBenchAllocations() - allocationsBefore;
+
+    printf("%-40s %12.0f frames/s %10.2f MB/s %8.2f allocs/frame\n",
+           name,
+           result.frames / result.seconds,
+           result.bytes / result.seconds / (1024.0 * 1024.0),
+           (result.frames > 0) ? (double)result.allocations / result.frames : 0.0);
+    fflush(stdout);
+
+    return result;
+}
+
+/* Aborts the benchmark when the protocol produced something unexpected */
+#define IOT_BENCH_CHECK(condition)                                                        \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(condition))                                                                 \
+        {                                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            abort();                                                                      \
+        }                                                                                 \
+    } while (0)
+
+#endif
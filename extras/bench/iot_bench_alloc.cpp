@@ -0,0 +1,42 @@
+/*
+ * Counts heap allocations by interposing glibc's malloc family. operator new
+ * ends up in malloc, so C++ allocations are counted as well.
+ */
+
+#include <atomic>
+#include <stddef.h>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void __libc_free(void *pointer);
+
+static std::atomic<size_t> allocations(0);
+
+size_t iotBenchAllocations()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+extern "C" void *malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void *pointer)
+{
+    __libc_free(pointer);
+}
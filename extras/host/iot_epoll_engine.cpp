@@ -0,0 +1,566 @@
+#include "iot_epoll_engine.h"
+#include "iot_queue.h"
+#include "iot_socket_client.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define IOT_ENGINE_TAG_LISTENER UINT64_MAX
+#define IOT_ENGINE_TAG_WAKE (UINT64_MAX - 1)
+#define IOT_ENGINE_EVENTS 256
+#define IOT_ENGINE_BATCH 64     /* Jobs a worker takes from one shard before looking at the next */
+#define IOT_ENGINE_SPINS 128    /* Empty polls before a worker sleeps on its eventfd */
+
+/* Request copied out of the receive buffer, on its way to a worker */
+struct IoTEngineJob
+{
+    uint64_t connection;
+    IoTRequest request;
+};
+
+/* Worker -> I/O thread */
+struct IoTEngineReplyItem
+{
+    uint64_t connection;
+    uint16_t id;
+    uint8_t *body;
+    size_t length;
+};
+
+struct IoTEngineConnection : public IoTSocketClient
+{
+    explicit IoTEngineConnection(int fd) : IoTSocketClient(fd), iotClient() {}
+
+    IoTClient iotClient;
+    uint64_t id = 0;         /* generation << 32 | slot */
+    bool writing = false;    /* EPOLLOUT armed: outbound bytes waiting for the socket */
+    bool closing = false;
+};
+
+struct IoTEngineShard
+{
+    IoTEngineShard(size_t index, size_t queueCapacity) : index(index), replies(queueCapacity) {}
+
+    size_t index;
+    IoTEpollEngine *engine = NULL;
+    IoTProtocol protocol;
+    IoTHeapAllocator heap; /* Own one: the shared heap allocator keeps unsynchronized stats */
+    OnDisconnect onDisconnect;
+
+    int epoll = -1;
+    int listener = -1;
+    int wake = -1;
+
+    std::vector<IoTEngineConnection *> connections; /* By slot */
+    std::vector<uint32_t> generations;
+    std::vector<uint32_t> freeSlots;
+    std::vector<IoTEngineConnection *> closing;     /* Closed once nothing up the stack uses them */
+
+    IoTMpscQueue<IoTEngineReplyItem> replies;
+    std::atomic<bool> wakePending{false};
+
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> closed{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> replied{0};
+
+    IoTEngineConnection *find(uint64_t id)
+    {
+        uint32_t slot = (uint32_t)id;
+        if (slot >= this->connections.size() || this->connections[slot] == NULL || this->connections[slot]->id != id)
+            return NULL;
+        return this->connections[slot];
+    }
+
+    /* Single writer (this shard's thread), read by stats() */
+    static void count(std::atomic<uint64_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+struct IoTEngineWorker
+{
+    std::vector<std::unique_ptr<IoTSpscQueue<IoTEngineJob>>> inputs; /* One per shard */
+    int wake = -1;
+    std::atomic<bool> sleeping{false};
+};
+
+static thread_local IoTEngineShard *currentShard = NULL;
+
+static void notify(int fd)
+{
+    uint64_t one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written;
+}
+
+void IoTEngineReply::send(const uint8_t *body, size_t length)
+{
+    free(this->body);
+    this->body = (uint8_t *)malloc(length + 1);
+    if (this->body == NULL)
+    {
+        throw "[IoTEpollEngine] Out of memory for reply";
+    }
+    memcpy(this->body, body, length);
+    this->length = length;
+}
+
+IoTEpollEngine::IoTEpollEngine(const IoTEngineConfig &config)
+{
+    this->config = config;
+    if (this->config.ioThreads == 0)
+    {
+        this->config.ioThreads = 1;
+    }
+}
+
+IoTEpollEngine::~IoTEpollEngine()
+{
+    this->stop();
+}
+
+bool IoTEpollEngine::start()
+{
+    if (this->running.load())
+        return false;
+
+    uint16_t port = this->config.port;
+    for (size_t i = 0; i < this->config.ioThreads; i++)
+    {
+        IoTEngineShard *shard = new IoTEngineShard(i, this->config.queueCapacity);
+        this->shards.emplace_back(shard);
+        shard->engine = this;
+        shard->protocol.allocator = &shard->heap;
+        shard->protocol.decodeMode = EIoTDecodeMode::VIEW; /* dispatch copies what a worker needs */
+        shard->protocol.use(IoTEpollEngine::dispatch);
+        shard->onDisconnect = [shard](IoTClient *iotClient)
+        {
+            IoTEngineConnection *connection = static_cast<IoTEngineConnection *>(iotClient->client);
+            if (!connection->closing)
+            {
+                connection->closing = true;
+                shard->closing.push_back(connection);
+            }
+        };
+
+        /* One listening socket per shard on the same port: the kernel balances accepted connections */
+        shard->listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(shard->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(shard->listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (shard->listener < 0 || bind(shard->listener, (struct sockaddr *)&address, sizeof(address)) < 0 || ::listen(shard->listener, SOMAXCONN) < 0)
+        {
+            this->stop();
+            return false;
+        }
+        if (port == 0)
+        {
+            socklen_t length = sizeof(address);
+            getsockname(shard->listener, (struct sockaddr *)&address, &length);
+            port = ntohs(address.sin_port);
+        }
+
+        shard->epoll = epoll_create1(EPOLL_CLOEXEC);
+        shard->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = IOT_ENGINE_TAG_LISTENER;
+        epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->listener, &event);
+        event.data.u64 = IOT_ENGINE_TAG_WAKE;
+        epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->wake, &event);
+    }
+    this->boundPort = port;
+
+    for (size_t i = 0; i < this->config.workerThreads; i++)
+    {
+        IoTEngineWorker *worker = new IoTEngineWorker();
+        this->workers.emplace_back(worker);
+        worker->wake = eventfd(0, EFD_CLOEXEC);
+        for (size_t s = 0; s < this->shards.size(); s++)
+        {
+            worker->inputs.emplace_back(new IoTSpscQueue<IoTEngineJob>(this->config.queueCapacity));
+        }
+    }
+
+    this->running.store(true);
+    for (auto &shard : this->shards)
+    {
+        this->threads.emplace_back(&IoTEpollEngine::runShard, this, shard.get());
+    }
+    for (auto &worker : this->workers)
+    {
+        this->threads.emplace_back(&IoTEpollEngine::runWorker, this, worker.get());
+    }
+    return true;
+}
+
+void IoTEpollEngine::stop()
+{
+    this->running.store(false);
+    for (auto &shard : this->shards)
+    {
+        if (shard->wake >= 0)
+            notify(shard->wake);
+    }
+    for (auto &worker : this->workers)
+    {
+        notify(worker->wake);
+    }
+    for (auto &thread : this->threads)
+    {
+        thread.join();
+    }
+    this->threads.clear();
+
+    /* Whatever was still in flight */
+    for (auto &worker : this->workers)
+    {
+        for (size_t s = 0; s < worker->inputs.size(); s++)
+        {
+            IoTEngineJob job;
+            while (worker->inputs[s]->pop(job))
+            {
+                this->shards[s]->protocol.freeRequest(&job.request);
+            }
+        }
+        ::close(worker->wake);
+    }
+    this->workers.clear();
+
+    for (auto &shard : this->shards)
+    {
+        IoTEngineReplyItem item;
+        while (shard->replies.pop(item))
+        {
+            free(item.body);
+        }
+        for (IoTEngineConnection *connection : shard->connections)
+        {
+            if (connection != NULL)
+            {
+                shard->protocol.unlisten(&connection->iotClient);
+                delete connection;
+            }
+        }
+        if (shard->epoll >= 0)
+            ::close(shard->epoll);
+        if (shard->listener >= 0)
+            ::close(shard->listener);
+        if (shard->wake >= 0)
+            ::close(shard->wake);
+    }
+    this->shards.clear();
+}
+
+IoTEngineStats IoTEpollEngine::stats() const
+{
+    IoTEngineStats stats = {0, 0, 0, 0};
+    for (auto &shard : this->shards)
+    {
+        stats.accepted += shard->accepted.load(std::memory_order_relaxed);
+        stats.closed += shard->closed.load(std::memory_order_relaxed);
+        stats.requests += shard->requests.load(std::memory_order_relaxed);
+        stats.replies += shard->replied.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void IoTEpollEngine::runShard(IoTEngineShard *shard)
+{
+    currentShard = shard;
+    struct epoll_event events[IOT_ENGINE_EVENTS];
+
+    while (this->running.load(std::memory_order_relaxed))
+    {
+        /* Wake up at least once per timer wheel tick for the protocol deadlines */
+        int count = epoll_wait(shard->epoll, events, IOT_ENGINE_EVENTS, IOT_TIMER_WHEEL_RESOLUTION);
+
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t tag = events[i].data.u64;
+            if (tag == IOT_ENGINE_TAG_LISTENER)
+            {
+                this->accept(shard);
+                continue;
+            }
+            if (tag == IOT_ENGINE_TAG_WAKE)
+            {
+                uint64_t value;
+                ssize_t length = read(shard->wake, &value, sizeof(value));
+                (void)length;
+                continue;
+            }
+
+            IoTEngineConnection *connection = shard->find(tag);
+            if (connection == NULL || connection->closing)
+                continue;
+
+            if (events[i].events & EPOLLOUT)
+            {
+                shard->protocol.flush(&connection->iotClient);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                connection->markReadable();
+                shard->protocol.readClient(&connection->iotClient);
+            }
+            this->settle(shard, connection);
+        }
+
+        shard->wakePending.store(false);
+        this->drainReplies(shard);
+
+        shard->protocol.expireTimers();
+
+        for (IoTEngineConnection *connection : shard->closing)
+        {
+            this->close(shard, connection);
+        }
+        shard->closing.clear();
+    }
+}
+
+void IoTEpollEngine::accept(IoTEngineShard *shard)
+{
+    int fd;
+    while ((fd = accept4(shard->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        uint32_t slot;
+        if (shard->freeSlots.empty())
+        {
+            slot = (uint32_t)shard->connections.size();
+            shard->connections.push_back(NULL);
+            shard->generations.push_back(0);
+        }
+        else
+        {
+            slot = shard->freeSlots.back();
+            shard->freeSlots.pop_back();
+        }
+
+        IoTEngineConnection *connection = new IoTEngineConnection(fd);
+        connection->setPolled(true);
+        connection->id = ((uint64_t)(++shard->generations[slot]) << 32) | slot;
+        connection->iotClient.client = connection;
+        connection->iotClient.vectoredWriter = connection;
+        connection->iotClient.bufferSize = this->config.bufferSize;
+        connection->iotClient.outboundCapacity = this->config.outboundCapacity;
+        connection->iotClient.onDisconnect = &shard->onDisconnect;
+        shard->protocol.listen(&connection->iotClient);
+        shard->connections[slot] = connection;
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = connection->id;
+        epoll_ctl(shard->epoll, EPOLL_CTL_ADD, fd, &event);
+
+        IoTEngineShard::count(shard->accepted);
+    }
+}
+
+void IoTEpollEngine::close(IoTEngineShard *shard, IoTEngineConnection *connection)
+{
+    uint32_t slot = (uint32_t)connection->id;
+    shard->protocol.unlisten(&connection->iotClient);
+    connection->stop(); /* Closing the socket also takes it out of the epoll set */
+    shard->connections[slot] = NULL;
+    shard->freeSlots.push_back(slot);
+    delete connection;
+
+    IoTEngineShard::count(shard->closed);
+}
+
+/* After reading or writing: schedule the close of a dead connection, watch EPOLLOUT while bytes are queued */
+void IoTEpollEngine::settle(IoTEngineShard *shard, IoTEngineConnection *connection)
+{
+    if (!connection->connected())
+    {
+        shard->onDisconnect(&connection->iotClient);
+        return;
+    }
+
+    bool queued = !connection->iotClient.outbound.empty();
+    if (queued != connection->writing)
+    {
+        connection->writing = queued;
+        struct epoll_event event = {};
+        event.events = queued ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        event.data.u64 = connection->id;
+        epoll_ctl(shard->epoll, EPOLL_CTL_MOD, connection->socket(), &event);
+    }
+}
+
+void IoTEpollEngine::deliver(IoTEngineShard *shard, uint64_t connectionId, uint16_t id, IoTEngineReply *reply)
+{
+    IoTEngineConnection *connection = shard->find(connectionId);
+    if (connection != NULL && !connection->closing && connection->connected())
+    {
+        IoTRequest response = {
+            IOT_VERSION,
+            EIoTMethod::RESPONSE,
+            id,
+            NULL,
+            IoTHeaders(),
+            reply->body,
+            reply->length,
+            0,
+            0,
+            &connection->iotClient};
+        shard->protocol.response(&response);
+        this->settle(shard, connection);
+
+        IoTEngineShard::count(shard->replied);
+    }
+    free(reply->body);
+    reply->body = NULL;
+}
+
+void IoTEpollEngine::drainReplies(IoTEngineShard *shard)
+{
+    IoTEngineReplyItem item;
+    while (shard->replies.pop(item))
+    {
+        IoTEngineReply reply;
+        reply.body = item.body;
+        reply.length = item.length;
+        this->deliver(shard, item.connection, item.id, &reply);
+    }
+}
+
+void IoTEpollEngine::handle(IoTRequest *request, IoTEngineReply *reply)
+{
+    if (this->onRequest)
+    {
+        this->onRequest(request, reply);
+    }
+}
+
+/* Middleware of every shard protocol, on the shard's I/O thread */
+void IoTEpollEngine::dispatch(IoTRequest *request, Next *next)
+{
+    IoTEngineShard *shard = currentShard;
+    IoTEpollEngine *engine = shard->engine;
+    IoTEngineConnection *connection = static_cast<IoTEngineConnection *>(request->iotClient->client);
+
+    if (request->method != EIoTMethod::REQUEST && request->method != EIoTMethod::SIGNAL && request->method != EIoTMethod::STREAMING)
+    {
+        (*next)();
+        return;
+    }
+    IoTEngineShard::count(shard->requests);
+
+    if (engine->workers.empty())
+    {
+        IoTEngineReply reply;
+        engine->handle(request, &reply);
+        if (request->method == EIoTMethod::REQUEST)
+        {
+            engine->deliver(shard, connection->id, request->id, &reply);
+        }
+        free(reply.body);
+        (*next)();
+        return;
+    }
+
+    /* Same connection, same worker: its frames are handled in order */
+    IoTEngineWorker *worker = engine->workers[(uint32_t)connection->id % engine->workers.size()].get();
+    IoTSpscQueue<IoTEngineJob> *queue = worker->inputs[shard->index].get();
+
+    IoTEngineJob job;
+    job.connection = connection->id;
+    job.request = shard->protocol.retainRequest(request);
+    while (!queue->push(std::move(job)))
+    {
+        /* Worker behind: answer what it already finished meanwhile, it may be waiting on our reply queue */
+        engine->drainReplies(shard);
+        std::this_thread::yield();
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (worker->sleeping.load(std::memory_order_relaxed))
+    {
+        notify(worker->wake);
+    }
+
+    (*next)();
+}
+
+void IoTEpollEngine::runWorker(IoTEngineWorker *worker)
+{
+    size_t idle = 0;
+    while (this->running.load(std::memory_order_relaxed))
+    {
+        bool busy = false;
+        for (size_t s = 0; s < worker->inputs.size(); s++)
+        {
+            IoTEngineShard *shard = this->shards[s].get();
+            IoTEngineJob job;
+            size_t replies = 0;
+            for (size_t n = 0; n < IOT_ENGINE_BATCH && worker->inputs[s]->pop(job); n++)
+            {
+                busy = true;
+                IoTEngineReply reply;
+                this->handle(&job.request, &reply);
+
+                if (job.request.method == EIoTMethod::REQUEST)
+                {
+                    IoTEngineReplyItem item = {job.connection, job.request.id, reply.body, reply.length};
+                    while (!shard->replies.push(std::move(item)))
+                    {
+                        std::this_thread::yield();
+                    }
+                    replies++;
+                }
+                else
+                {
+                    free(reply.body);
+                }
+                shard->protocol.freeRequest(&job.request); /* Touches no protocol state */
+            }
+
+            if (replies > 0 && !shard->wakePending.exchange(true))
+            {
+                notify(shard->wake);
+            }
+        }
+
+        if (busy)
+        {
+            idle = 0;
+            continue;
+        }
+        if (++idle < IOT_ENGINE_SPINS)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        /* Sleep, unless a job arrived between the last poll and raising the flag */
+        worker->sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool empty = true;
+        for (auto &input : worker->inputs)
+        {
+            empty = empty && input->empty();
+        }
+        if (empty && this->running.load())
+        {
+            uint64_t value;
+            ssize_t length = read(worker->wake, &value, sizeof(value));
+            (void)length;
+        }
+        worker->sleeping.store(false, std::memory_order_relaxed);
+        idle = 0;
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#ifndef __IOT_EPOLL_ENGINE_H__
+#define __IOT_EPOLL_ENGINE_H__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "iot_protocol.h"
+
+struct IoTEngineConfig
+{
+    uint16_t port = 0;              /* 0 = any free port, see IoTEpollEngine::port() */
+    size_t ioThreads = 1;           /* Each one owns a listening socket (SO_REUSEPORT), an epoll set and the connections the kernel hands it */
+    size_t workerThreads = 1;       /* Run onRequest. 0 = run it on the I/O thread */
+    size_t queueCapacity = 1024;    /* Per (I/O thread, worker) job queue and per I/O thread reply queue */
+    uint32_t bufferSize = 0;        /* Of every connection. 0 = IOT_PROTOCOL_DEFAULT_BUFFER_SIZE */
+    uint32_t outboundCapacity = 64 * 1024;
+};
+
+/* A worker's answer to a REQUEST, routed back to the I/O thread owning the connection */
+class IoTEngineReply
+{
+public:
+    void send(const uint8_t *body, size_t length); /* Copied. Without it a REQUEST gets an empty RESPONSE */
+
+private:
+    friend class IoTEpollEngine;
+    uint8_t *body = NULL;
+    size_t length = 0;
+};
+
+/*
+ * Owning copy of the request (path, headers and body live until the handler
+ * returns). REQUESTs are answered with what the handler passes to reply->send;
+ * reply is ignored for SIGNAL and STREAMING parts.
+ */
+typedef std::function<void(IoTRequest *request, IoTEngineReply *reply)> OnEngineRequest;
+
+struct IoTEngineStats
+{
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t requests; /* Frames handed to onRequest */
+    uint64_t replies;  /* RESPONSEs written back */
+};
+
+struct IoTEngineShard;
+struct IoTEngineWorker;
+struct IoTEngineConnection;
+
+/*
+ * Linux TCP server running IoTProtocol on several cores.
+ *
+ * Each I/O thread is a shard: its own IoTProtocol, listening socket
+ * (SO_REUSEPORT, so the kernel spreads connections), epoll set and timers.
+ * Connections never leave their shard, so the protocol state needs no lock.
+ * Decoded frames go to workers over one SPSC queue per (shard, worker) pair,
+ * picked by connection so its frames stay in order; replies come back over
+ * the shard's MPSC queue and an eventfd wakes it up.
+ */
+class IoTEpollEngine
+{
+public:
+    explicit IoTEpollEngine(const IoTEngineConfig &config);
+    ~IoTEpollEngine();
+
+    IoTEpollEngine(const IoTEpollEngine &other) = delete;
+    IoTEpollEngine &operator=(const IoTEpollEngine &other) = delete;
+
+    OnEngineRequest onRequest; /* Set before start(). Called concurrently by the workers */
+
+    bool start(); /* Binds and spawns the threads. false (errno set) when the port cannot be bound */
+    void stop();  /* Closes every connection and joins the threads */
+
+    uint16_t port() const { return this->boundPort; }
+    IoTEngineStats stats() const;
+
+private:
+    IoTEngineConfig config;
+    uint16_t boundPort = 0;
+    std::atomic<bool> running{false};
+    std::vector<std::unique_ptr<IoTEngineShard>> shards;
+    std::vector<std::unique_ptr<IoTEngineWorker>> workers;
+    std::vector<std::thread> threads;
+
+    static void dispatch(IoTRequest *request, Next *next);
+    void runShard(IoTEngineShard *shard);
+    void runWorker(IoTEngineWorker *worker);
+    void accept(IoTEngineShard *shard);
+    void close(IoTEngineShard *shard, IoTEngineConnection *connection);
+    void settle(IoTEngineShard *shard, IoTEngineConnection *connection);
+    void deliver(IoTEngineShard *shard, uint64_t connection, uint16_t id, IoTEngineReply *reply);
+    void drainReplies(IoTEngineShard *shard);
+    void handle(IoTRequest *request, IoTEngineReply *reply);
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "iot_file_sink.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+IoTFileSink::IoTFileSink(const char *path) : path(path)
+{
+}
+
+IoTFileSink::~IoTFileSink()
+{
+    if (this->fd >= 0)
+    {
+        this->close(0, false);
+    }
+}
+
+void IoTFileSink::release()
+{
+    if (this->map != NULL)
+    {
+        munmap(this->map, this->total);
+        this->map = NULL;
+    }
+    if (this->fd >= 0)
+    {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+    this->total = 0;
+}
+
+bool IoTFileSink::open(IoTRequest *request, size_t totalBodyLength)
+{
+    if (this->fd >= 0)
+    {
+        return false; /* One body at a time */
+    }
+
+    this->fd = ::open(this->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (this->fd < 0)
+    {
+        return false;
+    }
+    this->total = totalBodyLength;
+
+    if (totalBodyLength > 0)
+    {
+        void *map = MAP_FAILED;
+        if (ftruncate(this->fd, (off_t)totalBodyLength) == 0)
+        {
+            map = mmap(NULL, totalBodyLength, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+        }
+        if (map == MAP_FAILED)
+        {
+            this->release();
+            unlink(this->path.c_str());
+            return false;
+        }
+        this->map = (uint8_t *)map;
+    }
+    return true;
+}
+
+bool IoTFileSink::write(uint16_t id, size_t offset, const uint8_t *data, size_t length)
+{
+    if (offset > this->total || length > this->total - offset)
+    {
+        return false;
+    }
+
+    if (length > 0)
+    {
+        memcpy(this->map + offset, data, length);
+    }
+    return true;
+}
+
+void IoTFileSink::close(uint16_t id, bool complete)
+{
+    if (complete && this->sync && this->map != NULL)
+    {
+        msync(this->map, this->total, MS_SYNC);
+    }
+    this->release();
+
+    if (!complete)
+    {
+        unlink(this->path.c_str());
+    }
+}
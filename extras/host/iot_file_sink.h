@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef __IOT_FILE_SINK_H__
+#define __IOT_FILE_SINK_H__
+
+#include <string>
+
+#include "iot_protocol.h"
+
+/*
+ * Writes one body at a time into a file (POSIX). The file is created at
+ * totalBodyLength and memory-mapped on open, so each part is copied once,
+ * from the receive buffer into the page cache, with no heap buffer. The
+ * handlers of the last part see the mapping as the request body.
+ *
+ * An incomplete body (aborted, timed out, client lost) removes the file.
+ */
+class IoTFileSink : public IoTBodySink
+{
+public:
+    explicit IoTFileSink(const char *path);
+    ~IoTFileSink();
+
+    IoTFileSink(const IoTFileSink &other) = delete;
+    IoTFileSink &operator=(const IoTFileSink &other) = delete;
+
+    bool open(IoTRequest *request, size_t totalBodyLength) override;
+    bool write(uint16_t id, size_t offset, const uint8_t *data, size_t length) override;
+    uint8_t *body(uint16_t id) override { return this->map; }
+    void close(uint16_t id, bool complete) override;
+
+    std::string path;
+    bool sync = false; /* msync before closing a complete file */
+
+private:
+    int fd = -1;
+    uint8_t *map = NULL;
+    size_t total = 0;
+
+    void release();
+};
+
+#endif
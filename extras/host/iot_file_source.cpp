@@ -0,0 +1,67 @@
+#include "iot_file_source.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+IoTFileSource::~IoTFileSource()
+{
+    this->close();
+}
+
+bool IoTFileSource::open(const char *path)
+{
+    this->close();
+
+    this->fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (this->fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(this->fd, &info) != 0)
+    {
+        this->close();
+        return false;
+    }
+    this->length = (size_t)info.st_size;
+
+    if (this->length > 0)
+    {
+        void *map = mmap(NULL, this->length, PROT_READ, MAP_PRIVATE, this->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            this->close();
+            return false;
+        }
+        this->map = (uint8_t *)map;
+        madvise(map, this->length, MADV_SEQUENTIAL);
+    }
+    return true;
+}
+
+void IoTFileSource::close()
+{
+    if (this->map != NULL)
+    {
+        munmap(this->map, this->length);
+        this->map = NULL;
+    }
+    if (this->fd >= 0)
+    {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+    this->length = 0;
+}
+
+const uint8_t *IoTFileSource::read(size_t offset, size_t length, uint8_t *scratch)
+{
+    if (offset > this->length || length > this->length - offset)
+    {
+        return NULL;
+    }
+    return this->map + offset;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef __IOT_FILE_SOURCE_H__
+#define __IOT_FILE_SOURCE_H__
+
+#include "iot_protocol.h"
+
+/*
+ * Body read from a memory-mapped file (POSIX). Parts are written to the
+ * transport straight from the mapping: nothing is copied through the heap,
+ * and with a vectored writer nothing is copied at all.
+ */
+class IoTFileSource : public IoTBodySource
+{
+public:
+    IoTFileSource() {}
+    ~IoTFileSource();
+
+    IoTFileSource(const IoTFileSource &other) = delete;
+    IoTFileSource &operator=(const IoTFileSource &other) = delete;
+
+    bool open(const char *path); /* false (errno set) when it cannot be mapped */
+    void close();
+
+    size_t size() const { return this->length; } /* The request bodyLength */
+    const uint8_t *read(size_t offset, size_t length, uint8_t *scratch) override;
+
+private:
+    int fd = -1;
+    uint8_t *map = NULL;
+    size_t length = 0;
+};
+
+#endif
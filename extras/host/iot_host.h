@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef __IOT_HOST_H__
+#define __IOT_HOST_H__
+
+/*
+ * Minimal stand-ins for the parts of the Arduino core used by the protocol,
+ * so it can be compiled and benchmarked on a POSIX host (IOT_PROTOCOL_HOST).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+/* Same virtual interface as Arduino's Client (minus the IPAddress overload) */
+class Client
+{
+public:
+    virtual ~Client() {}
+
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+};
+
+#endif
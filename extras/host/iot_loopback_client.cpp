@@ -0,0 +1,159 @@
+#include "iot_loopback_client.h"
+
+void IoTLoopbackClient::join(IoTLoopbackClient *a, IoTLoopbackClient *b)
+{
+    a->tx = std::make_shared<IoTLoopbackPipe>();
+    b->tx = std::make_shared<IoTLoopbackPipe>();
+    a->rx = b->tx;
+    b->rx = a->tx;
+}
+
+int IoTLoopbackClient::connect(const char *host, uint16_t port)
+{
+    return this->connected();
+}
+
+size_t IoTLoopbackClient::write(uint8_t value)
+{
+    return this->write(&value, 1);
+}
+
+/* Bytes the peer still has room for */
+static size_t writable(IoTLoopbackPipe *pipe, size_t size)
+{
+    if (pipe->window == 0)
+        return size;
+
+    size_t unread = pipe->data.size() - pipe->readIndex;
+    size_t room = (unread < pipe->window) ? pipe->window - unread : 0;
+    return (size < room) ? size : room;
+}
+
+size_t IoTLoopbackClient::write(const uint8_t *buffer, size_t size)
+{
+    if (!this->connected())
+        return 0;
+
+    size = writable(this->tx.get(), size);
+    if (size == 0)
+        return 0;
+
+    this->tx->data.insert(this->tx->data.end(), buffer, buffer + size);
+    this->tx->bytesWritten += size;
+    this->tx->writes++;
+    return size;
+}
+
+void IoTLoopbackClient::segmentOutput(size_t segment)
+{
+    this->tx->segment = segment;
+    this->tx->segmentEnd = this->tx->readIndex;
+    this->tx->segmentDrained = true;
+}
+
+void IoTLoopbackClient::limitOutput(size_t window)
+{
+    this->tx->window = window;
+}
+
+size_t IoTLoopbackClient::writev(const IoTIoVec *iov, size_t count)
+{
+    if (!this->connected())
+        return 0;
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t length = writable(this->tx.get(), iov[i].length);
+        this->tx->data.insert(this->tx->data.end(), iov[i].data, iov[i].data + length);
+        size += length;
+        if (length < iov[i].length)
+            break;
+    }
+    if (size == 0)
+        return 0;
+    this->tx->bytesWritten += size;
+    this->tx->writes++;
+    return size;
+}
+
+int IoTLoopbackClient::available()
+{
+    if (!this->rx)
+        return 0;
+
+    size_t end = this->rx->data.size();
+    if (this->rx->segment > 0)
+    {
+        /* A drained segment reports 0 once, then the next segment arrives */
+        if (this->rx->readIndex >= this->rx->segmentEnd)
+        {
+            if (!this->rx->segmentDrained)
+            {
+                this->rx->segmentDrained = true;
+                return 0;
+            }
+            this->rx->segmentDrained = false;
+            this->rx->segmentEnd = this->rx->readIndex + this->rx->segment;
+        }
+        if (this->rx->segmentEnd < end)
+            end = this->rx->segmentEnd;
+    }
+
+    return (int)(end - this->rx->readIndex);
+}
+
+int IoTLoopbackClient::read()
+{
+    uint8_t value;
+    return (this->read(&value, 1) == 1) ? value : -1;
+}
+
+int IoTLoopbackClient::read(uint8_t *buffer, size_t size)
+{
+    size_t length = (size_t)this->available();
+    if (length == 0)
+        return -1;
+    if (length > size)
+        length = size;
+
+    memcpy(buffer, this->rx->data.data() + this->rx->readIndex, length);
+    this->rx->readIndex += length;
+
+    /* Compact once everything queued has been consumed */
+    if (this->rx->readIndex == this->rx->data.size())
+    {
+        this->rx->segmentEnd = (this->rx->segmentEnd > this->rx->readIndex) ? this->rx->segmentEnd - this->rx->readIndex : 0;
+        this->rx->data.clear();
+        this->rx->readIndex = 0;
+    }
+
+    return (int)length;
+}
+
+int IoTLoopbackClient::peek()
+{
+    return (this->available() > 0) ? this->rx->data[this->rx->readIndex] : -1;
+}
+
+void IoTLoopbackClient::flush()
+{
+}
+
+void IoTLoopbackClient::stop()
+{
+    if (this->tx)
+        this->tx->open = false;
+    if (this->rx)
+        this->rx->open = false;
+}
+
+uint8_t IoTLoopbackClient::connected()
+{
+    return (this->tx && this->tx->open && this->rx && this->rx->open) ? 1 : 0;
+}
+
+IoTLoopbackClient::operator bool()
+{
+    return this->connected() == 1;
+}
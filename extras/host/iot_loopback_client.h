@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef __IOT_LOOPBACK_CLIENT_H__
+#define __IOT_LOOPBACK_CLIENT_H__
+
+#include <memory>
+#include <vector>
+
+#include "iot_platform.h"
+
+/* One direction of an in-memory connection */
+struct IoTLoopbackPipe
+{
+    std::vector<uint8_t> data;
+    size_t readIndex = 0;
+    bool open = true;
+
+    /* When non-zero the reader gets at most `segment` bytes per read pass, like a segmented TCP stream */
+    size_t segment = 0;
+    size_t segmentEnd = 0;
+    bool segmentDrained = false;
+
+    /* When non-zero the writer can only get `window` unread bytes ahead of the reader, like a full socket send buffer */
+    size_t window = 0;
+
+    /* Stats */
+    uint64_t bytesWritten = 0;
+    uint64_t writes = 0; /* write() calls, i.e. packets on a real socket */
+};
+
+/*
+ * In-memory Client. Two clients joined with IoTLoopbackClient::join behave
+ * like both ends of a TCP connection inside a single process: bytes written
+ * on one side become available() on the other.
+ */
+class IoTLoopbackClient : public Client, public IoTVectoredWriter
+{
+private:
+    std::shared_ptr<IoTLoopbackPipe> rx;
+    std::shared_ptr<IoTLoopbackPipe> tx;
+
+public:
+    static void join(IoTLoopbackClient *a, IoTLoopbackClient *b);
+
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t value) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    size_t writev(const IoTIoVec *iov, size_t count) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buffer, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override;
+
+    /* Deliver what this client writes to its peer in `segment` byte pieces (0 = as written) */
+    void segmentOutput(size_t segment);
+
+    /* Accept writes only while the peer has less than `window` unread bytes (0 = unbounded) */
+    void limitOutput(size_t window);
+
+    /* Outgoing direction (bytes this client wrote) */
+    IoTLoopbackPipe *output() { return this->tx.get(); }
+};
+
+#endif
@@ -0,0 +1,166 @@
+#pragma once
+
+#ifndef __IOT_QUEUE_H__
+#define __IOT_QUEUE_H__
+
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOT_CACHE_LINE 64
+
+/* Smallest power of two >= `value` (min 2) */
+inline size_t iotQueueCapacity(size_t value)
+{
+    size_t capacity = 2;
+    while (capacity < value)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/*
+ * Bounded single-producer single-consumer queue. Each side owns its index and
+ * only reads the other one, caching it until the queue looks full/empty.
+ */
+template <typename T>
+class IoTSpscQueue
+{
+public:
+    explicit IoTSpscQueue(size_t capacity)
+    {
+        this->limit = iotQueueCapacity(capacity);
+        this->mask = this->limit - 1;
+        this->items = new T[this->limit];
+    }
+    ~IoTSpscQueue() { delete[] this->items; }
+
+    IoTSpscQueue(const IoTSpscQueue &other) = delete;
+    IoTSpscQueue &operator=(const IoTSpscQueue &other) = delete;
+
+    /* Producer */
+    bool push(T &&item)
+    {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->cachedHead == this->limit)
+        {
+            this->cachedHead = this->head.load(std::memory_order_acquire);
+            if (tail - this->cachedHead == this->limit)
+                return false;
+        }
+        this->items[tail & this->mask] = std::move(item);
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer */
+    bool pop(T &item)
+    {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if (head == this->cachedTail)
+        {
+            this->cachedTail = this->tail.load(std::memory_order_acquire);
+            if (head == this->cachedTail)
+                return false;
+        }
+        item = std::move(this->items[head & this->mask]);
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire); }
+
+private:
+    T *items;
+    size_t limit;
+    size_t mask;
+
+    alignas(IOT_CACHE_LINE) std::atomic<size_t> head{0}; /* Consumer */
+    size_t cachedTail = 0;
+    alignas(IOT_CACHE_LINE) std::atomic<size_t> tail{0}; /* Producer */
+    size_t cachedHead = 0;
+};
+
+/*
+ * Bounded multi-producer single-consumer queue (sequence-numbered cells).
+ * Producers claim a cell with a CAS on the tail; the consumer is wait-free.
+ */
+template <typename T>
+class IoTMpscQueue
+{
+public:
+    explicit IoTMpscQueue(size_t capacity)
+    {
+        this->limit = iotQueueCapacity(capacity);
+        this->mask = this->limit - 1;
+        this->cells = new Cell[this->limit];
+        for (size_t i = 0; i < this->limit; i++)
+        {
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    ~IoTMpscQueue() { delete[] this->cells; }
+
+    IoTMpscQueue(const IoTMpscQueue &other) = delete;
+    IoTMpscQueue &operator=(const IoTMpscQueue &other) = delete;
+
+    /* Any thread */
+    bool push(T &&item)
+    {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true)
+        {
+            cell = &this->cells[tail & this->mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)tail;
+            if (difference == 0)
+            {
+                if (this->tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (difference < 0)
+            {
+                return false; /* Full */
+            }
+            else
+            {
+                tail = this->tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->item = std::move(item);
+        cell->sequence.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer */
+    bool pop(T &item)
+    {
+        Cell *cell = &this->cells[this->head & this->mask];
+        if (cell->sequence.load(std::memory_order_acquire) != this->head + 1)
+            return false;
+
+        item = std::move(cell->item);
+        cell->sequence.store(this->head + this->limit, std::memory_order_release);
+        this->head++;
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    Cell *cells;
+    size_t limit;
+    size_t mask;
+
+    alignas(IOT_CACHE_LINE) size_t head = 0; /* Consumer */
+    alignas(IOT_CACHE_LINE) std::atomic<size_t> tail{0};
+};
+
+#endif
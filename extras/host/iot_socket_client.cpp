@@ -0,0 +1,191 @@
+#include "iot_socket_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static void configure(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    /* Frames are written whole: no point holding them back for Nagle */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+IoTSocketClient::IoTSocketClient(int fd)
+{
+    this->fd = fd;
+    configure(fd);
+}
+
+IoTSocketClient::~IoTSocketClient()
+{
+    this->stop();
+}
+
+int IoTSocketClient::connect(const char *host, uint16_t port)
+{
+    this->stop();
+
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses = NULL;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0)
+        return 0;
+
+    for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next)
+    {
+        int fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            this->fd = fd;
+            configure(fd);
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(addresses);
+
+    return this->connected();
+}
+
+size_t IoTSocketClient::write(uint8_t value)
+{
+    return this->write(&value, 1);
+}
+
+size_t IoTSocketClient::write(const uint8_t *buffer, size_t size)
+{
+    if (this->fd < 0)
+        return 0;
+
+    ssize_t written = send(this->fd, buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (written < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            this->stop();
+        return 0;
+    }
+    return (size_t)written;
+}
+
+size_t IoTSocketClient::writev(const IoTIoVec *iov, size_t count)
+{
+    if (this->fd < 0)
+        return 0;
+
+    struct iovec vectors[8];
+    if (count > 8)
+        count = 8;
+    for (size_t i = 0; i < count; i++)
+    {
+        vectors[i].iov_base = (void *)iov[i].data;
+        vectors[i].iov_len = iov[i].length;
+    }
+
+    struct msghdr message = {};
+    message.msg_iov = vectors;
+    message.msg_iovlen = count;
+    ssize_t written = sendmsg(this->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (written < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            this->stop();
+        return 0;
+    }
+    return (size_t)written;
+}
+
+int IoTSocketClient::available()
+{
+    if (this->fd < 0)
+        return 0;
+
+    /* Unknown amount: read() asks for a whole buffer and stops at the first short read */
+    if (this->polled)
+        return this->readable ? INT_MAX : 0;
+
+    if (this->drained)
+    {
+        this->drained = false;
+        return 0;
+    }
+
+    int length = 0;
+    if (ioctl(this->fd, FIONREAD, &length) < 0)
+        return 0;
+    return length;
+}
+
+int IoTSocketClient::read()
+{
+    uint8_t value;
+    return (this->read(&value, 1) == 1) ? value : -1;
+}
+
+int IoTSocketClient::read(uint8_t *buffer, size_t size)
+{
+    if (this->fd < 0)
+        return -1;
+
+    ssize_t length = recv(this->fd, buffer, size, MSG_DONTWAIT);
+    if (length > 0)
+    {
+        this->drained = ((size_t)length < size);
+        this->readable = !this->drained;
+        return (int)length;
+    }
+    this->readable = false;
+
+    /* 0 = peer closed */
+    if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        this->stop();
+    return -1;
+}
+
+int IoTSocketClient::peek()
+{
+    uint8_t value;
+    if (this->fd < 0 || recv(this->fd, &value, 1, MSG_PEEK | MSG_DONTWAIT) != 1)
+        return -1;
+    return value;
+}
+
+void IoTSocketClient::flush()
+{
+}
+
+void IoTSocketClient::stop()
+{
+    if (this->fd >= 0)
+    {
+        close(this->fd);
+        this->fd = -1;
+    }
+}
+
+uint8_t IoTSocketClient::connected()
+{
+    return (this->fd >= 0) ? 1 : 0;
+}
+
+IoTSocketClient::operator bool()
+{
+    return this->connected() == 1;
+}
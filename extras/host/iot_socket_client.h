@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef __IOT_SOCKET_CLIENT_H__
+#define __IOT_SOCKET_CLIENT_H__
+
+#include "iot_platform.h"
+
+/*
+ * Client over a non-blocking TCP socket (Linux). Writes take what the socket
+ * buffer accepts and return it, so IoTProtocol queues the rest on the
+ * client's outbound buffer instead of blocking.
+ */
+class IoTSocketClient : public Client, public IoTVectoredWriter
+{
+private:
+    int fd = -1;
+    bool drained = false;  /* The last read emptied the socket: the next available() skips the syscall */
+    bool polled = false;   /* Readiness comes from an event loop (markReadable) */
+    bool readable = false;
+
+public:
+    IoTSocketClient() {}
+    explicit IoTSocketClient(int fd); /* Adopts a connected socket, made non-blocking */
+    ~IoTSocketClient();
+
+    IoTSocketClient(const IoTSocketClient &other) = delete;
+    IoTSocketClient &operator=(const IoTSocketClient &other) = delete;
+
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t value) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    size_t writev(const IoTIoVec *iov, size_t count) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buffer, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override;
+
+    /* An event loop (epoll) tells when there is something to read: available() stops asking the socket */
+    void setPolled(bool polled) { this->polled = polled; }
+    void markReadable() { this->readable = true; }
+
+    int socket() const { return this->fd; }
+};
+
+#endif
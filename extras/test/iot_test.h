@@ -0,0 +1,83 @@
+#pragma once
+
+#ifndef __IOT_TEST_H__
+#define __IOT_TEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "iot_protocol.h"
+#include "extras/host/iot_loopback_client.h"
+
+/* Aborts the check with its line when `condition` does not hold */
+#define IOT_TEST_CHECK(condition)                                                         \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(condition))                                                                 \
+        {                                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            abort();                                                                      \
+        }                                                                                 \
+    } while (0)
+
+/* One side of a loopback connection */
+struct IoTTestPeer
+{
+    IoTLoopbackClient client;
+    IoTClient iotClient;
+    IoTProtocol protocol;
+};
+
+/* Joins `a` and `b`; `setup` (may be NULL) configures each IoTClient before listen */
+template <typename Setup>
+void iotTestJoin(IoTTestPeer *a, IoTTestPeer *b, Setup setup)
+{
+    IoTLoopbackClient::join(&a->client, &b->client);
+    IoTTestPeer *peers[] = {a, b};
+    for (size_t i = 0; i < 2; i++)
+    {
+        peers[i]->iotClient = IoTClient();
+        peers[i]->iotClient.client = &peers[i]->client;
+        setup(peers[i]);
+        peers[i]->protocol.listen(&peers[i]->iotClient);
+    }
+}
+
+inline void iotTestJoin(IoTTestPeer *a, IoTTestPeer *b)
+{
+    iotTestJoin(a, b, [](IoTTestPeer *peer) {});
+}
+
+/* Runs both loops until `done` holds or `millis` passed. Returns `done` */
+template <typename Done>
+bool iotTestPump(IoTTestPeer *a, IoTTestPeer *b, Done done, unsigned long millis = 2000)
+{
+    unsigned long deadline = iotMillis() + millis;
+    while (!done())
+    {
+        if (iotTimeReached(deadline, iotMillis()))
+            return false;
+        a->protocol.loop();
+        b->protocol.loop();
+    }
+    return true;
+}
+
+/* A request of `iotClient` with no headers */
+inline IoTRequest iotTestRequest(IoTClient *iotClient, EIoTMethod method, char *path, uint8_t *body, size_t bodyLength)
+{
+    IoTRequest request = {
+        IOT_VERSION,
+        method,
+        0,
+        path,
+        IoTHeaders(),
+        body,
+        bodyLength,
+        0,
+        0,
+        iotClient};
+    return request;
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Body codec (iot_body_codec.h): LZ blocks round trip and malformed blocks
+ * are rejected; over the loopback connection, parts above the 15-bit block
+ * length go out as several blocks and arrive intact.
+ */
+
+#include <vector>
+
+#include "iot_test.h"
+
+static uint32_t seed = 12345;
+
+static uint32_t nextRandom()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* Log-like text with runs of random bytes */
+static std::vector<uint8_t> mixedBody(size_t length)
+{
+    std::vector<uint8_t> body;
+    char line[96];
+    for (uint32_t i = 0; body.size() < length; i++)
+    {
+        if (i % 64 == 63)
+        {
+            for (int j = 0; j < 2048; j++)
+            {
+                body.push_back((uint8_t)nextRandom());
+            }
+            continue;
+        }
+        int n = snprintf(line, sizeof(line), "%06u sensor=%u value=%u.%u status=ok\n", i, i % 8, nextRandom() % 100, nextRandom() % 10);
+        body.insert(body.end(), line, line + n);
+    }
+    body.resize(length);
+    return body;
+}
+
+static void testLzRoundTrip()
+{
+    std::vector<uint8_t> input = mixedBody(40000);
+    std::vector<uint16_t> table(iotLzTableSize(IOT_LZ_DEFAULT_WINDOW) / sizeof(uint16_t));
+    std::vector<uint8_t> block(input.size());
+    std::vector<uint8_t> output(input.size());
+
+    size_t length = iotLzCompress(&input[0], input.size(), &block[0], block.size(), &table[0], IOT_LZ_DEFAULT_WINDOW);
+    IOT_TEST_CHECK(length > 0 && length < input.size());
+
+    size_t outLength = 0;
+    IOT_TEST_CHECK(iotLzDecompress(&block[0], length, &output[0], output.size(), &outLength));
+    IOT_TEST_CHECK(outLength == input.size() && output == input);
+
+    /* One byte short of room: rejected, not truncated */
+    IOT_TEST_CHECK(!iotLzDecompress(&block[0], length, &output[0], output.size() - 1, &outLength));
+
+    /* Above the 16-bit input limit: not compressed */
+    std::vector<uint8_t> large(65536, 'a');
+    std::vector<uint8_t> largeBlock(large.size());
+    IOT_TEST_CHECK(iotLzCompress(&large[0], large.size(), &largeBlock[0], largeBlock.size(), &table[0], IOT_LZ_DEFAULT_WINDOW) == 0);
+    printf("ok lz round trip\n");
+}
+
+static bool decompresses(const uint8_t *block, size_t length)
+{
+    uint8_t output[64];
+    size_t outLength = 0;
+    return iotLzDecompress(block, length, output, sizeof(output), &outLength);
+}
+
+static void testLzMalformed()
+{
+    /* Well formed: "abc", then 4 bytes 3 back ("abca"), then "z" */
+    const uint8_t valid[] = {0x30, 'a', 'b', 'c', 0x03, 0x00, 0x10, 'z'};
+    IOT_TEST_CHECK(decompresses(valid, sizeof(valid)));
+
+    /* Literal length past the end of the block */
+    const uint8_t longLiterals[] = {0x50, 'a', 'b', 'c'};
+    IOT_TEST_CHECK(!decompresses(longLiterals, sizeof(longLiterals)));
+
+    /* Length extension cut off */
+    const uint8_t cutExtension[] = {0xF0, 0xFF};
+    IOT_TEST_CHECK(!decompresses(cutExtension, sizeof(cutExtension)));
+
+    /* Match truncated: one byte of its distance */
+    const uint8_t truncatedMatch[] = {0x10, 'a', 0x01};
+    IOT_TEST_CHECK(!decompresses(truncatedMatch, sizeof(truncatedMatch)));
+
+    /* Match length extension cut off */
+    const uint8_t truncatedLength[] = {0x1F, 'a', 0x01, 0x00};
+    IOT_TEST_CHECK(!decompresses(truncatedLength, sizeof(truncatedLength)));
+
+    /* Distance before the start of the output, and distance 0 */
+    const uint8_t farOffset[] = {0x10, 'a', 0x02, 0x00, 0x00};
+    IOT_TEST_CHECK(!decompresses(farOffset, sizeof(farOffset)));
+    const uint8_t zeroOffset[] = {0x10, 'a', 0x00, 0x00, 0x00};
+    IOT_TEST_CHECK(!decompresses(zeroOffset, sizeof(zeroOffset)));
+
+    /* Match running past the output */
+    const uint8_t longMatch[] = {0x1F, 'a', 0x01, 0x00, 0x7F};
+    IOT_TEST_CHECK(!decompresses(longMatch, sizeof(longMatch)));
+    printf("ok lz malformed blocks\n");
+}
+
+static std::vector<uint8_t> uploaded;
+static size_t received = 0;
+static size_t largestPart = 0;
+
+static void receive(IoTRequest *request, Next *next)
+{
+    if (request->method == EIoTMethod::STREAMING)
+    {
+        IOT_TEST_CHECK(request->offset == received);
+        IOT_TEST_CHECK(request->offset + request->bodyLength <= uploaded.size());
+        IOT_TEST_CHECK(memcmp(request->body, &uploaded[request->offset], request->bodyLength) == 0);
+        received += request->bodyLength;
+        largestPart = std::max(largestPart, request->bodyLength);
+    }
+    (*next)();
+}
+
+/* A buffer size above what a block header describes: parts are cut at IOT_BODY_BLOCK_LENGTH and decode */
+static void testLargeParts()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                {
+                    peer->iotClient.bodyCodec = EIoTBodyCodec::LZ;
+                    peer->iotClient.maxBufferSize = 65536; });
+    b.protocol.use(receive);
+
+    a.protocol.bufferSizeRequest(&a.iotClient, 49152);
+    IOT_TEST_CHECK(iotTestPump(&a, &b, [&]()
+                               { return a.iotClient.sendCodec == EIoTBodyCodec::LZ && b.iotClient.receiveCodec == EIoTBodyCodec::LZ; }));
+    IOT_TEST_CHECK(a.iotClient.bufferSize == 49152 && b.iotClient.receiveBufferSize == 49152);
+
+    static char path[] = "/upload";
+    uploaded = mixedBody(150000);
+    IoTRequest request = iotTestRequest(&a.iotClient, EIoTMethod::STREAMING, path, &uploaded[0], uploaded.size());
+    a.protocol.streaming(&request, NULL);
+    IOT_TEST_CHECK(iotTestPump(&a, &b, []()
+                               { return received == uploaded.size(); }));
+
+    IOT_TEST_CHECK(largestPart == IOT_BODY_BLOCK_LENGTH);
+    IOT_TEST_CHECK(b.iotClient.codecStats.errors == 0);
+    IOT_TEST_CHECK(a.iotClient.codecStats.encodedBytes < a.iotClient.codecStats.rawBytes);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok parts above the block length\n");
+}
+
+/* A size above the peer's maximum is answered, and then sent with, the maximum */
+static void testBufferSizeClamp()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.maxBufferSize = 8192; });
+
+    a.protocol.bufferSizeRequest(&a.iotClient, 32768);
+    IOT_TEST_CHECK(iotTestPump(&a, &b, [&]()
+                               { return a.iotClient.peerMaxBufferSize != 0; }));
+    IOT_TEST_CHECK(a.iotClient.peerMaxBufferSize == 8192);
+    IOT_TEST_CHECK(b.iotClient.bufferSize == 8192 && a.iotClient.receiveBufferSize == 8192);
+    IOT_TEST_CHECK(b.iotClient.receiveBufferSize == 32768); /* a switched on sending its request */
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok buffer size clamped to the peer maximum\n");
+}
+
+int main(int argc, char **argv)
+{
+    testLzRoundTrip();
+    testLzMalformed();
+    testLargeParts();
+    testBufferSizeClamp();
+    return 0;
+}
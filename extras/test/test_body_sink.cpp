@@ -0,0 +1,204 @@
+/*
+ * Body sinks (iot_body_sink.h): over the loopback connection, the parts of a
+ * multipart message go to the sink and the handlers run once with the whole
+ * body; a sink failing partway drops the rest of the body, and the frames
+ * after it are handled as usual.
+ */
+
+#include <vector>
+
+#include "iot_body_sink.h"
+#include "iot_test.h"
+#ifdef __unix__
+#include <unistd.h>
+#include "extras/host/iot_file_sink.h"
+#endif
+
+static std::vector<uint8_t> uploaded;
+static size_t handled = 0;     /* Handler runs for /upload */
+static size_t handledBody = 0; /* Body length they got */
+static bool bodyMatches = false;
+static size_t signals = 0;     /* Handler runs for /after */
+
+static void handler(IoTRequest *request, Next *next)
+{
+    if (strcmp(request->path, "/after") == 0)
+    {
+        signals++;
+        return;
+    }
+    handled++;
+    handledBody = request->bodyLength;
+    bodyMatches = (request->bodyLength == uploaded.size() && memcmp(request->body, &uploaded[0], uploaded.size()) == 0);
+}
+
+/* Reassembles, counts its calls, and fails the write reaching `failAt` */
+class TestSink : public IoTReassemblySink
+{
+public:
+    size_t failAt = SIZE_MAX;
+    size_t opened = 0;
+    size_t writes = 0;
+    size_t closedComplete = 0;
+    size_t closedFailed = 0;
+
+    bool open(IoTRequest *request, size_t totalBodyLength)
+    {
+        this->opened++;
+        return IoTReassemblySink::open(request, totalBodyLength);
+    }
+
+    bool write(uint16_t id, size_t offset, const uint8_t *data, size_t length)
+    {
+        this->writes++;
+        if (offset + length > this->failAt)
+            return false;
+        return IoTReassemblySink::write(id, offset, data, length);
+    }
+
+    void close(uint16_t id, bool complete)
+    {
+        (complete ? this->closedComplete : this->closedFailed)++;
+        IoTReassemblySink::close(id, complete);
+    }
+};
+
+/* a sends a multipart REQUEST to /upload, then a SIGNAL to /after; b handles both */
+static void upload(IoTTestPeer *a, IoTTestPeer *b, size_t length)
+{
+    static char path[] = "/upload";
+    static char after[] = "/after";
+    uploaded.resize(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        uploaded[i] = (uint8_t)(i * 13 + i / 256);
+    }
+    handled = 0;
+    handledBody = 0;
+    bodyMatches = false;
+    signals = 0;
+
+    IoTRequest request = iotTestRequest(&a->iotClient, EIoTMethod::REQUEST, path, &uploaded[0], uploaded.size());
+    a->protocol.send(&request, NULL);
+    IoTRequest signal = iotTestRequest(&a->iotClient, EIoTMethod::SIGNAL, after, NULL, 0);
+    a->protocol.signal(&signal);
+
+    IOT_TEST_CHECK(iotTestPump(a, b, []()
+                               { return signals == 1; }));
+}
+
+static void testReassembly()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    TestSink sink;
+    b.protocol.onBodySink = [&sink](IoTRequest *request)
+    { return &sink; };
+    b.protocol.use(handler);
+
+    upload(&a, &b, 20000);
+    IOT_TEST_CHECK(handled == 1 && bodyMatches);
+    IOT_TEST_CHECK(sink.opened == 1 && sink.writes == a.iotClient.bufferStats.parts);
+    IOT_TEST_CHECK(sink.closedComplete == 1 && sink.closedFailed == 0);
+    IOT_TEST_CHECK(b.iotClient.multiPartControl.empty());
+    IOT_TEST_CHECK(sink.data()[sink.length()] == '\0');
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok multipart through a reassembly sink\n");
+}
+
+/* A write failing partway: closed once as failed, the rest dropped, no handler run */
+static void testFailurePartway()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    TestSink sink;
+    sink.failAt = 8000;
+    b.protocol.onBodySink = [&sink](IoTRequest *request)
+    { return &sink; };
+    b.protocol.use(handler);
+
+    upload(&a, &b, 20000);
+    IOT_TEST_CHECK(handled == 0);
+    IOT_TEST_CHECK(sink.closedFailed == 1 && sink.closedComplete == 0);
+    IOT_TEST_CHECK(sink.writes < a.iotClient.bufferStats.parts); /* Nothing written after the failure */
+    IOT_TEST_CHECK(b.iotClient.multiPartControl.empty());
+
+    /* The next body gets the sink again */
+    sink.failAt = SIZE_MAX;
+    upload(&a, &b, 12000);
+    IOT_TEST_CHECK(handled == 1 && bodyMatches);
+    IOT_TEST_CHECK(sink.opened == 2 && sink.closedComplete == 1);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok sink failing partway\n");
+}
+
+/* A body above maxLength is refused on open: its parts reach the handlers one by one */
+static void testRefused()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    TestSink sink;
+    sink.maxLength = 4096;
+    b.protocol.onBodySink = [&sink](IoTRequest *request)
+    { return &sink; };
+    b.protocol.use(handler);
+
+    upload(&a, &b, 20000);
+    IOT_TEST_CHECK(handled == a.iotClient.bufferStats.parts && handledBody < uploaded.size());
+    IOT_TEST_CHECK(sink.opened == 1 && sink.writes == 0 && sink.closedFailed == 0);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok sink refusing a body\n");
+}
+
+#ifdef __unix__
+static void testFileSink()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    char path[] = "/tmp/iot_test_sinkXXXXXX";
+    int fd = mkstemp(path);
+    IOT_TEST_CHECK(fd >= 0);
+    close(fd);
+    IoTFileSink sink(path);
+    b.protocol.onBodySink = [&sink](IoTRequest *request)
+    { return &sink; };
+    b.protocol.use(handler);
+
+    upload(&a, &b, 50000);
+    IOT_TEST_CHECK(handled == 1 && bodyMatches);
+
+    std::vector<uint8_t> written(uploaded.size() + 1);
+    FILE *file = fopen(path, "rb");
+    IOT_TEST_CHECK(file != NULL);
+    IOT_TEST_CHECK(fread(&written[0], 1, written.size(), file) == uploaded.size());
+    fclose(file);
+    written.resize(uploaded.size());
+    IOT_TEST_CHECK(written == uploaded);
+    unlink(path);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok multipart through a file sink\n");
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    testReassembly();
+    testFailurePartway();
+    testRefused();
+#ifdef __unix__
+    testFileSink();
+#endif
+    return 0;
+}
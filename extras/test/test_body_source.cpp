@@ -0,0 +1,216 @@
+/*
+ * Body sources (iot_body_source.h): over the loopback connection, a body
+ * pulled part by part while it is sent arrives whole; a source failing
+ * partway ends the send (throws, or drops the stream) after whole parts
+ * only, so the frames after it are handled as usual.
+ */
+
+#include <vector>
+
+#include "iot_body_source.h"
+#include "iot_test.h"
+#ifdef __unix__
+#include <unistd.h>
+#include "extras/host/iot_file_source.h"
+#endif
+
+static std::vector<uint8_t> expected; /* Body as the source produces it */
+static size_t received = 0;
+static size_t signals = 0;
+
+static void handler(IoTRequest *request, Next *next)
+{
+    if (strcmp(request->path, "/after") == 0)
+    {
+        signals++;
+        return;
+    }
+    IOT_TEST_CHECK(request->offset == received);
+    IOT_TEST_CHECK(request->totalBodyLength == expected.size());
+    IOT_TEST_CHECK(memcmp(request->body, &expected[request->offset], request->bodyLength) == 0);
+    received += request->bodyLength;
+}
+
+static void fillExpected(size_t length)
+{
+    expected.resize(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        expected[i] = (uint8_t)(i * 7 + i / 1000);
+    }
+    received = 0;
+    signals = 0;
+}
+
+/* Copies from `expected`, failing the read that reaches `failAt` */
+static size_t failAt = SIZE_MAX;
+static size_t reads = 0;
+
+static bool readExpected(size_t offset, uint8_t *buffer, size_t length)
+{
+    reads++;
+    if (offset + length > failAt)
+        return false;
+    memcpy(buffer, &expected[offset], length);
+    return true;
+}
+
+/* The SIGNAL after the body still gets through */
+static void sendAfter(IoTTestPeer *a, IoTTestPeer *b)
+{
+    static char after[] = "/after";
+    IoTRequest signal = iotTestRequest(&a->iotClient, EIoTMethod::SIGNAL, after, NULL, 0);
+    a->protocol.signal(&signal);
+    IOT_TEST_CHECK(iotTestPump(a, b, []()
+                               { return signals == 1; }));
+}
+
+static IoTRequest sourced(IoTTestPeer *peer, EIoTMethod method, IoTBodySource *source)
+{
+    static char path[] = "/upload";
+    IoTRequest request = iotTestRequest(&peer->iotClient, method, path, NULL, expected.size());
+    request.bodySource = source;
+    return request;
+}
+
+static void testCallbackSource(uint32_t streamWindow)
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [streamWindow](IoTTestPeer *peer)
+                { peer->iotClient.streamWindow = streamWindow; });
+    b.protocol.use(handler);
+
+    fillExpected(20000);
+    failAt = SIZE_MAX;
+    reads = 0;
+    IoTCallbackSource source(readExpected);
+    static size_t reported = 0;
+    static size_t partsSent = 0;
+    reported = 0;
+    partsSent = 0;
+    OnPartSent onPartSent = [](IoTRequest *request, uint32_t totalDataSent, uint32_t part)
+    {
+        IOT_TEST_CHECK(totalDataSent > reported && part == partsSent);
+        reported = totalDataSent;
+        partsSent++;
+    };
+    IoTRequestResponse requestResponse = {NULL, NULL, &onPartSent, 0};
+    IoTRequest request = sourced(&a, EIoTMethod::STREAMING, &source);
+    a.protocol.streaming(&request, &requestResponse);
+
+    IOT_TEST_CHECK(iotTestPump(&a, &b, []()
+                               { return received == expected.size(); }));
+    IOT_TEST_CHECK(reported == expected.size());
+    IOT_TEST_CHECK(reads == partsSent && partsSent == a.iotClient.bufferStats.parts);
+    sendAfter(&a, &b);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok multipart from a callback source (window %u)\n", (unsigned)streamWindow);
+}
+
+/* Failing partway: the send throws, the parts before it arrive whole */
+static void testFailurePartway()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    b.protocol.use(handler);
+
+    fillExpected(20000);
+    failAt = 8000;
+    reads = 0;
+    IoTCallbackSource source(readExpected);
+    IoTRequest request = sourced(&a, EIoTMethod::REQUEST, &source);
+
+    bool thrown = false;
+    try
+    {
+        a.protocol.send(&request, NULL);
+    }
+    catch (const char *error)
+    {
+        thrown = (strcmp(error, "[IoTProtocol] Body source failed") == 0);
+    }
+    IOT_TEST_CHECK(thrown);
+
+    sendAfter(&a, &b);
+    IOT_TEST_CHECK(received > 0 && received <= failAt);
+    IOT_TEST_CHECK(b.iotClient.multiPartControl.size() == 1); /* Expires on the receiver like a stalled message */
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok source failing partway\n");
+}
+
+/* Failing partway in a stream: the stream is dropped, nothing thrown */
+static void testStreamFailurePartway()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.streamWindow = 4096; });
+    b.protocol.use(handler);
+
+    fillExpected(20000);
+    failAt = 8000;
+    reads = 0;
+    IoTCallbackSource source(readExpected);
+    IoTRequest request = sourced(&a, EIoTMethod::STREAMING, &source);
+    a.protocol.streaming(&request, NULL);
+
+    IOT_TEST_CHECK(iotTestPump(&a, &b, [&]()
+                               { return a.iotClient.streams.empty(); }));
+    IOT_TEST_CHECK(a.iotClient.streamStats.dropped == 1);
+    sendAfter(&a, &b);
+    IOT_TEST_CHECK(received > 0 && received <= failAt);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok stream source failing partway\n");
+}
+
+#ifdef __unix__
+static void testFileSource()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    b.protocol.use(handler);
+
+    fillExpected(50000);
+    char path[] = "/tmp/iot_test_sourceXXXXXX";
+    int fd = mkstemp(path);
+    IOT_TEST_CHECK(fd >= 0);
+    IOT_TEST_CHECK(write(fd, &expected[0], expected.size()) == (ssize_t)expected.size());
+    close(fd);
+
+    IoTFileSource source;
+    IOT_TEST_CHECK(source.open(path));
+    IOT_TEST_CHECK(source.size() == expected.size());
+    IoTRequest request = sourced(&a, EIoTMethod::REQUEST, &source);
+    a.protocol.send(&request, NULL);
+
+    IOT_TEST_CHECK(iotTestPump(&a, &b, []()
+                               { return received == expected.size(); }));
+    source.close();
+    unlink(path);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok multipart from a file source\n");
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    testCallbackSource(0);
+    testCallbackSource(4096);
+    testFailurePartway();
+    testStreamFailurePartway();
+#ifdef __unix__
+    testFileSource();
+#endif
+    return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Header table (version 2 frames): over the loopback connection, the headers
+ * a peer decodes are the same whether they went out as version 1 text or
+ * through the table, once the table is full, and once it is frozen.
+ */
+
+#include <string>
+#include <vector>
+
+#include "iot_test.h"
+
+typedef std::vector<std::pair<std::string, std::string>> TestHeaders;
+
+/* Headers of each SIGNAL received, in order */
+static std::vector<TestHeaders> decoded;
+
+static void record(IoTRequest *request, Next *next)
+{
+    TestHeaders headers;
+    for (auto header = request->headers.begin(); header != request->headers.end(); ++header)
+    {
+        headers.push_back(std::make_pair(std::string(header->first), std::string(header->second)));
+    }
+    decoded.push_back(headers);
+    (*next)();
+}
+
+static void sendHeaders(IoTTestPeer *peer, TestHeaders headers, const char *path = "/headers")
+{
+    std::string pathText(path);
+    IoTRequest request = iotTestRequest(&peer->iotClient, EIoTMethod::SIGNAL, &pathText[0], NULL, 0);
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        request.headers.insert(std::make_pair(&headers[i].first[0], &headers[i].second[0]));
+    }
+    peer->protocol.signal(&request);
+}
+
+/* Sends each of `frames` from a to b, and checks b decodes them as sent */
+static void exchange(IoTTestPeer *a, IoTTestPeer *b, const std::vector<TestHeaders> &frames)
+{
+    decoded.clear();
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        sendHeaders(a, frames[i]);
+        IOT_TEST_CHECK(iotTestPump(a, b, [&]()
+                                   { return decoded.size() == i + 1; }));
+    }
+    IOT_TEST_CHECK(decoded == frames);
+}
+
+/* `prefix` and `i`, padded to `length` (at least their own) */
+static std::string numbered(const char *prefix, size_t i, size_t length)
+{
+    char text[16];
+    snprintf(text, sizeof(text), "%s%03u", prefix, (unsigned)i);
+    std::string value(text);
+    value.resize(length, 'x');
+    return value;
+}
+
+/* The same headers decode the same from a version 1 and a version 2 peer */
+static void testVersionsAgree()
+{
+    std::vector<TestHeaders> frames;
+    for (size_t i = 0; i < 12; i++)
+    {
+        TestHeaders headers;
+        headers.push_back(std::make_pair("content-type", "application/json")); /* Static key, same value */
+        headers.push_back(std::make_pair("device", numbered("sensor-", i % 3, 8)));    /* Literal key, three values */
+        headers.push_back(std::make_pair("timestamp", numbered("", i, 10)));          /* Static key, new every time */
+        headers.push_back(std::make_pair(std::string("x-long"), std::string(80, 'l'))); /* Never added: too long */
+        frames.push_back(headers);
+    }
+
+    IoTTestPeer v1;
+    IoTTestPeer v1Peer;
+    iotTestJoin(&v1, &v1Peer);
+    v1Peer.protocol.use(record);
+    exchange(&v1, &v1Peer, frames);
+    IOT_TEST_CHECK(v1.iotClient.headerStats.frames == 0);
+    IOT_TEST_CHECK(v1Peer.iotClient.peerHeaderTable == NULL);
+
+    IoTTestPeer v2;
+    IoTTestPeer v2Peer;
+    iotTestJoin(&v2, &v2Peer);
+    v2.iotClient.headerCompression = true;
+    v2Peer.protocol.use(record);
+    exchange(&v2, &v2Peer, frames);
+    IOT_TEST_CHECK(v2.iotClient.headerStats.frames == frames.size());
+    IOT_TEST_CHECK(v2.iotClient.headerStats.indexed > 0);
+    IOT_TEST_CHECK(v2.iotClient.headerStats.encodedBytes < v2.iotClient.headerStats.plainBytes);
+    IOT_TEST_CHECK(v2Peer.iotClient.peerHeaderTable != NULL && v2Peer.iotClient.peerHeaderTable->size() == v2.iotClient.headerTable->size());
+
+    /* The receiver, set up as version 1, answers with version 2 from then on */
+    IOT_TEST_CHECK(v2Peer.iotClient.headerCompression);
+
+    v1.protocol.unlisten(&v1.iotClient);
+    v1Peer.protocol.unlisten(&v1Peer.iotClient);
+    v2.protocol.unlisten(&v2.iotClient);
+    v2Peer.protocol.unlisten(&v2Peer.iotClient);
+    printf("ok version 1 and version 2 decode the same headers\n");
+}
+
+/* A frame adding an entry at a slot the receiver already has: the slot is left as is, the frame decodes */
+static void testSlotTaken()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.headerCompression = true; });
+    b.protocol.use(record);
+
+    std::vector<TestHeaders> first(1, TestHeaders(1, std::make_pair("device", "sensor-1")));
+    exchange(&a, &b, first);
+    IoTHeaderTable *peerTable = b.iotClient.peerHeaderTable;
+    IOT_TEST_CHECK(peerTable != NULL && peerTable->has(0) && !peerTable->has(1));
+
+    IOT_TEST_CHECK(peerTable->insert(1, "device", 6, "other", 5));
+    IOT_TEST_CHECK(!peerTable->insert(1, "device", 6, "again", 5));
+    IOT_TEST_CHECK(!peerTable->insert(IOT_HEADER_TABLE_ENTRIES, "device", 6, "again", 5));
+
+    /* a adds (device, sensor-2) at slot 1 */
+    std::vector<TestHeaders> second(1, TestHeaders(1, std::make_pair("device", "sensor-2")));
+    exchange(&a, &b, second);
+    IOT_TEST_CHECK(a.iotClient.headerTable->size() == 2);
+    IOT_TEST_CHECK(strcmp(peerTable->value(1), "other") == 0);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok insert into a slot already taken\n");
+}
+
+/* Past IOT_HEADER_TABLE_ENTRIES entries, or IOT_HEADER_TABLE_BYTES of text, headers go out as text */
+static void testTableFull(size_t valueLength, size_t expectedEntries)
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.headerCompression = true; });
+    b.protocol.use(record);
+
+    std::vector<TestHeaders> frames;
+    for (size_t i = 0; i < expectedEntries + 16; i++)
+    {
+        frames.push_back(TestHeaders(1, std::make_pair("k", numbered("v", i, valueLength))));
+    }
+    /* The first ones again: indexed */
+    for (size_t i = 0; i < 8; i++)
+    {
+        frames.push_back(frames[i]);
+    }
+    exchange(&a, &b, frames);
+
+    IOT_TEST_CHECK(a.iotClient.headerTable->size() == expectedEntries);
+    IOT_TEST_CHECK(a.iotClient.headerStats.inserted == expectedEntries);
+    IOT_TEST_CHECK(a.iotClient.headerStats.indexed == 8);
+    IOT_TEST_CHECK(b.iotClient.peerHeaderTable->size() == expectedEntries);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok full header table (%u entries of %u bytes)\n", (unsigned)expectedEntries, (unsigned)(valueLength + 3));
+}
+
+/* Entries planned for a frame that never went out freeze the table: headers go out as text from then on */
+static void testFrozen()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.headerCompression = true; });
+    b.protocol.use(record);
+
+    std::vector<TestHeaders> frames(2, TestHeaders(1, std::make_pair("device", "sensor-1")));
+    exchange(&a, &b, frames);
+    IOT_TEST_CHECK(a.iotClient.headerStats.indexed == 1);
+
+    /* Its path does not fit the buffer: thrown after planning (device, sensor-2) */
+    std::string longPath(a.iotClient.bufferSize + 16, 'p');
+    longPath[0] = '/';
+    bool thrown = false;
+    try
+    {
+        sendHeaders(&a, TestHeaders(1, std::make_pair("device", "sensor-2")), longPath.c_str());
+    }
+    catch (const char *error)
+    {
+        thrown = true;
+    }
+    IOT_TEST_CHECK(thrown);
+    IOT_TEST_CHECK(a.iotClient.headerTable->frozen);
+
+    uint64_t indexed = a.iotClient.headerStats.indexed;
+    uint32_t inserted = a.iotClient.headerStats.inserted;
+    frames.clear();
+    frames.push_back(TestHeaders(1, std::make_pair("device", "sensor-1")));
+    frames.push_back(TestHeaders(1, std::make_pair("device", "sensor-2")));
+    frames.push_back(TestHeaders(1, std::make_pair("device", "sensor-3")));
+    exchange(&a, &b, frames);
+    IOT_TEST_CHECK(a.iotClient.headerStats.indexed == indexed);
+    IOT_TEST_CHECK(a.iotClient.headerStats.inserted == inserted);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok frozen header table falls back to text\n");
+}
+
+int main(int argc, char **argv)
+{
+    testVersionsAgree();
+    testSlotTaken();
+    testTableFull(4, IOT_HEADER_TABLE_ENTRIES);                              /* ("k", "vNNN"): 7 bytes each */
+    testTableFull(61, IOT_HEADER_TABLE_BYTES / IOT_HEADER_TABLE_MAX_ENTRY); /* 64 bytes each, the most an entry takes */
+    testFrozen();
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * IoTPendingTable (iot_pending.h): records stay reachable through collisions
+ * and backward-shift deletion, and expire() hands popped timers back.
+ */
+
+#include <map>
+#include <vector>
+
+#include "iot_pending.h"
+#include "iot_test.h"
+
+/* Home slot of `id` in a table of `slots` (2^bits) slots, as IoTPendingTable hashes it */
+static size_t homeOf(uint16_t id, uint8_t bits)
+{
+    return (size_t)(((uint32_t)id * 2654435769u) >> (32 - bits)) & ((1u << bits) - 1);
+}
+
+/* `count` IDs hashing to `slot` */
+static std::vector<uint16_t> collidingIds(size_t slot, uint8_t bits, size_t count)
+{
+    std::vector<uint16_t> ids;
+    for (uint32_t id = 1; id <= 0xFFFF && ids.size() < count; id++)
+    {
+        if (homeOf((uint16_t)id, bits) == slot)
+        {
+            ids.push_back((uint16_t)id);
+        }
+    }
+    return ids;
+}
+
+/* Every ID of `expected` found with its value, and nothing else counted */
+static void checkContents(IoTPendingTable<int> *table, const std::map<uint16_t, int> &expected)
+{
+    IOT_TEST_CHECK(table->size() == expected.size());
+    for (std::map<uint16_t, int>::const_iterator it = expected.begin(); it != expected.end(); ++it)
+    {
+        int *value = table->find(it->first);
+        IOT_TEST_CHECK(value != NULL && *value == it->second);
+    }
+}
+
+static void testCollisions()
+{
+    IoTTimerWheel wheel;
+    IoTPendingTable<int> table;
+    IOT_TEST_CHECK(table.reserve(8, NULL, &wheel, 0, NULL)); /* 16 slots */
+
+    /* Runs starting at the last slot wrap to the first ones */
+    std::vector<uint16_t> ids = collidingIds(15, 4, 4);
+    std::vector<uint16_t> next = collidingIds(0, 4, 2);
+    ids.insert(ids.end(), next.begin(), next.end());
+
+    std::map<uint16_t, int> expected;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        IOT_TEST_CHECK(table.insert(ids[i], (int)i, 1000) != NULL);
+        expected[ids[i]] = (int)i;
+    }
+    checkContents(&table, expected);
+
+    /* An ID already pending keeps its record */
+    IOT_TEST_CHECK(*table.insert(ids[0], 99, 1000) == 0);
+    IOT_TEST_CHECK(table.size() == ids.size());
+
+    /* Erasing the head, then the middle of the run, shifts the later records back */
+    IOT_TEST_CHECK(table.erase(ids[0]));
+    expected.erase(ids[0]);
+    checkContents(&table, expected);
+    IOT_TEST_CHECK(table.find(ids[0]) == NULL);
+    IOT_TEST_CHECK(!table.erase(ids[0]));
+
+    IOT_TEST_CHECK(table.erase(ids[2]));
+    expected.erase(ids[2]);
+    checkContents(&table, expected);
+
+    /* Records wrapped past the end, whose home is the first slot, stay put when one before them goes */
+    IOT_TEST_CHECK(table.erase(ids[4]));
+    expected.erase(ids[4]);
+    checkContents(&table, expected);
+
+    /* Erased IDs go back in */
+    IOT_TEST_CHECK(table.insert(ids[0], 10, 1000) != NULL);
+    IOT_TEST_CHECK(table.insert(ids[2], 12, 1000) != NULL);
+    expected[ids[0]] = 10;
+    expected[ids[2]] = 12;
+    checkContents(&table, expected);
+
+    /* Full: no record for another ID */
+    for (uint16_t id = 1000; !table.full(); id++)
+    {
+        if (expected.count(id) == 0 && table.insert(id, id, 1000) != NULL)
+        {
+            expected[id] = id;
+        }
+    }
+    IOT_TEST_CHECK(table.size() == 8);
+    IOT_TEST_CHECK(table.insert(2000, 0, 1000) == NULL);
+    checkContents(&table, expected);
+
+    table.clear();
+    IOT_TEST_CHECK(table.size() == 0 && wheel.size() == 0);
+    IOT_TEST_CHECK(table.find(ids[1]) == NULL);
+    printf("ok pending insert/erase under collisions\n");
+}
+
+/* Random inserts and erases against std::map */
+static void testAgainstMap()
+{
+    IoTTimerWheel wheel;
+    IoTPendingTable<int> table;
+    IOT_TEST_CHECK(table.reserve(64, NULL, &wheel, 0, NULL));
+
+    std::map<uint16_t, int> expected;
+    uint32_t seed = 7;
+    for (int i = 0; i < 100000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint16_t id = (uint16_t)(1 + ((seed >> 8) % 200)); /* Few IDs: long runs, many hits */
+        if ((seed >> 4) & 1)
+        {
+            bool inserted = (table.insert(id, i, 1000) != NULL);
+            IOT_TEST_CHECK(inserted == (expected.count(id) != 0 || expected.size() < 64));
+            if (inserted && expected.count(id) == 0)
+            {
+                expected[id] = i;
+            }
+        }
+        else
+        {
+            IOT_TEST_CHECK(table.erase(id) == (expected.erase(id) != 0));
+        }
+    }
+    checkContents(&table, expected);
+    IOT_TEST_CHECK(wheel.size() == expected.size());
+    printf("ok pending against std::map\n");
+}
+
+static void testExpire()
+{
+    IoTTimerWheel wheel;
+    IoTPendingTable<int> table;
+    IOT_TEST_CHECK(table.reserve(8, NULL, &wheel, 3, &wheel));
+
+    table.insert(1, 10, 100);
+    table.insert(2, 20, 100);
+    table.insert(3, 30, 100);
+    table.insert(4, 40, 5000);
+    IOT_TEST_CHECK(wheel.size() == 4);
+
+    /* 1: left as is (erased), 2: rescheduled (kept), 3: erased by the callback, which also frees 4 */
+    std::vector<int> seen;
+    IoTTimer *timer;
+    while ((timer = wheel.popExpired(200)) != NULL)
+    {
+        IOT_TEST_CHECK(timer->kind == 3 && timer->owner == &wheel);
+        uint16_t id = timer->id;
+        table.expire(timer, [&](int *value)
+                     {
+                         seen.push_back(*value);
+                         if (id == 2)
+                         {
+                             table.reschedule(2, 1000);
+                         }
+                         else if (id == 3)
+                         {
+                             table.erase(3);
+                             table.erase(4);
+                         } });
+    }
+
+    IOT_TEST_CHECK(seen.size() == 3);
+    IOT_TEST_CHECK(table.size() == 1);
+    IOT_TEST_CHECK(table.find(1) == NULL && table.find(3) == NULL && table.find(4) == NULL);
+    IOT_TEST_CHECK(table.find(2) != NULL && *table.find(2) == 20);
+    IOT_TEST_CHECK(wheel.size() == 1);
+
+    /* Timers of another table are ignored */
+    IoTTimer stranger;
+    wheel.schedule(&stranger, 300);
+    timer = wheel.popExpired(400);
+    IOT_TEST_CHECK(timer == &stranger);
+    bool called = false;
+    table.expire(timer, [&](int *value)
+                 { called = true; });
+    IOT_TEST_CHECK(!called && table.size() == 1);
+
+    /* Rescheduled: due later */
+    timer = wheel.popExpired(1100);
+    IOT_TEST_CHECK(timer != NULL && timer->id == 2);
+    table.expire(timer, [&](int *value)
+                 { seen.push_back(*value); });
+    IOT_TEST_CHECK(table.size() == 0 && wheel.size() == 0);
+    printf("ok pending expire\n");
+}
+
+int main(int argc, char **argv)
+{
+    testCollisions();
+    testAgainstMap();
+    testExpire();
+    return 0;
+}
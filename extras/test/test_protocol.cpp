@@ -0,0 +1,355 @@
+/*
+ * Regression checks of IoTProtocol over the in-memory loopback connection.
+ * Each check aborts with its line on failure; run by ctest.
+ */
+
+#include "iot_router.h"
+#include "iot_test.h"
+
+/* An alive request the peer never answers times out: the client is stopped and reported disconnected once */
+static void testAliveTimeout()
+{
+    IoTLoopbackClient client;
+    IoTLoopbackClient peer; /* Never read */
+    IoTLoopbackClient::join(&client, &peer);
+
+    IoTProtocol protocol(50);
+    IoTClient iotClient = IoTClient();
+    iotClient.client = &client;
+    iotClient.aliveInterval = 1;
+
+    static int disconnects = 0;
+    static IoTClient *disconnected = NULL;
+    OnDisconnect onDisconnect = [](IoTClient *iotClient)
+    {
+        disconnects++;
+        disconnected = iotClient;
+    };
+    iotClient.onDisconnect = &onDisconnect;
+    protocol.listen(&iotClient);
+
+    unsigned long deadline = millis() + 3000;
+    while (disconnects == 0 && millis() < deadline)
+    {
+        protocol.loop();
+        delay(5);
+    }
+
+    IOT_TEST_CHECK(disconnects == 1);
+    IOT_TEST_CHECK(disconnected == &iotClient);
+    IOT_TEST_CHECK(!client.connected());
+    IOT_TEST_CHECK(iotClient.requestResponse.size() == 0);
+    IOT_TEST_CHECK(peer.available() > 0); /* The alive request went out */
+
+    protocol.unlisten(&iotClient);
+    printf("ok alive timeout\n");
+}
+
+/* Once the counter wraps, IDs still used by a stream, a multipart message being received or a pending request are skipped */
+static void testRequestIdReuse()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.streamWindow = 256; });
+
+    /* a streams as 1; b never runs, so it gets no credit and stays */
+    static char path[] = "/upload";
+    static uint8_t body[4096];
+    IoTRequest upload = iotTestRequest(&a.iotClient, EIoTMethod::STREAMING, path, body, sizeof(body));
+    a.protocol.streaming(&upload, NULL);
+    IOT_TEST_CHECK(upload.id == 1);
+    IOT_TEST_CHECK(a.iotClient.streams.size() == 1);
+
+    /* b streams as 2: a receives its first window and waits for the rest */
+    IoTRequest download = iotTestRequest(&b.iotClient, EIoTMethod::STREAMING, path, body, sizeof(body));
+    download.id = 2;
+    b.protocol.streaming(&download, NULL);
+    unsigned long deadline = iotMillis() + 2000;
+    while (a.iotClient.multiPartControl.count(2) == 0 && !iotTimeReached(deadline, iotMillis()))
+    {
+        a.protocol.loop();
+    }
+    IOT_TEST_CHECK(a.iotClient.multiPartControl.count(2) == 1);
+
+    /* a waits for a response as 3 */
+    OnResponse onResponse = [](IoTRequest *response) {};
+    IoTRequestResponse requestResponse = {&onResponse, NULL, NULL, 0};
+    IoTRequest pending = iotTestRequest(&a.iotClient, EIoTMethod::REQUEST, path, NULL, 0);
+    pending.id = 3;
+    IOT_TEST_CHECK(a.protocol.request(&pending, &requestResponse) != NULL);
+
+    a.iotClient.lastRequestId = 0xFFFF; /* Wraps to 1 */
+    IOT_TEST_CHECK(a.protocol.generateRequestId(&a.iotClient) == 4);
+
+    /* Freed once their transfers are over: b answers 3 and both streams finish */
+    IoTRequest response = iotTestRequest(&b.iotClient, EIoTMethod::RESPONSE, NULL, NULL, 0);
+    response.id = 3;
+    b.protocol.response(&response);
+    IOT_TEST_CHECK(iotTestPump(&a, &b, [&]()
+                               { return a.iotClient.requestResponse.size() == 0 && a.iotClient.streams.empty() && a.iotClient.multiPartControl.empty(); }));
+    a.iotClient.lastRequestId = 0xFFFF;
+    IOT_TEST_CHECK(a.protocol.generateRequestId(&a.iotClient) == 1);
+    IOT_TEST_CHECK(a.protocol.generateRequestId(&a.iotClient) == 2);
+    IOT_TEST_CHECK(a.protocol.generateRequestId(&a.iotClient) == 3);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok request ID reuse\n");
+}
+
+/* Past maxPendingRequests, request() returns NULL and sends nothing; a response frees a record */
+static void testPendingFull()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                {
+                    peer->iotClient.maxPendingRequests = 2;
+                    peer->iotClient.headerCompression = true; });
+
+    OnResponse onResponse = [](IoTRequest *response) {};
+    IoTRequestResponse requestResponse = {&onResponse, NULL, NULL, 0};
+    static char path[] = "/pending";
+    static char key[] = "device";
+    static char values[3][16] = {"sensor-1", "sensor-2", "sensor-3"}; /* Each adds a header table entry */
+    IoTRequest requests[3];
+    for (size_t i = 0; i < 3; i++)
+    {
+        requests[i] = iotTestRequest(&a.iotClient, EIoTMethod::REQUEST, path, NULL, 0);
+        requests[i].headers.insert(std::make_pair(key, values[i]));
+    }
+
+    IOT_TEST_CHECK(a.protocol.request(&requests[0], &requestResponse) != NULL);
+    IOT_TEST_CHECK(a.protocol.request(&requests[1], &requestResponse) != NULL);
+    size_t written = b.client.available();
+    IOT_TEST_CHECK(a.protocol.request(&requests[2], &requestResponse) == NULL);
+    IOT_TEST_CHECK(b.client.available() == written);
+    IOT_TEST_CHECK(a.iotClient.requestResponse.size() == 2);
+    IOT_TEST_CHECK(a.iotClient.headerTable != NULL && !a.iotClient.headerTable->frozen);
+
+    /* b answers the first */
+    IoTRequest response = iotTestRequest(&b.iotClient, EIoTMethod::RESPONSE, NULL, NULL, 0);
+    response.id = requests[0].id;
+    b.protocol.response(&response);
+    IOT_TEST_CHECK(iotTestPump(&a, &b, [&]()
+                               { return a.iotClient.requestResponse.size() == 1; }));
+
+    requests[2].id = 0;
+    IOT_TEST_CHECK(a.protocol.request(&requests[2], &requestResponse) != NULL);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok pending requests full\n");
+}
+
+static size_t partsReceived = 0;
+
+static void countParts(IoTRequest *request, Next *next)
+{
+    if (request->method == EIoTMethod::STREAMING)
+    {
+        partsReceived++;
+    }
+    (*next)();
+}
+
+/* A multipart message that stalls expires IOT_MULTIPART_TIMEOUT after its latest part, however many came before */
+static void testMultipartStall()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.outboundCapacity = 32 * 1024; }); /* The whole upload waits there */
+    b.protocol.use(countParts);
+    a.client.limitOutput(a.iotClient.bufferSize); /* About a part at a time: the next goes once b read */
+
+    static char path[] = "/upload";
+    static uint8_t body[16 * 1024];
+    IoTRequest request = iotTestRequest(&a.iotClient, EIoTMethod::STREAMING, path, body, sizeof(body));
+    a.protocol.streaming(&request, NULL);
+
+    IOT_TEST_CHECK(iotTestPump(&a, &b, []()
+                               { return partsReceived >= 4; }));
+    IOT_TEST_CHECK(b.iotClient.multiPartControl.size() == 1);
+
+    /* a stops sending */
+    unsigned long stalledAt = iotMillis();
+    while (!b.iotClient.multiPartControl.empty() && iotMillis() - stalledAt < 3 * IOT_MULTIPART_TIMEOUT)
+    {
+        b.protocol.loop();
+        delay(10);
+    }
+    unsigned long expiredAfter = iotMillis() - stalledAt;
+    IOT_TEST_CHECK(b.iotClient.multiPartControl.empty());
+    IOT_TEST_CHECK(expiredAfter <= IOT_MULTIPART_TIMEOUT + 500);
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok stalled multipart expires\n");
+}
+
+static char trace[16];
+static size_t traced = 0;
+
+template <char Before, char After>
+static void traceMiddleware(IoTRequest *request, Next *next)
+{
+    trace[traced++] = Before;
+    (*next)();
+    trace[traced++] = After;
+}
+
+/* Code after next() runs after the later stages (NESTED), before them (FLAT) */
+static void testMiddlewareOrder(EIoTMiddlewareMode mode, const char *expected)
+{
+    IoTProtocol protocol;
+    protocol.middlewareMode = mode;
+    protocol.use(traceMiddleware<'a', 'A'>);
+    IoTRouter router;
+    router.use("/route", traceMiddleware<'b', 'B'>);
+    protocol.use("/", &router);
+    protocol.use(traceMiddleware<'c', 'C'>);
+
+    static char path[] = "/route";
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::SIGNAL,
+        0,
+        path,
+        IoTHeaders(),
+        NULL,
+        0,
+        0,
+        0,
+        NULL,
+        true};
+
+    traced = 0;
+    protocol.runMiddleware(&request);
+    trace[traced] = '\0';
+    IOT_TEST_CHECK(strcmp(trace, expected) == 0);
+    printf("ok middleware order %s\n", (mode == EIoTMiddlewareMode::NESTED) ? "NESTED" : "FLAT");
+}
+
+static const char *routed = NULL; /* Handler that ran */
+static char captured[2][64];       /* Parameters it read */
+static bool fellThrough = false;
+
+/* Copies parameter `name` of the route, "" when not captured */
+static void capture(IoTRequest *request, size_t index, const char *name)
+{
+    const IoTPathParam *param = (request->params != NULL) ? request->params->get(name) : NULL;
+    size_t length = (param != NULL) ? param->length : 0;
+    memcpy(captured[index], (param != NULL) ? param->value : "", length);
+    captured[index][length] = '\0';
+}
+
+static void onDevice(IoTRequest *request, Next *next)
+{
+    routed = "device";
+    capture(request, 0, "id");
+}
+
+static void onDeviceList(IoTRequest *request, Next *next)
+{
+    routed = "list";
+    capture(request, 0, "id");
+}
+
+static void onMetric(IoTRequest *request, Next *next)
+{
+    routed = "metric";
+    capture(request, 0, "id");
+    capture(request, 1, "metric");
+}
+
+static void onFile(IoTRequest *request, Next *next)
+{
+    routed = "file";
+    capture(request, 0, "*");
+}
+
+static void afterRouter(IoTRequest *request, Next *next)
+{
+    fellThrough = true;
+}
+
+static void route(IoTProtocol *protocol, const char *path)
+{
+    static char pathText[64];
+    strcpy(pathText, path);
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::SIGNAL,
+        0,
+        pathText,
+        IoTHeaders(),
+        NULL,
+        0,
+        0,
+        0,
+        NULL,
+        true};
+
+    routed = NULL;
+    captured[0][0] = captured[1][0] = '\0';
+    fellThrough = false;
+    protocol->runMiddleware(&request);
+}
+
+/* Parameters and the wildcard are captured, a literal segment wins over a parameter, and paths matching no route go on to the next middleware */
+static void testRouter(EIoTMiddlewareMode mode)
+{
+    IoTProtocol protocol;
+    protocol.middlewareMode = mode;
+    IoTRouter router;
+    router.use("/devices/:id", onDevice);
+    router.use("/devices/list", onDeviceList);
+    router.use("/devices/:id/metrics/:metric", onMetric);
+    router.use("/files/*", onFile);
+    protocol.use("/api", &router);
+    protocol.use(afterRouter);
+
+    route(&protocol, "/api/devices/42");
+    IOT_TEST_CHECK(routed != NULL && strcmp(routed, "device") == 0);
+    IOT_TEST_CHECK(strcmp(captured[0], "42") == 0);
+    IOT_TEST_CHECK(!fellThrough);
+
+    route(&protocol, "/api/devices/7/metrics/temperature");
+    IOT_TEST_CHECK(routed != NULL && strcmp(routed, "metric") == 0);
+    IOT_TEST_CHECK(strcmp(captured[0], "7") == 0 && strcmp(captured[1], "temperature") == 0);
+
+    /* Static over parameter */
+    route(&protocol, "/api/devices/list");
+    IOT_TEST_CHECK(routed != NULL && strcmp(routed, "list") == 0);
+    IOT_TEST_CHECK(captured[0][0] == '\0');
+
+    /* Wildcard: the rest of the path */
+    route(&protocol, "/api/files/logs/2024/today.txt");
+    IOT_TEST_CHECK(routed != NULL && strcmp(routed, "file") == 0);
+    IOT_TEST_CHECK(strcmp(captured[0], "logs/2024/today.txt") == 0);
+
+    /* No route: a segment short, one too many, unknown, outside the mount */
+    const char *unmatched[] = {"/api/devices", "/api/devices/7/metrics", "/api/unknown", "/other/devices/42"};
+    for (size_t i = 0; i < sizeof(unmatched) / sizeof(unmatched[0]); i++)
+    {
+        route(&protocol, unmatched[i]);
+        IOT_TEST_CHECK(routed == NULL);
+        IOT_TEST_CHECK(fellThrough);
+    }
+    printf("ok router %s\n", (mode == EIoTMiddlewareMode::NESTED) ? "NESTED" : "FLAT");
+}
+
+int main(int argc, char **argv)
+{
+    testAliveTimeout();
+    testRequestIdReuse();
+    testPendingFull();
+    testMultipartStall();
+    testMiddlewareOrder(EIoTMiddlewareMode::NESTED, "abcCBA");
+    testMiddlewareOrder(EIoTMiddlewareMode::FLAT, "aAbBcC");
+    testRouter(EIoTMiddlewareMode::NESTED);
+    testRouter(EIoTMiddlewareMode::FLAT);
+    return 0;
+}
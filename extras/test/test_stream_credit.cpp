@@ -0,0 +1,118 @@
+/*
+ * Stream flow control (IoTClient::streamWindow): over the loopback
+ * connection, a stream stops once its window is used up, goes on when a
+ * CREDIT frame arrives, and is dropped when none comes within
+ * IOT_MULTIPART_TIMEOUT.
+ */
+
+#include <vector>
+
+#include "iot_test.h"
+
+static std::vector<uint8_t> uploaded;
+static size_t received = 0;
+
+static void receive(IoTRequest *request, Next *next)
+{
+    if (request->method == EIoTMethod::STREAMING)
+    {
+        IOT_TEST_CHECK(request->offset == received);
+        IOT_TEST_CHECK(memcmp(request->body, &uploaded[request->offset], request->bodyLength) == 0);
+        received += request->bodyLength;
+    }
+    (*next)();
+}
+
+static void startUpload(IoTTestPeer *peer, size_t length)
+{
+    static char path[] = "/upload";
+    uploaded.resize(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        uploaded[i] = (uint8_t)(i * 31 + 7);
+    }
+    received = 0;
+    IoTRequest request = iotTestRequest(&peer->iotClient, EIoTMethod::STREAMING, path, &uploaded[0], uploaded.size());
+    peer->protocol.streaming(&request, NULL);
+}
+
+/* Runs `peer` alone for `millis` */
+static void runAlone(IoTTestPeer *peer, unsigned long millis)
+{
+    unsigned long deadline = iotMillis() + millis;
+    while (!iotTimeReached(deadline, iotMillis()))
+    {
+        peer->protocol.loop();
+    }
+}
+
+/* The window used up, the stream waits; the receiver's CREDIT lets it go on */
+static void testCreditResumes()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b, [](IoTTestPeer *peer)
+                { peer->iotClient.streamWindow = 2048; });
+    b.protocol.use(receive);
+
+    startUpload(&a, 16 * 1024);
+    runAlone(&a, 50);
+    IOT_TEST_CHECK(a.iotClient.streams.size() == 1);
+    size_t sent = a.iotClient.streams[0].sent;
+    IOT_TEST_CHECK(sent >= 2048 && sent < 2048 + a.iotClient.bufferSize); /* Up to the part that used it up */
+    IOT_TEST_CHECK(a.iotClient.streams[0].credit <= 0);
+    IOT_TEST_CHECK(a.iotClient.streamStats.stalls > 0);
+    IOT_TEST_CHECK(a.iotClient.streamStats.creditsReceived == 0);
+
+    /* b takes the parts and grants them back */
+    runAlone(&b, 50);
+    IOT_TEST_CHECK(received == sent);
+    IOT_TEST_CHECK(b.iotClient.streamStats.creditsSent > 0);
+
+    runAlone(&a, 50);
+    IOT_TEST_CHECK(a.iotClient.streamStats.creditsReceived == b.iotClient.streamStats.creditsSent);
+    IOT_TEST_CHECK(a.iotClient.streams.size() == 1 && a.iotClient.streams[0].sent > sent);
+
+    IOT_TEST_CHECK(iotTestPump(&a, &b, []()
+                               { return received == uploaded.size(); }));
+    IOT_TEST_CHECK(a.iotClient.streams.empty());
+    IOT_TEST_CHECK(a.iotClient.streamStats.dropped == 0);
+    IOT_TEST_CHECK(b.iotClient.multiPartControl.empty());
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok stream resumes on credit\n");
+}
+
+/* No CREDIT within IOT_MULTIPART_TIMEOUT: the sender drops the stream, the receiver its message */
+static void testCreditTimeout()
+{
+    IoTTestPeer a;
+    IoTTestPeer b;
+    iotTestJoin(&a, &b);
+    a.iotClient.streamWindow = 2048;
+    b.protocol.use(receive); /* Window 0: takes the parts, never grants any */
+
+    unsigned long startedAt = iotMillis();
+    startUpload(&a, 16 * 1024);
+    IOT_TEST_CHECK(iotTestPump(&a, &b, [&]()
+                               { return a.iotClient.streams.empty() && b.iotClient.multiPartControl.empty(); },
+                               IOT_MULTIPART_TIMEOUT + 2000));
+    unsigned long elapsed = iotMillis() - startedAt;
+
+    IOT_TEST_CHECK(elapsed >= IOT_MULTIPART_TIMEOUT);
+    IOT_TEST_CHECK(a.iotClient.streamStats.dropped == 1);
+    IOT_TEST_CHECK(a.iotClient.streamStats.creditsReceived == 0);
+    IOT_TEST_CHECK(received > 0 && received < uploaded.size());
+
+    a.protocol.unlisten(&a.iotClient);
+    b.protocol.unlisten(&b.iotClient);
+    printf("ok stream dropped without credit\n");
+}
+
+int main(int argc, char **argv)
+{
+    testCreditResumes();
+    testCreditTimeout();
+    return 0;
+}
@@ -0,0 +1,263 @@
+#include "iot_allocator.h"
+
+#define IOT_ALLOCATOR_ALIGN 16
+
+static size_t alignSize(size_t size)
+{
+    return (size + (IOT_ALLOCATOR_ALIGN - 1)) & ~(size_t)(IOT_ALLOCATOR_ALIGN - 1);
+}
+
+/* Heap */
+
+IoTHeapAllocator::IoTHeapAllocator()
+{
+    memset(&this->stats, 0, sizeof(this->stats));
+}
+
+void *IoTHeapAllocator::allocate(size_t size)
+{
+    this->stats.allocations++;
+    this->stats.bytes += size;
+    return malloc(size);
+}
+
+void IoTHeapAllocator::deallocate(void *data)
+{
+    if (data == NULL)
+        return;
+
+    this->stats.deallocations++;
+    free(data);
+}
+
+IoTHeapAllocator *IoTHeapAllocator::shared()
+{
+    static IoTHeapAllocator allocator;
+    return &allocator;
+}
+
+/* Arena */
+
+IoTArena::IoTArena(IoTAllocator *parent)
+{
+    this->parent = parent;
+    this->head = NULL;
+    this->current = NULL;
+}
+
+IoTArena::IoTArena(const IoTArena &other) : IoTArena(other.parent)
+{
+}
+
+IoTArena &IoTArena::operator=(const IoTArena &other)
+{
+    if (this != &other)
+    {
+        this->setParent(other.parent);
+    }
+    return *this;
+}
+
+IoTArena::~IoTArena()
+{
+    this->release();
+}
+
+void IoTArena::release()
+{
+    IoTAllocator *parent = (this->parent != NULL) ? this->parent : IoTHeapAllocator::shared();
+
+    while (this->head != NULL)
+    {
+        Chunk *next = this->head->next;
+        parent->deallocate(this->head);
+        this->head = next;
+    }
+    this->current = NULL;
+}
+
+void IoTArena::setParent(IoTAllocator *parent)
+{
+    this->release();
+    this->parent = parent;
+}
+
+void *IoTArena::allocate(size_t size)
+{
+    size = alignSize(size);
+
+    /* Chunks after `current` are free since the last reset */
+    for (Chunk *chunk = this->current; chunk != NULL; chunk = chunk->next)
+    {
+        if (chunk->capacity - chunk->used >= size)
+        {
+            this->current = chunk;
+            void *data = (uint8_t *)chunk + alignSize(sizeof(Chunk)) + chunk->used;
+            chunk->used += size;
+            return data;
+        }
+    }
+
+    IoTAllocator *parent = (this->parent != NULL) ? this->parent : IoTHeapAllocator::shared();
+    size_t capacity = (size > IOT_ARENA_CHUNK_SIZE) ? size : IOT_ARENA_CHUNK_SIZE;
+    Chunk *chunk = (Chunk *)parent->allocate(alignSize(sizeof(Chunk)) + capacity);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->capacity = capacity;
+    chunk->used = size;
+
+    /* Placed right after `current`, so it is reused first after a reset */
+    if (this->current == NULL)
+    {
+        chunk->next = this->head;
+        this->head = chunk;
+    }
+    else
+    {
+        chunk->next = this->current->next;
+        this->current->next = chunk;
+    }
+    this->current = chunk;
+
+    return (uint8_t *)chunk + alignSize(sizeof(Chunk));
+}
+
+void IoTArena::reset()
+{
+    for (Chunk *chunk = this->head; chunk != NULL; chunk = chunk->next)
+    {
+        chunk->used = 0;
+    }
+    this->current = this->head;
+}
+
+size_t IoTArena::capacity() const
+{
+    size_t capacity = 0;
+    for (Chunk *chunk = this->head; chunk != NULL; chunk = chunk->next)
+    {
+        capacity += chunk->capacity;
+    }
+    return capacity;
+}
+
+/* Pool */
+
+IoTPool::IoTPool(size_t blockSize, IoTAllocator *parent)
+{
+    this->parent = parent;
+    this->blockSize = (blockSize > 0) ? alignSize(blockSize) : 0;
+    this->slabList = NULL;
+    this->slabs = 0;
+    this->freeList = NULL;
+}
+
+IoTPool::IoTPool(const IoTPool &other) : IoTPool(other.blockSize, other.parent)
+{
+}
+
+IoTPool &IoTPool::operator=(const IoTPool &other)
+{
+    if (this != &other)
+    {
+        this->setParent(other.parent);
+        this->blockSize = other.blockSize;
+    }
+    return *this;
+}
+
+IoTPool::~IoTPool()
+{
+    this->release();
+}
+
+void IoTPool::release()
+{
+    IoTAllocator *parent = (this->parent != NULL) ? this->parent : IoTHeapAllocator::shared();
+
+    while (this->slabList != NULL)
+    {
+        Slab *next = this->slabList->next;
+        parent->deallocate(this->slabList);
+        this->slabList = next;
+    }
+    this->slabs = 0;
+    this->freeList = NULL;
+}
+
+void IoTPool::setParent(IoTAllocator *parent)
+{
+    this->release();
+    this->parent = parent;
+}
+
+bool IoTPool::owns(void *data) const
+{
+    for (Slab *slab = this->slabList; slab != NULL; slab = slab->next)
+    {
+        uint8_t *blocks = (uint8_t *)slab + alignSize(sizeof(Slab));
+        if ((uint8_t *)data >= blocks && (uint8_t *)data < blocks + (this->blockSize * IOT_POOL_SLAB_BLOCKS))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void *IoTPool::allocate(size_t size)
+{
+    IoTAllocator *parent = (this->parent != NULL) ? this->parent : IoTHeapAllocator::shared();
+
+    if (this->blockSize == 0)
+    {
+        this->blockSize = alignSize(size);
+    }
+
+    if (alignSize(size) != this->blockSize)
+    {
+        return parent->allocate(size);
+    }
+
+    if (this->freeList == NULL)
+    {
+        Slab *slab = (Slab *)parent->allocate(alignSize(sizeof(Slab)) + (this->blockSize * IOT_POOL_SLAB_BLOCKS));
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->next = this->slabList;
+        this->slabList = slab;
+        this->slabs++;
+
+        uint8_t *blocks = (uint8_t *)slab + alignSize(sizeof(Slab));
+        for (size_t i = IOT_POOL_SLAB_BLOCKS; i > 0; i--)
+        {
+            FreeBlock *block = (FreeBlock *)(blocks + ((i - 1) * this->blockSize));
+            block->next = this->freeList;
+            this->freeList = block;
+        }
+    }
+
+    FreeBlock *block = this->freeList;
+    this->freeList = block->next;
+    return block;
+}
+
+void IoTPool::deallocate(void *data)
+{
+    if (data == NULL)
+        return;
+
+    if (!this->owns(data))
+    {
+        IoTAllocator *parent = (this->parent != NULL) ? this->parent : IoTHeapAllocator::shared();
+        parent->deallocate(data);
+        return;
+    }
+
+    FreeBlock *block = (FreeBlock *)data;
+    block->next = this->freeList;
+    this->freeList = block;
+}
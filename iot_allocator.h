@@ -0,0 +1,207 @@
+#pragma once
+
+#ifndef __IOT_ALLOCATOR_H__
+#define __IOT_ALLOCATOR_H__
+
+#include "iot_platform.h"
+#include <stddef.h>
+#include <type_traits>
+
+#ifndef IOT_ARENA_CHUNK_SIZE
+#define IOT_ARENA_CHUNK_SIZE 1024 /* Bytes per arena chunk; larger requests get a chunk of their own */
+#endif
+
+#ifndef IOT_POOL_SLAB_BLOCKS
+#define IOT_POOL_SLAB_BLOCKS 16 /* Blocks a pool takes from its parent at once */
+#endif
+
+/*
+ * Memory used by the protocol.
+ *
+ * Everything IoTProtocol allocates goes through an IoTAllocator. The default is
+ * IoTHeapAllocator::shared() (malloc/free, counted). Each IoTClient has an
+ * arena for the copies of the frame being handled, reset once its handlers
+ * return, and pools for its pending request records, so after warm-up the
+ * receive and send paths do not touch the global heap.
+ */
+class IoTAllocator
+{
+public:
+    virtual ~IoTAllocator() {}
+    virtual void *allocate(size_t size) = 0;
+    virtual void deallocate(void *data) = 0;
+};
+
+/* Holds a block of an IoTAllocator for a scope, released on exceptions too */
+class IoTAllocationGuard
+{
+public:
+    explicit IoTAllocationGuard(IoTAllocator *allocator) : allocator(allocator), data(NULL) {}
+    ~IoTAllocationGuard()
+    {
+        if (this->data != NULL)
+        {
+            this->allocator->deallocate(this->data);
+        }
+    }
+
+    /* Allocates the block, NULL when out of memory. Once per guard */
+    void *allocate(size_t size)
+    {
+        this->data = this->allocator->allocate(size);
+        return this->data;
+    }
+
+    /* Hands the block over to the caller: no longer released by the guard */
+    void *release()
+    {
+        void *data = this->data;
+        this->data = NULL;
+        return data;
+    }
+
+private:
+    IoTAllocator *allocator;
+    void *data;
+    IoTAllocationGuard(const IoTAllocationGuard &other);
+    IoTAllocationGuard &operator=(const IoTAllocationGuard &other);
+};
+
+struct IoTAllocatorStats
+{
+    uint64_t allocations;
+    uint64_t deallocations;
+    uint64_t bytes; /* Allocated so far */
+};
+
+/* malloc/free, counting every call */
+class IoTHeapAllocator : public IoTAllocator
+{
+public:
+    IoTAllocatorStats stats;
+
+    IoTHeapAllocator();
+    void *allocate(size_t size);
+    void deallocate(void *data);
+
+    /* Default allocator of every protocol and client: its stats are the protocol's global heap traffic */
+    static IoTHeapAllocator *shared();
+};
+
+/*
+ * Bump allocator. Chunks come from `parent` and are kept across reset(), which
+ * releases everything at once; deallocate is a no-op.
+ *
+ * Copying an arena gives an empty arena with the same parent.
+ */
+class IoTArena : public IoTAllocator
+{
+public:
+    IoTArena(IoTAllocator *parent = NULL);
+    IoTArena(const IoTArena &other);
+    IoTArena &operator=(const IoTArena &other);
+    ~IoTArena();
+
+    void *allocate(size_t size);
+    void deallocate(void *data) {}
+    void reset();
+
+    void setParent(IoTAllocator *parent); /* Releases the chunks */
+    size_t capacity() const;              /* Bytes held in chunks */
+
+private:
+    struct Chunk
+    {
+        Chunk *next;
+        size_t capacity;
+        size_t used;
+    };
+
+    IoTAllocator *parent;
+    Chunk *head;
+    Chunk *current;
+
+    void release();
+};
+
+/*
+ * Fixed-size blocks. The block size is set by the first allocation (or the
+ * constructor); blocks are taken from `parent` IOT_POOL_SLAB_BLOCKS at a time
+ * and recycled through a free list. Requests of another size go to `parent`.
+ *
+ * Copying a pool gives an empty pool with the same parent and block size.
+ */
+class IoTPool : public IoTAllocator
+{
+public:
+    IoTPool(size_t blockSize = 0, IoTAllocator *parent = NULL);
+    IoTPool(const IoTPool &other);
+    IoTPool &operator=(const IoTPool &other);
+    ~IoTPool();
+
+    void *allocate(size_t size);
+    void deallocate(void *data);
+
+    void setParent(IoTAllocator *parent); /* Releases the slabs, every block must be free */
+    size_t blocks() const { return this->slabs * IOT_POOL_SLAB_BLOCKS; }
+
+private:
+    struct Slab
+    {
+        Slab *next;
+    };
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    IoTAllocator *parent;
+    size_t blockSize;
+    Slab *slabList;
+    size_t slabs;
+    FreeBlock *freeList;
+
+    bool owns(void *data) const;
+    void release();
+};
+
+/* Standard allocator over an IoTAllocator (NULL = IoTHeapAllocator::shared()), for std containers */
+template <typename T>
+class IoTStlAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    IoTAllocator *allocator;
+
+    IoTStlAllocator(IoTAllocator *allocator = NULL) : allocator(allocator) {}
+    template <typename U>
+    IoTStlAllocator(const IoTStlAllocator<U> &other) : allocator(other.allocator) {}
+
+    T *allocate(size_t n)
+    {
+        IoTAllocator *target = (this->allocator != NULL) ? this->allocator : IoTHeapAllocator::shared();
+        void *data = target->allocate(n * sizeof(T));
+        if (data == NULL)
+        {
+            throw "[IoTProtocol] Out of memory";
+        }
+        return (T *)data;
+    }
+
+    void deallocate(T *data, size_t n)
+    {
+        IoTAllocator *target = (this->allocator != NULL) ? this->allocator : IoTHeapAllocator::shared();
+        target->deallocate(data);
+    }
+
+    template <typename U>
+    bool operator==(const IoTStlAllocator<U> &other) const { return this->allocator == other.allocator; }
+    template <typename U>
+    bool operator!=(const IoTStlAllocator<U> &other) const { return this->allocator != other.allocator; }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include "iot_body_codec.h"
+
+/* Window clamped and rounded down to a power of two */
+static size_t lzWindow(size_t window)
+{
+    size_t clamped = IOT_LZ_MIN_WINDOW;
+    while (clamped < IOT_LZ_MAX_WINDOW && clamped * 2 <= window)
+    {
+        clamped *= 2;
+    }
+    return clamped;
+}
+
+size_t iotLzTableSize(size_t window)
+{
+    return (lzWindow(window) / 4) * sizeof(uint16_t);
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* Extension bytes of a length past its nibble */
+static bool putLength(uint8_t *out, size_t capacity, size_t *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (*op >= capacity)
+            return false;
+        out[(*op)++] = 255;
+    }
+    if (*op >= capacity)
+        return false;
+    out[(*op)++] = (uint8_t)length;
+    return true;
+}
+
+/* One sequence: `literalLength` literals, then a match (distance 0 = none, the last sequence) */
+static bool putSequence(uint8_t *out, size_t capacity, size_t *op, const uint8_t *literals, size_t literalLength, size_t distance, size_t matchLength)
+{
+    if (*op >= capacity)
+        return false;
+    size_t token = (*op)++;
+
+    uint8_t literalNibble = (literalLength < 15) ? (uint8_t)literalLength : 15;
+    if (literalLength >= 15 && !putLength(out, capacity, op, literalLength - 15))
+        return false;
+    if (literalLength > capacity - *op)
+        return false;
+    memcpy(out + *op, literals, literalLength);
+    *op += literalLength;
+
+    uint8_t matchNibble = 0;
+    if (distance > 0)
+    {
+        if (capacity - *op < 2)
+            return false;
+        out[(*op)++] = (uint8_t)(distance & 0xFF);
+        out[(*op)++] = (uint8_t)(distance >> 8);
+
+        size_t extra = matchLength - 4;
+        matchNibble = (extra < 15) ? (uint8_t)extra : 15;
+        if (extra >= 15 && !putLength(out, capacity, op, extra - 15))
+            return false;
+    }
+
+    out[token] = (uint8_t)((literalNibble << 4) | matchNibble);
+    return true;
+}
+
+size_t iotLzCompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity, uint16_t *table, size_t window)
+{
+    if (length > 65535)
+        return 0;
+
+    window = lzWindow(window);
+    size_t entries = window / 4;
+    unsigned shift = 32;
+    for (size_t n = entries; n > 1; n >>= 1)
+    {
+        shift--;
+    }
+    memset(table, 0, entries * sizeof(uint16_t));
+
+    /* Greedy: the last candidate of each hash, checked against the input; stale entries just miss */
+    size_t op = 0;
+    size_t anchor = 0;
+    size_t ip = 1;
+    size_t searchEnd = (length > 8) ? length - 8 : 0;
+    while (ip < searchEnd)
+    {
+        uint32_t sequence = read32(in + ip);
+        uint32_t hash = (sequence * 2654435761U) >> shift;
+        size_t ref = table[hash];
+        table[hash] = (uint16_t)ip;
+
+        if (ref >= ip || ip - ref > window || read32(in + ref) != sequence)
+        {
+            /* Skip faster through input that does not match */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1])
+        {
+            ip--;
+            ref--;
+        }
+        size_t match = 4;
+        while (ip + match < length && in[ref + match] == in[ip + match])
+        {
+            match++;
+        }
+
+        if (!putSequence(out, capacity, &op, in + anchor, ip - anchor, ip - ref, match))
+            return 0;
+        ip += match;
+        anchor = ip;
+
+        if (ip < searchEnd)
+        {
+            table[(read32(in + ip - 2) * 2654435761U) >> shift] = (uint16_t)(ip - 2);
+        }
+    }
+
+    if (!putSequence(out, capacity, &op, in + anchor, length - anchor, 0, 0))
+        return 0;
+    return op;
+}
+
+/* Length past a nibble of 15 */
+static bool getLength(const uint8_t *in, size_t length, size_t *ip, size_t *value)
+{
+    uint8_t byte;
+    do
+    {
+        if (*ip >= length)
+            return false;
+        byte = in[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool iotLzDecompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity, size_t *outLength)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < length)
+    {
+        uint8_t token = in[ip++];
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !getLength(in, length, &ip, &literalLength))
+            return false;
+        if (literalLength > length - ip || literalLength > capacity - op)
+            return false;
+        memcpy(out + op, in + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == length)
+            break;
+
+        if (length - ip < 2)
+            return false;
+        size_t distance = in[ip] | ((size_t)in[ip + 1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > op)
+            return false;
+
+        size_t matchLength = (token & 0x0F);
+        if (matchLength == 15 && !getLength(in, length, &ip, &matchLength))
+            return false;
+        matchLength += 4;
+        if (matchLength > capacity - op)
+            return false;
+
+        const uint8_t *match = out + op - distance;
+        if (distance >= matchLength)
+        {
+            memcpy(out + op, match, matchLength);
+        }
+        else
+        {
+            /* Overlapping: repeats the last `distance` bytes */
+            for (size_t i = 0; i < matchLength; i++)
+            {
+                out[op + i] = match[i];
+            }
+        }
+        op += matchLength;
+    }
+
+    *outLength = op;
+    return true;
+}
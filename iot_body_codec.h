@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef __IOT_BODY_CODEC_H__
+#define __IOT_BODY_CODEC_H__
+
+#include "iot_platform.h"
+
+enum class EIoTBodyCodec : uint8_t
+{
+    NONE = 0x0,
+    LZ = 0x1,
+};
+
+#define IOT_BODY_CODECS (1 << (uint8_t)EIoTBodyCodec::LZ) /* Codecs this build decodes: bit per EIoTBodyCodec */
+
+/*
+ * Block of one body part once a codec is in use: a 2-byte big-endian header,
+ * then the payload. STORED: the part as is (it did not shrink); otherwise
+ * the part compressed. The low 15 bits are the payload length.
+ */
+#define IOT_BODY_BLOCK_HEADER 2
+#define IOT_BODY_BLOCK_STORED 0x8000
+#define IOT_BODY_BLOCK_LENGTH 0x7FFF
+
+#define IOT_LZ_DEFAULT_WINDOW 4096 /* Encoder match distance */
+#define IOT_LZ_MIN_WINDOW 256
+#define IOT_LZ_MAX_WINDOW 32768
+#define IOT_LZ_MIN_INPUT 16 /* Shorter parts are stored */
+
+/*
+ * LZ block (LZ4 sequence layout): sequences of a token (literal count in the
+ * high nibble, match length - 4 in the low one, 15 = more bytes follow, each
+ * adding up to 255), the literals, then the match as a 2-byte little-endian
+ * distance back into the output. The last sequence has literals only.
+ *
+ * Blocks are independent: a part decodes on its own, so the decoder needs no
+ * window and no state between parts. The window only bounds how far back the
+ * encoder looks and the size of its table, so a small one (IoTClient
+ * bodyCodecWindow) costs constrained senders less memory for the same wire
+ * format.
+ */
+
+/* Bytes of the encoder table for `window` (clamped to IOT_LZ_MIN_WINDOW..IOT_LZ_MAX_WINDOW): window / 2 */
+size_t iotLzTableSize(size_t window);
+
+/* Compresses `length` bytes (at most 65535) into `out`. `table` is iotLzTableSize(window) bytes, any content. 0 = does not fit in `capacity` */
+size_t iotLzCompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity, uint16_t *table, size_t window);
+
+/* Decompresses a block into `out`. false = corrupt or larger than `capacity` */
+bool iotLzDecompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity, size_t *outLength);
+
+#endif
@@ -0,0 +1,77 @@
+#include "iot_body_sink.h"
+
+IoTReassemblySink::IoTReassemblySink(size_t maxLength, IoTAllocator *allocator)
+{
+    this->maxLength = maxLength;
+    this->allocator = (allocator != NULL) ? allocator : IoTHeapAllocator::shared();
+    this->buffer = NULL;
+    this->total = 0;
+    this->receiving = false;
+}
+
+IoTReassemblySink::~IoTReassemblySink()
+{
+    this->release();
+}
+
+void IoTReassemblySink::release()
+{
+    if (this->buffer != NULL)
+    {
+        this->allocator->deallocate(this->buffer);
+    }
+    this->buffer = NULL;
+    this->total = 0;
+}
+
+bool IoTReassemblySink::open(IoTRequest *request, size_t totalBodyLength)
+{
+    if (this->receiving || (this->maxLength != 0 && totalBodyLength > this->maxLength))
+    {
+        return false;
+    }
+
+    this->release();
+    this->buffer = (uint8_t *)this->allocator->allocate(totalBodyLength + 1);
+    if (this->buffer == NULL)
+    {
+        return false;
+    }
+    this->buffer[totalBodyLength] = '\0';
+    this->total = totalBodyLength;
+    this->receiving = true;
+    return true;
+}
+
+bool IoTReassemblySink::write(uint16_t id, size_t offset, const uint8_t *data, size_t length)
+{
+    if (offset > this->total || length > this->total - offset)
+    {
+        return false;
+    }
+
+    memcpy(this->buffer + offset, data, length);
+    return true;
+}
+
+void IoTReassemblySink::close(uint16_t id, bool complete)
+{
+    this->receiving = false;
+    if (!complete)
+    {
+        this->release();
+    }
+}
+
+uint8_t *IoTReassemblySink::take()
+{
+    if (this->receiving)
+    {
+        return NULL; /* Still being written */
+    }
+
+    uint8_t *buffer = this->buffer;
+    this->buffer = NULL;
+    this->total = 0;
+    return buffer;
+}
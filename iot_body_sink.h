@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef __IOT_BODY_SINK_H__
+#define __IOT_BODY_SINK_H__
+
+#include "iot_platform.h"
+#include "iot_allocator.h"
+
+struct IoTRequest;
+
+/*
+ * Receiver of a body as its parts arrive.
+ *
+ * IoTProtocol::onBodySink picks a sink on the first part of a body. Every part
+ * is then written to it straight from the receive buffer (whatever the decode
+ * mode) instead of going to the middlewares or OnResponse one by one; these
+ * run once, on the last part, with body() as the request body.
+ */
+class IoTBodySink
+{
+public:
+    virtual ~IoTBodySink() {}
+
+    /* First part of body request->id (path and headers set). false refuses it: its parts are handled as without a sink */
+    virtual bool open(IoTRequest *request, size_t totalBodyLength) { return true; }
+    /* `length` bytes at `offset` of the body, valid during the call only. false aborts: the rest of the body is dropped */
+    virtual bool write(uint16_t id, size_t offset, const uint8_t *data, size_t length) = 0;
+    /* Whole body handed to the handlers of the last part. NULL = the sink keeps none */
+    virtual uint8_t *body(uint16_t id) { return NULL; }
+    /* After the handlers of the last part (complete), or when the body is dropped: write failed, timed out or client lost */
+    virtual void close(uint16_t id, bool complete) {}
+};
+
+/*
+ * Reassembles one body at a time into a buffer allocated once, from
+ * totalBodyLength, on open: each part is copied once, from the receive buffer
+ * to its place. A second body opened while one is in progress is refused.
+ *
+ * The buffer of the last complete body (NUL-terminated) stays until the next
+ * open; take() hands it over, release it with the sink allocator.
+ */
+class IoTReassemblySink : public IoTBodySink
+{
+public:
+    explicit IoTReassemblySink(size_t maxLength = 0, IoTAllocator *allocator = NULL); /* maxLength 0 = any; NULL = IoTHeapAllocator::shared() */
+    ~IoTReassemblySink();
+
+    bool open(IoTRequest *request, size_t totalBodyLength);
+    bool write(uint16_t id, size_t offset, const uint8_t *data, size_t length);
+    uint8_t *body(uint16_t id) { return this->buffer; }
+    void close(uint16_t id, bool complete);
+
+    uint8_t *data() const { return this->buffer; }
+    size_t length() const { return this->total; }
+    uint8_t *take();
+
+    size_t maxLength;
+    IoTAllocator *allocator;
+
+private:
+    IoTReassemblySink(const IoTReassemblySink &other);
+    IoTReassemblySink &operator=(const IoTReassemblySink &other);
+
+    uint8_t *buffer;
+    size_t total;
+    bool receiving;
+
+    void release();
+};
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef __IOT_BODY_SOURCE_H__
+#define __IOT_BODY_SOURCE_H__
+
+#include "iot_platform.h"
+#include <functional>
+
+/*
+ * Body of an outgoing request pulled part by part while it is sent, so it
+ * never has to be in memory as a whole. Set request->bodySource (body NULL,
+ * bodyLength the total) and send as usual; OnPartSent reports each part.
+ */
+class IoTBodySource
+{
+public:
+    virtual ~IoTBodySource() {}
+
+    /*
+     * `length` bytes at `offset` of the body: either a pointer into memory the
+     * source owns (no copy), or `scratch` after filling it. Valid until the
+     * next read. NULL fails the send.
+     */
+    virtual const uint8_t *read(size_t offset, size_t length, uint8_t *scratch) = 0;
+};
+
+/* Fills `length` bytes at `offset` into `buffer`. false fails the send */
+typedef std::function<bool(size_t offset, uint8_t *buffer, size_t length)> OnBodyRead;
+
+/* Source backed by a callback: each part is produced straight into the frame being written */
+class IoTCallbackSource : public IoTBodySource
+{
+public:
+    explicit IoTCallbackSource(OnBodyRead onRead) : onRead(onRead) {}
+
+    const uint8_t *read(size_t offset, size_t length, uint8_t *scratch)
+    {
+        return this->onRead(offset, scratch, length) ? scratch : NULL;
+    }
+
+    OnBodyRead onRead;
+};
+
+#endif
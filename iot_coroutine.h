@@ -0,0 +1,377 @@
+#pragma once
+
+#ifndef __IOT_COROUTINE_H__
+#define __IOT_COROUTINE_H__
+
+/*
+ * C++20 coroutine front-end for IoTProtocol (compiles to nothing on older
+ * standards, so Arduino cores can keep including the library as a whole).
+ *
+ *   IoTTask exchange(IoTAsync *async, IoTClient *iotClient)
+ *   {
+ *       IoTRequest request = {...};
+ *       IoTAwaitResult result = co_await async->request(&request);
+ *       if (result.timedOut()) ...
+ *
+ *       IoTResponseStream stream = async->stream(&download);
+ *       while (IoTRequest *part = co_await stream.next()) ...
+ *   }
+ *
+ * Coroutines are resumed from the protocol callbacks, i.e. by whatever drives
+ * the protocol (loop(), readClient, expireTimers or the epoll engine shards),
+ * on that thread. A response handed to a coroutine is a view: valid until the
+ * coroutine suspends again (IoTProtocol::retainRequest keeps it).
+ */
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+
+#include <coroutine>
+#include <deque>
+
+#include "iot_protocol.h"
+
+/* Fire-and-forget coroutine: runs until its first co_await right away, its frame goes away when it returns */
+struct IoTTask
+{
+    struct promise_type
+    {
+        IoTTask get_return_object() { return IoTTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { throw; } /* To whoever resumed it, like a throwing callback */
+    };
+};
+
+enum class EIoTAwaitStatus : uint8_t
+{
+    RESPONSE = 0x0,
+    TIMEOUT = 0x1
+};
+
+struct IoTAwaitResult
+{
+    EIoTAwaitStatus status;
+    IoTRequest *response; /* NULL on TIMEOUT */
+
+    bool timedOut() const { return this->status == EIoTAwaitStatus::TIMEOUT; }
+};
+
+class IoTAsync;
+class IoTResponseStream;
+
+/*
+ * Callbacks of one exchange in flight. They never live in a coroutine frame:
+ * the protocol may still be inside them when the coroutine resumes and ends.
+ */
+struct IoTAsyncSlot
+{
+    IoTAsync *async;
+    OnResponse onResponse;
+    OnTimeout onTimeout;
+
+    std::coroutine_handle<> waiting; /* request(): the coroutine awaiting the response */
+    IoTAwaitResult result;
+    IoTResponseStream *stream;       /* stream(): where parts go. NULL once the stream is gone */
+    size_t received;                 /* Body bytes of the response so far */
+    bool resolved;                   /* request() already resumed: ignore the remaining parts */
+    IoTAsyncSlot *nextFree;
+};
+
+/* Parts of a (multipart) response, pulled with `co_await next()` */
+class IoTResponseStream
+{
+public:
+    IoTResponseStream(IoTResponseStream &&other) = delete;
+    IoTResponseStream(const IoTResponseStream &other) = delete;
+    ~IoTResponseStream();
+
+    struct NextAwaiter
+    {
+        IoTResponseStream *stream;
+
+        bool await_ready() const { return !this->stream->buffered.empty() || this->stream->ended; }
+        void await_suspend(std::coroutine_handle<> handle) { this->stream->waiting = handle; }
+        IoTRequest *await_resume() { return this->stream->take(); }
+    };
+
+    /* Next part, NULL after the last one or on timeout */
+    NextAwaiter next() { return NextAwaiter{this}; }
+
+    bool timedOut() const { return this->expired; }
+
+private:
+    friend class IoTAsync;
+    IoTResponseStream(IoTAsync *async, IoTRequest *request, unsigned long timeout);
+
+    IoTAsync *async;
+    IoTAsyncSlot *slot = NULL;
+    std::coroutine_handle<> waiting;
+    IoTRequest *view = NULL;          /* Part delivered to a waiting coroutine */
+    std::deque<IoTRequest> buffered;  /* Parts that arrived while nobody was waiting (retained copies) */
+    IoTRequest current;               /* Retained part handed out last */
+    bool holding = false;             /* `current` is owned */
+    bool ended = false;
+    bool expired = false;
+
+    IoTRequest *take();
+    void deliver(IoTRequest *part, bool last);
+    void end(bool timedOut);
+};
+
+/* Awaitable request(): sends when the coroutine suspends */
+struct IoTRequestAwaiter
+{
+    IoTAsync *async;
+    IoTRequest *request;
+    unsigned long timeout;
+    IoTAsyncSlot *slot;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    IoTAwaitResult await_resume() { return this->slot->result; }
+};
+
+/*
+ * Awaitable exchanges on one IoTProtocol. Slots are pooled: after the first
+ * exchanges, awaiting a response allocates nothing.
+ */
+class IoTAsync
+{
+public:
+    explicit IoTAsync(IoTProtocol *protocol) : protocol(protocol) {}
+    IoTAsync(const IoTAsync &other) = delete;
+    IoTAsync &operator=(const IoTAsync &other) = delete;
+
+    /* co_await: REQUEST, resolves to its RESPONSE (first part of a multipart one, see stream) or TIMEOUT. 0 = protocol timeout */
+    IoTRequestAwaiter request(IoTRequest *request, unsigned long timeout = 0)
+    {
+        return IoTRequestAwaiter{this, request, timeout, NULL};
+    }
+
+    /* Sends a REQUEST or STREAMING now; its response parts are read with `co_await stream.next()` */
+    IoTResponseStream stream(IoTRequest *request, unsigned long timeout = 0)
+    {
+        if (request->method != EIoTMethod::REQUEST && request->method != EIoTMethod::STREAMING)
+        {
+            throw "[IoTAsync] stream needs a REQUEST or STREAMING";
+        }
+        return IoTResponseStream(this, request, timeout);
+    }
+
+    IoTProtocol *protocol;
+
+private:
+    friend struct IoTRequestAwaiter;
+    friend class IoTResponseStream;
+
+    std::deque<IoTAsyncSlot> slots; /* Stable addresses */
+    IoTAsyncSlot *freeSlots = NULL;
+
+    IoTAsyncSlot *acquire()
+    {
+        IoTAsyncSlot *slot = this->freeSlots;
+        if (slot != NULL)
+        {
+            this->freeSlots = slot->nextFree;
+        }
+        else
+        {
+            slot = &this->slots.emplace_back();
+            slot->async = this;
+            slot->onResponse = [slot](IoTRequest *response)
+            { slot->async->onResponse(slot, response); };
+            slot->onTimeout = [slot](IoTRequest *request)
+            { slot->async->onTimeout(slot); };
+        }
+        slot->waiting = nullptr;
+        slot->result = IoTAwaitResult{EIoTAwaitStatus::TIMEOUT, NULL};
+        slot->stream = NULL;
+        slot->received = 0;
+        slot->resolved = false;
+        slot->nextFree = NULL;
+        return slot;
+    }
+
+    void release(IoTAsyncSlot *slot)
+    {
+        slot->waiting = nullptr;
+        slot->stream = NULL;
+        slot->nextFree = this->freeSlots;
+        this->freeSlots = slot;
+    }
+
+    /* Sends `request` with the slot callbacks. Throws when it cannot be sent (maxPendingRequests awaited) */
+    void send(IoTAsyncSlot *slot, IoTRequest *request, unsigned long timeout)
+    {
+        IoTRequestResponse requestResponse = {&slot->onResponse, &slot->onTimeout, NULL, timeout};
+        IoTRequest *sent = NULL;
+        try
+        {
+            sent = this->protocol->send(request, &requestResponse);
+        }
+        catch (...)
+        {
+            this->release(slot);
+            throw;
+        }
+        if (sent == NULL)
+        {
+            this->release(slot);
+            throw "[IoTAsync] Too many pending requests";
+        }
+    }
+
+    void onResponse(IoTAsyncSlot *slot, IoTRequest *response)
+    {
+        slot->received += response->bodyLength;
+        bool last = (slot->received >= response->totalBodyLength);
+
+        if (slot->stream != NULL)
+        {
+            IoTResponseStream *stream = slot->stream;
+            if (last)
+            {
+                stream->slot = NULL;
+                this->release(slot);
+            }
+            stream->deliver(response, last); /* May resume the consumer, which may destroy the stream */
+            return;
+        }
+
+        if (slot->resolved || slot->waiting == nullptr)
+        {
+            /* request() already resumed on the first part, or its stream is gone: drain */
+            if (last)
+                this->release(slot);
+            return;
+        }
+
+        slot->resolved = true;
+        slot->result = IoTAwaitResult{EIoTAwaitStatus::RESPONSE, response};
+        std::coroutine_handle<> waiting = slot->waiting;
+        slot->waiting = nullptr;
+        if (last)
+        {
+            /* The result stays readable: await_resume runs before the slot can be handed out again */
+            this->release(slot);
+        }
+        waiting.resume();
+    }
+
+    void onTimeout(IoTAsyncSlot *slot)
+    {
+        if (slot->stream != NULL)
+        {
+            IoTResponseStream *stream = slot->stream;
+            stream->slot = NULL;
+            this->release(slot);
+            stream->end(true);
+            return;
+        }
+
+        std::coroutine_handle<> waiting = slot->resolved ? nullptr : slot->waiting;
+        slot->result = IoTAwaitResult{EIoTAwaitStatus::TIMEOUT, NULL};
+        this->release(slot);
+        if (waiting)
+        {
+            waiting.resume();
+        }
+    }
+};
+
+inline void IoTRequestAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    this->slot = this->async->acquire();
+    this->slot->waiting = handle;
+    this->request->method = EIoTMethod::REQUEST;
+
+    /* The response may arrive (and resume the coroutine) before send returns: touch nothing after it */
+    this->async->send(this->slot, this->request, this->timeout);
+}
+
+/* Stream */
+
+/* Never moves (prvalue return): parts are routed to `this` from the start */
+inline IoTResponseStream::IoTResponseStream(IoTAsync *async, IoTRequest *request, unsigned long timeout) : async(async)
+{
+    this->slot = async->acquire();
+    this->slot->stream = this;
+    async->send(this->slot, request, timeout); /* Parts arriving before it returns are buffered */
+}
+
+inline IoTResponseStream::~IoTResponseStream()
+{
+    if (this->slot != NULL)
+    {
+        this->slot->stream = NULL; /* Remaining parts are drained by the slot */
+        this->slot->resolved = true;
+    }
+    if (this->holding)
+    {
+        this->async->protocol->freeRequest(&this->current);
+    }
+    for (IoTRequest &part : this->buffered)
+    {
+        this->async->protocol->freeRequest(&part);
+    }
+}
+
+inline IoTRequest *IoTResponseStream::take()
+{
+    if (this->holding)
+    {
+        this->async->protocol->freeRequest(&this->current);
+        this->holding = false;
+    }
+
+    if (this->view != NULL)
+    {
+        IoTRequest *view = this->view;
+        this->view = NULL;
+        return view;
+    }
+    if (!this->buffered.empty())
+    {
+        this->current = this->buffered.front();
+        this->buffered.pop_front();
+        this->holding = true;
+        return &this->current;
+    }
+    return NULL;
+}
+
+inline void IoTResponseStream::deliver(IoTRequest *part, bool last)
+{
+    this->ended = last;
+
+    if (this->waiting)
+    {
+        /* Straight to the consumer, zero-copy */
+        std::coroutine_handle<> waiting = this->waiting;
+        this->waiting = nullptr;
+        this->view = part;
+        waiting.resume();
+        return;
+    }
+
+    this->buffered.push_back(this->async->protocol->retainRequest(part));
+}
+
+inline void IoTResponseStream::end(bool timedOut)
+{
+    this->ended = true;
+    this->expired = timedOut;
+    if (this->waiting)
+    {
+        std::coroutine_handle<> waiting = this->waiting;
+        this->waiting = nullptr;
+        waiting.resume();
+    }
+}
+
+#endif
+#endif
+
+#endif
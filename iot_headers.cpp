@@ -0,0 +1,344 @@
+#include "iot_headers.h"
+
+#define IOT_HEADER_KEYS_SLOTS 64 /* Power of two, twice IOT_HEADER_KEYS_MAX */
+
+struct IoTHeaderKeysRegistry
+{
+    const char *names[IOT_HEADER_KEYS_MAX];
+    size_t lengths[IOT_HEADER_KEYS_MAX];
+    uint32_t hashes[IOT_HEADER_KEYS_MAX];
+    uint8_t slots[IOT_HEADER_KEYS_SLOTS]; /* ID + 1, 0 = empty */
+    uint8_t size;
+};
+
+/* FNV-1a */
+static uint32_t hashKey(const char *key, size_t keyLength)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < keyLength; i++)
+    {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint8_t internKey(IoTHeaderKeysRegistry *registry, const char *key)
+{
+    size_t keyLength = strlen(key);
+    uint32_t hash = hashKey(key, keyLength);
+
+    uint32_t slot = hash & (IOT_HEADER_KEYS_SLOTS - 1);
+    for (; registry->slots[slot] != 0; slot = (slot + 1) & (IOT_HEADER_KEYS_SLOTS - 1))
+    {
+        uint8_t id = registry->slots[slot] - 1;
+        if (registry->hashes[id] == hash && registry->lengths[id] == keyLength && memcmp(registry->names[id], key, keyLength) == 0)
+        {
+            return id;
+        }
+    }
+
+    if (registry->size >= IOT_HEADER_KEYS_MAX)
+    {
+        return IOT_HEADER_KEY_NONE;
+    }
+
+    uint8_t id = registry->size++;
+    registry->names[id] = key;
+    registry->lengths[id] = keyLength;
+    registry->hashes[id] = hash;
+    registry->slots[slot] = id + 1;
+    return id;
+}
+
+static IoTHeaderKeysRegistry *headerKeys()
+{
+    static IoTHeaderKeysRegistry registry;
+    static bool initialized = false;
+
+    if (!initialized)
+    {
+        initialized = true;
+
+        /* Same order as EIoTHeaderKey */
+        static const char *defaults[] = {
+            "content-type",
+            "content-length",
+            "content-encoding",
+            "accept",
+            "accept-encoding",
+            "authorization",
+            "user-agent",
+            "date",
+            "type",
+            "device",
+            "token",
+            "timestamp",
+            "version",
+            "status"};
+
+        memset(&registry, 0, sizeof(registry));
+        for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+        {
+            internKey(&registry, defaults[i]);
+        }
+    }
+
+    return &registry;
+}
+
+uint8_t IoTHeaderKeys::intern(const char *key)
+{
+    return internKey(headerKeys(), key);
+}
+
+uint8_t IoTHeaderKeys::find(const char *key)
+{
+    return find(key, strlen(key));
+}
+
+uint8_t IoTHeaderKeys::find(const char *key, size_t keyLength)
+{
+    return find(key, keyLength, hashKey(key, keyLength));
+}
+
+uint32_t IoTHeaderKeys::hash(const char *key, size_t keyLength)
+{
+    return hashKey(key, keyLength);
+}
+
+uint8_t IoTHeaderKeys::find(const char *key, size_t keyLength, uint32_t hash)
+{
+    IoTHeaderKeysRegistry *registry = headerKeys();
+
+    for (uint32_t slot = hash & (IOT_HEADER_KEYS_SLOTS - 1); registry->slots[slot] != 0; slot = (slot + 1) & (IOT_HEADER_KEYS_SLOTS - 1))
+    {
+        uint8_t id = registry->slots[slot] - 1;
+        if (registry->hashes[id] == hash && registry->lengths[id] == keyLength && memcmp(registry->names[id], key, keyLength) == 0)
+        {
+            return id;
+        }
+    }
+
+    return IOT_HEADER_KEY_NONE;
+}
+
+const char *IoTHeaderKeys::name(uint8_t id)
+{
+    IoTHeaderKeysRegistry *registry = headerKeys();
+    return (id < registry->size) ? registry->names[id] : NULL;
+}
+
+uint8_t IoTHeaderKeys::size()
+{
+    return headerKeys()->size;
+}
+
+IoTHeaders::IoTHeaders()
+{
+    this->data = this->inlineHeaders;
+    this->count = 0;
+    this->capacity = IOT_HEADERS_INLINE_CAPACITY;
+    this->allocator = NULL;
+    memset(this->known, 0, sizeof(this->known));
+}
+
+IoTHeaders::IoTHeaders(const std::map<char *, char *> &headers) : IoTHeaders()
+{
+    for (auto header = headers.begin(); header != headers.end(); ++header)
+    {
+        this->insert(*header);
+    }
+}
+
+IoTHeaders::IoTHeaders(const IoTHeaders &other) : IoTHeaders()
+{
+    this->copyFrom(other);
+}
+
+IoTHeaders &IoTHeaders::operator=(const IoTHeaders &other)
+{
+    if (this != &other)
+    {
+        this->clear();
+        this->copyFrom(other);
+    }
+    return *this;
+}
+
+IoTHeaders::~IoTHeaders()
+{
+    if (this->data != this->inlineHeaders)
+    {
+        ((this->allocator != NULL) ? this->allocator : IoTHeapAllocator::shared())->deallocate(this->data);
+    }
+}
+
+void IoTHeaders::setAllocator(IoTAllocator *allocator)
+{
+    if (this->data == this->inlineHeaders)
+    {
+        this->allocator = allocator;
+    }
+}
+
+void IoTHeaders::copyFrom(const IoTHeaders &other)
+{
+    for (size_t i = 0; i < other.count; i++)
+    {
+        this->add(other.data[i].first, other.data[i].second, IOT_HEADER_KEY_NONE);
+    }
+    memcpy(this->known, other.known, sizeof(this->known));
+}
+
+void IoTHeaders::clear()
+{
+    /* Keeps a spilled heap block for reuse */
+    this->count = 0;
+    memset(this->known, 0, sizeof(this->known));
+}
+
+std::pair<IoTHeaders::iterator, bool> IoTHeaders::insert(const value_type &header)
+{
+    this->add(header.first, header.second, IoTHeaderKeys::find(header.first));
+    return std::make_pair(this->end() - 1, true);
+}
+
+void IoTHeaders::add(char *key, char *value, uint8_t keyId)
+{
+    if (this->count == this->capacity)
+    {
+        IoTAllocator *allocator = (this->allocator != NULL) ? this->allocator : IoTHeapAllocator::shared();
+        size_t capacity = this->capacity * 2;
+        value_type *data = (value_type *)allocator->allocate(capacity * sizeof(value_type));
+        if (data == NULL)
+        {
+            throw "[IoTProtocol] Out of memory for headers";
+        }
+        memcpy((void *)data, (void *)this->data, this->count * sizeof(value_type));
+        if (this->data != this->inlineHeaders)
+        {
+            allocator->deallocate(this->data);
+        }
+        this->data = data;
+        this->capacity = capacity;
+    }
+
+    this->data[this->count] = value_type(key, value);
+    this->count++;
+
+    if (keyId < IOT_HEADER_KEYS_MAX && this->known[keyId] == 0)
+    {
+        this->known[keyId] = (uint8_t)((this->count <= 255) ? this->count : 0);
+    }
+}
+
+const char *IoTHeaders::get(uint8_t keyId) const
+{
+    if (keyId >= IOT_HEADER_KEYS_MAX || this->known[keyId] == 0)
+    {
+        return NULL;
+    }
+    return this->data[this->known[keyId] - 1].second;
+}
+
+const char *IoTHeaders::get(const char *key) const
+{
+    uint8_t keyId = IoTHeaderKeys::find(key);
+    if (keyId != IOT_HEADER_KEY_NONE)
+    {
+        return this->get(keyId);
+    }
+
+    for (size_t i = 0; i < this->count; i++)
+    {
+        if (strcmp(this->data[i].first, key) == 0)
+        {
+            return this->data[i].second;
+        }
+    }
+    return NULL;
+}
+
+IoTHeaderTable::IoTHeaderTable()
+{
+    memset(this->entries, 0, sizeof(this->entries));
+    memset(this->buckets, 0, sizeof(this->buckets));
+    this->textLength = 0;
+    this->count = 0;
+    this->confirmed = 0;
+    this->unsent = 0;
+    this->frozen = false;
+}
+
+uint32_t IoTHeaderTable::hash(uint32_t keyHash, const char *value, size_t valueLength)
+{
+    /* Values run longer than keys: 8 bytes per multiply */
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    uint64_t hash = ((uint64_t)keyHash << 32) ^ valueLength;
+    for (; valueLength >= 8; value += 8, valueLength -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, value, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, value, valueLength);
+    hash = (hash ^ tail) * multiplier;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+int IoTHeaderTable::find(uint32_t hash, const char *key, size_t keyLength, const char *value, size_t valueLength) const
+{
+    for (uint32_t bucket = hash & (IOT_HEADER_TABLE_BUCKETS - 1); this->buckets[bucket] != 0; bucket = (bucket + 1) & (IOT_HEADER_TABLE_BUCKETS - 1))
+    {
+        uint8_t slot = this->buckets[bucket] - 1;
+        const Entry *entry = &(this->entries[slot]);
+        if (entry->hash == hash && entry->keyLength == keyLength && entry->valueLength == valueLength &&
+            memcmp(this->text + entry->key, key, keyLength) == 0 && memcmp(this->text + entry->value, value, valueLength) == 0)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+bool IoTHeaderTable::fits(size_t keyLength, size_t valueLength) const
+{
+    return this->count < IOT_HEADER_TABLE_ENTRIES && keyLength + valueLength + 2 <= IOT_HEADER_TABLE_MAX_ENTRY &&
+           this->textLength + keyLength + valueLength + 2 <= IOT_HEADER_TABLE_BYTES;
+}
+
+bool IoTHeaderTable::insert(uint8_t slot, const char *key, size_t keyLength, const char *value, size_t valueLength)
+{
+    if (slot >= IOT_HEADER_TABLE_ENTRIES || this->entries[slot].used || !this->fits(keyLength, valueLength))
+    {
+        return false;
+    }
+
+    Entry *entry = &(this->entries[slot]);
+    entry->key = (uint16_t)this->textLength;
+    entry->keyLength = (uint8_t)keyLength;
+    entry->value = (uint16_t)(this->textLength + keyLength + 1);
+    entry->valueLength = (uint8_t)valueLength;
+    uint32_t keyHash = IoTHeaderKeys::hash(key, keyLength);
+    entry->keyId = IoTHeaderKeys::find(key, keyLength, keyHash);
+    entry->hash = hash(keyHash, value, valueLength);
+    entry->used = true;
+
+    memcpy(this->text + entry->key, key, keyLength);
+    this->text[entry->key + keyLength] = '\0';
+    memcpy(this->text + entry->value, value, valueLength);
+    this->text[entry->value + valueLength] = '\0';
+
+    uint32_t bucket = entry->hash & (IOT_HEADER_TABLE_BUCKETS - 1);
+    while (this->buckets[bucket] != 0)
+    {
+        bucket = (bucket + 1) & (IOT_HEADER_TABLE_BUCKETS - 1);
+    }
+    this->buckets[bucket] = slot + 1;
+
+    this->textLength += keyLength + valueLength + 2;
+    this->count++;
+    return true;
+}
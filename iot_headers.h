@@ -0,0 +1,182 @@
+#pragma once
+
+#ifndef __IOT_HEADERS_H__
+#define __IOT_HEADERS_H__
+
+#include "iot_platform.h"
+#include "iot_allocator.h"
+#include <map>
+#include <utility>
+
+#ifndef IOT_HEADERS_INLINE_CAPACITY
+#define IOT_HEADERS_INLINE_CAPACITY 8 /* Headers stored without a heap allocation */
+#endif
+
+#define IOT_HEADER_KEYS_MAX 32 /* Well-known keys the registry can hold */
+#define IOT_HEADER_KEY_NONE 0xFF
+
+#define IOT_HEADER_STATIC_KEYS 14 /* EIoTHeaderKey: registered by every peer, in the same order */
+
+#ifndef IOT_HEADER_TABLE_ENTRIES
+#define IOT_HEADER_TABLE_ENTRIES 64 /* Slots of a header table, at most 128 */
+#endif
+
+#ifndef IOT_HEADER_TABLE_BYTES
+#define IOT_HEADER_TABLE_BYTES 1024 /* Key and value text of a header table */
+#endif
+
+#define IOT_HEADER_TABLE_MAX_ENTRY 64 /* Longer headers (key + value + 2) are sent as text, never added */
+#define IOT_HEADER_TABLE_BUCKETS 256  /* Power of two, at least twice IOT_HEADER_TABLE_ENTRIES */
+
+/*
+ * Registry of well-known header keys.
+ *
+ * Keys are interned once at startup and get a small ID. Headers whose key is
+ * registered carry that ID, so looking them up is an index, not a strcmp walk.
+ * A set of common keys is registered by default (IDs below).
+ */
+enum class EIoTHeaderKey : uint8_t
+{
+    CONTENT_TYPE = 0x0,
+    CONTENT_LENGTH = 0x1,
+    CONTENT_ENCODING = 0x2,
+    ACCEPT = 0x3,
+    ACCEPT_ENCODING = 0x4,
+    AUTHORIZATION = 0x5,
+    USER_AGENT = 0x6,
+    DATE = 0x7,
+    TYPE = 0x8,
+    DEVICE = 0x9,
+    TOKEN = 0xA,
+    TIMESTAMP = 0xB,
+    VERSION = 0xC,
+    STATUS = 0xD
+};
+
+class IoTHeaderKeys
+{
+public:
+    /* Registers `key` (must stay valid, e.g. a literal) and returns its ID, IOT_HEADER_KEY_NONE when full */
+    static uint8_t intern(const char *key);
+
+    /* ID of a registered key, IOT_HEADER_KEY_NONE otherwise (one hash probe) */
+    static uint8_t find(const char *key);
+    static uint8_t find(const char *key, size_t keyLength);
+    static uint8_t find(const char *key, size_t keyLength, uint32_t hash); /* hash: IoTHeaderKeys::hash of the key */
+    static uint32_t hash(const char *key, size_t keyLength);
+
+    static const char *name(uint8_t id);
+    static uint8_t size();
+};
+
+/*
+ * Flat header container: insertion order, the first IOT_HEADERS_INLINE_CAPACITY
+ * headers stored inline, and an index from well-known key ID to header.
+ *
+ * Elements are `std::pair<char *, char *>` (key, value), so code written for
+ * the former std::map (insert(std::make_pair(k, v)), header->first/second)
+ * keeps working. Key and value memory is not owned by the container.
+ * Headers past the inline ones spill to a block from `allocator`
+ * (NULL = IoTHeapAllocator::shared()).
+ */
+class IoTHeaders
+{
+public:
+    typedef std::pair<char *, char *> value_type;
+    typedef value_type *iterator;
+    typedef const value_type *const_iterator;
+
+    IoTHeaders();
+    IoTHeaders(const std::map<char *, char *> &headers);
+    IoTHeaders(const IoTHeaders &other);
+    IoTHeaders &operator=(const IoTHeaders &other);
+    ~IoTHeaders();
+
+    iterator begin() { return this->data; }
+    iterator end() { return this->data + this->count; }
+    const_iterator begin() const { return this->data; }
+    const_iterator end() const { return this->data + this->count; }
+    size_t size() const { return this->count; }
+    bool empty() const { return this->count == 0; }
+    void clear();
+
+    void setAllocator(IoTAllocator *allocator); /* Only while empty and not spilled */
+
+    std::pair<iterator, bool> insert(const value_type &header);
+    void add(char *key, char *value, uint8_t keyId);
+
+    /* Value of the first header with this key, NULL when absent */
+    const char *get(uint8_t keyId) const;
+    const char *get(EIoTHeaderKey key) const { return this->get((uint8_t)key); }
+    const char *get(const char *key) const;
+
+private:
+    value_type inlineHeaders[IOT_HEADERS_INLINE_CAPACITY];
+    value_type *data;
+    size_t count;
+    size_t capacity;
+    IoTAllocator *allocator;
+    uint8_t known[IOT_HEADER_KEYS_MAX]; /* Index + 1 of the header with that key ID, 0 = absent */
+
+    void copyFrom(const IoTHeaders &other);
+};
+
+/*
+ * Header table of one direction of a connection (version 2 frames, see
+ * IoTClient::headerCompression).
+ *
+ * Slots hold (key, value) pairs as NUL-terminated text that lives as long as
+ * the table, up to IOT_HEADER_TABLE_ENTRIES of them and IOT_HEADER_TABLE_BYTES
+ * of text. Nothing is evicted. The sender fills slots in order; a frame adding
+ * a header names its slot, so the receiver's copy ends up the same whatever
+ * order frames arrive in, and a slot already taken is left as is.
+ */
+class IoTHeaderTable
+{
+public:
+    IoTHeaderTable();
+
+    /* Of an entry, from IoTHeaderKeys::hash of its key */
+    static uint32_t hash(uint32_t keyHash, const char *value, size_t valueLength);
+
+    /* Slot holding (key, value), -1 = none */
+    int find(uint32_t hash, const char *key, size_t keyLength, const char *value, size_t valueLength) const;
+
+    /* Room for one more entry of that size */
+    bool fits(size_t keyLength, size_t valueLength) const;
+
+    /* Adds (key, value) at `slot`. false when the slot is taken, out of range, or there is no room */
+    bool insert(uint8_t slot, const char *key, size_t keyLength, const char *value, size_t valueLength);
+
+    bool has(uint8_t slot) const { return slot < IOT_HEADER_TABLE_ENTRIES && this->entries[slot].used; }
+    char *key(uint8_t slot) { return this->text + this->entries[slot].key; }
+    char *value(uint8_t slot) { return this->text + this->entries[slot].value; }
+    uint8_t keyId(uint8_t slot) const { return this->entries[slot].keyId; }
+
+    uint8_t size() const { return this->count; } /* Slots taken (the sender's next slot) */
+
+    /* Sender state, under IoTClient::writeLock */
+    uint8_t confirmed; /* Slots [0, confirmed) are in entries the transport took: frames may reference them */
+    uint16_t unsent;   /* Frames adding entries, not handed to the transport yet */
+    bool frozen;       /* An entry may never have reached the peer: no more references nor entries */
+
+private:
+    struct Entry
+    {
+        uint16_t key; /* Offset in `text` */
+        uint16_t value;
+        uint8_t keyLength;
+        uint8_t valueLength;
+        uint8_t keyId; /* IoTHeaderKeys ID of the key */
+        bool used;
+        uint32_t hash;
+    };
+
+    Entry entries[IOT_HEADER_TABLE_ENTRIES];
+    uint8_t buckets[IOT_HEADER_TABLE_BUCKETS]; /* Slot + 1 by hash, 0 = empty */
+    char text[IOT_HEADER_TABLE_BYTES];
+    size_t textLength;
+    uint8_t count;
+};
+
+#endif
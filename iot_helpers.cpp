@@ -1,16 +1,220 @@
 #include "iot_helpers.h"
 
+/*
+ * Delimiter scanning.
+ *
+ * matchBlock compares IOT_SCAN_BLOCK bytes at once against two byte values and
+ * returns a mask with one bit set per matching byte (bit `i << IOT_SCAN_SHIFT`
+ * for byte i): AVX2 or SSE2 on x86, otherwise SWAR on a 64-bit word
+ * (forced with IOT_SCAN_SWAR).
+ */
+#if defined(__AVX2__) && !defined(IOT_SCAN_SWAR)
+#include <immintrin.h>
+
+#define IOT_SCAN_BLOCK 32
+#define IOT_SCAN_SHIFT 0
+
+static inline uint64_t matchBlock(const uint8_t *block, uint8_t a, uint8_t b)
+{
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)block);
+    __m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8((char)a)),
+                                    _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8((char)b)));
+    return (uint32_t)_mm256_movemask_epi8(match);
+}
+
+#elif defined(__SSE2__) && !defined(IOT_SCAN_SWAR)
+#include <emmintrin.h>
+
+#define IOT_SCAN_BLOCK 16
+#define IOT_SCAN_SHIFT 0
+
+static inline uint64_t matchBlock(const uint8_t *block, uint8_t a, uint8_t b)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)block);
+    __m128i match = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)a)),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)b)));
+    return (uint32_t)_mm_movemask_epi8(match);
+}
+
+#else
+
+#define IOT_SCAN_BLOCK 8
+#define IOT_SCAN_SHIFT 3 /* Matches flag the high bit of their byte */
+
+/* High bit of every byte of `word` that is zero (exact, no false positives) */
+static inline uint64_t zeroBytes(uint64_t word)
+{
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+    return ~(((word & low7) + low7) | word | low7);
+}
+
+static inline uint64_t matchBlock(const uint8_t *block, uint8_t a, uint8_t b)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t word;
+    memcpy(&word, block, sizeof(word));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    word = __builtin_bswap64(word);
+#endif
+    return zeroBytes(word ^ (ones * a)) | zeroBytes(word ^ (ones * b));
+}
+
+#endif
+
+/*
+ * Calls onMatch(position) for each byte equal to `a` or `b` in
+ * buffer[start, bufLen), in order, until it returns false. Returns false
+ * when stopped by onMatch.
+ */
+template <typename OnMatch>
+static inline bool scanDelimiters(const uint8_t *buffer, size_t bufLen, size_t start, uint8_t a, uint8_t b, OnMatch onMatch)
+{
+    size_t i = start;
+
+    for (; i + IOT_SCAN_BLOCK <= bufLen; i += IOT_SCAN_BLOCK)
+    {
+        uint64_t mask = matchBlock(buffer + i, a, b);
+        while (mask != 0)
+        {
+            if (!onMatch(i + ((size_t)__builtin_ctzll(mask) >> IOT_SCAN_SHIFT)))
+            {
+                return false;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < bufLen; i++)
+    {
+        if ((buffer[i] == a || buffer[i] == b) && !onMatch(i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 int indexOf(uint8_t *buffer, size_t bufLen, uint8_t value, size_t start)
 {
     int index = -1;
 
-    for (size_t i = start; (i < bufLen && index == -1); i++)
+    scanDelimiters(buffer, bufLen, start, value, value, [&index](size_t position)
+                   {
+                       index = (int)position;
+                       return false; });
+
+    return index;
+}
+
+void resetHeaderTokenizer(IoTHeaderTokenizer *tokenizer, size_t offset)
+{
+    tokenizer->offset = offset;
+    tokenizer->scan = offset;
+    tokenizer->rs = SIZE_MAX;
+}
+
+bool tokenizeHeaders(const uint8_t *buffer, size_t bufLen, uint8_t separator, uint8_t terminator,
+                     IoTHeaderTokenizer *tokenizer, std::vector<IoTHeaderSpan> *headers, size_t headerSize)
+{
+    if (headers->size() >= headerSize)
     {
-        if (buffer[i] == value)
+        return true;
+    }
+
+    bool completed = !scanDelimiters(buffer, bufLen, tokenizer->scan, separator, terminator, [&](size_t position)
+                                     {
+                                         if (buffer[position] == separator)
+                                         {
+                                             /* The first separator splits key and value, later ones belong to the value */
+                                             if (tokenizer->rs == SIZE_MAX)
+                                             {
+                                                 tokenizer->rs = position;
+                                             }
+                                             return true;
+                                         }
+
+                                         IoTHeaderSpan header = {
+                                             tokenizer->offset,
+                                             (tokenizer->rs == SIZE_MAX) ? position : tokenizer->rs,
+                                             position};
+                                         headers->push_back(header);
+
+                                         tokenizer->offset = position + 1;
+                                         tokenizer->scan = position + 1;
+                                         tokenizer->rs = SIZE_MAX;
+
+                                         /* Stop right after the last header: the body may contain delimiters */
+                                         return headers->size() < headerSize; });
+
+    if (!completed)
+    {
+        tokenizer->scan = bufLen;
+    }
+
+    return completed;
+}
+
+bool tokenizeTableHeaders(const uint8_t *buffer, size_t bufLen, uint8_t separator, uint8_t terminator,
+                          IoTHeaderTokenizer *tokenizer, std::vector<IoTHeaderSpan> *headers, size_t headerSize)
+{
+    while (headers->size() < headerSize)
+    {
+        size_t start = tokenizer->offset;
+        if (start >= bufLen)
+        {
+            return false;
+        }
+
+        uint8_t code = buffer[start];
+        if (code & IOT_HEADER_INDEXED)
+        {
+            IoTHeaderSpan header = {start, start, start, code, (uint8_t)(code & ~IOT_HEADER_INDEXED)};
+            headers->push_back(header);
+            tokenizer->offset = start + 1;
+            tokenizer->scan = start + 1;
+            continue;
+        }
+
+        bool keyed = (code & IOT_HEADER_STATIC) != 0; /* Static key: no key text, separators belong to the value */
+        bool insert = (code & (keyed ? IOT_HEADER_STATIC_INSERT : IOT_HEADER_LITERAL_INSERT)) != 0;
+        size_t text = start + (insert ? 2 : 1);
+        if (text > bufLen)
+        {
+            return false;
+        }
+
+        size_t etx = SIZE_MAX;
+        bool completed = !scanDelimiters(buffer, bufLen, (tokenizer->scan > text) ? tokenizer->scan : text, separator, terminator, [&](size_t position)
+                                         {
+                                             if (buffer[position] == separator)
+                                             {
+                                                 if (!keyed && tokenizer->rs == SIZE_MAX)
+                                                 {
+                                                     tokenizer->rs = position;
+                                                 }
+                                                 return true;
+                                             }
+                                             etx = position;
+                                             return false; });
+        if (!completed)
         {
-            index = i;
+            tokenizer->scan = bufLen;
+            return false;
         }
+
+        IoTHeaderSpan header = {
+            text,
+            keyed ? text - 1 : ((tokenizer->rs == SIZE_MAX) ? etx : tokenizer->rs),
+            etx,
+            code,
+            insert ? buffer[start + 1] : (uint8_t)IOT_HEADER_SLOT_NONE};
+        headers->push_back(header);
+
+        tokenizer->offset = etx + 1;
+        tokenizer->scan = etx + 1;
+        tokenizer->rs = SIZE_MAX;
     }
 
-    return index;
-}
\ No newline at end of file
+    return true;
+}
@@ -3,8 +3,58 @@
 #ifndef __IOT_HELPERS_H__
 #define __IOT_HELPERS_H__
 
-#include "Arduino.h"
+#include "iot_platform.h"
+#include <vector>
 
 int indexOf(uint8_t *buffer, size_t bufLen, uint8_t value, size_t start = (size_t)0);
 
-#endif
\ No newline at end of file
+/*
+ * First byte of a header in version 2 frames (header table, see IoTHeaderTable):
+ *
+ *   1sssssss           the header in table slot s
+ *   01Nkkkkk VALUE ETX the static key k (EIoTHeaderKey) with a value
+ *   001N0000 KEY RS VALUE ETX
+ *
+ * N: the header is also added to the table, at the slot in the next byte.
+ */
+#define IOT_HEADER_INDEXED 0x80
+#define IOT_HEADER_STATIC 0x40
+#define IOT_HEADER_STATIC_INSERT 0x20
+#define IOT_HEADER_LITERAL 0x20
+#define IOT_HEADER_LITERAL_INSERT 0x10
+#define IOT_HEADER_SLOT_NONE 0xFF
+
+/* Offsets of one `KEY + separator + VALUE + terminator` header (IOT_RS / IOT_ETX) */
+struct IoTHeaderSpan
+{
+    size_t key;
+    size_t rs; /* == etx when the header has no separator (empty value). Static key: the byte before the value */
+    size_t etx;
+    uint8_t code; /* Version 2: first byte (IOT_HEADER_*). 0 = version 1 */
+    uint8_t slot; /* Version 2: slot referenced, or added to (IOT_HEADER_SLOT_NONE = not added) */
+};
+
+/* Progress of tokenizeHeaders, so it can resume when the header block is split across reads */
+struct IoTHeaderTokenizer
+{
+    size_t offset; /* Start of the current header */
+    size_t scan;   /* Next byte to scan */
+    size_t rs;     /* Separator of the current header, SIZE_MAX when not seen yet */
+};
+
+void resetHeaderTokenizer(IoTHeaderTokenizer *tokenizer, size_t offset);
+
+/*
+ * Splits header records in one pass over buffer[tokenizer->scan, bufLen),
+ * visiting each separator / terminator once (SIMD/SWAR delimiter scan). Stops
+ * right after the `headerSize`th header and returns true; returns false when
+ * the buffer ends first.
+ */
+bool tokenizeHeaders(const uint8_t *buffer, size_t bufLen, uint8_t separator, uint8_t terminator,
+                     IoTHeaderTokenizer *tokenizer, std::vector<IoTHeaderSpan> *headers, size_t headerSize);
+
+/* Same for the version 2 header forms: each header starts with its IOT_HEADER_* byte, indexed ones have no terminator */
+bool tokenizeTableHeaders(const uint8_t *buffer, size_t bufLen, uint8_t separator, uint8_t terminator,
+                          IoTHeaderTokenizer *tokenizer, std::vector<IoTHeaderSpan> *headers, size_t headerSize);
+
+#endif
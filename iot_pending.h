@@ -0,0 +1,283 @@
+#pragma once
+
+#ifndef __IOT_PENDING_H__
+#define __IOT_PENDING_H__
+
+#include "iot_platform.h"
+#include "iot_allocator.h"
+#include "iot_timer.h"
+#include <new>
+
+/*
+ * Fixed-capacity table of in-flight records keyed by 16-bit ID.
+ *
+ * Open addressing with linear probing (backward-shift deletion, no tombstones)
+ * over a power-of-two slot array at most half full, so find/insert/erase are
+ * O(1). Each record carries a timer on the wheel given to reserve() (shared
+ * with other tables); whoever pops one of its timers hands it to expire().
+ *
+ * Records and slots are allocated once by reserve(). Copying a table gives an
+ * empty table.
+ */
+template <typename T>
+class IoTPendingTable
+{
+public:
+    IoTPendingTable()
+    {
+        this->records = NULL;
+        this->slots = NULL;
+        this->freeList = NULL;
+        this->allocator = NULL;
+        this->wheel = NULL;
+        this->limit = 0;
+        this->count = 0;
+        this->mask = 0;
+        this->shift = 32;
+    }
+
+    IoTPendingTable(const IoTPendingTable &other) : IoTPendingTable() {}
+
+    IoTPendingTable &operator=(const IoTPendingTable &other)
+    {
+        if (this != &other)
+        {
+            this->release();
+        }
+        return *this;
+    }
+
+    ~IoTPendingTable()
+    {
+        this->release();
+    }
+
+    /*
+     * Allocates room for `capacity` records (max 65535) from `allocator`
+     * (NULL = heap), timed on `wheel` with timers tagged `kind` and `owner`.
+     * Drops every record.
+     */
+    bool reserve(size_t capacity, IoTAllocator *allocator, IoTTimerWheel *wheel, uint8_t kind, void *owner)
+    {
+        this->release();
+        this->wheel = wheel;
+        if (capacity == 0)
+            return true;
+        if (capacity > 0xFFFF)
+            capacity = 0xFFFF;
+
+        size_t slots = 2;
+        uint8_t bits = 1;
+        while (slots < capacity * 2)
+        {
+            slots <<= 1;
+            bits++;
+        }
+
+        this->allocator = (allocator != NULL) ? allocator : IoTHeapAllocator::shared();
+        this->records = (Record *)this->allocator->allocate(capacity * sizeof(Record));
+        this->slots = (uint16_t *)this->allocator->allocate(slots * sizeof(uint16_t));
+        if (this->records == NULL || this->slots == NULL)
+        {
+            this->allocator->deallocate(this->records);
+            this->allocator->deallocate(this->slots);
+            this->records = NULL;
+            this->slots = NULL;
+            return false;
+        }
+
+        this->limit = capacity;
+        this->mask = slots - 1;
+        this->shift = 32 - bits;
+        memset(this->slots, 0, slots * sizeof(uint16_t));
+        for (size_t i = capacity; i > 0; i--)
+        {
+            Record *record = new (&this->records[i - 1]) Record();
+            record->timer.kind = kind;
+            record->timer.owner = owner;
+            record->nextFree = this->freeList;
+            this->freeList = record;
+        }
+        return true;
+    }
+
+    T *find(uint16_t id)
+    {
+        size_t slot = this->lookup(id);
+        return (slot != SIZE_MAX) ? &(this->records[this->slots[slot] - 1].value) : NULL;
+    }
+
+    /* Inserts a copy of `value` due at `deadline`. An ID already pending keeps its record. NULL when full */
+    T *insert(uint16_t id, const T &value, unsigned long deadline)
+    {
+        T *existing = this->find(id);
+        if (existing != NULL)
+            return existing;
+        if (this->freeList == NULL)
+            return NULL;
+
+        Record *record = this->freeList;
+        this->freeList = record->nextFree;
+        record->value = value;
+        record->id = id;
+        record->timer.id = id;
+        record->used = true;
+
+        size_t slot = this->home(id);
+        while (this->slots[slot] != 0)
+        {
+            slot = (slot + 1) & this->mask;
+        }
+        this->slots[slot] = (uint16_t)(record - this->records) + 1;
+        this->count++;
+
+        this->wheel->schedule(&record->timer, deadline);
+        return &record->value;
+    }
+
+    void reschedule(uint16_t id, unsigned long deadline)
+    {
+        size_t slot = this->lookup(id);
+        if (slot != SIZE_MAX)
+        {
+            this->wheel->schedule(&(this->records[this->slots[slot] - 1].timer), deadline);
+        }
+    }
+
+    bool erase(uint16_t id)
+    {
+        size_t slot = this->lookup(id);
+        if (slot == SIZE_MAX)
+            return false;
+
+        Record *record = &(this->records[this->slots[slot] - 1]);
+        this->wheel->cancel(&record->timer);
+        record->value = T();
+        record->used = false;
+        record->nextFree = this->freeList;
+        this->freeList = record;
+        this->count--;
+
+        /* Backward shift: pull later records of the probe run into the hole */
+        size_t hole = slot;
+        size_t next = slot;
+        this->slots[hole] = 0;
+        while (true)
+        {
+            next = (next + 1) & this->mask;
+            if (this->slots[next] == 0)
+                break;
+
+            size_t wanted = this->home(this->records[this->slots[next] - 1].id);
+            if (((next - wanted) & this->mask) >= ((next - hole) & this->mask))
+            {
+                this->slots[hole] = this->slots[next];
+                this->slots[next] = 0;
+                hole = next;
+            }
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < this->limit; i++)
+        {
+            if (this->records[i].used)
+            {
+                this->erase(this->records[i].id);
+            }
+        }
+    }
+
+    /*
+     * `timer`, popped from the wheel, is one of this table's: calls
+     * onExpired(T *) with a copy of the record, so the callback may erase or
+     * clear, then erases the record unless the callback rescheduled or erased
+     * it.
+     */
+    template <typename OnExpired>
+    void expire(IoTTimer *timer, OnExpired onExpired)
+    {
+        Record *record = reinterpret_cast<Record *>(timer);
+        if (record < this->records || record >= this->records + this->limit || !record->used)
+            return;
+
+        uint16_t id = record->id;
+        T value = record->value;
+
+        onExpired(&value);
+
+        if (record->used && record->id == id && !record->timer.scheduled())
+        {
+            this->erase(id);
+        }
+    }
+
+    size_t size() const { return this->count; }
+    size_t capacity() const { return this->limit; }
+    bool full() const { return this->freeList == NULL; }
+
+private:
+    struct Record
+    {
+        IoTTimer timer; /* First: expire() maps a timer back to its record */
+        T value;
+        uint16_t id;
+        bool used;
+        Record *nextFree;
+    };
+
+    Record *records;
+    uint16_t *slots; /* Record index + 1, 0 = empty */
+    Record *freeList;
+    IoTAllocator *allocator;
+    IoTTimerWheel *wheel;
+    size_t limit;
+    size_t count;
+    size_t mask;
+    uint8_t shift;
+
+    /* Fibonacci hashing: spreads sequential IDs */
+    size_t home(uint16_t id) const
+    {
+        return (size_t)(((uint32_t)id * 2654435769u) >> this->shift) & this->mask;
+    }
+
+    size_t lookup(uint16_t id) const
+    {
+        if (this->slots == NULL)
+            return SIZE_MAX;
+
+        for (size_t slot = this->home(id); this->slots[slot] != 0; slot = (slot + 1) & this->mask)
+        {
+            if (this->records[this->slots[slot] - 1].id == id)
+            {
+                return slot;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    void release()
+    {
+        if (this->records != NULL)
+        {
+            for (size_t i = 0; i < this->limit; i++)
+            {
+                this->records[i].~Record();
+            }
+            this->allocator->deallocate(this->records);
+            this->allocator->deallocate(this->slots);
+        }
+        this->records = NULL;
+        this->slots = NULL;
+        this->freeList = NULL;
+        this->limit = 0;
+        this->count = 0;
+        this->mask = 0;
+        this->shift = 32;
+    }
+};
+
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+
+#ifndef __IOT_PLATFORM_H__
+#define __IOT_PLATFORM_H__
+
+/*
+ * Portability layer.
+ *
+ * On Arduino targets the clock, sleep and `Client` come from the Arduino core.
+ * Defining IOT_PROTOCOL_HOST (done by the CMake host build) swaps them for the
+ * POSIX implementations in extras/host so the protocol can be built, measured
+ * and regression-tracked on a Linux box.
+ */
+
+#if defined(IOT_PROTOCOL_HOST)
+#include "extras/host/iot_host.h"
+#else
+#include "Arduino.h"
+#endif
+
+/* Milliseconds since start */
+inline unsigned long iotMillis()
+{
+    return millis();
+}
+
+/* Microseconds since start */
+inline unsigned long iotMicros()
+{
+    return micros();
+}
+
+/* Yields the current task for `ticks` scheduler ticks (milliseconds on host) */
+inline void iotSleep(uint32_t ticks)
+{
+#if !defined(IOT_PROTOCOL_HOST) && (defined(ESP_PLATFORM) || defined(ESP32))
+    vTaskDelay(ticks);
+#else
+    delay(ticks);
+#endif
+}
+
+/*
+ * Short critical section between tasks sending on the same client. Holders
+ * only copy into memory or write to the transport, so waiters spin and yield.
+ * Targets without threads (AVR) get a no-op. Copies are unlocked.
+ */
+#if defined(__AVR__)
+class IoTSpinLock
+{
+public:
+    void lock() {}
+    void unlock() {}
+};
+#else
+#include <atomic>
+class IoTSpinLock
+{
+public:
+    IoTSpinLock() {}
+    IoTSpinLock(const IoTSpinLock &other) {}
+    IoTSpinLock &operator=(const IoTSpinLock &other) { return *this; }
+
+    void lock()
+    {
+        while (this->flag.test_and_set(std::memory_order_acquire))
+        {
+            iotSleep(0);
+        }
+    }
+    void unlock() { this->flag.clear(std::memory_order_release); }
+
+private:
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+#endif
+
+/* Holds an IoTSpinLock for a scope, released on exceptions too */
+class IoTLockGuard
+{
+public:
+    explicit IoTLockGuard(IoTSpinLock *lock) : lock(lock) { this->lock->lock(); }
+    ~IoTLockGuard() { this->lock->unlock(); }
+
+private:
+    IoTSpinLock *lock;
+    IoTLockGuard(const IoTLockGuard &other);
+    IoTLockGuard &operator=(const IoTLockGuard &other);
+};
+
+/* Scatter-gather element */
+struct IoTIoVec
+{
+    const uint8_t *data;
+    size_t length;
+};
+
+/*
+ * Optional capability of a transport: write several buffers as one
+ * (e.g. writev/sendmsg). Arduino's Client has no such call, so it is an
+ * interface of its own that a Client implementation may also inherit.
+ */
+class IoTVectoredWriter
+{
+public:
+    virtual ~IoTVectoredWriter() {}
+    virtual size_t writev(const IoTIoVec *iov, size_t count) = 0;
+};
+
+#endif
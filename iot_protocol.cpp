@@ -1,4 +1,102 @@
 #include "iot_protocol.h"
+#include "iot_router.h"
+
+/* `value` as Big Endian (MSB first) on `size` bytes */
+static void writeBigEndian(uint8_t *data, size_t value, uint8_t size)
+{
+    for (uint8_t i = size; i > 0; i--)
+    {
+        *(data++) = (value >> ((i - 1) * 8)) & 255;
+    }
+}
+
+static size_t readBigEndian(const uint8_t *data, uint8_t size)
+{
+    size_t value = 0;
+    for (uint8_t i = 0; i < size; i++)
+    {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/* Size carried by a BUFFER_SIZE frame, 0 = back to the default */
+static uint32_t announcedBufferSize(const uint8_t *body)
+{
+    uint32_t size = (uint32_t)readBigEndian(body, 4);
+    return (size != 0) ? size : IOT_PROTOCOL_DEFAULT_BUFFER_SIZE;
+}
+
+/* Codec a BUFFER_SIZE frame switches to, the byte after its sizes (`at`). NONE for v1 bodies */
+static EIoTBodyCodec announcedCodec(const uint8_t *body, size_t bodyLength, size_t at)
+{
+    return (bodyLength >= at + 2) ? (EIoTBodyCodec)body[at] : EIoTBodyCodec::NONE;
+}
+
+/* Codec to announce: the one wanted, once the peer said it decodes it */
+static EIoTBodyCodec usableCodec(const IoTClient *iotClient)
+{
+    EIoTBodyCodec codec = iotClient->bodyCodec;
+    return (codec != EIoTBodyCodec::NONE && (iotClient->peerBodyCodecs & (1 << (uint8_t)codec))) ? codec : EIoTBodyCodec::NONE;
+}
+
+/* Whether the body of a frame with this LSCB goes as a block of `codec` */
+static bool bodyEncoded(EIoTBodyCodec codec, uint8_t LSCB)
+{
+    if (codec == EIoTBodyCodec::NONE || !(LSCB & IOT_LSCB_BODY))
+        return false;
+
+    EIoTMethod method = (EIoTMethod)(LSCB >> 2);
+    return method == EIoTMethod::REQUEST || method == EIoTMethod::RESPONSE || method == EIoTMethod::STREAMING;
+}
+
+/* Body bytes per part in `partBodySpace`: with a block header, no more than its 15-bit length describes */
+static size_t sliceLengthOf(size_t partBodySpace, size_t blockHeader)
+{
+    size_t slice = partBodySpace - blockHeader;
+    return (blockHeader != 0 && slice > IOT_BODY_BLOCK_LENGTH) ? IOT_BODY_BLOCK_LENGTH : slice;
+}
+
+/* Outbound class of a request (never AUTO) */
+static EIoTPriority priorityOf(const IoTRequest *request)
+{
+    if (request->priority != EIoTPriority::AUTO)
+    {
+        return request->priority;
+    }
+
+    switch (request->method)
+    {
+    case EIoTMethod::ALIVE_REQUEST:
+    case EIoTMethod::ALIVE_RESPONSE:
+    case EIoTMethod::BUFFER_SIZE_REQUEST:
+    case EIoTMethod::BUFFER_SIZE_RESPONSE:
+    case EIoTMethod::CREDIT:
+        return EIoTPriority::CONTROL;
+    case EIoTMethod::STREAMING:
+        return EIoTPriority::BULK;
+    default:
+        return EIoTPriority::INTERACTIVE;
+    }
+}
+
+/* Ahead of each frame in a class queue */
+struct IoTQueuedFrame
+{
+    uint32_t length;
+    uint32_t queuedAt; /* iotMicros */
+};
+
+/* Bytes waiting to be written: outbound and the class queues */
+static size_t queuedBytes(IoTClient *iotClient)
+{
+    size_t queued = iotClient->outbound.size();
+    for (uint8_t i = 0; i < IOT_PRIORITY_CLASSES; i++)
+    {
+        queued += iotClient->priorityQueues[i].size();
+    }
+    return queued;
+}
 
 IoTProtocol::IoTProtocol(unsigned long timeout, uint32_t delay)
 {
@@ -7,45 +105,127 @@ IoTProtocol::IoTProtocol(unsigned long timeout, uint32_t delay)
 
     this->onAliveRequestTimeout = [this](IoTRequest *request)
     {
+        /* `request` belongs to the pending record that clearing the table resets */
+        IoTClient *iotClient = request->iotClient;
+
         /* Close client */
-        request->iotClient->client->stop();
-        request->iotClient->requestResponse.clear();
-        request->iotClient->multiPartControl.clear();
+        iotClient->client->stop();
+        iotClient->requestResponse.clear();
+        this->dropMultiParts(iotClient);
+        {
+            IoTLockGuard guard(&iotClient->writeLock);
+            this->markRequestIds(iotClient);
+        }
 
-        this->resetRemainBuffer(request->iotClient);
+        this->resetDecoder(iotClient);
 
-        if (request->iotClient->onDisconnect != NULL)
+        if (iotClient->onDisconnect != NULL)
         {
-            (*(request->iotClient->onDisconnect))(request->iotClient);
+            (*(iotClient->onDisconnect))(iotClient);
         }
     };
+}
+
+void IoTProtocol::use(IoTMiddleware middleware)
+{
+    IoTMiddlewareStage stage = {middleware, NULL, std::vector<char>()};
+    this->middlewares.push_back(stage);
+}
 
-    this->onBufferSizeResponse = [this](IoTRequest *response)
+void IoTProtocol::use(const char *path, IoTRouter *router)
+{
+    IoTMiddlewareStage stage = {NULL, router, std::vector<char>()};
+    size_t length = (path != NULL) ? strlen(path) : 0;
+    while (length > 0 && path[length - 1] == '/')
     {
-        if (response->method != EIoTMethod::BUFFER_SIZE_RESPONSE)
-            return;
-        response->iotClient->bufferSize = (response->body[0] << 24) + (response->body[1] << 16) + (response->body[2] << 8) + response->body[3];
-    };
+        length--;
+    }
+    if (length > 0)
+    {
+        stage.path.assign(path, path + length);
+        stage.path.push_back('\0');
+    }
+    this->middlewares.push_back(stage);
 }
 
-void IoTProtocol::use(IoTMiddleware middleware)
+/* What follows the mount point of `stage` in `path`, NULL = not under it */
+static const char *mountedPath(const IoTMiddlewareStage *stage, const char *path)
 {
-    this->middlewares.push_back(middleware);
+    if (path == NULL || stage->path.empty())
+    {
+        return path;
+    }
+
+    size_t length = stage->path.size() - 1;
+    if (strncmp(path, stage->path.data(), length) != 0 || (path[length] != '/' && path[length] != '\0'))
+    {
+        return NULL;
+    }
+    return path + length;
 }
 
-void IoTProtocol::runMiddleware(IoTRequest *request, int index = 0)
+/* What Next resumes. Captured by pointer so the Next std::function stays within its small buffer (no heap) */
+struct IoTMiddlewareCall
+{
+    IoTProtocol *protocol;
+    IoTRequest *request;
+    int index;
+};
+
+void IoTProtocol::runMiddleware(IoTRequest *request, int index)
 {
-    if (index >= this->middlewares.size())
+    if (this->middlewareMode == EIoTMiddlewareMode::FLAT)
+    {
+        this->runFlatMiddleware(request, (size_t)index);
+        return;
+    }
+
+    if (index >= (int)this->middlewares.size())
     {
         return;
     }
 
-    Next _next = [this, request, index]()
+    IoTMiddlewareCall call = {this, request, index};
+    IoTMiddlewareCall *_call = &call;
+    Next _next = [_call]()
     {
-        this->runMiddleware(request, (index + 1));
+        _call->protocol->runMiddleware(_call->request, (_call->index + 1));
     };
 
-    this->middlewares.at(index)(request, &_next);
+    IoTMiddlewareStage *stage = &(this->middlewares.at(index));
+    if (stage->router == NULL)
+    {
+        stage->middleware(request, &_next);
+        return;
+    }
+
+    const char *path = mountedPath(stage, request->path);
+    if (path == NULL)
+    {
+        _next();
+        return;
+    }
+    stage->router->dispatch(request, path, &_next);
+}
+
+void IoTProtocol::runFlatMiddleware(IoTRequest *request, size_t index)
+{
+    IoTMiddlewareContext context;
+
+    for (size_t i = index; i < this->middlewares.size(); i++)
+    {
+        IoTMiddlewareStage *stage = &(this->middlewares[i]);
+        if (stage->router == NULL)
+        {
+            if (!context.step(stage->middleware, request))
+                return;
+            continue;
+        }
+
+        const char *path = mountedPath(stage, request->path);
+        if (path != NULL && !stage->router->dispatch(request, path, &context))
+            return;
+    }
 }
 
 void IoTProtocol::listen(IoTClient *iotClient)
@@ -55,603 +235,2425 @@ void IoTProtocol::listen(IoTClient *iotClient)
         throw "[IoTProtocol] Client of IoTClient is null";
     }
 
-    iotClient->requestResponse = std::map<uint16_t, IoTRequestResponse>();
-    iotClient->multiPartControl = std::map<uint16_t, IoTMultiPart>();
-    iotClient->remainBuffer = NULL;
-    iotClient->remainBufferLength = 0;
-    iotClient->lockedForWrite = false;
+    /* Pending request records come from the client pools, frame copies from its arena */
+    IoTAllocator *allocator = this->allocatorOf(iotClient);
+    if (iotClient->maxPendingRequests == 0)
+    {
+        iotClient->maxPendingRequests = IOT_PROTOCOL_DEFAULT_MAX_PENDING_REQUESTS;
+    }
+    if (!iotClient->requestResponse.reserve(iotClient->maxPendingRequests, allocator, &this->timers, (uint8_t)EIoTTimer::REQUEST_TIMEOUT, iotClient))
+    {
+        throw "[IoTProtocol] Out of memory for pending requests";
+    }
+    iotClient->multiPartControl = IoTMultiPartMap(std::less<uint16_t>(), IoTStlAllocator<IoTMultiPartMap::value_type>(&iotClient->multiPartPool));
+    iotClient->multiPartPool.setParent(allocator);
+    iotClient->arena.setParent(allocator);
+    iotClient->lastRequestId = 0;
+    if (iotClient->requestIdsInUse == NULL)
+    {
+        iotClient->requestIdsInUse = (uint64_t *)allocator->allocate(IOT_REQUEST_ID_WORDS * sizeof(uint64_t));
+        if (iotClient->requestIdsInUse == NULL)
+        {
+            throw "[IoTProtocol] Out of memory for request IDs";
+        }
+    }
+    iotClient->decoder = IoTDecoder();
+    iotClient->readStats = IoTReadStats();
+    this->dropOutbound(iotClient);
+    iotClient->coalesceStats = IoTCoalesceStats();
+    iotClient->aboveHighWater = false;
+    if (iotClient->outboundCapacity == 0)
+    {
+        iotClient->outboundCapacity = IOT_PROTOCOL_DEFAULT_OUTBOUND_CAPACITY;
+    }
+    if (iotClient->outboundHighWater == 0 || iotClient->outboundHighWater > iotClient->outboundCapacity)
+    {
+        iotClient->outboundHighWater = iotClient->outboundCapacity - iotClient->outboundCapacity / 4;
+    }
     if (iotClient->aliveInterval == 0)
     {
         iotClient->aliveInterval = IOT_PROTOCOL_DEFAULT_ALIVE_INTERVAL;
     }
+    iotClient->aliveTimer.kind = (uint8_t)EIoTTimer::ALIVE;
+    iotClient->aliveTimer.owner = iotClient;
     this->scheduleNextAliveRequest(iotClient);
 
     if (iotClient->bufferSize == 0)
     {
         iotClient->bufferSize = IOT_PROTOCOL_DEFAULT_BUFFER_SIZE;
     }
+    if (iotClient->receiveBufferSize == 0)
+    {
+        iotClient->receiveBufferSize = iotClient->bufferSize;
+    }
+    if (iotClient->maxBufferSize == 0)
+    {
+        iotClient->maxBufferSize = IOT_PROTOCOL_MAX_BUFFER_SIZE;
+    }
+    iotClient->bufferTuner.probed = false;
+    iotClient->bufferTuner.pending = false;
+    iotClient->bufferTuner.sampled = 0;
+    iotClient->bufferTuner.previousSize = 0;
+    iotClient->bufferTuner.ceiling = 0;
+    iotClient->bufferStats = IoTBufferStats();
+    iotClient->bufferStats.size = iotClient->bufferSize;
+    iotClient->streams.clear();
+    this->markRequestIds(iotClient);
+    iotClient->streamCursor = 0;
+    iotClient->streamStats = IoTStreamStats();
+    this->freeHeaderTables(iotClient);
+    iotClient->headerStats = IoTHeaderStats();
+    iotClient->sendCodec = EIoTBodyCodec::NONE;
+    iotClient->receiveCodec = EIoTBodyCodec::NONE;
+    iotClient->peerBodyCodecs = 0;
+    this->freeCodecBuffer(iotClient);
+    iotClient->codecStats = IoTCodecStats();
 
     this->clients.insert(std::make_pair(iotClient->client, iotClient));
 }
 
-void IoTProtocol::onData(IoTClient *iotClient, uint8_t *buffer, size_t bufLen)
+void IoTProtocol::unlisten(IoTClient *iotClient)
 {
-
-    IoTRequest request = {
-        0,
-        EIoTMethod::SIGNAL,
-        0,
-        NULL,
-        std::map<char *, char *>(),
-        NULL,
-        0,
-        0,
-        0,
-        iotClient};
-
-    size_t offset = 0;
-
-    if (bufLen < offset)
-        return;
-
-    uint8_t MSCB = buffer[offset];
-    uint8_t LSCB = buffer[++offset];
-
-    request.version = MSCB >> 2;
-    request.method = (EIoTMethod)(LSCB >> 2);
-
-    /* Alive Method */
-    if (request.method == EIoTMethod::ALIVE_REQUEST)
+    this->clients.erase(iotClient->client);
+    this->timers.cancel(&(iotClient->aliveTimer));
+    iotClient->requestResponse.clear();
+    this->dropMultiParts(iotClient);
     {
-        /* Respond the alive Request  */
-        IoTRequest aliveResponse = {
-            IOT_VERSION,
-            EIoTMethod::ALIVE_REQUEST,
-            0,
-            NULL,
-            std::map<char *, char *>(),
-            NULL,
-            0,
-            0,
-            0,
-            iotClient};
-        this->aliveResponse(&aliveResponse);
-
-        /* Cancel next alive request and schedule another one from now */
-        this->scheduleNextAliveRequest(iotClient);
-
-        return this->freeRequest(&request);
+        IoTLockGuard guard(&iotClient->writeLock);
+        while (!iotClient->streams.empty())
+        {
+            this->dropStream(iotClient, iotClient->streams.size() - 1);
+        }
+        this->freeHeaderTables(iotClient);
+        this->freeCodecBuffer(iotClient);
+        this->allocatorOf(iotClient)->deallocate(iotClient->requestIdsInUse);
+        iotClient->requestIdsInUse = NULL;
     }
-
-    /* ID */
-    if (MSCB & IOT_MSCB_ID && bufLen >= offset + 2)
+    this->dropOutbound(iotClient);
+    if (iotClient->coalescer.buffer != NULL)
     {
-        request.id = (buffer[++offset] << 8) + (buffer[++offset]);
+        this->allocatorOf(iotClient)->deallocate(iotClient->coalescer.buffer);
+        iotClient->coalescer.buffer = NULL;
+        iotClient->coalescer.capacity = 0;
     }
+    this->resetDecoder(iotClient);
+}
 
-    /* PATH */
-    if (MSCB & IOT_MSCB_PATH)
+/* `*table`, allocated on first use. NULL when out of memory */
+IoTHeaderTable *IoTProtocol::headerTableOf(IoTClient *iotClient, IoTHeaderTable **table)
+{
+    if (*table == NULL)
     {
-        int indexEXT = indexOf(buffer, bufLen, IOT_ETX, ++offset);
-        if (indexEXT > -1)
+        void *memory = this->allocatorOf(iotClient)->allocate(sizeof(IoTHeaderTable));
+        if (memory != NULL)
         {
-            size_t pathLength = (indexEXT - offset);
-            request.path = static_cast<char *>(malloc(pathLength * sizeof(char) + 1));
-            memcpy(request.path, (buffer + offset), pathLength);
-            request.path[pathLength] = '\0';
-
-            offset = indexEXT;
+            *table = new (memory) IoTHeaderTable();
         }
     }
+    return *table;
+}
 
-    /* HEADER */
-    if (LSCB & IOT_LSCB_HEADER)
+void IoTProtocol::freeHeaderTables(IoTClient *iotClient)
+{
+    IoTHeaderTable **tables[] = {&iotClient->headerTable, &iotClient->peerHeaderTable};
+    for (size_t i = 0; i < 2; i++)
     {
-        offset++;
-        int indexRS = -1;
-        int indexEXT = -1;
-
-        uint8_t headerSize = buffer[offset++];
-
-        while ((indexRS = indexOf(buffer, bufLen, IOT_RS, offset)) &&
-               ((indexEXT = indexOf(buffer, bufLen, IOT_ETX, offset + 1)) != -1) &&
-               indexRS < indexEXT - 1)
+        if (*tables[i] != NULL)
         {
-            size_t keyLength = (indexRS - offset);
-
-            char *headerKey = (char *)malloc(keyLength * sizeof(char) + 1);
-            memcpy(headerKey, (buffer + offset), keyLength);
-            headerKey[keyLength] = '\0';
-
-            size_t valueLength = (indexEXT - (indexRS + 1));
-            char *headerValue = (char *)malloc(valueLength * sizeof(char) + 1);
-            memcpy(headerValue, (buffer + indexRS + 1), valueLength);
-            headerValue[valueLength] = '\0';
-
-            request.headers.insert(std::make_pair(headerKey, headerValue));
-
-            offset = indexEXT + 1;
-
-            if (request.headers.size() == headerSize)
-            {
-                break;
-            }
+            (*tables[i])->~IoTHeaderTable();
+            this->allocatorOf(iotClient)->deallocate(*tables[i]);
+            *tables[i] = NULL;
         }
-
-        offset--;
     }
+}
 
-    /* BODY */
-    bool requestCompleted = true;
-
-    if (LSCB & IOT_LSCB_BODY)
+/* Forgets the multipart transfers in progress, closing their sinks */
+void IoTProtocol::dropMultiParts(IoTClient *iotClient)
+{
+    /* One at a time: close may drop the client again */
+    while (!iotClient->multiPartControl.empty())
     {
-        uint8_t bodyLengthSize = 2;
-        switch (request.method)
+        auto multiPart = iotClient->multiPartControl.begin();
+        uint16_t id = multiPart->first;
+        IoTBodySink *sink = multiPart->second.sink;
+        iotClient->multiPartControl.erase(multiPart);
         {
-        case EIoTMethod::SIGNAL:
-        case EIoTMethod::BUFFER_SIZE_REQUEST:
-        case EIoTMethod::BUFFER_SIZE_RESPONSE:
-            bodyLengthSize = 1;
-            break;
-        case EIoTMethod::STREAMING:
-            bodyLengthSize = 4;
-            break;
+            IoTLockGuard guard(&iotClient->writeLock);
+            this->releaseRequestId(iotClient, id);
         }
-
-        request.bodyLength = 0;
-        for (uint8_t i = bodyLengthSize; i > 0; i--)
+        if (sink != NULL)
         {
-            request.bodyLength += buffer[++offset] << ((i - 1) * 8);
+            sink->close(id, false);
         }
-        request.totalBodyLength = request.bodyLength;
-
-        /* Single Request */
-        /* ...(17) EXT (18) 0 (19) 30 | (20) B (21) B (22) B + ...25B + (48) B , (49) B , (50) */
-
-        /* Multi Request */
-        /* ...(17) EXT (18) 4 (19) 36 | (20) B (21) B (22) B + ...999B + (1022) B , (1023) B , (1024) */
-        /* ...(17) EXT (18) 4 (19) 36 | (20) B (21) B (22) B + ...51B + (74) B , (75) B , (76) */
+    }
+}
 
-        offset++;
+IoTBodySink *IoTProtocol::openBodySink(IoTRequest *request)
+{
+    if (!this->onBodySink || request->method > EIoTMethod::STREAMING)
+    {
+        return NULL;
+    }
 
-        size_t bodyIncomeLength = bufLen - offset;
-        size_t bodyEndIndex = offset + request.bodyLength;
+    IoTBodySink *sink = this->onBodySink(request);
+    if (sink != NULL && !sink->open(request, request->totalBodyLength))
+    {
+        return NULL;
+    }
+    return sink;
+}
 
-        auto multiPartControl = iotClient->multiPartControl.find(request.id);
-        if ((multiPartControl != iotClient->multiPartControl.end()))
-        {
-            bodyEndIndex -= multiPartControl->second.received;
-        }
-        else
-        {
-            IoTMultiPart multiPart = {
-                0,
-                0,
-                millis()};
+IoTAllocator *IoTProtocol::allocatorOf(IoTClient *iotClient)
+{
+    if (iotClient->allocator != NULL)
+        return iotClient->allocator;
+    if (this->allocator != NULL)
+        return this->allocator;
+    return IoTHeapAllocator::shared();
+}
 
-            iotClient->multiPartControl.insert(std::make_pair(request.id, multiPart));
-            multiPartControl = iotClient->multiPartControl.find(request.id);
-        }
+/* Size of the BODY_LENGTH field for a method */
+static uint8_t bodyLengthSizeOf(EIoTMethod method)
+{
+    switch (method)
+    {
+    case EIoTMethod::SIGNAL:
+    case EIoTMethod::BUFFER_SIZE_REQUEST:
+    case EIoTMethod::BUFFER_SIZE_RESPONSE:
+    case EIoTMethod::CREDIT:
+        return 1;
+    case EIoTMethod::STREAMING:
+        return 4;
+    case EIoTMethod::ALIVE_REQUEST:
+    case EIoTMethod::ALIVE_RESPONSE:
+        return 0;
+    default:
+        return 2;
+    }
+}
 
-        if (bodyEndIndex > bufLen)
-        {
-            bodyEndIndex = bufLen;
-        }
+bool IoTProtocol::frameBudgetSpent(IoTClient *iotClient)
+{
+    return (this->frameBudget > 0 && iotClient->readStats.lastFrames >= this->frameBudget);
+}
 
-        request.bodyLength = bodyEndIndex - offset;
+size_t IoTProtocol::onData(IoTClient *iotClient, uint8_t *buffer, size_t bufLen)
+{
+    IoTDecoder *decoder = &(iotClient->decoder);
+    size_t consumed = 0;
 
-        multiPartControl->second.parts++;
-        multiPartControl->second.received += request.bodyLength;
-        multiPartControl->second.timeout += IOT_MULTIPART_TIMEOUT;
+    decoder->busy = true;
 
-        if (multiPartControl->second.received < request.totalBodyLength)
-        {
-            requestCompleted = false;
-        }
-        else
+    /* Finish the frame split across previous reads. Only the bytes it still needs are staged */
+    while (decoder->frameLength > 0 && consumed < bufLen && !this->frameBudgetSpent(iotClient))
+    {
+        size_t want = this->decoderWant(iotClient, buffer + consumed, bufLen - consumed);
+        if (!this->stageFrame(iotClient, buffer + consumed, want))
         {
-            iotClient->multiPartControl.erase(request.id);
+            /* Larger than any frame the peer may send: the stream is out of sync */
+            this->resetDecoder(iotClient);
+            decoder->busy = false;
+            return bufLen;
         }
+        consumed += want;
 
-        if (bodyIncomeLength > request.bodyLength) /* Income more than one request, so keeps it on remainBuffer */
+        if (this->decode(iotClient, decoder->frame, decoder->frameLength))
         {
-            iotClient->remainBufferLength = bufLen - bodyEndIndex;
-            iotClient->remainBuffer = (uint8_t *)(malloc(iotClient->remainBufferLength * sizeof(uint8_t) + 1));
-            memcpy(iotClient->remainBuffer, (buffer + bodyEndIndex), iotClient->remainBufferLength);
-            iotClient->remainBuffer[iotClient->remainBufferLength] = '\0';
+            this->onFrame(iotClient, decoder->frame);
+            decoder->frameLength = 0;
+            decoder->state = EIoTDecodeState::CONTROL;
         }
-
-        request.body = (uint8_t *)(malloc((request.bodyLength) * sizeof(uint8_t) + 1));
-        memcpy(request.body, (buffer + offset), request.bodyLength);
-        request.body[request.bodyLength] = '\0';
-
-        offset = bodyEndIndex - 1;
     }
 
-    /* Request Response */
-    auto rr = iotClient->requestResponse.find(request.id);
-    if (rr != iotClient->requestResponse.end())
+    /* Frames that are whole inside the buffer are parsed in place */
+    while (consumed < bufLen && !this->frameBudgetSpent(iotClient))
     {
-        if (rr->second.onResponse != NULL)
-        {
-            (*(rr->second.onResponse))(&request);
-        }
+        uint8_t *frame = buffer + consumed;
+        size_t length = bufLen - consumed;
 
-        if (requestCompleted)
-        {
-            iotClient->requestResponse.erase(request.id);
-        }
-        else
-        {
-            rr->second.timeout += this->timeout;
-        }
-    }
-    else
-    {
-        if (request.method == EIoTMethod::SIGNAL ||
-            request.method != EIoTMethod::REQUEST ||
-            request.method != EIoTMethod::STREAMING)
+        if (!this->decode(iotClient, frame, length))
         {
-            /* Middleware */
-            this->runMiddleware(&request);
+            /* Partial frame: keep it (and its parse progress) for the next read */
+            if (!this->stageFrame(iotClient, frame, length))
+            {
+                this->resetDecoder(iotClient);
+            }
+            consumed = bufLen;
+            break;
         }
-    }
 
-    /* Cancel next alive request and schedule another one from now */
-    this->scheduleNextAliveRequest(iotClient);
-
-    /* Buffer Size */
-    if (request.method == EIoTMethod::BUFFER_SIZE_REQUEST)
-    {
-        /* Set buffer size */
-        iotClient->bufferSize = (request.body[0] << 24) + (request.body[1] << 16) + (request.body[2] << 8) + request.body[3];
-        /* Respond buffer size */
-        this->bufferSizeResponse(&request);
+        consumed += decoder->offset;
+        this->onFrame(iotClient, frame);
+        decoder->state = EIoTDecodeState::CONTROL;
     }
 
-    this->freeRequest(&request);
-}
+    decoder->busy = false;
 
-uint16_t IoTProtocol::generateRequestId(IoTClient *iotClient)
-{
-    vTaskDelay(1);
-    uint16_t id = (uint16_t)(millis() % 10000);
-    if (iotClient->requestResponse.find(id) != iotClient->requestResponse.end() || id == 0)
-    {
-        return this->generateRequestId(iotClient);
-    }
-    return id;
+    return consumed;
 }
 
-IoTRequest *IoTProtocol::signal(IoTRequest *request)
+bool IoTProtocol::decode(IoTClient *iotClient, uint8_t *frame, size_t length)
 {
-    request->method = EIoTMethod::SIGNAL;
-    return this->send(request, NULL);
-}
+    IoTDecoder *decoder = &(iotClient->decoder);
 
-IoTRequest *IoTProtocol::request(IoTRequest *request, IoTRequestResponse *requestResponse)
-{
-    request->method = EIoTMethod::REQUEST;
-    return this->send(request, requestResponse);
-}
+    while (true)
+    {
+        switch (decoder->state)
+        {
+        case EIoTDecodeState::CONTROL:
+            if (length < 2)
+                return false;
+
+            decoder->MSCB = frame[0];
+            decoder->LSCB = frame[1];
+            decoder->id = 0;
+            decoder->offset = 2;
+            decoder->state = EIoTDecodeState::ID;
+            break;
 
-IoTRequest *IoTProtocol::response(IoTRequest *request)
+        case EIoTDecodeState::ID:
+            if (decoder->MSCB & IOT_MSCB_ID)
+            {
+                if (length < decoder->offset + 2)
+                    return false;
+
+                decoder->id = (frame[decoder->offset] << 8) + frame[decoder->offset + 1];
+                decoder->offset += 2;
+            }
+            decoder->scan = decoder->offset;
+            decoder->state = EIoTDecodeState::PATH;
+            break;
+
+        case EIoTDecodeState::PATH:
+            if (decoder->MSCB & IOT_MSCB_PATH)
+            {
+                int indexETX = indexOf(frame, length, IOT_ETX, decoder->scan);
+                if (indexETX == -1)
+                {
+                    decoder->scan = length; /* Resume the scan where it stopped */
+                    return false;
+                }
+
+                decoder->pathStart = decoder->offset;
+                decoder->pathEnd = indexETX;
+                decoder->offset = indexETX + 1;
+            }
+            decoder->state = EIoTDecodeState::HEADER_SIZE;
+            break;
+
+        case EIoTDecodeState::HEADER_SIZE:
+            decoder->headers.clear();
+            if (decoder->LSCB & IOT_LSCB_HEADER)
+            {
+                if (length < decoder->offset + 1)
+                    return false;
+
+                decoder->headerSize = frame[decoder->offset++];
+            }
+            else
+            {
+                decoder->headerSize = 0;
+            }
+            resetHeaderTokenizer(&(decoder->tokenizer), decoder->offset);
+            decoder->state = EIoTDecodeState::HEADER;
+            break;
+
+        case EIoTDecodeState::HEADER:
+            if ((decoder->MSCB >> 2) >= IOT_VERSION_HEADER_TABLE)
+            {
+                if (!tokenizeTableHeaders(frame, length, IOT_RS, IOT_ETX, &(decoder->tokenizer), &(decoder->headers), decoder->headerSize))
+                    return false;
+            }
+            else if (!tokenizeHeaders(frame, length, IOT_RS, IOT_ETX, &(decoder->tokenizer), &(decoder->headers), decoder->headerSize))
+                return false;
+
+            decoder->offset = decoder->tokenizer.offset;
+            decoder->state = EIoTDecodeState::BODY_LENGTH;
+            break;
+
+        case EIoTDecodeState::BODY_LENGTH:
+            decoder->bodyLength = 0;
+            decoder->partLength = 0;
+            if (decoder->LSCB & IOT_LSCB_BODY)
+            {
+                uint8_t bodyLengthSize = bodyLengthSizeOf((EIoTMethod)(decoder->LSCB >> 2));
+                bool encoded = bodyEncoded(iotClient->receiveCodec, decoder->LSCB);
+                if (length < decoder->offset + bodyLengthSize + (encoded ? IOT_BODY_BLOCK_HEADER : 0))
+                    return false;
+
+                for (uint8_t i = bodyLengthSize; i > 0; i--)
+                {
+                    decoder->bodyLength += (size_t)frame[decoder->offset++] << ((i - 1) * 8);
+                }
+
+                /* Encoded: the block header gives the part length */
+                if (encoded)
+                {
+                    decoder->block = (uint16_t)readBigEndian(frame + decoder->offset, IOT_BODY_BLOCK_HEADER);
+                    decoder->offset += IOT_BODY_BLOCK_HEADER;
+                    decoder->partLength = decoder->block & IOT_BODY_BLOCK_LENGTH;
+                    decoder->bodyStart = decoder->offset;
+                    decoder->state = EIoTDecodeState::BODY;
+                    break;
+                }
+
+                /* A part carries the rest of the body up to the end of the buffer size */
+                size_t received = 0;
+                auto multiPartControl = iotClient->multiPartControl.find(decoder->id);
+                if (multiPartControl != iotClient->multiPartControl.end())
+                {
+                    received = multiPartControl->second.received;
+                }
+
+                size_t bodyRemain = (decoder->bodyLength > received) ? decoder->bodyLength - received : 0;
+                size_t partSpace = (iotClient->receiveBufferSize > decoder->offset) ? iotClient->receiveBufferSize - decoder->offset : 0;
+                decoder->partLength = (bodyRemain < partSpace) ? bodyRemain : partSpace;
+            }
+            decoder->bodyStart = decoder->offset;
+            decoder->state = EIoTDecodeState::BODY;
+            break;
+
+        case EIoTDecodeState::BODY:
+            if (length < decoder->bodyStart + decoder->partLength)
+                return false;
+
+            decoder->offset = decoder->bodyStart + decoder->partLength;
+            return true;
+        }
+    }
+}
+
+size_t IoTProtocol::decoderWant(IoTClient *iotClient, uint8_t *buffer, size_t bufLen)
+{
+    IoTDecoder *decoder = &(iotClient->decoder);
+    size_t frameEnd = decoder->frameLength + 1;
+
+    switch (decoder->state)
+    {
+    case EIoTDecodeState::CONTROL:
+        frameEnd = 2;
+        break;
+    case EIoTDecodeState::ID:
+        frameEnd = decoder->offset + 2;
+        break;
+    case EIoTDecodeState::HEADER_SIZE:
+        frameEnd = decoder->offset + 1;
+        break;
+    case EIoTDecodeState::HEADER:
+        /* Version 2: the next header may be a slot, without terminator. Its first byte tells */
+        if ((decoder->MSCB >> 2) >= IOT_VERSION_HEADER_TABLE && decoder->frameLength <= decoder->tokenizer.offset)
+        {
+            frameEnd = decoder->tokenizer.offset + 1;
+            break;
+        }
+        /* Fall through */
+    case EIoTDecodeState::PATH:
+    {
+        /* Up to the delimiter that lets the scan progress */
+        int indexETX = indexOf(buffer, bufLen, IOT_ETX);
+        return (indexETX == -1) ? bufLen : (size_t)(indexETX + 1);
+    }
+    case EIoTDecodeState::BODY_LENGTH:
+        frameEnd = decoder->offset + bodyLengthSizeOf((EIoTMethod)(decoder->LSCB >> 2)) +
+                   (bodyEncoded(iotClient->receiveCodec, decoder->LSCB) ? IOT_BODY_BLOCK_HEADER : 0);
+        break;
+    case EIoTDecodeState::BODY:
+        frameEnd = decoder->bodyStart + decoder->partLength;
+        break;
+    }
+
+    size_t want = (frameEnd > decoder->frameLength) ? frameEnd - decoder->frameLength : 1;
+    return (want < bufLen) ? want : bufLen;
+}
+
+bool IoTProtocol::stageFrame(IoTClient *iotClient, uint8_t *buffer, size_t bufLen)
+{
+    IoTDecoder *decoder = &(iotClient->decoder);
+    size_t frameLength = decoder->frameLength + bufLen;
+
+    if (frameLength > iotClient->receiveBufferSize)
+        return false;
+
+    if (frameLength + 1 > decoder->frameCapacity)
+    {
+        /* Room for a whole frame plus the terminator written after the body */
+        IoTAllocator *allocator = this->allocatorOf(iotClient);
+        size_t capacity = iotClient->receiveBufferSize + 1;
+        uint8_t *frame = (uint8_t *)allocator->allocate(capacity * sizeof(uint8_t));
+        if (frame == NULL)
+            return false;
+
+        if (decoder->frame != NULL)
+        {
+            memcpy(frame, decoder->frame, decoder->frameLength);
+            allocator->deallocate(decoder->frame);
+        }
+        decoder->frame = frame;
+        decoder->frameCapacity = capacity;
+    }
+
+    memcpy(decoder->frame + decoder->frameLength, buffer, bufLen);
+    decoder->frameLength = frameLength;
+    return true;
+}
+
+void IoTProtocol::onFrame(IoTClient *iotClient, uint8_t *frame)
+{
+    IoTDecoder *decoder = &(iotClient->decoder);
+
+    iotClient->readStats.lastFrames++;
+    iotClient->readStats.frames++;
+
+    IoTRequest request = {
+        (uint8_t)(decoder->MSCB >> 2),
+        (EIoTMethod)(decoder->LSCB >> 2),
+        decoder->id,
+        NULL,
+        IoTHeaders(),
+        NULL,
+        0,
+        0,
+        0,
+        iotClient,
+        true};
+    bool view = (this->decodeMode == EIoTDecodeMode::VIEW);
+    request.headers.setAllocator(&iotClient->arena);
+
+    /* Alive Method */
+    if (request.method == EIoTMethod::ALIVE_REQUEST)
+    {
+        /* Respond the alive Request  */
+        IoTRequest aliveResponse = {
+            IOT_VERSION,
+            EIoTMethod::ALIVE_REQUEST,
+            0,
+            NULL,
+            IoTHeaders(),
+            NULL,
+            0,
+            0,
+            0,
+            iotClient};
+        this->aliveResponse(&aliveResponse);
+
+        /* Cancel next alive request and schedule another one from now */
+        this->scheduleNextAliveRequest(iotClient);
+        return;
+    }
+
+    /* Credit Method: the peer took more of one of the streams sent */
+    if (request.method == EIoTMethod::CREDIT)
+    {
+        if ((decoder->LSCB & IOT_LSCB_BODY) && decoder->partLength >= 4)
+        {
+            uint32_t bytes = (uint32_t)readBigEndian(frame + decoder->bodyStart, 4);
+            IoTLockGuard guard(&iotClient->writeLock);
+            iotClient->streamStats.creditsReceived++;
+            for (auto stream = iotClient->streams.begin(); stream != iotClient->streams.end(); ++stream)
+            {
+                if (stream->request.id == request.id)
+                {
+                    stream->credit += bytes;
+                    stream->creditAt = iotMillis();
+                    break;
+                }
+            }
+            this->pumpStreams(iotClient);
+        }
+
+        this->scheduleNextAliveRequest(iotClient);
+        return;
+    }
+
+    /* PATH */
+    if (decoder->MSCB & IOT_MSCB_PATH)
+    {
+        size_t pathLength = decoder->pathEnd - decoder->pathStart;
+        if (view)
+        {
+            frame[decoder->pathEnd] = '\0'; /* ETX becomes the terminator */
+            request.path = (char *)(frame + decoder->pathStart);
+        }
+        else
+        {
+            request.path = static_cast<char *>(iotClient->arena.allocate(pathLength * sizeof(char) + 1));
+            memcpy(request.path, (frame + decoder->pathStart), pathLength);
+            request.path[pathLength] = '\0';
+        }
+    }
+
+    /* HEADER */
+    IoTHeaderTable *peerTable = NULL;
+    if (request.version >= IOT_VERSION_HEADER_TABLE && !decoder->headers.empty())
+    {
+        peerTable = this->headerTableOf(iotClient, &iotClient->peerHeaderTable);
+        iotClient->headerCompression = true; /* The peer decodes version 2 as well */
+    }
+
+    for (auto span = decoder->headers.begin(); span != decoder->headers.end(); ++span)
+    {
+        /* Table slot: its text is NUL-terminated and lasts as long as the connection */
+        if (span->code & IOT_HEADER_INDEXED)
+        {
+            if (peerTable != NULL && peerTable->has(span->slot))
+            {
+                request.headers.add(peerTable->key(span->slot), peerTable->value(span->slot), peerTable->keyId(span->slot));
+            }
+            continue; /* Slot never added (e.g. out of memory): the header is lost */
+        }
+
+        char *headerKey;
+        char *headerValue;
+        uint8_t keyId;
+        bool keyed = (span->code & IOT_HEADER_STATIC) != 0;
+        size_t keyLength = (span->rs - span->key);
+        size_t valueStart = (span->rs < span->etx) ? span->rs + 1 : span->etx;
+        size_t valueLength = (span->etx - valueStart);
+
+        if (keyed)
+        {
+            keyId = span->code & ~(IOT_HEADER_STATIC | IOT_HEADER_STATIC_INSERT);
+            if (keyId >= IOT_HEADER_STATIC_KEYS)
+                continue;
+            headerKey = (char *)IoTHeaderKeys::name(keyId);
+            keyLength = strlen(headerKey);
+        }
+        else
+        {
+            if (span->code != 0 && (span->code & ~IOT_HEADER_LITERAL_INSERT) != IOT_HEADER_LITERAL)
+                continue; /* Unknown form */
+            keyId = IoTHeaderKeys::find((const char *)(frame + span->key), keyLength);
+        }
+
+        if (view)
+        {
+            /* RS and ETX become the terminators */
+            frame[span->rs] = '\0';
+            frame[span->etx] = '\0';
+            if (!keyed)
+            {
+                headerKey = (char *)(frame + span->key);
+            }
+            headerValue = (char *)(frame + valueStart);
+        }
+        else
+        {
+            if (!keyed)
+            {
+                headerKey = (char *)iotClient->arena.allocate(keyLength * sizeof(char) + 1);
+                memcpy(headerKey, (frame + span->key), keyLength);
+                headerKey[keyLength] = '\0';
+            }
+
+            headerValue = (char *)iotClient->arena.allocate(valueLength * sizeof(char) + 1);
+            memcpy(headerValue, (frame + valueStart), valueLength);
+            headerValue[valueLength] = '\0';
+        }
+
+        /* Every part of a multipart carries it: the slot is taken from the first one on */
+        if (span->code != 0 && span->slot != IOT_HEADER_SLOT_NONE && peerTable != NULL)
+        {
+            peerTable->insert(span->slot, headerKey, keyLength, headerValue, valueLength);
+        }
+
+        request.headers.add(headerKey, headerValue, keyId);
+    }
+
+    /* BODY */
+    bool requestCompleted = true;
+    size_t partLength = decoder->partLength;
+    IoTBodySink *sink = NULL;
+    bool discard = false; /* Part of a body whose sink failed */
+    size_t bodyEnd = decoder->bodyStart + decoder->partLength;
+    uint8_t afterBody = frame[bodyEnd];
+    uint8_t *partBody = frame + decoder->bodyStart;
+    bool corrupt = false; /* Block of the body codec that did not decode */
+
+    if (decoder->LSCB & IOT_LSCB_BODY)
+    {
+        request.bodyLength = decoder->partLength;
+
+        /* Compressed part: decoded on its own, its raw length counts from here on */
+        if (bodyEncoded(iotClient->receiveCodec, decoder->LSCB) && !(decoder->block & IOT_BODY_BLOCK_STORED))
+        {
+            uint8_t *decoded = this->decodeBody(iotClient, partBody, decoder->partLength, &partLength);
+            if (decoded != NULL)
+            {
+                partBody = decoded;
+                request.bodyLength = partLength;
+            }
+            else
+            {
+                corrupt = true;
+                request.bodyLength = 0;
+            }
+        }
+        request.totalBodyLength = decoder->bodyLength;
+
+        auto multiPartControl = iotClient->multiPartControl.find(request.id);
+        if (multiPartControl == iotClient->multiPartControl.end())
+        {
+            sink = this->openBodySink(&request);
+
+            /* Whole body in one part: nothing to track */
+            if (request.bodyLength < request.totalBodyLength)
+            {
+                IoTMultiPart multiPart = {
+                    0,
+                    0,
+                    iotMillis()};
+
+                multiPartControl = iotClient->multiPartControl.insert(std::make_pair(request.id, multiPart)).first;
+                multiPartControl->second.timer.kind = (uint8_t)EIoTTimer::MULTIPART_TIMEOUT;
+                multiPartControl->second.timer.id = request.id;
+                multiPartControl->second.timer.owner = iotClient;
+                multiPartControl->second.sink = sink;
+
+                IoTLockGuard guard(&iotClient->writeLock);
+                this->claimRequestId(iotClient, request.id);
+            }
+        }
+        else
+        {
+            request.offset = multiPartControl->second.received;
+            sink = multiPartControl->second.sink;
+            discard = multiPartControl->second.discard;
+        }
+
+        if (multiPartControl != iotClient->multiPartControl.end())
+        {
+            multiPartControl->second.parts++;
+            multiPartControl->second.received += request.bodyLength;
+            multiPartControl->second.timeout = iotMillis() + IOT_MULTIPART_TIMEOUT; /* From the latest part */
+
+            if (multiPartControl->second.received < request.totalBodyLength)
+            {
+                requestCompleted = false;
+                this->timers.schedule(&(multiPartControl->second.timer), multiPartControl->second.timeout);
+            }
+            else
+            {
+                iotClient->multiPartControl.erase(multiPartControl); /* Cancels its timer */
+
+                IoTLockGuard guard(&iotClient->writeLock);
+                this->releaseRequestId(iotClient, request.id);
+            }
+        }
+
+        if (corrupt)
+        {
+            /* The rest of the body cannot be put back together: dropped like a failed sink */
+            if (sink != NULL)
+            {
+                sink->close(request.id, false);
+                sink = NULL;
+            }
+            discard = true;
+            if (!requestCompleted)
+            {
+                multiPartControl->second.sink = NULL;
+                multiPartControl->second.discard = true;
+            }
+        }
+
+        if (sink != NULL)
+        {
+            /* Straight from the receive buffer, whatever the decode mode */
+            if (!sink->write(request.id, request.offset, partBody, request.bodyLength))
+            {
+                sink->close(request.id, false);
+                sink = NULL;
+                discard = true;
+                if (!requestCompleted)
+                {
+                    multiPartControl->second.sink = NULL;
+                    multiPartControl->second.discard = true;
+                }
+            }
+            else if (requestCompleted)
+            {
+                /* The handlers get the whole body once */
+                request.body = sink->body(request.id);
+                request.bodyLength = request.totalBodyLength;
+                request.offset = 0;
+            }
+        }
+        else if (view && !discard)
+        {
+            /* Borrow the byte after the body (next frame, spare byte or that of the decoded part) for the terminator */
+            request.body = partBody;
+            partBody[request.bodyLength] = '\0';
+        }
+        else if (!discard)
+        {
+            request.body = (uint8_t *)(iotClient->arena.allocate((request.bodyLength) * sizeof(uint8_t) + 1));
+            memcpy(request.body, partBody, request.bodyLength);
+            request.body[request.bodyLength] = '\0';
+        }
+    }
+
+    /* Parts going to a sink reach the handlers once, with the last one */
+    bool deliver = !discard && (sink == NULL || requestCompleted);
+
+    /* Request Response. BUFFER_SIZE_RESPONSE has no ID of its own (0, like the alive request): handled below */
+    IoTRequestResponse *rr = (request.method == EIoTMethod::BUFFER_SIZE_RESPONSE) ? NULL : iotClient->requestResponse.find(request.id);
+    if (rr != NULL)
+    {
+        if (rr->onResponse != NULL && deliver)
+        {
+            (*(rr->onResponse))(&request);
+        }
+
+        /* The handler may have cancelled it (e.g. closed the client) */
+        rr = iotClient->requestResponse.find(request.id);
+        if (rr != NULL)
+        {
+            if (requestCompleted)
+            {
+                iotClient->requestResponse.erase(request.id);
+
+                IoTLockGuard guard(&iotClient->writeLock);
+                this->releaseRequestId(iotClient, request.id);
+            }
+            else
+            {
+                rr->timeout = iotMillis() + this->timeout; /* From the latest part */
+                iotClient->requestResponse.reschedule(request.id, rr->timeout);
+            }
+        }
+    }
+    else if (deliver)
+    {
+        if (request.method == EIoTMethod::SIGNAL ||
+            request.method != EIoTMethod::REQUEST ||
+            request.method != EIoTMethod::STREAMING)
+        {
+            /* Middleware */
+            this->runMiddleware(&request);
+        }
+    }
+
+    if (sink != NULL && requestCompleted)
+    {
+        sink->close(request.id, true);
+    }
+
+    /* Stream flow control: what the handlers took is granted back, half a window at a time */
+    if (!requestCompleted && iotClient->streamWindow > 0 && request.method >= EIoTMethod::REQUEST && request.method <= EIoTMethod::STREAMING)
+    {
+        auto multiPart = iotClient->multiPartControl.find(request.id);
+        if (multiPart != iotClient->multiPartControl.end())
+        {
+            multiPart->second.ungranted += (uint32_t)partLength;
+            if (multiPart->second.ungranted >= iotClient->streamWindow / 2)
+            {
+                uint32_t bytes = multiPart->second.ungranted;
+                multiPart->second.ungranted = 0;
+                this->credit(iotClient, request.id, bytes);
+            }
+        }
+    }
+
+    /* Cancel next alive request and schedule another one from now */
+    this->scheduleNextAliveRequest(iotClient);
+
+    /* Buffer Size: frames received from now on use it; the response switches the frames sent */
+    if (request.method == EIoTMethod::BUFFER_SIZE_REQUEST && request.body != NULL && request.bodyLength >= 4)
+    {
+        iotClient->receiveBufferSize = announcedBufferSize(request.body);
+        iotClient->receiveCodec = announcedCodec(request.body, request.bodyLength, 4);
+        iotClient->peerBodyCodecs = (request.bodyLength >= 6) ? request.body[5] : 0;
+        this->bufferSizeResponse(&request);
+    }
+    else if (request.method == EIoTMethod::BUFFER_SIZE_RESPONSE && request.body != NULL && request.bodyLength >= 4)
+    {
+        iotClient->receiveBufferSize = announcedBufferSize(request.body);
+        if (request.bodyLength >= 8)
+        {
+            iotClient->peerMaxBufferSize = (uint32_t)readBigEndian(request.body + 4, 4);
+        }
+        if (iotClient->bufferTuner.pending)
+        {
+            iotClient->bufferTuner.pending = false;
+            iotClient->bufferStats.rttMicros = (uint32_t)(iotMicros() - iotClient->bufferTuner.requestedAt);
+        }
+
+        iotClient->receiveCodec = announcedCodec(request.body, request.bodyLength, 8);
+        iotClient->peerBodyCodecs = (request.bodyLength >= 10) ? request.body[9] : 0;
+        /* Learned that the peer decodes the codec wanted: announce it, same size */
+        if (usableCodec(iotClient) != iotClient->sendCodec && usableCodec(iotClient) != EIoTBodyCodec::NONE)
+        {
+            this->bufferSizeRequest(iotClient, iotClient->bufferSize);
+        }
+    }
+
+    this->freeRequest(&request);
+    request.headers.clear();
+    iotClient->arena.reset();
+
+    frame[bodyEnd] = afterBody;
+}
+
+/* `id` names a transfer still going on: a pending request, an outgoing stream or a multipart message being received. Write lock held */
+static bool requestIdInUse(IoTClient *iotClient, uint16_t id)
+{
+    if (iotClient->requestResponse.find(id) != NULL || iotClient->multiPartControl.count(id) > 0)
+        return true;
+
+    for (size_t i = 0; i < iotClient->streams.size(); i++)
+    {
+        if (iotClient->streams[i].request.id == id)
+            return true;
+    }
+    return false;
+}
+
+/* Sets the bit of `id` in requestIdsInUse. Write lock held */
+void IoTProtocol::claimRequestId(IoTClient *iotClient, uint16_t id)
+{
+    if (iotClient->requestIdsInUse != NULL)
+    {
+        iotClient->requestIdsInUse[id >> 6] |= (uint64_t)1 << (id & 63);
+    }
+}
+
+/* Clears the bit of `id` unless another transfer still names it (e.g. the multipart response of a pending request). Write lock held */
+void IoTProtocol::releaseRequestId(IoTClient *iotClient, uint16_t id)
+{
+    if (iotClient->requestIdsInUse != NULL && id != 0 && !requestIdInUse(iotClient, id))
+    {
+        iotClient->requestIdsInUse[id >> 6] &= ~((uint64_t)1 << (id & 63));
+    }
+}
+
+/* Sets requestIdsInUse from the streams and multipart messages, after requestResponse was cleared. Write lock held */
+void IoTProtocol::markRequestIds(IoTClient *iotClient)
+{
+    if (iotClient->requestIdsInUse == NULL)
+        return;
+
+    memset(iotClient->requestIdsInUse, 0, IOT_REQUEST_ID_WORDS * sizeof(uint64_t));
+    iotClient->requestIdsInUse[0] = 1; /* 0 is the alive request */
+    for (auto multiPart = iotClient->multiPartControl.begin(); multiPart != iotClient->multiPartControl.end(); ++multiPart)
+    {
+        this->claimRequestId(iotClient, multiPart->first);
+    }
+    for (size_t i = 0; i < iotClient->streams.size(); i++)
+    {
+        this->claimRequestId(iotClient, iotClient->streams[i].request.id);
+    }
+}
+
+uint16_t IoTProtocol::generateRequestId(IoTClient *iotClient)
+{
+    /*
+     * Next ID after the last one handed out, over 1..65535 (0 is the alive
+     * request). IDs in use are skipped (CREDIT frames and parts are matched
+     * by ID): requestIdsInUse is scanned a word (64 IDs) at a time, so a
+     * free ID is found in one step unless the IDs after the last one are
+     * taken, at worst in IOT_REQUEST_ID_WORDS steps.
+     */
+    IoTLockGuard guard(&iotClient->writeLock);
+    uint64_t *inUse = iotClient->requestIdsInUse;
+    if (inUse == NULL)
+    {
+        /* Not listened: nothing in flight */
+        uint16_t id = ++(iotClient->lastRequestId);
+        return (id != 0) ? id : ++(iotClient->lastRequestId);
+    }
+
+    uint16_t start = (uint16_t)(iotClient->lastRequestId + 1);
+    size_t word = start >> 6;
+    uint64_t available = ~inUse[word] & (~(uint64_t)0 << (start & 63)); /* IDs before `start` come last */
+    for (size_t i = 0; i <= IOT_REQUEST_ID_WORDS; i++)
+    {
+        if (available != 0)
+        {
+            uint16_t id = (uint16_t)((word << 6) + __builtin_ctzll(available));
+            iotClient->lastRequestId = id;
+            return id;
+        }
+        word = (word + 1) % IOT_REQUEST_ID_WORDS;
+        available = ~inUse[word];
+    }
+
+    throw "[IoTProtocol] No request ID available";
+}
+
+IoTRequest *IoTProtocol::signal(IoTRequest *request)
+{
+    request->method = EIoTMethod::SIGNAL;
+    return this->send(request, NULL);
+}
+
+IoTRequest *IoTProtocol::request(IoTRequest *request, IoTRequestResponse *requestResponse)
+{
+    request->method = EIoTMethod::REQUEST;
+    return this->send(request, requestResponse);
+}
+
+IoTRequest *IoTProtocol::response(IoTRequest *request)
+{
+    request->method = EIoTMethod::RESPONSE;
+    return this->send(request, NULL);
+}
+
+IoTRequest *IoTProtocol::streaming(IoTRequest *request, IoTRequestResponse *requestResponse)
+{
+    request->method = EIoTMethod::STREAMING;
+    return this->send(request, requestResponse);
+}
+
+IoTRequest *IoTProtocol::aliveRequest(IoTRequest *request, IoTRequestResponse *requestResponse)
+{
+    request->method = EIoTMethod::ALIVE_REQUEST;
+    request->id = 0;
+    freeRequest(request);
+    request->bodyLength = 0;
+    request->totalBodyLength = 0;
+    request->parts = 0;
+    return this->send(request, requestResponse);
+}
+
+IoTRequest *IoTProtocol::aliveResponse(IoTRequest *request)
+{
+    request->method = EIoTMethod::ALIVE_RESPONSE;
+    request->id = 0;
+    freeRequest(request);
+    request->bodyLength = 0;
+    request->totalBodyLength = 0;
+    request->parts = 0;
+    return this->send(request, NULL);
+}
+
+IoTRequest *IoTProtocol::bufferSizeRequest(IoTClient *iotClient, uint32_t size)
+{
+    if (iotClient->peerMaxBufferSize != 0 && size > iotClient->peerMaxBufferSize)
+    {
+        size = iotClient->peerMaxBufferSize;
+    }
+
+    // 2048 : [0, 0 , 8, 0], then the codec used from this frame on and the codecs decoded (v1 peers read the first 4 bytes only)
+    uint8_t body[6];
+    writeBigEndian(body, size, 4);
+    body[4] = (uint8_t)usableCodec(iotClient);
+    body[5] = IOT_BODY_CODECS;
+
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::BUFFER_SIZE_REQUEST,
+        0,
+        NULL,
+        IoTHeaders(),
+        body,
+        sizeof(body),
+        0,
+        0,
+        iotClient};
+
+    iotClient->bufferTuner.pending = true;
+    iotClient->bufferTuner.requestedAt = iotMicros();
+    return this->send(&request, NULL);
+}
+
+IoTRequest *IoTProtocol::bufferSizeResponse(IoTRequest *request)
+{
+    /* The size taken (at most this side's maximum: frames sent from now on use it), this side's maximum, the codec used from this frame on and the codecs decoded (v1 peers read the first 4 bytes only) */
+    uint32_t size = (uint32_t)readBigEndian(request->body, 4);
+    if (size > request->iotClient->maxBufferSize)
+    {
+        size = request->iotClient->maxBufferSize;
+    }
+    uint8_t body[10];
+    writeBigEndian(body, size, 4);
+    writeBigEndian(body + 4, request->iotClient->maxBufferSize, 4);
+    body[8] = (uint8_t)usableCodec(request->iotClient);
+    body[9] = IOT_BODY_CODECS;
+
+    IoTRequest response = {
+        IOT_VERSION,
+        EIoTMethod::BUFFER_SIZE_RESPONSE,
+        request->id,
+        NULL,
+        IoTHeaders(),
+        body,
+        sizeof(body),
+        0,
+        0,
+        request->iotClient};
+
+    return this->send(&response, NULL);
+}
+
+IoTRequest *IoTProtocol::credit(IoTClient *iotClient, uint16_t id, uint32_t bytes)
+{
+    uint8_t body[4];
+    writeBigEndian(body, bytes, 4);
+
+    IoTRequest request = {
+        IOT_VERSION,
+        EIoTMethod::CREDIT,
+        id,
+        NULL,
+        IoTHeaders(),
+        body,
+        4,
+        0,
+        0,
+        iotClient};
+
+    iotClient->streamStats.creditsSent++;
+    return this->send(&request, NULL);
+}
+
+/* Control bytes of a request, returns the size of its Body Length field (0 = no body) */
+static uint8_t controlBytes(IoTRequest *request, uint8_t *MSCB, uint8_t *LSCB)
+{
+    /* Version 2 only when enqueue encodes the headers with the header table */
+    *MSCB = ((request->version < IOT_VERSION_HEADER_TABLE) ? request->version : IOT_VERSION) << 2;
+    *LSCB = (uint8_t)(request->method) << 2;
+
+    *LSCB += (((request->headers.size() > 0) ? IOT_LSCB_HEADER : 0) + ((request->body != NULL || request->bodySource != NULL) ? IOT_LSCB_BODY : 0));
+
+    switch (request->method)
+    {
+    case EIoTMethod::SIGNAL:
+        *MSCB += (((request->path != NULL) ? IOT_MSCB_PATH : 0));
+        break;
+    case EIoTMethod::REQUEST:
+    case EIoTMethod::STREAMING:
+        *MSCB += ((IOT_MSCB_ID) + ((request->path != NULL) ? IOT_MSCB_PATH : 0));
+        break;
+    case EIoTMethod::RESPONSE:
+    case EIoTMethod::CREDIT:
+        *MSCB += ((IOT_MSCB_ID));
+        break;
+    default:
+        break;
+    }
+
+    return (*LSCB & IOT_LSCB_BODY) ? bodyLengthSizeOf(request->method) : 0;
+}
+
+/* Version 2 form of one header: its first byte (IOT_HEADER_*) and the table slot it adds to */
+struct IoTHeaderPlan
+{
+    uint8_t code;
+    uint8_t slot; /* IOT_HEADER_SLOT_NONE = not added */
+    uint32_t keyLength;
+    uint32_t valueLength;
+};
+
+/*
+ * Writes MSCB, LSCB, ID, PATH, HEADERs and Body Length into `data` and returns
+ * the prefix length. With `data` NULL only the length is computed. With `plan`
+ * the headers take the version 2 forms it says, one plan per header.
+ */
+static size_t encodePrefix(IoTRequest *request, uint8_t MSCB, uint8_t LSCB, uint8_t bodyLengthSize, uint8_t *data, const IoTHeaderPlan *plan = NULL)
+{
+    size_t nextIndex = 2;
+
+    if (data != NULL)
+    {
+        data[0] = MSCB;
+        data[1] = LSCB;
+    }
+
+    /* ID */
+    if (MSCB & IOT_MSCB_ID)
+    {
+        if (data != NULL)
+        {
+            writeBigEndian(data + nextIndex, request->id, 2);
+        }
+        nextIndex += 2;
+    }
+
+    /* PATH */
+    if (MSCB & IOT_MSCB_PATH)
+    {
+        size_t pathLength = strlen(request->path);
+        if (data != NULL)
+        {
+            memcpy(data + nextIndex, request->path, pathLength);
+            data[nextIndex + pathLength] = IOT_ETX;
+        }
+        nextIndex += pathLength + 1 /* (EXT) */;
+    }
+
+    /* HEADERs */
+    if (LSCB & IOT_LSCB_HEADER)
+    {
+        if (request->headers.size() > 255)
+        {
+            throw "[IoTProtocol] Too many headers. Maximum Headers is 255.";
+        }
+
+        if (data != NULL)
+        {
+            data[nextIndex] = request->headers.size() & 255;
+        }
+        nextIndex++;
+
+        for (auto header = request->headers.begin(); header != request->headers.end(); ++header)
+        {
+            const IoTHeaderPlan *form = NULL;
+            if (plan != NULL)
+            {
+                form = plan++;
+                if (data != NULL)
+                {
+                    data[nextIndex] = form->code;
+                }
+                nextIndex++;
+                if (form->code & IOT_HEADER_INDEXED)
+                {
+                    continue;
+                }
+                if (form->slot != IOT_HEADER_SLOT_NONE)
+                {
+                    if (data != NULL)
+                    {
+                        data[nextIndex] = form->slot;
+                    }
+                    nextIndex++;
+                }
+                if (form->code & IOT_HEADER_STATIC)
+                {
+                    size_t valueLength = form->valueLength;
+                    if (data != NULL)
+                    {
+                        memcpy(data + nextIndex, header->second, valueLength);
+                        data[nextIndex + valueLength] = IOT_ETX;
+                    }
+                    nextIndex += valueLength + 1; /* + 1 (EXT) */
+                    continue;
+                }
+            }
+
+            size_t keyLength = (form != NULL) ? form->keyLength : strlen(header->first);
+            size_t valueLength = (form != NULL) ? form->valueLength : strlen(header->second);
+            if (data != NULL)
+            {
+                memcpy(data + nextIndex, header->first, keyLength);
+                data[nextIndex + keyLength] = IOT_RS;
+                memcpy(data + nextIndex + keyLength + 1, header->second, valueLength);
+                data[nextIndex + keyLength + 1 + valueLength] = IOT_ETX;
+            }
+            nextIndex += keyLength + valueLength + 2; /* + 1 (RS) + 1 (EXT) */
+        }
+    }
+
+    /* BODY */
+    if (data != NULL)
+    {
+        writeBigEndian(data + nextIndex, request->bodyLength, bodyLengthSize);
+    }
+    nextIndex += bodyLengthSize;
+
+    return nextIndex;
+}
+
+IoTRequest *IoTProtocol::send(IoTRequest *request, IoTRequestResponse *requestResponse)
+{
+    return this->enqueue(request, requestResponse, false);
+}
+
+EIoTSendResult IoTProtocol::trySend(IoTRequest *request, IoTRequestResponse *requestResponse)
+{
+    return (this->enqueue(request, requestResponse, true) != NULL) ? EIoTSendResult::QUEUED : EIoTSendResult::WOULD_BLOCK;
+}
+
+IoTRequest *IoTProtocol::enqueue(IoTRequest *request, IoTRequestResponse *requestResponse, bool nonBlocking)
+{
+    if (request->version == 0)
+    {
+        request->version = IOT_VERSION;
+    }
+
+    uint8_t MSCB, LSCB;
+    uint8_t bodyLengthSize = controlBytes(request, &MSCB, &LSCB);
+
+    if ((MSCB & IOT_MSCB_ID) && request->id == 0)
+    {
+        request->id = this->generateRequestId(request->iotClient);
+    }
+
+    /* Header table: the headers are planned once, the frame goes out as version 2 */
+    IoTClient *iotClient = request->iotClient;
+
+    /* Checked again by transmit: turned down here, no table entry is planned for it (they would freeze the table) */
+    if (requestResponse != NULL && iotClient->requestResponse.full() && iotClient->requestResponse.find(request->id) == NULL)
+    {
+        return NULL;
+    }
+    size_t headerCount = (iotClient->headerCompression && request->headers.size() <= 255) ? request->headers.size() : 0;
+    IoTHeaderPlan plan[(headerCount > 0) ? headerCount : 1];
+
+    /* Entries the frame adds are settled once transmit returns, or throws (they may never reach the peer) */
+    struct Settle
+    {
+        IoTProtocol *protocol;
+        IoTClient *iotClient;
+        bool inserted;
+        bool transmitted;
+        ~Settle()
+        {
+            if (this->inserted)
+            {
+                this->protocol->settleHeaders(this->iotClient, this->transmitted);
+            }
+        }
+    } settle = {this, iotClient, false, false};
+
+    if (headerCount > 0)
+    {
+        /* trySend adds none: a WOULD_BLOCK frame never goes out */
+        settle.inserted = (this->planHeaders(iotClient, request, plan, !nonBlocking) > 0);
+        MSCB = (MSCB & (IOT_MSCB_ID | IOT_MSCB_PATH)) | (IOT_VERSION_HEADER_TABLE << 2);
+    }
+
+    size_t prefixLength = encodePrefix(request, MSCB, LSCB, bodyLengthSize, NULL, (headerCount > 0) ? plan : NULL);
+    size_t frameSize = iotClient->bufferSize; /* The tuner may change it meanwhile: `data` is sized on this one */
+    if (prefixLength >= frameSize)
+    {
+        throw "[IoTProtocol] Path and Headers too big.";
+    }
+
+    /* Record Data */
+
+    size_t bodyLength = (LSCB & IOT_LSCB_BODY) ? request->bodyLength : 0;
+    size_t dataLength = std::min(frameSize, prefixLength + bodyLength) + IOT_BODY_BLOCK_HEADER; /* Room for a block header (IoTClient::bodyCodec) */
+
+    uint8_t data[dataLength + 1]; /* +1 => (\0) */
+    encodePrefix(request, MSCB, LSCB, bodyLengthSize, data, (headerCount > 0) ? plan : NULL);
+
+    IoTRequest *sent = this->transmit(request, requestResponse, data, dataLength, prefixLength, bodyLength, nonBlocking);
+    settle.transmitted = (sent != NULL);
+    return sent;
+}
+
+/*
+ * Version 2 form of each header of `request`: a confirmed slot of the header
+ * table when it holds the header, otherwise the static key or text, added to
+ * the table when `mayInsert` and it fits. Returns the entries added.
+ */
+uint8_t IoTProtocol::planHeaders(IoTClient *iotClient, IoTRequest *request, IoTHeaderPlan *plan, bool mayInsert)
+{
+    IoTLockGuard guard(&iotClient->writeLock);
+
+    IoTHeaderTable *table = this->headerTableOf(iotClient, &iotClient->headerTable);
+    if (table != NULL && table->unsent == 0 && iotClient->outbound.empty() && iotClient->streams.empty())
+    {
+        /* Every frame adding entries was taken by the transport, ahead of this one */
+        table->confirmed = table->size();
+    }
+    bool useTable = (table != NULL && !table->frozen);
+
+    uint8_t inserted = 0;
+    size_t plainBytes = 0;
+    size_t encodedBytes = 0;
+    size_t indexed = 0;
+    for (auto header = request->headers.begin(); header != request->headers.end(); ++header, ++plan)
+    {
+        size_t keyLength = strlen(header->first);
+        size_t valueLength = strlen(header->second);
+        uint32_t keyHash = IoTHeaderKeys::hash(header->first, keyLength);
+        uint8_t keyId = IoTHeaderKeys::find(header->first, keyLength, keyHash);
+        bool keyed = (keyId < IOT_HEADER_STATIC_KEYS);
+        plainBytes += keyLength + valueLength + 2;
+
+        plan->code = keyed ? (uint8_t)(IOT_HEADER_STATIC | keyId) : (uint8_t)IOT_HEADER_LITERAL;
+        plan->slot = IOT_HEADER_SLOT_NONE;
+        plan->keyLength = (uint32_t)keyLength;
+        plan->valueLength = (uint32_t)valueLength;
+        if (useTable)
+        {
+            int slot = table->find(IoTHeaderTable::hash(keyHash, header->second, valueLength),
+                                   header->first, keyLength, header->second, valueLength);
+            if (slot >= 0 && slot < table->confirmed)
+            {
+                plan->code = (uint8_t)(IOT_HEADER_INDEXED | slot);
+                encodedBytes++;
+                indexed++;
+                continue;
+            }
+
+            /* Still unconfirmed: sent as is until it is */
+            if (slot < 0 && mayInsert && table->fits(keyLength, valueLength))
+            {
+                plan->slot = table->size();
+                table->insert(plan->slot, header->first, keyLength, header->second, valueLength);
+                plan->code |= keyed ? IOT_HEADER_STATIC_INSERT : IOT_HEADER_LITERAL_INSERT;
+                inserted++;
+            }
+        }
+        encodedBytes += ((plan->slot != IOT_HEADER_SLOT_NONE) ? 2 : 1) + (keyed ? 0 : keyLength + 1) + valueLength + 1;
+    }
+
+    if (inserted > 0)
+    {
+        table->unsent++;
+    }
+    iotClient->headerStats.frames++;
+    iotClient->headerStats.plainBytes += plainBytes;
+    iotClient->headerStats.encodedBytes += encodedBytes;
+    iotClient->headerStats.indexed += indexed;
+    iotClient->headerStats.inserted += inserted;
+    return inserted;
+}
+
+/* A frame that added header table entries was handed to transmit, which returned (`transmitted`) or threw */
+void IoTProtocol::settleHeaders(IoTClient *iotClient, bool transmitted)
+{
+    IoTLockGuard guard(&iotClient->writeLock);
+    IoTHeaderTable *table = iotClient->headerTable;
+    if (table == NULL)
+    {
+        return; /* Freed by unlisten meanwhile */
+    }
+    if (table->unsent > 0)
+    {
+        table->unsent--;
+    }
+    if (!transmitted)
+    {
+        /* Whether the peer got them is unknown: its table and this one may differ from now on */
+        table->frozen = true;
+    }
+}
+
+IoTRequestTemplate IoTProtocol::compile(IoTRequest *request)
+{
+    IoTRequestTemplate requestTemplate = IoTRequestTemplate();
+
+    if (request->version == 0)
+    {
+        request->version = IOT_VERSION;
+    }
+
+    uint8_t MSCB, LSCB;
+    requestTemplate.method = request->method;
+    requestTemplate.bodyLengthSize = controlBytes(request, &MSCB, &LSCB);
+    requestTemplate.prefixLength = encodePrefix(request, MSCB, LSCB, requestTemplate.bodyLengthSize, NULL);
+
+    requestTemplate.prefix = (uint8_t *)malloc(requestTemplate.prefixLength);
+    if (requestTemplate.prefix == NULL)
+    {
+        throw "[IoTProtocol] Out of memory for request template";
+    }
+    encodePrefix(request, MSCB, LSCB, requestTemplate.bodyLengthSize, requestTemplate.prefix);
+
+    requestTemplate.idOffset = (MSCB & IOT_MSCB_ID) ? 2 : 0;
+    requestTemplate.bodyLengthOffset = requestTemplate.prefixLength - requestTemplate.bodyLengthSize;
+
+    if (MSCB & IOT_MSCB_PATH)
+    {
+        size_t pathLength = strlen(request->path);
+        requestTemplate.path = (char *)malloc(pathLength + 1);
+        if (requestTemplate.path == NULL)
+        {
+            free(requestTemplate.prefix);
+            throw "[IoTProtocol] Out of memory for request template";
+        }
+        memcpy(requestTemplate.path, request->path, pathLength + 1);
+    }
+
+    return requestTemplate;
+}
+
+IoTRequest *IoTProtocol::send(IoTRequestTemplate *requestTemplate, IoTRequest *request, IoTRequestResponse *requestResponse)
 {
-    request->method = EIoTMethod::RESPONSE;
-    return this->send(request, NULL);
+    return this->enqueue(requestTemplate, request, requestResponse, false);
 }
 
-IoTRequest *IoTProtocol::streaming(IoTRequest *request, IoTRequestResponse *requestResponse)
+EIoTSendResult IoTProtocol::trySend(IoTRequestTemplate *requestTemplate, IoTRequest *request, IoTRequestResponse *requestResponse)
 {
-    request->method = EIoTMethod::STREAMING;
-    return this->send(request, requestResponse);
+    return (this->enqueue(requestTemplate, request, requestResponse, true) != NULL) ? EIoTSendResult::QUEUED : EIoTSendResult::WOULD_BLOCK;
 }
 
-IoTRequest *IoTProtocol::aliveRequest(IoTRequest *request, IoTRequestResponse *requestResponse)
+IoTRequest *IoTProtocol::enqueue(IoTRequestTemplate *requestTemplate, IoTRequest *request, IoTRequestResponse *requestResponse, bool nonBlocking)
 {
-    request->method = EIoTMethod::ALIVE_REQUEST;
-    request->id = 0;
-    freeRequest(request);
-    request->bodyLength = 0;
-    request->totalBodyLength = 0;
-    request->parts = 0;
-    return this->send(request, requestResponse);
+    size_t frameSize = request->iotClient->bufferSize;
+    if (requestTemplate->prefixLength >= frameSize)
+    {
+        throw "[IoTProtocol] Path and Headers too big.";
+    }
+
+    request->version = requestTemplate->prefix[0] >> 2;
+    request->method = requestTemplate->method;
+    request->path = requestTemplate->path;
+
+    if (requestTemplate->idOffset != 0 && request->id == 0)
+    {
+        request->id = this->generateRequestId(request->iotClient);
+    }
+
+    size_t bodyLength = (requestTemplate->bodyLengthSize > 0) ? request->bodyLength : 0;
+    size_t dataLength = std::min(frameSize, requestTemplate->prefixLength + bodyLength) + IOT_BODY_BLOCK_HEADER;
+
+    /* The template stays untouched (shareable across clients): ID and Body Length are patched on the copy */
+    uint8_t data[dataLength + 1]; /* +1 => (\0) */
+    memcpy(data, requestTemplate->prefix, requestTemplate->prefixLength);
+    if (requestTemplate->idOffset != 0)
+    {
+        writeBigEndian(data + requestTemplate->idOffset, request->id, 2);
+    }
+    writeBigEndian(data + requestTemplate->bodyLengthOffset, bodyLength, requestTemplate->bodyLengthSize);
+
+    return this->transmit(request, requestResponse, data, dataLength, requestTemplate->prefixLength, bodyLength, nonBlocking);
 }
 
-IoTRequest *IoTProtocol::aliveResponse(IoTRequest *request)
+void IoTProtocol::freeTemplate(IoTRequestTemplate *requestTemplate)
 {
-    request->method = EIoTMethod::ALIVE_RESPONSE;
-    request->id = 0;
-    freeRequest(request);
-    request->bodyLength = 0;
-    request->totalBodyLength = 0;
-    request->parts = 0;
-    return this->send(request, NULL);
+    free(requestTemplate->prefix);
+    free(requestTemplate->path);
+    requestTemplate->prefix = NULL;
+    requestTemplate->path = NULL;
+    requestTemplate->prefixLength = 0;
 }
 
-IoTRequest *IoTProtocol::bufferSizeRequest(IoTClient *iotClient, uint32_t size)
+IoTRequest *IoTProtocol::transmit(IoTRequest *request, IoTRequestResponse *requestResponse, uint8_t *data, size_t frameSize, size_t prefixLength, size_t bodyLength, bool nonBlocking)
 {
-    // 2048 : [0, 0 , 8, 0]
-    uint8_t body[4];
-    for (uint8_t i = 0; i < 4; i++)
+    IoTClient *iotClient = request->iotClient;
+
+    /* No room to track the response: not sent (maxPendingRequests) */
+    if (requestResponse != NULL && iotClient->requestResponse.full() && iotClient->requestResponse.find(request->id) == NULL)
     {
-        body[i] = (size >> (24 - (i * 8))) & (0xFF);
+        return NULL;
     }
-    // body[0] = size >> 24 & (0xFF);
-    // body[1] = size >> 16 & (0xFF);
-    // body[2] = size >> 8 & (0xFF);
-    // body[3] = size & (0xFF);
 
-    IoTRequest request = {
-        IOT_VERSION,
-        EIoTMethod::BUFFER_SIZE_REQUEST,
-        0,
-        NULL,
-        std::map<char *, char *>(),
-        body,
-        4,
-        0,
-        0,
-        iotClient};
-    IoTRequestResponse onResponse = {
-        &(this->onBufferSizeResponse),
-        NULL};
-    return this->send(&request, &onResponse);
+    size_t queued;
+    bool highWater;
+    size_t sent = 0;
+    unsigned long startedAt = 0;
+    {
+        IoTLockGuard guard(&iotClient->writeLock);
+
+        /* Parts follow the size in use now, `data` was sized before the lock (frameSize) */
+        size_t blockHeader = bodyEncoded(iotClient->sendCodec, data[1]) ? IOT_BODY_BLOCK_HEADER : 0;
+        if (prefixLength + blockHeader >= iotClient->bufferSize)
+        {
+            throw "[IoTProtocol] Path and Headers too big.";
+        }
+        size_t partBodySpace = iotClient->bufferSize - prefixLength;
+        size_t sliceLength = sliceLengthOf(partBodySpace, blockHeader); /* Body bytes per part */
+        EIoTPriority priority = priorityOf(request);
+
+        /* Multipart with an ID: a stream, its parts take turns with the other streams (IoTClient::streamWindow) */
+        bool streamed = (iotClient->streamWindow > 0 && bodyLength > sliceLength &&
+                         request->method >= EIoTMethod::REQUEST && request->method <= EIoTMethod::STREAMING);
+
+        /* Frame for parts larger than `data`, released however this returns */
+        IoTAllocationGuard grownGuard(this->allocatorOf(iotClient));
+        if (!streamed && blockHeader + std::min(bodyLength, sliceLength) > frameSize - prefixLength)
+        {
+            uint8_t *grown = (uint8_t *)grownGuard.allocate(prefixLength + partBodySpace + 1);
+            if (grown == NULL)
+            {
+                throw "[IoTProtocol] Out of memory for frame";
+            }
+            memcpy(grown, data, prefixLength);
+            data = grown;
+        }
+
+        if (streamed)
+        {
+            /* Frame first: nothing of the stream is recorded until it has one, and it is released if registering fails */
+            IoTAllocationGuard frameGuard(this->allocatorOf(iotClient));
+            size_t frameCapacity = prefixLength + partBodySpace + 1;
+            uint8_t *frame = (uint8_t *)frameGuard.allocate(frameCapacity);
+            if (frame == NULL)
+            {
+                throw "[IoTProtocol] Out of memory for stream";
+            }
+            memcpy(frame, data, prefixLength);
+
+            IoTStream stream;
+            stream.request = *request;
+            stream.request.headers.clear();
+            stream.onPartSent = (requestResponse != NULL) ? requestResponse->onPartSent : NULL;
+            stream.frame = frame;
+            stream.frameCapacity = frameCapacity;
+            stream.prefixLength = prefixLength;
+            stream.sent = 0;
+            stream.credit = iotClient->streamWindow;
+            stream.creditAt = iotMillis();
+            iotClient->streams.push_back(stream);
+            this->claimRequestId(iotClient, request->id);
+            frameGuard.release(); /* Owned by the stream now, dropStream frees it */
+            request->parts = 0; /* Reported by onPartSent as they go out */
+
+            this->pumpStreams(iotClient);
+        }
+        else if (nonBlocking)
+        {
+            /* Everything has to fit on the queue of its class, whatever the transport takes right now */
+            size_t parts = (bodyLength == 0) ? 1 : (bodyLength + sliceLength - 1) / sliceLength;
+            size_t total = parts * (prefixLength + blockHeader + sizeof(IoTQueuedFrame)) + bodyLength;
+            if (!iotClient->outbound.empty())
+            {
+                this->flushOutbound(iotClient);
+            }
+            IoTRingBuffer *queue = &(iotClient->priorityQueues[(uint8_t)priority - 1]);
+            size_t space = (queue->capacity() > 0) ? queue->space() : iotClient->outboundCapacity;
+            if (total > space)
+            {
+                return NULL;
+            }
+        }
+
+        /* A size switch applies from this frame on: it may not overtake the frames queued before it */
+        if (request->method == EIoTMethod::BUFFER_SIZE_REQUEST || request->method == EIoTMethod::BUFFER_SIZE_RESPONSE)
+        {
+            this->drainOutbound(iotClient);
+        }
+
+        if (!streamed)
+        {
+            if (bodyLength > sliceLength)
+            {
+                startedAt = iotMicros();
+            }
+
+            /* Every part repeats the prefix and carries the next slice of the body, up to bufferSize */
+            size_t i = 0;
+            size_t parts = 0;
+            do
+            {
+                size_t partLength = bodyLength - i;
+                if (partLength > sliceLength)
+                {
+                    partLength = sliceLength;
+                }
+
+                if (parts > 1) /* Schedule next alive request after send all data only if is a multipart */
+                {
+                    /* Cancel and Schedule next alive request */
+                    this->scheduleNextAliveRequest(iotClient);
+                }
+
+                const uint8_t *body;
+                if (request->bodySource != NULL)
+                {
+                    /* Pulled now, into the room after the prefix (and block header) unless the source has it in memory */
+                    body = request->bodySource->read(i, partLength, data + prefixLength + blockHeader);
+                    if (body == NULL)
+                    {
+                        throw "[IoTProtocol] Body source failed";
+                    }
+                }
+                else
+                {
+                    body = request->body + i;
+                }
+
+                this->queuePart(iotClient, priority, data, prefixLength, body, partLength);
+                i += partLength;
+
+                if (requestResponse != NULL && requestResponse->onPartSent != NULL)
+                {
+                    (*(requestResponse->onPartSent))(request, i, parts);
+                }
+
+                parts++;
+            } while (i < bodyLength);
+
+            request->parts = parts;
+
+            if (bodyLength > 0)
+            {
+                iotClient->bufferStats.parts += parts;
+                iotClient->bufferStats.prefixBytes += parts * prefixLength;
+                iotClient->bufferStats.bodyBytes += bodyLength;
+            }
+            sent = parts;
+        }
+
+        /* Frames after this one go out with the size and the body codec it announces (the peer switches when it reads it) */
+        if ((request->method == EIoTMethod::BUFFER_SIZE_REQUEST || request->method == EIoTMethod::BUFFER_SIZE_RESPONSE) && bodyLength >= 4)
+        {
+            iotClient->bufferSize = announcedBufferSize(request->body);
+            iotClient->sendCodec = announcedCodec(request->body, bodyLength, (request->method == EIoTMethod::BUFFER_SIZE_REQUEST) ? 4 : 8);
+        }
+
+        /* Backpressure: reported once per crossing, flushing below the mark rearms it */
+        queued = queuedBytes(iotClient);
+        highWater = (queued >= iotClient->outboundHighWater && !iotClient->aboveHighWater);
+        if (highWater)
+        {
+            iotClient->aboveHighWater = true;
+        }
+    }
+
+    if (highWater && iotClient->onHighWater != NULL)
+    {
+        (*(iotClient->onHighWater))(iotClient, queued);
+    }
+
+    if (sent > 1 && iotClient->bufferTuner.enabled)
+    {
+        this->tuneBufferSize(iotClient, bodyLength, sent, iotMicros() - startedAt);
+    }
+
+    if (requestResponse != NULL)
+    {
+        if (requestResponse->timeout == 0)
+        {
+            requestResponse->timeout = this->timeout;
+        }
+        requestResponse->timeout += iotMillis();
+        requestResponse->request = *request;
+
+        iotClient->requestResponse.insert(request->id, *requestResponse, requestResponse->timeout);
+
+        IoTLockGuard guard(&iotClient->writeLock);
+        this->claimRequestId(iotClient, request->id);
+    }
+
+    this->readClient(iotClient);
+
+    return request;
 }
 
-IoTRequest *IoTProtocol::bufferSizeResponse(IoTRequest *request)
+/* Adapts bufferSize to the multipart send that just went out (see IoTBufferTuner) */
+void IoTProtocol::tuneBufferSize(IoTClient *iotClient, size_t bodyLength, size_t parts, unsigned long elapsed)
 {
-    IoTRequest response = {
-        IOT_VERSION,
-        EIoTMethod::BUFFER_SIZE_RESPONSE,
-        request->id,
-        NULL,
-        std::map<char *, char *>(),
-        request->body,
-        request->bodyLength,
-        0,
-        0,
-        request->iotClient};
+    IoTBufferTuner *tuner = &(iotClient->bufferTuner);
+    IoTBufferStats *stats = &(iotClient->bufferStats);
 
-    return this->send(&response, NULL);
+    /* Samples of another size do not count */
+    if (stats->size != iotClient->bufferSize)
+    {
+        stats->size = iotClient->bufferSize;
+        stats->partMicros = 0;
+        stats->throughput = 0;
+        tuner->sampled = 0;
+    }
+
+    uint32_t partMicros = (uint32_t)(elapsed / parts);
+    uint32_t throughput = (uint32_t)((uint64_t)bodyLength * 1000 / (elapsed > 0 ? elapsed : 1));
+    stats->partMicros = (stats->partMicros == 0) ? partMicros : (3 * stats->partMicros + partMicros) / 4;
+    stats->throughput = (stats->throughput == 0) ? throughput : (uint32_t)(((uint64_t)3 * stats->throughput + throughput) / 4);
+
+    /* A response that never came does not hold the tuner forever */
+    if (tuner->pending && (iotMicros() - tuner->requestedAt) / 1000 > this->timeout)
+    {
+        tuner->pending = false;
+    }
+
+    uint16_t samples = (tuner->samples != 0) ? tuner->samples : 4;
+    if (++(tuner->sampled) < samples || tuner->pending)
+    {
+        return;
+    }
+    tuner->sampled = 0;
+
+    /* The peer maximum comes with the response: ask for the current size first */
+    if (!tuner->probed && iotClient->peerMaxBufferSize == 0)
+    {
+        tuner->probed = true;
+        this->bufferSizeRequest(iotClient, iotClient->bufferSize);
+        return;
+    }
+
+    uint32_t size = iotClient->bufferSize;
+    uint32_t low = (tuner->minSize != 0) ? tuner->minSize : IOT_PROTOCOL_DEFAULT_BUFFER_SIZE;
+    uint32_t high = iotClient->maxBufferSize;
+    if (tuner->maxSize != 0 && tuner->maxSize < high)
+    {
+        high = tuner->maxSize;
+    }
+    if (iotClient->peerMaxBufferSize != 0 && iotClient->peerMaxBufferSize < high)
+    {
+        high = iotClient->peerMaxBufferSize;
+    }
+
+    uint32_t next = size;
+    if (tuner->maxPartMicros != 0 && stats->partMicros > tuner->maxPartMicros)
+    {
+        next = std::max(size / 2, low);
+        tuner->ceiling = size;
+    }
+    else if (tuner->previousSize != 0 && tuner->previousSize < size && (uint64_t)stats->throughput * 10 < (uint64_t)tuner->previousThroughput * 9)
+    {
+        /* Growing did not pay off: back, and no further than this */
+        next = tuner->previousSize;
+        tuner->ceiling = size;
+    }
+    else if (size < high && (tuner->ceiling == 0 || size * 2 < tuner->ceiling))
+    {
+        next = std::min(size * 2, high);
+    }
+
+    if (next == size)
+    {
+        return;
+    }
+
+    tuner->previousSize = size;
+    tuner->previousThroughput = stats->throughput;
+    stats->resizes++;
+    this->bufferSizeRequest(iotClient, next);
 }
 
-IoTRequest *IoTProtocol::send(IoTRequest *request, IoTRequestResponse *requestResponse)
+/*
+ * Writes one frame straight to the transport when nothing is queued before it,
+ * committing what it does not take to outbound. Otherwise the frame waits in
+ * the queue of its class.
+ */
+void IoTProtocol::queueFrame(IoTClient *iotClient, EIoTPriority priority, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength)
 {
+    if (iotClient->coalescer.micros > 0 && this->coalesceFrame(iotClient, prefix, prefixLength, body, bodyLength))
+    {
+        iotClient->priorityStats[(uint8_t)priority - 1].direct++;
+        return;
+    }
 
-    if (request->version == 0)
+    if (!iotClient->outbound.empty())
     {
-        request->version = IOT_VERSION;
+        if (this->queueClassFrame(iotClient, priority, prefix, prefixLength, body, bodyLength))
+            return;
+
+        /* Larger than its class queue: goes out as bytes once everything before it did */
+        if (!this->drainOutbound(iotClient))
+            return;
+    }
+
+    iotClient->priorityStats[(uint8_t)priority - 1].direct++;
+    iotClient->coalesceStats.writes++;
+    iotClient->coalesceStats.frames++;
+    size_t written = this->writeFrame(iotClient, prefix, prefixLength, body, bodyLength);
+    if (written >= prefixLength + bodyLength)
+        return;
+
+    if (written < prefixLength)
+    {
+        this->queueBytes(iotClient, prefix + written, prefixLength - written);
+        written = prefixLength;
     }
+    this->queueBytes(iotClient, body + (written - prefixLength), bodyLength - (written - prefixLength));
+}
 
-    uint8_t MSCB = request->version << 2;
-    uint8_t LSCB = (uint8_t)(request->method) << 2;
+/* Packs a frame with the ones waiting to share a write. false = it goes out as usual, after the ones waiting (written now) */
+bool IoTProtocol::coalesceFrame(IoTClient *iotClient, const uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength)
+{
+    IoTCoalescer *coalescer = &(iotClient->coalescer);
+    size_t length = prefixLength + bodyLength;
+    size_t limit = iotClient->bufferSize;
+    unsigned long now = iotMicros();
+
+    /* No room, deadline passed or a frame that goes straight out: what waits goes first */
+    if (coalescer->length > 0 &&
+        (coalescer->length + length > limit || coalescer->capacity < limit || length > limit / 2 ||
+         now - coalescer->firstAt >= coalescer->micros))
+    {
+        this->writeCoalesced(iotClient);
+    }
 
-    uint8_t bodyLengthSize = 2;
+    /* Copying large frames would cost more than the write saved. Anything queued goes before */
+    if (length > limit / 2 || !iotClient->outbound.empty())
+        return false;
 
-    LSCB += (((request->headers.size() > 0) ? IOT_LSCB_HEADER : 0) + ((request->body != NULL) ? IOT_LSCB_BODY : 0));
+    if (coalescer->capacity < limit)
+    {
+        IoTAllocator *allocator = this->allocatorOf(iotClient);
+        if (coalescer->buffer != NULL)
+        {
+            allocator->deallocate(coalescer->buffer);
+        }
+        coalescer->buffer = (uint8_t *)allocator->allocate(limit);
+        coalescer->capacity = (coalescer->buffer != NULL) ? (uint32_t)limit : 0;
+        if (coalescer->buffer == NULL)
+            return false;
+    }
 
-    switch (request->method)
+    if (coalescer->length == 0)
     {
-    case EIoTMethod::SIGNAL:
-        MSCB += (((request->path != NULL) ? IOT_MSCB_PATH : 0));
+        coalescer->firstAt = now;
+        coalescer->offsets = 0;
+    }
+    else
+    {
+        coalescer->offsets += now - coalescer->firstAt;
+    }
 
-        bodyLengthSize = 1;
-        break;
-    case EIoTMethod::REQUEST:
-        MSCB += ((IOT_MSCB_ID) + ((request->path != NULL) ? IOT_MSCB_PATH : 0));
-        break;
-    case EIoTMethod::RESPONSE:
-        MSCB += ((IOT_MSCB_ID));
-        break;
-    case EIoTMethod::STREAMING:
-        MSCB += ((IOT_MSCB_ID) + ((request->path != NULL) ? IOT_MSCB_PATH : 0));
+    memcpy(coalescer->buffer + coalescer->length, prefix, prefixLength);
+    if (bodyLength > 0)
+    {
+        memcpy(coalescer->buffer + coalescer->length + prefixLength, body, bodyLength);
+    }
+    coalescer->length += (uint32_t)length;
+    coalescer->frames++;
+    return true;
+}
 
-        bodyLengthSize = 4;
-        break;
-    case EIoTMethod::ALIVE_REQUEST:
-    case EIoTMethod::ALIVE_RESPONSE:
-        bodyLengthSize = 0;
-        break;
-    case EIoTMethod::BUFFER_SIZE_REQUEST:
-    case EIoTMethod::BUFFER_SIZE_RESPONSE:
-        bodyLengthSize = 1;
+/* Writes the coalesced frames in one go, committing what the transport does not take to outbound. Returns the bytes written */
+size_t IoTProtocol::writeCoalesced(IoTClient *iotClient)
+{
+    IoTCoalescer *coalescer = &(iotClient->coalescer);
+    size_t length = coalescer->length;
+    if (length == 0)
+        return 0;
+
+    unsigned long waited = iotMicros() - coalescer->firstAt;
+    IoTCoalesceStats *stats = &(iotClient->coalesceStats);
+    stats->writes++;
+    stats->frames += coalescer->frames;
+    stats->coalesced += coalescer->frames;
+    stats->delayMicros += (uint64_t)coalescer->frames * waited - coalescer->offsets;
+    if (waited > stats->maxDelayMicros)
+    {
+        stats->maxDelayMicros = (uint32_t)waited;
+    }
+    coalescer->length = 0;
+    coalescer->frames = 0;
+
+    size_t written = iotClient->client->write(coalescer->buffer, length);
+    if (written < length)
+    {
+        this->queueBytes(iotClient, coalescer->buffer + written, length - written);
+        return written;
+    }
+    return length;
+}
+
+/*
+ * queueFrame for a part of a message: with the body codec in use, the block
+ * header goes in the room after the prefix and the payload is the part
+ * compressed, or the part itself when it does not shrink.
+ */
+void IoTProtocol::queuePart(IoTClient *iotClient, EIoTPriority priority, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength)
+{
+    if (!bodyEncoded(iotClient->sendCodec, prefix[1]))
+    {
+        this->queueFrame(iotClient, priority, prefix, prefixLength, body, bodyLength);
+        return;
+    }
+
+    const uint8_t *payload;
+    size_t payloadLength = this->encodeBody(iotClient, body, bodyLength, &payload);
+    uint16_t block = (uint16_t)payloadLength | ((payload == body) ? IOT_BODY_BLOCK_STORED : 0);
+    writeBigEndian(prefix + prefixLength, block, IOT_BODY_BLOCK_HEADER);
+    this->queueFrame(iotClient, priority, prefix, prefixLength + IOT_BODY_BLOCK_HEADER, payload, payloadLength);
+}
+
+/* Payload of the block of a part: compressed into codecBuffer, or `body` itself (stored). Returns its length */
+size_t IoTProtocol::encodeBody(IoTClient *iotClient, const uint8_t *body, size_t bodyLength, const uint8_t **payload)
+{
+    IoTCodecStats *stats = &(iotClient->codecStats);
+    stats->parts++;
+    stats->rawBytes += bodyLength;
+    *payload = body;
+
+    size_t window = (iotClient->bodyCodecWindow != 0) ? iotClient->bodyCodecWindow : IOT_LZ_DEFAULT_WINDOW;
+    size_t tableSize = iotLzTableSize(window);
+    size_t capacity = tableSize + iotClient->bufferSize;
+    if (capacity > iotClient->codecCapacity && bodyLength >= IOT_LZ_MIN_INPUT)
+    {
+        /* Out of memory: parts go stored */
+        this->freeCodecBuffer(iotClient);
+        iotClient->codecBuffer = (uint8_t *)this->allocatorOf(iotClient)->allocate(capacity);
+        iotClient->codecCapacity = (iotClient->codecBuffer != NULL) ? capacity : 0;
+    }
+
+    size_t encoded = 0;
+    if (iotClient->codecBuffer != NULL && bodyLength >= IOT_LZ_MIN_INPUT)
+    {
+        /* Only worth it when smaller */
+        encoded = iotLzCompress(body, bodyLength, iotClient->codecBuffer + tableSize, bodyLength - 1,
+                                (uint16_t *)iotClient->codecBuffer, window);
+    }
+
+    if (encoded == 0)
+    {
+        stats->stored++;
+        stats->encodedBytes += IOT_BODY_BLOCK_HEADER + bodyLength;
+        return bodyLength;
+    }
+    stats->encodedBytes += IOT_BODY_BLOCK_HEADER + encoded;
+    *payload = iotClient->codecBuffer + tableSize;
+    return encoded;
+}
+
+/* Compressed block of a received part, decoded into the decoder's buffer. NULL = corrupt or out of memory */
+uint8_t *IoTProtocol::decodeBody(IoTClient *iotClient, const uint8_t *block, size_t blockLength, size_t *bodyLength)
+{
+    IoTDecoder *decoder = &(iotClient->decoder);
+    IoTCodecStats *stats = &(iotClient->codecStats);
+    stats->decoded++;
+
+    /* A part is never larger than a frame, plus the terminator of EIoTDecodeMode::VIEW */
+    size_t capacity = iotClient->receiveBufferSize + 1;
+    if (capacity > decoder->decodedCapacity)
+    {
+        IoTAllocator *allocator = this->allocatorOf(iotClient);
+        if (decoder->decoded != NULL)
+        {
+            allocator->deallocate(decoder->decoded);
+        }
+        decoder->decoded = (uint8_t *)allocator->allocate(capacity);
+        decoder->decodedCapacity = (decoder->decoded != NULL) ? capacity : 0;
+    }
+
+    if (decoder->decoded == NULL ||
+        !iotLzDecompress(block, blockLength, decoder->decoded, decoder->decodedCapacity - 1, bodyLength))
+    {
+        stats->errors++;
+        return NULL;
     }
+    return decoder->decoded;
+}
 
-    /* Sum Total Data Length */
+void IoTProtocol::freeCodecBuffer(IoTClient *iotClient)
+{
+    if (iotClient->codecBuffer != NULL)
+    {
+        this->allocatorOf(iotClient)->deallocate(iotClient->codecBuffer);
+    }
+    iotClient->codecBuffer = NULL;
+    iotClient->codecCapacity = 0;
+}
 
-    size_t dataLength = 2;
+/* Appends a whole frame to the queue of its class, waiting for room. false = it never fits */
+bool IoTProtocol::queueClassFrame(IoTClient *iotClient, EIoTPriority priority, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength)
+{
+    uint8_t index = (uint8_t)priority - 1;
+    IoTRingBuffer *queue = &(iotClient->priorityQueues[index]);
+    IoTQueuedFrame queued = {(uint32_t)(prefixLength + bodyLength), (uint32_t)iotMicros()};
+    size_t length = sizeof(queued) + queued.length;
 
-    if (MSCB & IOT_MSCB_ID)
+    if (length > iotClient->outboundCapacity)
+    {
+        return false;
+    }
+    if (queue->capacity() == 0)
     {
-        if (request->id == 0)
+        if (!queue->reserve(iotClient->outboundCapacity, this->allocatorOf(iotClient)))
         {
-            request->id = this->generateRequestId(request->iotClient);
+            throw "[IoTProtocol] Out of memory for outbound buffer";
         }
-        dataLength += 2;
     }
 
-    size_t pathLength = 0;
-    if (MSCB & IOT_MSCB_PATH)
+    while (queue->space() < length)
     {
-        pathLength = strlen(request->path);
-        dataLength += pathLength + 1 /* (EXT) */;
+        if (this->flushOutbound(iotClient) == 0)
+        {
+            if (!iotClient->client->connected())
+            {
+                /* Nobody will take it */
+                this->dropOutbound(iotClient);
+                return true;
+            }
+            iotSleep(1);
+        }
+        if (iotClient->outbound.empty())
+        {
+            /* Everything queued went out meanwhile: this one can be written straight */
+            return false;
+        }
     }
 
-    size_t headersLength = 0;
-    uint8_t headerSize = request->headers.size() & 255;
-    if (LSCB & IOT_LSCB_HEADER)
+    queue->write((const uint8_t *)&queued, sizeof(queued));
+    queue->write(prefix, prefixLength);
+    queue->write(body, bodyLength);
+    iotClient->priorityStats[index].depth++;
+    return true;
+}
+
+/* Appends to the outbound buffer. When it is full, waits for the transport to take bytes (the only place send waits) */
+void IoTProtocol::queueBytes(IoTClient *iotClient, const uint8_t *data, size_t length)
+{
+    if (length > 0 && iotClient->outbound.capacity() == 0)
     {
-        if (request->headers.size() > 255)
+        if (!iotClient->outbound.reserve(iotClient->outboundCapacity, this->allocatorOf(iotClient)))
         {
-            throw "[IoTProtocol] Too many headers. Maximum Headers is 255.";
+            throw "[IoTProtocol] Out of memory for outbound buffer";
         }
+    }
 
-        for (auto header = request->headers.begin(); header != request->headers.end(); ++header)
+    while (length > 0)
+    {
+        size_t accepted = iotClient->outbound.write(data, length);
+        data += accepted;
+        length -= accepted;
+        if (length == 0)
+            break;
+
+        /* Only outbound: the rest of this frame goes before any queued one */
+        if (this->writeOutbound(iotClient) == 0)
         {
-            headersLength += strlen(header->first) + strlen(header->second) + 2; /* + 1 (RS) + 1 (EXT) */
+            if (!iotClient->client->connected())
+            {
+                /* Nobody will take them */
+                this->dropOutbound(iotClient);
+                return;
+            }
+            iotSleep(1);
         }
-        dataLength += headersLength + 1; /* +1 (headerSize) */
     }
+}
 
-    if ((pathLength + headersLength) > ((request->iotClient->bufferSize) - 8))
-    {
-        throw "[IoTProtocol] Path and Headers too big.";
-    }
+/* Writes what the transport takes of outbound */
+size_t IoTProtocol::writeOutbound(IoTClient *iotClient)
+{
+    IoTIoVec iov[2];
+    size_t count = iotClient->outbound.peek(iov);
+    if (count == 0)
+        return 0;
 
-    if (LSCB & IOT_LSCB_BODY)
+    size_t written;
+    if (iotClient->vectoredWriter != NULL)
     {
-        dataLength += bodyLengthSize + request->bodyLength;
+        written = iotClient->vectoredWriter->writev(iov, count);
     }
     else
     {
-        bodyLengthSize = 0;
+        written = iotClient->client->write(iov[0].data, iov[0].length);
+        if (count == 2 && written == iov[0].length)
+        {
+            written += iotClient->client->write(iov[1].data, iov[1].length);
+        }
     }
+    iotClient->outbound.consume(written);
+    return written;
+}
+
+/*
+ * Moves the next waiting frame to the (empty) outbound: classes in order, each
+ * taking up to its weight in frames per round while it has some waiting, so
+ * the lower ones still get a turn. false = none waiting.
+ */
+bool IoTProtocol::promoteFrame(IoTClient *iotClient)
+{
+    static const uint8_t defaultWeights[IOT_PRIORITY_CLASSES] = {8, 4, 1};
 
-    if (dataLength > request->iotClient->bufferSize)
+    int8_t next = -1;
+    for (uint8_t round = 0; round < 2 && next < 0; round++)
     {
-        dataLength = request->iotClient->bufferSize;
+        bool waiting = false;
+        for (uint8_t i = 0; i < IOT_PRIORITY_CLASSES; i++)
+        {
+            if (iotClient->priorityQueues[i].empty())
+                continue;
+            waiting = true;
+            uint8_t weight = (iotClient->priorityWeights[i] != 0) ? iotClient->priorityWeights[i] : defaultWeights[i];
+            if (iotClient->priorityServed[i] < weight)
+            {
+                next = (int8_t)i;
+                break;
+            }
+        }
+        if (!waiting)
+        {
+            return false;
+        }
+        if (next < 0)
+        {
+            /* Every class waiting used its turns: next round */
+            memset(iotClient->priorityServed, 0, sizeof(iotClient->priorityServed));
+        }
     }
 
-    /* Record Data */
-
-    uint8_t data[dataLength + 1]; /* +1 => (\0) */
-    size_t nextIndex = 0;
-
-    data[nextIndex] = MSCB;
-    data[++nextIndex] = LSCB;
-
-    /* ID */
-    if (MSCB & IOT_MSCB_ID)
+    IoTRingBuffer *queue = &(iotClient->priorityQueues[next]);
+    IoTQueuedFrame queued;
+    IoTIoVec iov[2];
+    queue->peek(iov);
+    size_t first = (iov[0].length < sizeof(queued)) ? iov[0].length : sizeof(queued);
+    memcpy(&queued, iov[0].data, first);
+    if (first < sizeof(queued))
     {
-        data[++nextIndex] = request->id >> 8;  /* Id as Big Endian - (MSB first) */
-        data[++nextIndex] = request->id & 255; /* Id as Big Endian - (LSB last)  */
+        memcpy((uint8_t *)&queued + first, iov[1].data, sizeof(queued) - first);
     }
+    queue->consume(sizeof(queued));
 
-    /* PATH */
-    if (MSCB & IOT_MSCB_PATH)
+    if (iotClient->outbound.capacity() == 0)
     {
-        for (size_t i = 0; i < pathLength; i++)
+        if (!iotClient->outbound.reserve(iotClient->outboundCapacity, this->allocatorOf(iotClient)))
         {
-            data[++nextIndex] = *(request->path + i);
+            throw "[IoTProtocol] Out of memory for outbound buffer";
         }
-        data[++nextIndex] = IOT_ETX;
     }
 
-    /* HEADERs */
-    if (LSCB & IOT_LSCB_HEADER)
+    /* Fits: it was no larger than a class queue, which is as large as outbound */
+    size_t remain = queued.length;
+    while (remain > 0)
     {
-        data[++nextIndex] = headerSize;
+        queue->peek(iov);
+        size_t length = (iov[0].length < remain) ? iov[0].length : remain;
+        iotClient->outbound.write((const uint8_t *)iov[0].data, length);
+        queue->consume(length);
+        remain -= length;
+    }
 
-        for (auto header = request->headers.begin(); header != request->headers.end(); ++header)
-        {
-            /* Key */
-            size_t keyLength = strlen(header->first);
-            for (size_t i = 0; i < keyLength; i++)
-            {
-                data[++nextIndex] = header->first[i];
-            }
+    IoTPriorityStats *stats = &(iotClient->priorityStats[next]);
+    uint32_t wait = (uint32_t)iotMicros() - queued.queuedAt;
+    stats->depth--;
+    stats->queued++;
+    stats->waitMicros += wait;
+    if (wait > stats->maxWaitMicros)
+    {
+        stats->maxWaitMicros = wait;
+    }
+    iotClient->priorityServed[next]++;
+    iotClient->coalesceStats.writes++;
+    iotClient->coalesceStats.frames++;
+    return true;
+}
+
+/* Writes outbound, then the waiting frames by class, until the transport stops taking bytes */
+size_t IoTProtocol::flushOutbound(IoTClient *iotClient)
+{
+    size_t total = 0;
+    while (!iotClient->outbound.empty() || this->promoteFrame(iotClient))
+    {
+        size_t written = this->writeOutbound(iotClient);
+        total += written;
+        if (!iotClient->outbound.empty())
+            break;
+    }
 
-            /* RS */
-            data[++nextIndex] = IOT_RS;
+    if (queuedBytes(iotClient) < iotClient->outboundHighWater)
+    {
+        iotClient->aboveHighWater = false;
+    }
+    return total;
+}
 
-            /* Value */
-            size_t valueLength = strlen(header->second);
-            for (size_t i = 0; i < valueLength; i++)
+/* Waits until every queued frame was written. false = disconnected, they were dropped */
+bool IoTProtocol::drainOutbound(IoTClient *iotClient)
+{
+    while (!iotClient->outbound.empty())
+    {
+        if (this->flushOutbound(iotClient) == 0)
+        {
+            if (!iotClient->client->connected())
             {
-                data[++nextIndex] = header->second[i];
+                this->dropOutbound(iotClient);
+                return false;
             }
-
-            /* EXT */
-            data[++nextIndex] = IOT_ETX;
+            iotSleep(1);
         }
     }
+    return true;
+}
 
-    /* BODY */
-    if (LSCB & IOT_LSCB_BODY)
+/* Forgets every byte waiting to be written */
+void IoTProtocol::dropOutbound(IoTClient *iotClient)
+{
+    iotClient->coalescer.length = 0;
+    iotClient->coalescer.frames = 0;
+    iotClient->outbound.clear();
+    for (uint8_t i = 0; i < IOT_PRIORITY_CLASSES; i++)
     {
-        /* Body Length */
-        for (uint8_t i = bodyLengthSize; i > 0; i--) /* Body Length as Big Endian */
-        {
-            data[++nextIndex] = (request->bodyLength >> ((i - 1) * 8)) & 255;
-        }
+        iotClient->priorityQueues[i].clear();
+        iotClient->priorityStats[i].depth = 0;
+        iotClient->priorityServed[i] = 0;
     }
+}
+
+size_t IoTProtocol::flush(IoTClient *iotClient)
+{
+    return this->flushClient(iotClient, true);
+}
 
-    size_t prefixDataIndex = nextIndex;
+/* flush, the coalesced frames written only once due unless `coalesced` */
+size_t IoTProtocol::flushClient(IoTClient *iotClient, bool coalesced)
+{
+    IoTCoalescer *coalescer = &(iotClient->coalescer);
+    bool due = coalescer->length > 0 && (coalesced || iotMicros() - coalescer->firstAt >= coalescer->micros);
+    if (!due && iotClient->outbound.empty() && iotClient->streams.empty())
+        return 0;
+
+    IoTLockGuard guard(&iotClient->writeLock);
+    size_t written = due ? this->writeCoalesced(iotClient) : 0;
+    written += this->flushOutbound(iotClient);
+    this->pumpStreams(iotClient);
+    if (coalesced)
+    {
+        /* Parts of streams packed just now */
+        written += this->writeCoalesced(iotClient);
+    }
+    return written;
+}
 
-    std::function<size_t(size_t, size_t)> writeBodyPart = [&writeBodyPart, this, request, prefixDataIndex, &data, requestResponse](size_t i = 0, size_t parts = 0)
+/*
+ * Sends the next part of each stream with credit in turn, while the transport
+ * takes them: parts never wait on the outbound buffer, so the frames of other
+ * sends are not queued behind a whole body. Write lock held.
+ */
+void IoTProtocol::pumpStreams(IoTClient *iotClient)
+{
+    unsigned long now = iotMillis();
+    bool progress = true;
+    while (progress && !iotClient->streams.empty() && iotClient->outbound.empty())
     {
-        size_t indexData = prefixDataIndex + 1; // 42
-        /* Body */
-        if (request->bodyLength > 0) // 1060 > 0
+        progress = false;
+        for (size_t turn = iotClient->streams.size(); turn > 0 && !iotClient->streams.empty() && iotClient->outbound.empty(); turn--)
         {
-            size_t bodyBufferRemain = (request->bodyLength - i);
-            size_t bodyUntilIndex = ((bodyBufferRemain + indexData) > request->iotClient->bufferSize) ? i + ((request->iotClient->bufferSize) - indexData) : i + bodyBufferRemain;
-            for (; i < bodyUntilIndex; i++)
+            if (iotClient->streamCursor >= iotClient->streams.size())
             {
-                *(data + (indexData++)) = *(request->body + i);
+                iotClient->streamCursor = 0;
+            }
+            size_t index = iotClient->streamCursor;
+            IoTStream *stream = &(iotClient->streams[index]);
+
+            if (stream->credit <= 0)
+            {
+                if (iotTimeReached(stream->creditAt + IOT_MULTIPART_TIMEOUT, now))
+                {
+                    /* The receiver dropped it by now as well */
+                    this->dropStream(iotClient, index);
+                    continue;
+                }
+                iotClient->streamStats.stalls++;
+                iotClient->streamCursor++;
+                continue;
+            }
+
+            /* The buffer size and body codec may have changed since the previous part: the receiver follows them the same way */
+            size_t blockHeader = bodyEncoded(iotClient->sendCodec, stream->frame[1]) ? IOT_BODY_BLOCK_HEADER : 0;
+            if (stream->prefixLength + blockHeader >= iotClient->bufferSize)
+            {
+                this->dropStream(iotClient, index);
+                continue;
+            }
+            size_t partBodySpace = iotClient->bufferSize - stream->prefixLength;
+            if (stream->prefixLength + partBodySpace + 1 > stream->frameCapacity)
+            {
+                IoTAllocator *allocator = this->allocatorOf(iotClient);
+                uint8_t *frame = (uint8_t *)allocator->allocate(stream->prefixLength + partBodySpace + 1);
+                if (frame == NULL)
+                {
+                    this->dropStream(iotClient, index);
+                    continue;
+                }
+                memcpy(frame, stream->frame, stream->prefixLength);
+                allocator->deallocate(stream->frame);
+                stream->frame = frame;
+                stream->frameCapacity = stream->prefixLength + partBodySpace + 1;
             }
-        }
 
-        *(data + (indexData)) = '\0';
+            size_t partLength = stream->request.bodyLength - stream->sent;
+            if (partLength > sliceLengthOf(partBodySpace, blockHeader))
+            {
+                partLength = sliceLengthOf(partBodySpace, blockHeader);
+            }
 
-        if (parts > 1) /* Schedule next alive request after send all data only if is a multipart */
-        {
-            /* Cancel and Schedule next alive request */
-            this->scheduleNextAliveRequest(request->iotClient);
-        }
+            const uint8_t *body;
+            if (stream->request.bodySource != NULL)
+            {
+                body = stream->request.bodySource->read(stream->sent, partLength, stream->frame + stream->prefixLength + blockHeader);
+                if (body == NULL)
+                {
+                    this->dropStream(iotClient, index);
+                    continue;
+                }
+            }
+            else
+            {
+                body = stream->request.body + stream->sent;
+            }
 
-        request->iotClient->client->write(data, indexData);
+            this->queuePart(iotClient, priorityOf(&(stream->request)), stream->frame, stream->prefixLength, body, partLength);
+            stream->sent += partLength;
+            stream->credit -= (int64_t)partLength;
+            iotClient->streamStats.parts++;
+            iotClient->bufferStats.parts++;
+            iotClient->bufferStats.prefixBytes += stream->prefixLength;
+            iotClient->bufferStats.bodyBytes += partLength;
+            progress = true;
 
-        if(requestResponse != NULL && requestResponse->onPartSent != NULL) {
-            (*(requestResponse->onPartSent))(request, i, parts);
-        }
+            if (stream->onPartSent != NULL)
+            {
+                (*(stream->onPartSent))(&(stream->request), stream->sent, stream->request.parts);
+            }
+            stream->request.parts++;
 
-        parts++;
-        if (i >= request->bodyLength)
-        {
-            return parts;
-        }
-        else
-        {
-            return writeBodyPart(i, parts);
+            if (stream->sent >= stream->request.bodyLength)
+            {
+                this->dropStream(iotClient, index); /* Done: the next one moves to its place */
+            }
+            else
+            {
+                iotClient->streamCursor++;
+            }
         }
-    };
+    }
+}
 
-    while (request->iotClient->lockedForWrite)
+/* Forgets a stream, whether it is done or not. Write lock held */
+void IoTProtocol::dropStream(IoTClient *iotClient, size_t index)
+{
+    IoTStream *stream = &(iotClient->streams[index]);
+    if (stream->sent < stream->request.bodyLength)
     {
-        vTaskDelay(this->delay);
+        iotClient->streamStats.dropped++;
     }
-    request->iotClient->lockedForWrite = true;
-    request->parts = writeBodyPart(0, 0);
-    request->iotClient->lockedForWrite = false;
-
-    if (requestResponse != NULL)
+    /* Never went out: the header table entries it adds never reach the peer */
+    if (stream->sent == 0 && iotClient->headerTable != NULL && (stream->frame[0] >> 2) >= IOT_VERSION_HEADER_TABLE)
     {
-        if (requestResponse->timeout == 0)
-        {
-            requestResponse->timeout = this->timeout;
-        }
-        requestResponse->timeout += millis();
-        requestResponse->request = *request;
+        iotClient->headerTable->frozen = true;
+    }
+    this->allocatorOf(iotClient)->deallocate(stream->frame);
+    uint16_t id = stream->request.id;
+    iotClient->streams.erase(iotClient->streams.begin() + index);
+    this->releaseRequestId(iotClient, id);
+}
 
-        request->iotClient->requestResponse.insert(std::make_pair(request->id, *requestResponse));
+size_t IoTProtocol::writeFrame(IoTClient *iotClient, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength)
+{
+    if (bodyLength == 0)
+    {
+        return iotClient->client->write(prefix, prefixLength);
     }
 
-    this->readClient(request->iotClient);
+    /* Prefix and body slice straight from their own memory */
+    if (iotClient->vectoredWriter != NULL)
+    {
+        IoTIoVec iov[2] = {
+            {prefix, prefixLength},
+            {body, bodyLength}};
+        return iotClient->vectoredWriter->writev(iov, 2);
+    }
 
-    return request;
+    /* Transport without vectored write: copy the slice after the prefix (room for bufferSize), unless a body source filled it there */
+    if (body != prefix + prefixLength)
+    {
+        memcpy(prefix + prefixLength, body, bodyLength);
+    }
+    return iotClient->client->write(prefix, prefixLength + bodyLength);
 }
 
-void IoTProtocol::resetRemainBuffer(IoTClient *iotClient)
+void IoTProtocol::resetDecoder(IoTClient *iotClient)
 {
-    iotClient->remainBufferLength = 0;
-    if (iotClient->remainBuffer != NULL)
+    IoTDecoder *decoder = &(iotClient->decoder);
+
+    IoTAllocator *allocator = this->allocatorOf(iotClient);
+
+    if (decoder->frame != NULL)
     {
-        free(iotClient->remainBuffer);
+        allocator->deallocate(decoder->frame);
     }
-    iotClient->remainBuffer = NULL;
+    decoder->frame = NULL;
+    decoder->frameLength = 0;
+    decoder->frameCapacity = 0;
+
+    if (decoder->pending != NULL)
+    {
+        allocator->deallocate(decoder->pending);
+    }
+    decoder->pending = NULL;
+    decoder->pendingLength = 0;
+    decoder->pendingCapacity = 0;
+
+    if (decoder->decoded != NULL)
+    {
+        allocator->deallocate(decoder->decoded);
+    }
+    decoder->decoded = NULL;
+    decoder->decodedCapacity = 0;
+    decoder->state = EIoTDecodeState::CONTROL;
 }
 
 void IoTProtocol::scheduleNextAliveRequest(IoTClient *iotClient)
@@ -659,11 +2661,20 @@ void IoTProtocol::scheduleNextAliveRequest(IoTClient *iotClient)
     if (iotClient->aliveInterval == 0)
         return;
 
-    iotClient->aliveNextRequest = millis() + (iotClient->aliveInterval * 1000);
+    iotClient->aliveNextRequest = iotMillis() + (iotClient->aliveInterval * 1000);
+
+    /* Only moved when it fires: receiving a frame just pushes aliveNextRequest */
+    if (!iotClient->aliveTimer.scheduled())
+    {
+        this->timers.schedule(&(iotClient->aliveTimer), iotClient->aliveNextRequest);
+    }
 }
 
 void IoTProtocol::freeRequest(IoTRequest *request)
 {
+    if (request->view)
+        return; /* Nothing is owned by a view */
+
     /* Free Request */
     free(request->path);
     free(request->body);
@@ -674,11 +2685,45 @@ void IoTProtocol::freeRequest(IoTRequest *request)
     }
 }
 
+static char *retainString(const char *value)
+{
+    if (value == NULL)
+        return NULL;
+
+    size_t length = strlen(value);
+    char *retained = (char *)malloc(length * sizeof(char) + 1);
+    memcpy(retained, value, length + 1);
+    return retained;
+}
+
+IoTRequest IoTProtocol::retainRequest(IoTRequest *request)
+{
+    IoTRequest retained = *request;
+    retained.view = false;
+
+    retained.path = retainString(request->path);
+
+    retained.headers = IoTHeaders();
+    for (auto header = request->headers.begin(); header != request->headers.end(); ++header)
+    {
+        retained.headers.insert(std::make_pair(retainString(header->first), retainString(header->second)));
+    }
+
+    if (request->body != NULL)
+    {
+        retained.body = (uint8_t *)(malloc((request->bodyLength) * sizeof(uint8_t) + 1));
+        memcpy(retained.body, request->body, request->bodyLength);
+        retained.body[request->bodyLength] = '\0';
+    }
+
+    return retained;
+}
+
 // void IoTProtocol::resetClients()
 // {
 //     for (auto client = this->clients.begin(); client != this->clients.end(); ++client)
 //     {
-//         this->resetRemainBuffer(client->second);
+//         this->resetDecoder(client->second);
 //     }
 
 //     this->clients.clear();
@@ -691,118 +2736,174 @@ void IoTProtocol::readClient(IoTClient *iotClient)
         return;
     }
 
-    uint8_t buffer[(iotClient->bufferSize) + 1];
-    size_t bufferLength = 0;
+    /* Already decoding this client further up the stack (send from a handler) */
+    if (iotClient->decoder.busy)
+    {
+        return;
+    }
+
+    IoTDecoder *decoder = &(iotClient->decoder);
+    iotClient->readStats.lastFrames = 0;
+    iotClient->readStats.calls++;
 
-    if (iotClient->remainBuffer != NULL)
+    /* Bytes left over when the previous call ran out of frame budget come first */
+    if (decoder->pendingLength > 0)
     {
-        for (uint32_t i = 0; i < iotClient->remainBufferLength; i++)
+        size_t consumed = this->onData(iotClient, decoder->pending, decoder->pendingLength);
+        decoder->pendingLength -= consumed;
+        if (decoder->pendingLength > 0)
         {
-            buffer[bufferLength++] = *(iotClient->remainBuffer + i);
+            memmove(decoder->pending, decoder->pending + consumed, decoder->pendingLength);
+            return;
         }
-
-        this->resetRemainBuffer(iotClient);
     }
 
-    while (iotClient->client->available() && bufferLength < iotClient->bufferSize)
-    {
-        buffer[bufferLength++] = iotClient->client->read();
-    }
+    /* A BUFFER_SIZE frame decoded below changes receiveBufferSize: the reads stay within this buffer */
+    size_t readSize = iotClient->receiveBufferSize;
+    uint8_t buffer[readSize + 1]; /* +1 => room for the terminator after a body */
 
-    if (bufferLength > 0)
+    /* Drain every frame already received, unless the frame budget runs out first */
+    int available;
+    while ((available = iotClient->client->available()) > 0 && !this->frameBudgetSpent(iotClient))
     {
-        buffer[bufferLength] = '\0';
-        this->onData(iotClient, buffer, (bufferLength));
+        size_t wanted = ((size_t)available < readSize) ? (size_t)available : readSize;
+        int read = iotClient->client->read(buffer, wanted);
+        if (read <= 0)
+        {
+            break;
+        }
+        size_t bufferLength = (size_t)read;
+
+        size_t consumed = this->onData(iotClient, buffer, bufferLength);
+        if (consumed < bufferLength)
+        {
+            size_t remain = bufferLength - consumed;
+            if (decoder->pendingCapacity < remain + 1)
+            {
+                IoTAllocator *allocator = this->allocatorOf(iotClient);
+                uint8_t *pending = (uint8_t *)allocator->allocate((readSize + 1) * sizeof(uint8_t));
+                if (pending == NULL)
+                {
+                    this->resetDecoder(iotClient);
+                    return;
+                }
+                allocator->deallocate(decoder->pending);
+                decoder->pending = pending;
+                decoder->pendingCapacity = readSize + 1;
+            }
+            memcpy(decoder->pending, buffer + consumed, remain);
+            decoder->pendingLength = remain;
+            break;
+        }
     }
 }
 
 void IoTProtocol::loop()
 {
-    unsigned long now = millis();
-
     /* Read Clients */
 
     for (auto iotClient = this->clients.begin(); iotClient != this->clients.end(); iotClient++)
     {
+        this->flushClient(iotClient->second, false);
         this->readClient(iotClient->second);
+    }
 
-        /* Alive Request */
-        if (now >= iotClient->second->aliveNextRequest)
-        {
-            /* Send Alive Request */
-            IoTRequest aliveRequest = {
-                IOT_VERSION,
-                EIoTMethod::ALIVE_REQUEST,
-                0,
-                NULL,
-                std::map<char *, char *>(),
-                NULL,
-                0,
-                0,
-                0,
-                iotClient->second};
-            IoTRequestResponse aliveRequestResponse = {
-                NULL,
-                &this->onAliveRequestTimeout,
-                NULL,
-                this->timeout};
-
-            this->aliveRequest(&aliveRequest, &aliveRequestResponse);
+    this->expireTimers();
+}
 
-            /* Schedule the next alive request */
-            this->scheduleNextAliveRequest(iotClient->second);
+void IoTProtocol::expireTimers()
+{
+    /* Deadlines: only the ones that passed, whatever the number of clients */
+    unsigned long now = iotMillis();
+    IoTTimer *timer;
+    while ((timer = this->timers.popExpired(now)) != NULL)
+    {
+        this->onTimer(timer, now);
+    }
+}
 
-            /* Read again for alive response */
-            this->readClient(iotClient->second);
-        }
+void IoTProtocol::onTimer(IoTTimer *timer, unsigned long now)
+{
+    IoTClient *iotClient = (IoTClient *)(timer->owner);
 
-        /* Timeout */
-        if (iotClient->second != NULL)
+    switch ((EIoTTimer)timer->kind)
+    {
+    case EIoTTimer::ALIVE:
+    {
+        /* Frames received since it was scheduled pushed the deadline back */
+        if (!iotTimeReached(iotClient->aliveNextRequest, now))
         {
-            IoTClient *c = iotClient->second;
-            for (auto rr = iotClient->second->requestResponse.begin(); (c != nullptr) && (c->requestResponse.find(rr->first) != c->requestResponse.end()) && rr != c->requestResponse.end();)
-            {
-                unsigned long timeout = rr->second.timeout;
-                if (now >= timeout)
-                {
-                    OnTimeout *onTimeout = rr->second.onTimeout;
-                    if (onTimeout != NULL)
-                    {
-                        (*onTimeout)(&(rr->second.request));
-                    }
+            this->timers.schedule(timer, iotClient->aliveNextRequest);
+            break;
+        }
 
-                    c->requestResponse.erase(rr->first);
+        /* Send Alive Request */
+        IoTRequest aliveRequest = {
+            IOT_VERSION,
+            EIoTMethod::ALIVE_REQUEST,
+            0,
+            NULL,
+            IoTHeaders(),
+            NULL,
+            0,
+            0,
+            0,
+            iotClient};
+        IoTRequestResponse aliveRequestResponse = {
+            NULL,
+            &this->onAliveRequestTimeout,
+            NULL,
+            this->timeout};
 
-                    continue;
-                }
+        this->aliveRequest(&aliveRequest, &aliveRequestResponse);
 
-                rr++;
-            }
+        /* Schedule the next alive request */
+        this->scheduleNextAliveRequest(iotClient);
 
-            /* MultiPart Timeout */
-            auto multiPartControl = iotClient->second->multiPartControl;
-            for (auto mpc = multiPartControl.begin(); mpc != multiPartControl.end(); mpc++)
-            {
-                unsigned long timeout = mpc->second.timeout;
-                if (now >= timeout)
-                {
-                    iotClient->second->requestResponse.erase(mpc->first);
-                    continue;
-                }
-            }
+        /* Read again for alive response */
+        this->readClient(iotClient);
+        break;
+    }
+    case EIoTTimer::REQUEST_TIMEOUT:
+    {
+        uint16_t id = timer->id;
+        iotClient->requestResponse.expire(timer, [](IoTRequestResponse *rr)
+                                          {
+                                              if (rr->onTimeout != NULL)
+                                              {
+                                                  (*(rr->onTimeout))(&(rr->request));
+                                              } });
+        IoTLockGuard guard(&iotClient->writeLock);
+        this->releaseRequestId(iotClient, id);
+        break;
+    }
+    case EIoTTimer::MULTIPART_TIMEOUT:
+    {
+        uint16_t id = timer->id; /* `timer` goes with the entry */
+        auto multiPart = iotClient->multiPartControl.find(id);
+        if (multiPart == iotClient->multiPartControl.end())
+            break;
+        IoTBodySink *sink = multiPart->second.sink;
+        iotClient->multiPartControl.erase(multiPart);
+        {
+            IoTLockGuard guard(&iotClient->writeLock);
+            this->releaseRequestId(iotClient, id);
         }
+        if (sink != NULL)
+        {
+            sink->close(id, false);
+        }
+        break;
+    }
     }
 }
 
 const char *IoTProtocol::getHeader(IoTRequest *request, const char *headerKey)
 {
-    for (auto header = request->headers.begin(); header != request->headers.end(); ++header)
-    {
-        if (strcmp(header->first, headerKey) == 0)
-        {
-            return header->second;
-        }
-    }
+    return request->headers.get(headerKey);
+}
 
-    return nullptr;
-}
\ No newline at end of file
+const char *IoTProtocol::getHeader(IoTRequest *request, EIoTHeaderKey headerKey)
+{
+    return request->headers.get(headerKey);
+}
@@ -8,15 +8,23 @@
 // {
 // #endif
 
-#include "Arduino.h"
+#include "iot_platform.h"
 #include <vector>
 #include <functional>
 #include <map>
 #include <algorithm>
 
+#include "iot_allocator.h"
+#include "iot_pending.h"
+#include "iot_ring_buffer.h"
+#include "iot_body_sink.h"
+#include "iot_body_source.h"
 #include "iot_helpers.h"
+#include "iot_headers.h"
+#include "iot_body_codec.h"
 
 #define IOT_VERSION (uint8_t)1
+#define IOT_VERSION_HEADER_TABLE (uint8_t)2 /* Frames whose headers use the header table forms (IoTClient::headerCompression) */
 
 #define IOT_ETX 0x3
 #define IOT_RS 0x1E
@@ -34,8 +42,24 @@
 #define IOT_PROTOCOL_DEFAULT_BUFFER_SIZE 1024
 #endif 
 
+#ifndef IOT_PROTOCOL_MAX_BUFFER_SIZE
+#define IOT_PROTOCOL_MAX_BUFFER_SIZE 16384 /* Largest buffer size a client accepts unless IoTClient::maxBufferSize says otherwise */
+#endif
+
+#ifndef IOT_PROTOCOL_DEFAULT_MAX_PENDING_REQUESTS
+#define IOT_PROTOCOL_DEFAULT_MAX_PENDING_REQUESTS 32
+#endif
+
+#define IOT_REQUEST_ID_WORDS (65536 / 64) /* Of IoTClient::requestIdsInUse */
+
+#ifndef IOT_PROTOCOL_DEFAULT_OUTBOUND_CAPACITY
+#define IOT_PROTOCOL_DEFAULT_OUTBOUND_CAPACITY 4096
+#endif
+
 #define IOT_MULTIPART_TIMEOUT 5000
 
+#define IOT_PRIORITY_CLASSES 3
+
 enum class EIoTMethod : uint8_t
 {
     SIGNAL = 0x1,
@@ -45,27 +69,149 @@ enum class EIoTMethod : uint8_t
     ALIVE_REQUEST = 0x5,
     ALIVE_RESPONSE = 0x6,
     BUFFER_SIZE_REQUEST = 0x7,
-    BUFFER_SIZE_RESPONSE = 0x8
+    BUFFER_SIZE_RESPONSE = 0x8,
+    CREDIT = 0x9 /* Stream flow control: ID of the stream, 4 byte body with the body bytes granted */
+};
+
+/*
+ * Outbound class of a frame. Frames the transport cannot take right away wait
+ * in the queue of their class, served CONTROL first, then INTERACTIVE, then
+ * BULK by weighted round robin (IoTClient::priorityWeights), so bulk parts
+ * never hold back an alive response and are never starved either.
+ */
+enum class EIoTPriority : uint8_t
+{
+    AUTO = 0x0,        /* By method: CONTROL for alive, buffer size and credit, BULK for STREAMING, INTERACTIVE otherwise */
+    CONTROL = 0x1,
+    INTERACTIVE = 0x2,
+    BULK = 0x3
+};
+
+/*
+ * How onData hands path, headers and body to middlewares and OnResponse.
+ *
+ * COPY: each one is a copy on the client arena, released once the handlers return.
+ * VIEW: each one is a NUL-terminated view into the receive buffer, valid only
+ *       while the handlers run. Use IoTProtocol::retainRequest to keep it.
+ */
+enum class EIoTDecodeMode : uint8_t
+{
+    COPY = 0x0,
+    VIEW = 0x1
 };
 
 struct IoTClient;
+struct IoTPathParams;
+class IoTRouter;
 struct IoTRequest
 {
     uint8_t version;
     EIoTMethod method;
     uint16_t id;
     char *path;
-    std::map<char *, char *> headers;
+    IoTHeaders headers;
     uint8_t *body;
     size_t bodyLength;
     size_t totalBodyLength;
     size_t parts;
     IoTClient *iotClient;
+    bool view; /* path, headers and body are not owned: receive buffer views or client arena copies, valid while the handlers run */
+    size_t offset; /* Of this part's body within the whole body (received multipart) */
+    IoTBodySource *bodySource; /* Sending: pulls the body part by part instead of `body` (NULL) */
+    const IoTPathParams *params; /* Set by IoTRouter for the handlers of a route (iot_router.h) */
+    EIoTPriority priority; /* Sending: outbound class, AUTO = by method */
 };
 
 typedef std::function<void(void)> Next;
 typedef void (*IoTMiddleware)(IoTRequest *, Next *);
 
+/*
+ * How runMiddleware walks IoTProtocol::middlewares.
+ *
+ * NESTED: next() runs the later stages before it returns, so code after
+ *         next() runs after them. The default.
+ * FLAT:   next() only records that the pipeline goes on and the executor
+ *         moves to the following stage once the middleware returns: no
+ *         recursion, whatever the chain length. Code after next() runs
+ *         before the later stages, and next() must be called before the
+ *         middleware returns.
+ */
+enum class EIoTMiddlewareMode : uint8_t
+{
+    NESTED = 0x0,
+    FLAT = 0x1
+};
+
+/*
+ * State behind the Next of the FLAT executor and of IoTChain, one per run and
+ * reused by every stage. Its Next is only valid while the middleware it was
+ * handed to runs: a copy called later writes into a context that is gone.
+ */
+struct IoTMiddlewareContext
+{
+    Next next;    /* Sets `proceed` */
+    bool proceed;
+
+    IoTMiddlewareContext() : proceed(false)
+    {
+        bool *proceed = &this->proceed;
+        this->next = [proceed]()
+        { *proceed = true; };
+    }
+    IoTMiddlewareContext(const IoTMiddlewareContext &other) = delete;
+    IoTMiddlewareContext &operator=(const IoTMiddlewareContext &other) = delete;
+
+    /* Runs `middleware`, true when it called next */
+    bool step(IoTMiddleware middleware, IoTRequest *request)
+    {
+        this->proceed = false;
+        middleware(request, &this->next);
+        return this->proceed;
+    }
+};
+
+/*
+ * Middleware chain fixed at compile time: the stages are template arguments,
+ * so the calls are direct and the compiler can inline the whole pipeline.
+ * IoTChain<auth, decode, handle>::run is itself an IoTMiddleware. Its stages
+ * run in FLAT order (EIoTMiddlewareMode), whatever the protocol's mode.
+ */
+template <IoTMiddleware... Stages>
+struct IoTChain;
+
+template <>
+struct IoTChain<>
+{
+    static bool steps(IoTRequest *request, IoTMiddlewareContext *context) { return true; }
+};
+
+template <IoTMiddleware First, IoTMiddleware... Rest>
+struct IoTChain<First, Rest...>
+{
+    /* true when every stage called next */
+    static bool steps(IoTRequest *request, IoTMiddlewareContext *context)
+    {
+        return context->step(First, request) && IoTChain<Rest...>::steps(request, context);
+    }
+
+    static void run(IoTRequest *request, Next *next)
+    {
+        IoTMiddlewareContext context;
+        if (steps(request, &context))
+        {
+            (*next)();
+        }
+    }
+};
+
+/* Stage of IoTProtocol::middlewares: a middleware, or a router mounted on a path */
+struct IoTMiddlewareStage
+{
+    IoTMiddleware middleware; /* NULL for a router */
+    IoTRouter *router;
+    std::vector<char> path;   /* Mount point without its trailing '/', NUL-terminated. Empty = every path */
+};
+
 typedef std::function<void(IoTRequest *response)> OnResponse;
 typedef std::function<void(IoTRequest *request)> OnTimeout;
 typedef std::function<void(IoTRequest *request, uint32_t totalDataSent, uint32_t part)> OnPartSent;
@@ -79,55 +225,426 @@ struct IoTRequestResponse
     IoTRequest request;
 };
 
+/*
+ * Request pre-encoded once by IoTProtocol::compile: control bytes, path and
+ * headers are serialized up front, so sending it only writes the ID and the
+ * Body Length. The prefix is never modified while sending, so one template can
+ * be shared by every client. Release it with IoTProtocol::freeTemplate.
+ */
+struct IoTRequestTemplate
+{
+    EIoTMethod method;
+    char *path;              /* Owned copy, handed to onPartSent/onTimeout as request->path */
+    uint8_t *prefix;         /* MSCB .. Body Length */
+    size_t prefixLength;
+    size_t idOffset;         /* 0 = method without ID */
+    size_t bodyLengthOffset;
+    uint8_t bodyLengthSize;  /* 0 = compiled without body */
+};
+
 struct IoTMultiPart
 {
     uint32_t parts;    /* Number of Parts */
     uint32_t received; /* Bytes received */
     unsigned long timeout;
+    IoTTimer timer; /* Fires at `timeout` (EIoTTimer::MULTIPART_TIMEOUT) */
+    IoTBodySink *sink; /* Taking the parts, see IoTProtocol::onBodySink */
+    bool discard;      /* Its sink failed: the remaining parts are dropped */
+    uint32_t ungranted; /* Body bytes handled since the last CREDIT (IoTClient::streamWindow) */
+};
+
+/*
+ * Multipart send going out part by part, in turn with the other streams of
+ * its client (IoTClient::streamWindow). Its body (or body source) is read as
+ * the parts go out, so it must stay valid until the last one did: onPartSent
+ * reports every part.
+ */
+struct IoTStream
+{
+    IoTRequest request;     /* Without headers: they are in `frame` */
+    OnPartSent *onPartSent;
+    uint8_t *frame;         /* Prefix, then room for one part */
+    size_t frameCapacity;
+    size_t prefixLength;
+    size_t sent;            /* Body bytes */
+    int64_t credit;         /* Body bytes it may still send. The last part sent may overdraw it */
+    unsigned long creditAt; /* iotMillis of the last credit: dropped after IOT_MULTIPART_TIMEOUT without one */
+};
+
+struct IoTStreamStats
+{
+    uint64_t parts;           /* Parts sent by streams */
+    uint64_t creditsSent;     /* CREDIT frames sent, as receiver */
+    uint64_t creditsReceived; /* CREDIT frames received, as sender */
+    uint64_t stalls;          /* Turns a stream skipped for lack of credit */
+    uint32_t dropped;         /* Streams given up: no credit in time, body source failed or prefix too big */
+};
+
+/* What a timer of IoTProtocol::timers is about. Its owner is the IoTClient */
+enum class EIoTTimer : uint8_t
+{
+    ALIVE = 0x1,             /* Next alive request of the client */
+    REQUEST_TIMEOUT = 0x2,   /* Pending request (id) without response */
+    MULTIPART_TIMEOUT = 0x3  /* Multipart transfer (id) that stopped arriving */
+};
+
+/* Where the decoder is inside the current frame */
+enum class EIoTDecodeState : uint8_t
+{
+    CONTROL = 0x0, /* MSCB + LSCB */
+    ID = 0x1,
+    PATH = 0x2,
+    HEADER_SIZE = 0x3,
+    HEADER = 0x4,
+    BODY_LENGTH = 0x5,
+    BODY = 0x6
+};
+
+/*
+ * Resumable frame decoder state of a client.
+ *
+ * Offsets are relative to the start of the current frame, so parsing resumes
+ * where it stopped when a frame is split across reads. Frames that arrive whole
+ * are parsed in place; only the bytes of a split frame are staged on `frame`.
+ */
+struct IoTDecoder
+{
+    EIoTDecodeState state;
+    size_t offset; /* Next byte to parse */
+    size_t scan;   /* Next byte to scan for a delimiter */
+
+    uint8_t MSCB;
+    uint8_t LSCB;
+    uint16_t id;
+    size_t pathStart;
+    size_t pathEnd; /* ETX */
+    uint8_t headerSize;
+    IoTHeaderTokenizer tokenizer;
+    std::vector<IoTHeaderSpan> headers;
+    size_t bodyLength; /* Declared (total) body length */
+    size_t bodyStart;
+    size_t partLength; /* Body bytes carried by this frame */
+    uint16_t block;    /* Body codec block header of this frame (IOT_BODY_BLOCK_*) */
+
+    uint8_t *decoded; /* Body of the frame once decoded by the body codec */
+    size_t decodedCapacity;
+
+    uint8_t *frame; /* Staged bytes of a frame split across reads */
+    size_t frameLength;
+    size_t frameCapacity;
+
+    uint8_t *pending; /* Received bytes not decoded yet because the frame budget ran out */
+    size_t pendingLength;
+    size_t pendingCapacity;
+
+    bool busy; /* Decoding, so nested reads (send from a handler) are deferred */
+};
+
+struct IoTReadStats
+{
+    uint32_t lastFrames; /* Frames handled by the last readClient call */
+    uint64_t frames;     /* Frames handled */
+    uint64_t calls;      /* readClient calls */
+};
+
+/*
+ * Opt-in buffer size tuning of a client (IoTClient::bufferTuner.enabled).
+ *
+ * After every `samples` multipart sends the tuner looks at the body
+ * throughput and the time per part of the current size and asks the peer
+ * for another one with bufferSizeRequest: twice as large while that keeps
+ * paying off, back to the previous size when it got slower, half as large
+ * when a part takes longer than maxPartMicros. Sizes stay within
+ * [minSize, maxSize], this side's maxBufferSize and the maximum the peer
+ * advertised (probed first).
+ */
+struct IoTBufferTuner
+{
+    bool enabled;
+    uint32_t minSize;       /* 0 = IOT_PROTOCOL_DEFAULT_BUFFER_SIZE */
+    uint32_t maxSize;       /* 0 = no bound but the two maximums */
+    uint16_t samples;       /* Multipart sends per decision. 0 = 4 */
+    uint32_t maxPartMicros; /* Latency bound per part. 0 = none */
+
+    /* State */
+    bool probed;                 /* Asked the peer for its maximum */
+    bool pending;                /* Waiting for a BUFFER_SIZE_RESPONSE */
+    unsigned long requestedAt;   /* iotMicros of the pending request */
+    uint16_t sampled;            /* Multipart sends since the last decision */
+    uint32_t previousSize;       /* Size before the last change. 0 = none */
+    uint32_t previousThroughput; /* Its throughput */
+    uint32_t ceiling;            /* Growing to this size got slower. 0 = none */
+};
+
+/*
+ * Opt-in write coalescing of a client (IoTClient::coalescer.micros).
+ *
+ * Frames written while nothing is queued are packed into one buffer of up to
+ * bufferSize bytes instead of each being its own write. The buffer goes out
+ * in one write when the next frame does not fit, when its oldest frame waited
+ * `micros` (checked by loop and by the next send), or on flush(). Frames
+ * larger than half the buffer size go straight out, after the waiting ones.
+ */
+struct IoTCoalescer
+{
+    uint32_t micros; /* Flush deadline of the oldest frame waiting. 0 = off, every frame is its own write */
+
+    /* State */
+    uint8_t *buffer;       /* Frames waiting. Allocated on first use, freed by unlisten */
+    uint32_t length;
+    uint32_t capacity;
+    uint16_t frames;       /* In `buffer` */
+    unsigned long firstAt; /* iotMicros of the oldest */
+    uint64_t offsets;      /* Sum of the later ones' queue times after firstAt */
+};
+
+/* Counts every frame sent, coalescing on or off: once it is off, each frame is one write and waits 0 */
+struct IoTCoalesceStats
+{
+    uint64_t writes;         /* Frames written on their own plus packed writes (the rest of a short write is not counted again) */
+    uint64_t frames;         /* Sent */
+    uint64_t coalesced;      /* Of them, packed with others */
+    uint64_t delayMicros;    /* Time packed frames waited in the buffer, summed */
+    uint32_t maxDelayMicros; /* Longest a frame waited */
+
+    double framesPerWrite() const
+    {
+        return (this->writes > 0) ? (double)this->frames / (double)this->writes : 0.0;
+    }
+
+    /* Latency added per frame */
+    double delayPerFrame() const
+    {
+        return (this->frames > 0) ? (double)this->delayMicros / (double)this->frames : 0.0;
+    }
+};
+
+struct IoTBufferStats
+{
+    uint32_t size;        /* Buffer size in use for sending */
+    uint64_t parts;       /* Frames sent with a body */
+    uint64_t prefixBytes; /* Control bytes, ID, path, headers and Body Length repeated by those frames */
+    uint64_t bodyBytes;
+    uint32_t partMicros;  /* Time to hand one part of a multipart send to the transport (smoothed, current size) */
+    uint32_t throughput;  /* Body bytes per ms of multipart sends (smoothed, current size) */
+    uint32_t rttMicros;   /* Last BUFFER_SIZE_REQUEST round trip */
+    uint32_t resizes;     /* Sizes the tuner asked for */
+
+    /* Share of the bytes sent that are prefix, 0..1 */
+    double overhead() const
+    {
+        return (this->prefixBytes + this->bodyBytes > 0) ? (double)this->prefixBytes / (double)(this->prefixBytes + this->bodyBytes) : 0.0;
+    }
+};
+
+struct IoTPriorityStats
+{
+    uint32_t depth;         /* Frames waiting in the class queue */
+    uint64_t direct;        /* Frames written with nothing queued before them */
+    uint64_t queued;        /* Frames that waited in the class queue */
+    uint64_t waitMicros;    /* Total time those waited */
+    uint32_t maxWaitMicros;
+};
+
+struct IoTHeaderStats
+{
+    uint64_t frames;       /* Sent with the header table */
+    uint64_t plainBytes;   /* Their header blocks as version 1 text */
+    uint64_t encodedBytes; /* The same, as sent */
+    uint64_t indexed;      /* Headers sent as a table slot */
+    uint32_t inserted;     /* Entries added to the table */
+};
+
+struct IoTCodecStats
+{
+    uint64_t parts;        /* Sent with the body codec */
+    uint64_t rawBytes;     /* Their body bytes */
+    uint64_t encodedBytes; /* The same, as sent (block headers included) */
+    uint64_t stored;       /* Parts that did not shrink, sent as is */
+    uint64_t decoded;      /* Parts received with the body codec */
+    uint32_t errors;       /* Of those, parts that did not decode: their message is dropped */
+
+    /* Bytes sent per body byte, 0..1 (and a bit above for incompressible bodies) */
+    double ratio() const
+    {
+        return (this->rawBytes > 0) ? (double)this->encodedBytes / (double)this->rawBytes : 1.0;
+    }
 };
 
 typedef std::function<void(IoTClient *iotClient)> OnDisconnect;
+typedef std::function<IoTBodySink *(IoTRequest *request)> OnBodySink;
+typedef std::function<void(IoTClient *iotClient, size_t queued)> OnHighWater;
+
+/* What trySend did */
+enum class EIoTSendResult : uint8_t
+{
+    QUEUED = 0x0,     /* Written to the transport or queued on the outbound buffer */
+    WOULD_BLOCK = 0x1 /* Outbound buffer or pending requests full: nothing was sent */
+};
+
+struct IoTHeaderPlan; /* How enqueue sends each header of a version 2 frame */
+
+typedef std::map<uint16_t, IoTMultiPart, std::less<uint16_t>, IoTStlAllocator<std::pair<const uint16_t, IoTMultiPart>>> IoTMultiPartMap;
 
 struct IoTClient
 {
     Client *client;
-    std::map<uint16_t, IoTRequestResponse> requestResponse;
-    std::map<uint16_t, IoTMultiPart> multiPartControl;
-    uint8_t *remainBuffer; /* Remain data on buffer o be processed */
-    size_t remainBufferLength;
-    bool lockedForWrite;
+    IoTPendingTable<IoTRequestResponse> requestResponse; /* Requests waiting for a response, by ID */
+    uint16_t lastRequestId;                              /* Last ID from generateRequestId */
+    uint64_t *requestIdsInUse;                           /* Bit per ID naming a pending request, stream or multipart message (8 KiB). Allocated by listen, freed by unlisten */
+    IoTMultiPartMap multiPartControl;
+    IoTDecoder decoder;
+    IoTReadStats readStats;
+    IoTVectoredWriter *vectoredWriter; /* Optional: lets send write prefix and body without copying. NULL = copy into one buffer */
+    IoTSpinLock writeLock;             /* Held while a message is written or queued, so parts of concurrent sends never interleave */
+    /* Outbound: bytes the transport did not take yet, flushed by send, loop and flush */
+    IoTRingBuffer outbound;       /* Frame being written, then the ones taken from the class queues. Allocated on the first short write */
+    uint32_t outboundCapacity;    /* Of outbound and each class queue. 0 = IOT_PROTOCOL_DEFAULT_OUTBOUND_CAPACITY */
+    uint32_t outboundHighWater;   /* onHighWater when queued bytes (class queues included) reach it. 0 = 3/4 of outboundCapacity */
+    bool aboveHighWater;
+    OnHighWater *onHighWater;
+    /* Priority classes (EIoTPriority): whole frames waiting for outbound to drain, each with its length and queue time */
+    IoTRingBuffer priorityQueues[IOT_PRIORITY_CLASSES];      /* Allocated on the first frame that waits */
+    uint8_t priorityWeights[IOT_PRIORITY_CLASSES];          /* Frames per round while the class has some waiting. 0 = 8, 4, 1 */
+    uint8_t priorityServed[IOT_PRIORITY_CLASSES];           /* In the current round */
+    IoTPriorityStats priorityStats[IOT_PRIORITY_CLASSES];
+    IoTCoalescer coalescer;
+    IoTCoalesceStats coalesceStats;
     /* Alive */
     uint16_t aliveInterval;
-    unsigned long aliveNextRequest;
-    /* Buffer */
-    uint32_t bufferSize;
+    unsigned long aliveNextRequest; /* Pushed back by every frame; aliveTimer catches up with it when it fires */
+    IoTTimer aliveTimer;
+    /*
+     * Buffer: each frame carries up to the buffer size bytes (prefix included)
+     * and receivers infer the part length from it, so both ends switch at the
+     * BUFFER_SIZE frame announcing a size: the sender right after writing it,
+     * the receiver when it arrives.
+     */
+    uint32_t bufferSize;        /* Frames sent */
+    uint32_t receiveBufferSize; /* Frames received. 0 = bufferSize */
+    uint32_t maxBufferSize;     /* Largest size this side takes, advertised in BUFFER_SIZE_RESPONSE. 0 = IOT_PROTOCOL_MAX_BUFFER_SIZE */
+    uint32_t peerMaxBufferSize; /* Advertised by the peer. 0 = unknown (v1 peers) */
+    IoTBufferTuner bufferTuner;
+    IoTBufferStats bufferStats;
+    /*
+     * Streams: with streamWindow set, multipart REQUEST, RESPONSE and STREAMING
+     * sends are interleaved part by part (by ID, round robin) instead of going
+     * out in one go, so other frames get through between their parts. Each
+     * one runs at most streamWindow body bytes ahead of what the receiver's
+     * handlers took: the receiver grants more with CREDIT frames. Both ends
+     * set the same window. 0 = off (v1 peers)
+     */
+    uint32_t streamWindow;
+    std::vector<IoTStream> streams; /* Being sent, parts pumped by send, flush and loop */
+    size_t streamCursor;            /* Next stream to send a part */
+    IoTStreamStats streamStats;
+    /*
+     * Header table: with headerCompression set, frames with headers go out as
+     * version 2, each header as a slot of a per-connection table of (key, value)
+     * pairs, a static key ID and its value, or text. Frames add the headers
+     * that fit to the table; later frames reference them once those frames were
+     * taken by the transport. Set by itself when the peer sends version 2
+     * frames. Templates stay version 1. false = version 1 (v1 peers)
+     */
+    bool headerCompression;
+    IoTHeaderTable *headerTable;     /* Headers sent. Allocated on first use, freed by unlisten */
+    IoTHeaderTable *peerHeaderTable; /* Headers received */
+    IoTHeaderStats headerStats;
+    /*
+     * Body codec: with bodyCodec set, REQUEST, RESPONSE and STREAMING bodies
+     * go out compressed once the peer said it decodes the codec. Each part is
+     * a block of its own (stored when it does not shrink), so neither end ever
+     * holds more than one part. BUFFER_SIZE frames carry the codecs each end
+     * decodes and the one it uses from that frame on: the sender switches
+     * right after writing it, the receiver when it arrives. NONE = off (v1 peers)
+     */
+    EIoTBodyCodec bodyCodec;
+    uint32_t bodyCodecWindow;   /* Encoder match distance, 256..32768: window / 2 bytes of table. 0 = IOT_LZ_DEFAULT_WINDOW */
+    EIoTBodyCodec sendCodec;    /* Of the frames sent */
+    EIoTBodyCodec receiveCodec; /* Of the frames received */
+    uint8_t peerBodyCodecs;     /* Decoded by the peer, bit per codec. 0 = unknown (v1 peers) */
+    uint8_t *codecBuffer;       /* Encoder table, then the block of one part. Allocated on first use, freed by unlisten */
+    size_t codecCapacity;
+    IoTCodecStats codecStats;
+    /* Pending requests: capacity of requestResponse. 0 = IOT_PROTOCOL_DEFAULT_MAX_PENDING_REQUESTS. Once full, sends with a requestResponse return NULL (nothing sent) */
+    uint16_t maxPendingRequests;
 
     OnDisconnect *onDisconnect;
+
+    /* Memory: set up by IoTProtocol::listen */
+    IoTAllocator *allocator; /* NULL = IoTProtocol::allocator */
+    IoTArena arena;          /* Copies of the frame being handled (EIoTDecodeMode::COPY), reset after each frame */
+    IoTPool multiPartPool;   /* Nodes of multiPartControl */
 };
 
 class IoTProtocol
 {
 private:
     std::map<Client *, IoTClient *> clients = std::map<Client *, IoTClient *>();
-    void onData(IoTClient *iotClient, uint8_t *buffer, size_t bufLen);
+    IoTTimerWheel timers; /* Alive, request and multipart deadlines of every client */
+    size_t onData(IoTClient *iotClient, uint8_t *buffer, size_t bufLen);
+    bool frameBudgetSpent(IoTClient *iotClient);
+    size_t writeFrame(IoTClient *iotClient, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength);
+    bool decode(IoTClient *iotClient, uint8_t *frame, size_t length);
+    size_t decoderWant(IoTClient *iotClient, uint8_t *buffer, size_t bufLen);
+    bool stageFrame(IoTClient *iotClient, uint8_t *buffer, size_t bufLen);
+    void onFrame(IoTClient *iotClient, uint8_t *frame);
+    IoTAllocator *allocatorOf(IoTClient *iotClient);
+    void runFlatMiddleware(IoTRequest *request, size_t index);
+    void onTimer(IoTTimer *timer, unsigned long now);
+    IoTBodySink *openBodySink(IoTRequest *request);
+    void dropMultiParts(IoTClient *iotClient);
+    void claimRequestId(IoTClient *iotClient, uint16_t id);
+    void releaseRequestId(IoTClient *iotClient, uint16_t id);
+    void markRequestIds(IoTClient *iotClient);
+    IoTRequest *enqueue(IoTRequest *request, IoTRequestResponse *requestResponse, bool nonBlocking);
+    IoTRequest *enqueue(IoTRequestTemplate *requestTemplate, IoTRequest *request, IoTRequestResponse *requestResponse, bool nonBlocking);
+    IoTRequest *transmit(IoTRequest *request, IoTRequestResponse *requestResponse, uint8_t *data, size_t frameSize, size_t prefixLength, size_t bodyLength, bool nonBlocking);
+    void tuneBufferSize(IoTClient *iotClient, size_t bodyLength, size_t parts, unsigned long elapsed);
+    void pumpStreams(IoTClient *iotClient);
+    void dropStream(IoTClient *iotClient, size_t index);
+    IoTHeaderTable *headerTableOf(IoTClient *iotClient, IoTHeaderTable **table);
+    void freeHeaderTables(IoTClient *iotClient);
+    uint8_t planHeaders(IoTClient *iotClient, IoTRequest *request, IoTHeaderPlan *plan, bool mayInsert);
+    void settleHeaders(IoTClient *iotClient, bool transmitted);
+    void queueFrame(IoTClient *iotClient, EIoTPriority priority, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength);
+    void queuePart(IoTClient *iotClient, EIoTPriority priority, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength);
+    size_t encodeBody(IoTClient *iotClient, const uint8_t *body, size_t bodyLength, const uint8_t **payload);
+    uint8_t *decodeBody(IoTClient *iotClient, const uint8_t *block, size_t blockLength, size_t *bodyLength);
+    void freeCodecBuffer(IoTClient *iotClient);
+    bool queueClassFrame(IoTClient *iotClient, EIoTPriority priority, uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength);
+    void queueBytes(IoTClient *iotClient, const uint8_t *data, size_t length);
+    size_t writeOutbound(IoTClient *iotClient);
+    bool promoteFrame(IoTClient *iotClient);
+    size_t flushOutbound(IoTClient *iotClient);
+    bool coalesceFrame(IoTClient *iotClient, const uint8_t *prefix, size_t prefixLength, const uint8_t *body, size_t bodyLength);
+    size_t writeCoalesced(IoTClient *iotClient);
+    size_t flushClient(IoTClient *iotClient, bool coalesced);
+    bool drainOutbound(IoTClient *iotClient);
+    void dropOutbound(IoTClient *iotClient);
 
     /* Alive Request Response Timeout */
     OnTimeout onAliveRequestTimeout;
 
-    /* Buffer Size Response */
-    OnResponse onBufferSizeResponse;
-
 public:
     IoTProtocol(unsigned long timeout = 1000, uint32_t delay = 300);
-    uint32_t delay = 300;
+    uint32_t delay = 300; /* Unused: sends no longer wait for each other, they queue on the outbound buffer */
     unsigned long timeout = 1000;
+    EIoTDecodeMode decodeMode = EIoTDecodeMode::COPY;
+    EIoTMiddlewareMode middlewareMode = EIoTMiddlewareMode::NESTED;
+    uint32_t frameBudget = 0; /* Max frames handled per client on each readClient call (fairness across clients). 0 = drain all */
+    IoTAllocator *allocator = NULL; /* Backs client arenas, pools and decoder buffers. NULL = IoTHeapAllocator::shared() */
 
-    std::vector<IoTMiddleware> middlewares;
+    std::vector<IoTMiddlewareStage> middlewares;
+    /* Called on the first part of a SIGNAL, REQUEST, RESPONSE or STREAMING body: a sink to write it to, NULL = none */
+    OnBodySink onBodySink;
 
     /* Common methods */
     void use(IoTMiddleware middleware);
-    void runMiddleware(IoTRequest *request, int index);
+    void use(const char *path, IoTRouter *router); /* Routes of `router` are relative to `path` */
+    void runMiddleware(IoTRequest *request, int index = 0); /* Stages from `index` on, as middlewareMode says */
     void listen(IoTClient *iotClient);
+    void unlisten(IoTClient *iotClient); /* Stops handling a client (e.g. disconnected): drops its pending requests, timers and queued bytes */
     uint16_t generateRequestId(IoTClient *iotClient);
     IoTRequest *signal(IoTRequest *request);
     IoTRequest *request(IoTRequest *request, IoTRequestResponse *requestResponse);
@@ -135,20 +652,37 @@ public:
     IoTRequest *streaming(IoTRequest *request, IoTRequestResponse *requestResponse);
     IoTRequest *aliveRequest(IoTRequest *request, IoTRequestResponse *requestResponse);
     IoTRequest *aliveResponse(IoTRequest *request);
-    IoTRequest *bufferSizeRequest(IoTClient *iotClient, uint32_t size);
+    IoTRequest *bufferSizeRequest(IoTClient *iotClient, uint32_t size); /* Clamped to peerMaxBufferSize when known */
     IoTRequest *bufferSizeResponse(IoTRequest *request);
+    IoTRequest *credit(IoTClient *iotClient, uint16_t id, uint32_t bytes); /* Grants `bytes` more to the peer's stream `id` */
+    /* NULL, and nothing sent, when `requestResponse` is set and maxPendingRequests responses are already awaited */
     IoTRequest *send(IoTRequest *request, IoTRequestResponse *requestResponse);
-    void resetRemainBuffer(IoTClient *iotClient);
+    /* send that never waits: WOULD_BLOCK unless the whole message fits on the outbound buffer (and the pending requests) */
+    EIoTSendResult trySend(IoTRequest *request, IoTRequestResponse *requestResponse);
+    /* Writes the coalesced frames and the queued outbound bytes the transport accepts now, then parts of streams with credit (loop() does it for every client, coalesced frames once due). Returns the queued bytes written */
+    size_t flush(IoTClient *iotClient);
+
+    /* Templates: compile reads method, path, headers and whether there is a body (body or bodySource set) */
+    IoTRequestTemplate compile(IoTRequest *request);
+    /* Sends `requestTemplate` with request->body/bodyLength (and request->id, generated when 0) on request->iotClient */
+    IoTRequest *send(IoTRequestTemplate *requestTemplate, IoTRequest *request, IoTRequestResponse *requestResponse = NULL);
+    EIoTSendResult trySend(IoTRequestTemplate *requestTemplate, IoTRequest *request, IoTRequestResponse *requestResponse = NULL);
+    void freeTemplate(IoTRequestTemplate *requestTemplate);
+
+    void resetDecoder(IoTClient *iotClient);
     void scheduleNextAliveRequest(IoTClient *iotClient);
 
     /* Helper methods */
     void freeRequest(IoTRequest *request);
+    IoTRequest retainRequest(IoTRequest *request); /* Owning deep copy, release it with freeRequest */
     // void resetClients();
     void readClient(IoTClient *iotClient);
     void loop();
+    void expireTimers(); /* The deadline half of loop(), for event loops that read clients when they become readable */
 
     /* Utils for app layer */
     const char *getHeader(IoTRequest *request, const char *headerKey);
+    const char *getHeader(IoTRequest *request, EIoTHeaderKey headerKey); /* Well-known keys: index lookup */
 };
 
 // #ifdef __cplusplus
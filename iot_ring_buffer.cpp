@@ -0,0 +1,114 @@
+#include "iot_ring_buffer.h"
+
+IoTRingBuffer::IoTRingBuffer()
+{
+    this->data = NULL;
+    this->limit = 0;
+    this->head = 0;
+    this->length = 0;
+    this->allocator = NULL;
+}
+
+IoTRingBuffer::IoTRingBuffer(const IoTRingBuffer &other) : IoTRingBuffer()
+{
+}
+
+IoTRingBuffer &IoTRingBuffer::operator=(const IoTRingBuffer &other)
+{
+    if (this != &other)
+    {
+        this->release();
+    }
+    return *this;
+}
+
+IoTRingBuffer::~IoTRingBuffer()
+{
+    this->release();
+}
+
+void IoTRingBuffer::release()
+{
+    if (this->data != NULL)
+    {
+        this->allocator->deallocate(this->data);
+    }
+    this->data = NULL;
+    this->limit = 0;
+    this->head = 0;
+    this->length = 0;
+}
+
+bool IoTRingBuffer::reserve(size_t capacity, IoTAllocator *allocator)
+{
+    this->release();
+
+    this->allocator = (allocator != NULL) ? allocator : IoTHeapAllocator::shared();
+    this->data = (uint8_t *)this->allocator->allocate(capacity);
+    if (this->data == NULL)
+    {
+        return false;
+    }
+    this->limit = capacity;
+    return true;
+}
+
+size_t IoTRingBuffer::write(const uint8_t *data, size_t length)
+{
+    if (length > this->space())
+    {
+        length = this->space();
+    }
+
+    size_t tail = (this->head + this->length) % (this->limit > 0 ? this->limit : 1);
+    size_t first = this->limit - tail;
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(this->data + tail, data, first);
+    memcpy(this->data, data + first, length - first);
+
+    this->length += length;
+    return length;
+}
+
+size_t IoTRingBuffer::peek(IoTIoVec iov[2]) const
+{
+    if (this->length == 0)
+    {
+        return 0;
+    }
+
+    size_t first = this->limit - this->head;
+    if (first >= this->length)
+    {
+        iov[0].data = this->data + this->head;
+        iov[0].length = this->length;
+        return 1;
+    }
+
+    iov[0].data = this->data + this->head;
+    iov[0].length = first;
+    iov[1].data = this->data;
+    iov[1].length = this->length - first;
+    return 2;
+}
+
+void IoTRingBuffer::consume(size_t length)
+{
+    if (length >= this->length)
+    {
+        this->clear();
+        return;
+    }
+
+    this->head = (this->head + length) % this->limit;
+    this->length -= length;
+}
+
+void IoTRingBuffer::clear()
+{
+    this->head = 0;
+    this->length = 0;
+}
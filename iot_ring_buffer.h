@@ -0,0 +1,53 @@
+#pragma once
+
+#ifndef __IOT_RING_BUFFER_H__
+#define __IOT_RING_BUFFER_H__
+
+#include "iot_platform.h"
+#include "iot_allocator.h"
+
+/*
+ * Bounded byte ring. Storage is allocated once by reserve(); readers see the
+ * queued bytes as at most two contiguous segments (peek), so they can be
+ * handed to a vectored write without copying.
+ *
+ * Copying a ring gives an empty ring.
+ */
+class IoTRingBuffer
+{
+public:
+    IoTRingBuffer();
+    IoTRingBuffer(const IoTRingBuffer &other);
+    IoTRingBuffer &operator=(const IoTRingBuffer &other);
+    ~IoTRingBuffer();
+
+    /* Allocates `capacity` bytes from `allocator` (NULL = heap). Drops the queued bytes */
+    bool reserve(size_t capacity, IoTAllocator *allocator);
+
+    size_t capacity() const { return this->limit; }
+    size_t size() const { return this->length; }
+    size_t space() const { return this->limit - this->length; }
+    bool empty() const { return this->length == 0; }
+
+    /* Appends up to `length` bytes, returns how many fit */
+    size_t write(const uint8_t *data, size_t length);
+
+    /* Queued bytes as 1 or 2 segments, returns the number of segments (0 = empty) */
+    size_t peek(IoTIoVec iov[2]) const;
+
+    /* Drops `length` bytes from the front */
+    void consume(size_t length);
+
+    void clear();
+
+private:
+    uint8_t *data;
+    size_t limit;
+    size_t head; /* First queued byte */
+    size_t length;
+    IoTAllocator *allocator;
+
+    void release();
+};
+
+#endif
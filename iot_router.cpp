@@ -0,0 +1,349 @@
+#include "iot_router.h"
+
+static const char wildcardName[] = "*";
+
+const IoTPathParam *IoTPathParams::get(const char *name) const
+{
+    for (size_t i = 0; i < this->size; i++)
+    {
+        if (strcmp(this->params[i].name, name) == 0)
+        {
+            return &(this->params[i]);
+        }
+    }
+    return NULL;
+}
+
+IoTRouter::IoTRouter()
+{
+    this->compiled = false;
+}
+
+/* Length of the segment starting at `path` (up to '/' or the end) */
+static size_t segmentLength(const char *path)
+{
+    size_t length = 0;
+    while (path[length] != '/' && path[length] != '\0')
+    {
+        length++;
+    }
+    return length;
+}
+
+void IoTRouter::use(const char *pattern, IoTMiddleware middleware)
+{
+    if (pattern == NULL || middleware == NULL)
+    {
+        throw "[IoTRouter] Pattern and middleware are required";
+    }
+
+    /* Segments of the pattern, each NUL-terminated, empty ones ('//', trailing '/') dropped */
+    std::vector<char> normalized;
+    uint32_t segmentCount = 0;
+    size_t params = 0;
+    for (const char *segment = pattern; *segment != '\0';)
+    {
+        size_t length = segmentLength(segment);
+        if (length > 0)
+        {
+            if (segment[0] == '*' && (length != 1 || segment[length] != '\0'))
+            {
+                throw "[IoTRouter] '*' must be the last segment";
+            }
+            if (segment[0] == ':' && length == 1)
+            {
+                throw "[IoTRouter] Parameter without name";
+            }
+            if ((segment[0] == ':' || segment[0] == '*') && ++params > IOT_ROUTER_MAX_PARAMS)
+            {
+                throw "[IoTRouter] Too many parameters";
+            }
+            normalized.insert(normalized.end(), segment, segment + length);
+            normalized.push_back('\0');
+            segmentCount++;
+        }
+        segment += length;
+        if (*segment == '/')
+        {
+            segment++;
+        }
+    }
+
+    /* Same pattern: one more handler on its chain */
+    for (auto route = this->routes.begin(); route != this->routes.end(); ++route)
+    {
+        if (route->patternLength == normalized.size() &&
+            (normalized.empty() || memcmp(&this->segments[route->pattern], &normalized[0], normalized.size()) == 0))
+        {
+            route->chain.push_back(middleware);
+            return;
+        }
+    }
+
+    Route route;
+    route.pattern = (uint32_t)this->segments.size();
+    route.patternLength = (uint32_t)normalized.size();
+    route.segmentCount = segmentCount;
+    route.chain.push_back(middleware);
+    this->segments.insert(this->segments.end(), normalized.begin(), normalized.end());
+    this->routes.push_back(route);
+    this->compiled = false;
+}
+
+void IoTRouter::compile()
+{
+    /* Insert every route into a trie whose literal children are unsorted lists */
+    std::vector<Node> nodes;
+    std::vector<std::vector<Edge>> literals;
+    Node root = {0, 0, -1, 0, -1, -1};
+    nodes.push_back(root);
+    literals.push_back(std::vector<Edge>());
+
+    for (size_t r = 0; r < this->routes.size(); r++)
+    {
+        uint32_t node = 0;
+        uint32_t offset = this->routes[r].pattern;
+
+        for (uint32_t s = 0; s < this->routes[r].segmentCount; s++)
+        {
+            const char *segment = &this->segments[offset];
+            uint32_t length = (uint32_t)strlen(segment);
+
+            if (segment[0] == '*')
+            {
+                if (nodes[node].wildcard < 0)
+                {
+                    nodes[node].wildcard = (int32_t)r;
+                }
+                node = UINT32_MAX;
+                break;
+            }
+
+            int32_t child = -1;
+            if (segment[0] == ':')
+            {
+                if (nodes[node].param >= 0 && strcmp(&this->segments[nodes[node].paramName], segment + 1) != 0)
+                {
+                    throw "[IoTRouter] Parameters at the same place must have the same name";
+                }
+                child = nodes[node].param;
+            }
+            else
+            {
+                for (auto edge = literals[node].begin(); edge != literals[node].end(); ++edge)
+                {
+                    if (strcmp(&this->segments[edge->label], segment) == 0)
+                    {
+                        child = (int32_t)edge->node;
+                        break;
+                    }
+                }
+            }
+
+            if (child < 0)
+            {
+                child = (int32_t)nodes.size();
+                nodes.push_back(root);
+                literals.push_back(std::vector<Edge>());
+                if (segment[0] == ':')
+                {
+                    nodes[node].param = child;
+                    nodes[node].paramName = offset + 1;
+                }
+                else
+                {
+                    Edge edge = {offset, length, (uint32_t)child};
+                    literals[node].push_back(edge);
+                }
+            }
+
+            node = (uint32_t)child;
+            offset += length + 1;
+        }
+
+        if (node != UINT32_MAX && nodes[node].route < 0)
+        {
+            nodes[node].route = (int32_t)r;
+        }
+    }
+
+    /* Flatten: the literal children of each node become a sorted run of `edges` */
+    const char *labels = this->segments.data();
+    this->edges.clear();
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        std::sort(literals[n].begin(), literals[n].end(), [labels](const Edge &a, const Edge &b)
+                  { return strcmp(labels + a.label, labels + b.label) < 0; });
+        nodes[n].firstEdge = (uint32_t)this->edges.size();
+        nodes[n].edgeCount = (uint32_t)literals[n].size();
+        this->edges.insert(this->edges.end(), literals[n].begin(), literals[n].end());
+    }
+    this->nodes.swap(nodes);
+    this->compiled = true;
+}
+
+/* Route matching `path` from `node`, -1 = none. Literals first, then the parameter, then the wildcard */
+int32_t IoTRouter::walk(uint32_t node, const char *path, IoTPathParams *params)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+
+    const Node *current = &(this->nodes[node]);
+    if (*path == '\0')
+    {
+        if (current->route >= 0)
+        {
+            return current->route;
+        }
+        if (current->wildcard >= 0)
+        {
+            IoTPathParam rest = {wildcardName, path, 0};
+            params->params[params->size++] = rest;
+            return current->wildcard;
+        }
+        return -1;
+    }
+
+    size_t length = segmentLength(path);
+
+    /* Binary search among the literal children */
+    const char *labels = this->segments.data();
+    size_t low = current->firstEdge;
+    size_t high = current->firstEdge + current->edgeCount;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        const Edge *edge = &(this->edges[middle]);
+        int order = strncmp(labels + edge->label, path, length);
+        if (order == 0 && edge->labelLength != length)
+        {
+            order = (edge->labelLength < length) ? -1 : 1;
+        }
+
+        if (order == 0)
+        {
+            int32_t route = this->walk(edge->node, path + length, params);
+            if (route >= 0)
+            {
+                return route;
+            }
+            break;
+        }
+        if (order < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (current->param >= 0)
+    {
+        size_t size = params->size;
+        IoTPathParam param = {labels + current->paramName, path, length};
+        params->params[params->size++] = param;
+        int32_t route = this->walk((uint32_t)current->param, path + length, params);
+        if (route >= 0)
+        {
+            return route;
+        }
+        params->size = size;
+    }
+
+    if (current->wildcard >= 0)
+    {
+        IoTPathParam rest = {wildcardName, path, strlen(path)};
+        params->params[params->size++] = rest;
+        return current->wildcard;
+    }
+
+    return -1;
+}
+
+const std::vector<IoTMiddleware> *IoTRouter::match(const char *path, IoTPathParams *params)
+{
+    if (!this->compiled)
+    {
+        this->compile();
+    }
+
+    params->size = 0;
+    if (path == NULL || this->routes.empty())
+    {
+        return NULL;
+    }
+
+    int32_t route = this->walk(0, path, params);
+    return (route >= 0) ? &(this->routes[route].chain) : NULL;
+}
+
+/* What the Next of a route handler resumes, like IoTMiddlewareCall */
+struct IoTRouteCall
+{
+    const std::vector<IoTMiddleware> *chain;
+    IoTRequest *request;
+    size_t index;
+    const IoTPathParams *outer; /* request->params outside the router */
+    Next *next;                 /* Middlewares after the router */
+};
+
+static void runRoute(IoTRouteCall *call)
+{
+    if (call->index >= call->chain->size())
+    {
+        /* Fell through the chain */
+        call->request->params = call->outer;
+        (*(call->next))();
+        return;
+    }
+
+    IoTRouteCall nextCall = *call;
+    nextCall.index++;
+    IoTRouteCall *_call = &nextCall;
+    Next _next = [_call]()
+    {
+        runRoute(_call);
+    };
+
+    call->chain->at(call->index)(call->request, &_next);
+}
+
+void IoTRouter::dispatch(IoTRequest *request, const char *path, Next *next)
+{
+    IoTPathParams params;
+    const std::vector<IoTMiddleware> *chain = this->match(path, &params);
+    if (chain == NULL)
+    {
+        (*next)();
+        return;
+    }
+
+    IoTRouteCall call = {chain, request, 0, request->params, next};
+    request->params = &params;
+    runRoute(&call);
+    request->params = call.outer;
+}
+
+bool IoTRouter::dispatch(IoTRequest *request, const char *path, IoTMiddlewareContext *context)
+{
+    IoTPathParams params;
+    const std::vector<IoTMiddleware> *chain = this->match(path, &params);
+    if (chain == NULL)
+    {
+        return true;
+    }
+
+    const IoTPathParams *outer = request->params;
+    request->params = &params;
+    bool proceed = true;
+    for (size_t i = 0; i < chain->size() && proceed; i++)
+    {
+        proceed = context->step((*chain)[i], request);
+    }
+    request->params = outer;
+    return proceed;
+}
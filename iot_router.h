@@ -0,0 +1,97 @@
+#pragma once
+
+#ifndef __IOT_ROUTER_H__
+#define __IOT_ROUTER_H__
+
+#include "iot_protocol.h"
+
+#ifndef IOT_ROUTER_MAX_PARAMS
+#define IOT_ROUTER_MAX_PARAMS 8 /* Parameters (and wildcard) captured by one route */
+#endif
+
+/* Path parameter captured by a route: `value` is a view into request->path, `length` bytes (not NUL-terminated) */
+struct IoTPathParam
+{
+    const char *name;
+    const char *value;
+    size_t length;
+};
+
+struct IoTPathParams
+{
+    size_t size;
+    IoTPathParam params[IOT_ROUTER_MAX_PARAMS];
+
+    const IoTPathParam *get(const char *name) const; /* NULL = not captured */
+};
+
+/*
+ * Path router, mounted with IoTProtocol::use(path, router).
+ *
+ *   router.use("/devices/:id/telemetry", onTelemetry);
+ *   protocol.use("/api", &router);
+ *
+ * Patterns are '/'-separated segments: literals, `:name` parameters (one
+ * segment) and a final `*` (the rest of the path, captured as "*"). They are
+ * compiled once into a segment trie, so a frame costs one walk down its path:
+ * literals are matched before parameters, and only the handler chain of the
+ * matching route runs. Handlers read the parameters from request->params.
+ * Without a match, or when the chain calls next past its last handler, the
+ * protocol middlewares after the router go on.
+ */
+class IoTRouter
+{
+public:
+    IoTRouter();
+
+    /* Appends `middleware` to the chain of `pattern` */
+    void use(const char *pattern, IoTMiddleware middleware);
+
+    /* Builds the trie. Done on the first dispatch when routes changed, call it at startup to keep that off the receive path */
+    void compile();
+
+    /* Handler chain of the route matching `path` (NULL = none), filling `params` */
+    const std::vector<IoTMiddleware> *match(const char *path, IoTPathParams *params);
+
+    /* Runs the matching chain with request->params set, then `next` when it falls through */
+    void dispatch(IoTRequest *request, const char *path, Next *next);
+
+    /* Same for the FLAT executor (EIoTMiddlewareMode). true when the pipeline goes on: no match, or the chain called next to its end */
+    bool dispatch(IoTRequest *request, const char *path, IoTMiddlewareContext *context);
+
+private:
+    struct Route
+    {
+        uint32_t pattern; /* Offset in `segments`: its segments, each NUL-terminated */
+        uint32_t patternLength;
+        uint32_t segmentCount;
+        std::vector<IoTMiddleware> chain;
+    };
+
+    struct Node
+    {
+        uint32_t firstEdge; /* Literal children: edges[firstEdge, firstEdge + edgeCount), sorted by label */
+        uint32_t edgeCount;
+        int32_t param;      /* `:name` child node, -1 = none */
+        uint32_t paramName; /* Of the `:name` child, offset in `segments` */
+        int32_t wildcard;   /* Route of a final `*`, -1 = none */
+        int32_t route;      /* Route ending here, -1 = none */
+    };
+
+    struct Edge
+    {
+        uint32_t label; /* Offset in `segments` */
+        uint32_t labelLength;
+        uint32_t node;
+    };
+
+    std::vector<Route> routes;
+    std::vector<Node> nodes;
+    std::vector<Edge> edges;
+    std::vector<char> segments; /* Of every pattern. Labels and parameter names point into it */
+    bool compiled;
+
+    int32_t walk(uint32_t node, const char *path, IoTPathParams *params);
+};
+
+#endif
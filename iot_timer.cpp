@@ -0,0 +1,246 @@
+#include "iot_timer.h"
+
+#define IOT_TIMER_WHEEL_MASK (IOT_TIMER_WHEEL_SLOTS - 1)
+
+/* Timer */
+
+IoTTimer::IoTTimer()
+{
+    this->next = NULL;
+    this->prev = NULL;
+    this->wheel = NULL;
+    this->deadline = 0;
+    this->slot = 0;
+    this->kind = 0;
+    this->id = 0;
+    this->owner = NULL;
+}
+
+IoTTimer::IoTTimer(const IoTTimer &other) : IoTTimer()
+{
+}
+
+IoTTimer &IoTTimer::operator=(const IoTTimer &other)
+{
+    if (this != &other && this->wheel != NULL)
+    {
+        this->wheel->cancel(this);
+    }
+    return *this;
+}
+
+IoTTimer::~IoTTimer()
+{
+    if (this->wheel != NULL)
+    {
+        this->wheel->cancel(this);
+    }
+}
+
+/* Wheel */
+
+IoTTimerWheel::IoTTimerWheel()
+{
+    memset(this->slots, 0, sizeof(this->slots));
+    this->cursor = 0;
+    this->started = false;
+    this->count = 0;
+}
+
+IoTTimerWheel::IoTTimerWheel(const IoTTimerWheel &other) : IoTTimerWheel()
+{
+}
+
+IoTTimerWheel &IoTTimerWheel::operator=(const IoTTimerWheel &other)
+{
+    if (this != &other)
+    {
+        this->clear();
+    }
+    return *this;
+}
+
+IoTTimerWheel::~IoTTimerWheel()
+{
+    this->clear();
+}
+
+void IoTTimerWheel::place(IoTTimer *timer)
+{
+    unsigned long tick = this->cursor / IOT_TIMER_WHEEL_RESOLUTION;
+    unsigned long ticks = 0; /* Until due */
+    if (!iotTimeReached(timer->deadline, this->cursor))
+    {
+        ticks = (timer->deadline - this->cursor) / IOT_TIMER_WHEEL_RESOLUTION;
+    }
+
+    /* Beyond the last level: park as far as it reaches, placed again when it cascades */
+    unsigned long reach = (1UL << (IOT_TIMER_WHEEL_BITS * IOT_TIMER_WHEEL_LEVELS)) - 1;
+    if (ticks > reach)
+    {
+        ticks = reach;
+    }
+    tick += ticks;
+
+    uint8_t level = 0;
+    while (level + 1 < IOT_TIMER_WHEEL_LEVELS && ticks >= (1UL << (IOT_TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    uint16_t slot = level * IOT_TIMER_WHEEL_SLOTS + ((tick >> (IOT_TIMER_WHEEL_BITS * level)) & IOT_TIMER_WHEEL_MASK);
+
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = this->slots[slot];
+    if (timer->next != NULL)
+    {
+        timer->next->prev = timer;
+    }
+    this->slots[slot] = timer;
+}
+
+void IoTTimerWheel::schedule(IoTTimer *timer, unsigned long deadline)
+{
+    if (timer->wheel != NULL)
+    {
+        timer->wheel->cancel(timer);
+    }
+
+    if (!this->started)
+    {
+        unsigned long now = iotMillis();
+        this->cursor = now - (now % IOT_TIMER_WHEEL_RESOLUTION);
+        this->started = true;
+    }
+
+    timer->deadline = deadline;
+    timer->wheel = this;
+    this->place(timer);
+    this->count++;
+}
+
+void IoTTimerWheel::cancel(IoTTimer *timer)
+{
+    if (timer->wheel != this)
+        return;
+
+    if (timer->prev != NULL)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        this->slots[timer->slot] = timer->next;
+    }
+
+    if (timer->next != NULL)
+    {
+        timer->next->prev = timer->prev;
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->wheel = NULL;
+    this->count--;
+}
+
+void IoTTimerWheel::clear()
+{
+    for (size_t i = 0; i < IOT_TIMER_WHEEL_LEVELS * IOT_TIMER_WHEEL_SLOTS; i++)
+    {
+        for (IoTTimer *timer = this->slots[i]; timer != NULL;)
+        {
+            IoTTimer *next = timer->next;
+            timer->next = NULL;
+            timer->prev = NULL;
+            timer->wheel = NULL;
+            timer = next;
+        }
+        this->slots[i] = NULL;
+    }
+    this->count = 0;
+    this->started = false;
+}
+
+/* Moves the timers of a higher level slot down, now that the wheel reached it */
+void IoTTimerWheel::cascade(uint8_t level, unsigned long tick)
+{
+    uint16_t slot = level * IOT_TIMER_WHEEL_SLOTS + ((tick >> (IOT_TIMER_WHEEL_BITS * level)) & IOT_TIMER_WHEEL_MASK);
+
+    IoTTimer *timer = this->slots[slot];
+    this->slots[slot] = NULL;
+    while (timer != NULL)
+    {
+        IoTTimer *next = timer->next;
+        this->place(timer);
+        timer = next;
+    }
+}
+
+/* Places every timer again from `now` */
+void IoTTimerWheel::rebase(unsigned long now)
+{
+    IoTTimer *timers = NULL;
+    for (size_t i = 0; i < IOT_TIMER_WHEEL_LEVELS * IOT_TIMER_WHEEL_SLOTS; i++)
+    {
+        while (this->slots[i] != NULL)
+        {
+            IoTTimer *timer = this->slots[i];
+            this->slots[i] = timer->next;
+            timer->next = timers;
+            timers = timer;
+        }
+    }
+
+    this->cursor = now - (now % IOT_TIMER_WHEEL_RESOLUTION);
+    while (timers != NULL)
+    {
+        IoTTimer *next = timers->next;
+        this->place(timers);
+        timers = next;
+    }
+}
+
+IoTTimer *IoTTimerWheel::popExpired(unsigned long now)
+{
+    if (this->count == 0)
+    {
+        this->started = false;
+        return NULL;
+    }
+
+    /* Stepping through a long stall one tick at a time costs more than placing every timer again */
+    if ((long)(now - this->cursor) > (long)(IOT_TIMER_WHEEL_SLOTS * IOT_TIMER_WHEEL_SLOTS * IOT_TIMER_WHEEL_RESOLUTION))
+    {
+        this->rebase(now);
+    }
+
+    while (true)
+    {
+        unsigned long tick = this->cursor / IOT_TIMER_WHEEL_RESOLUTION;
+        for (IoTTimer *timer = this->slots[tick & IOT_TIMER_WHEEL_MASK]; timer != NULL; timer = timer->next)
+        {
+            if (iotTimeReached(timer->deadline, now))
+            {
+                this->cancel(timer);
+                return timer;
+            }
+        }
+
+        /* Stay on the current tick, timers may still be added to it */
+        if ((long)(now - this->cursor) < (long)IOT_TIMER_WHEEL_RESOLUTION)
+        {
+            return NULL;
+        }
+        this->cursor += IOT_TIMER_WHEEL_RESOLUTION;
+        tick++;
+
+        for (uint8_t level = 1; level < IOT_TIMER_WHEEL_LEVELS; level++)
+        {
+            if (((tick >> (IOT_TIMER_WHEEL_BITS * (level - 1))) & IOT_TIMER_WHEEL_MASK) != 0)
+                break;
+            this->cascade(level, tick);
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef __IOT_TIMER_H__
+#define __IOT_TIMER_H__
+
+#include "iot_platform.h"
+
+#ifndef IOT_TIMER_WHEEL_RESOLUTION
+#define IOT_TIMER_WHEEL_RESOLUTION 16 /* Milliseconds per tick, power of two */
+#endif
+
+#define IOT_TIMER_WHEEL_BITS 6 /* 64 slots per level */
+#define IOT_TIMER_WHEEL_SLOTS (1 << IOT_TIMER_WHEEL_BITS)
+#define IOT_TIMER_WHEEL_LEVELS 4 /* 64^4 ticks: ~74 hours at 16 ms */
+
+/* `deadline` is at or before `now`, across millis() wrap-around */
+inline bool iotTimeReached(unsigned long deadline, unsigned long now)
+{
+    return (long)(now - deadline) >= 0;
+}
+
+class IoTTimerWheel;
+
+/*
+ * Intrusive timer: embed it in the record that owns the deadline. `kind`, `id`
+ * and `owner` are free for the owner, to know what a popped timer is about.
+ *
+ * A timer cancels itself when destroyed or assigned; copies are not scheduled.
+ */
+struct IoTTimer
+{
+    IoTTimer *next;
+    IoTTimer *prev;
+    IoTTimerWheel *wheel; /* Scheduled on, NULL = not scheduled */
+    unsigned long deadline;
+    uint16_t slot; /* level * IOT_TIMER_WHEEL_SLOTS + index */
+
+    uint8_t kind;
+    uint16_t id;
+    void *owner;
+
+    IoTTimer();
+    IoTTimer(const IoTTimer &other);
+    IoTTimer &operator=(const IoTTimer &other);
+    ~IoTTimer();
+
+    bool scheduled() const { return this->wheel != NULL; }
+};
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * IOT_TIMER_WHEEL_LEVELS levels of IOT_TIMER_WHEEL_SLOTS slots; a level's slot
+ * spans a whole revolution of the level below. A timer is kept on the lowest
+ * level that reaches its deadline and moves down (cascades) as the wheel turns,
+ * so scheduling and cancelling are O(1) and popExpired only visits due timers
+ * plus the occasional cascade, however many timers are far from due.
+ *
+ * Copying a wheel gives an empty wheel.
+ */
+class IoTTimerWheel
+{
+public:
+    IoTTimerWheel();
+    IoTTimerWheel(const IoTTimerWheel &other);
+    IoTTimerWheel &operator=(const IoTTimerWheel &other);
+    ~IoTTimerWheel();
+
+    void schedule(IoTTimer *timer, unsigned long deadline); /* Reschedules a timer already scheduled */
+    void cancel(IoTTimer *timer);
+    void clear();
+
+    /* Next timer due at `now`, unscheduled, or NULL */
+    IoTTimer *popExpired(unsigned long now);
+
+    size_t size() const { return this->count; }
+
+private:
+    IoTTimer *slots[IOT_TIMER_WHEEL_LEVELS * IOT_TIMER_WHEEL_SLOTS];
+    unsigned long cursor; /* Start (ms) of the tick processed next */
+    bool started;
+    size_t count;
+
+    void place(IoTTimer *timer);
+    void cascade(uint8_t level, unsigned long tick);
+    void rebase(unsigned long now);
+};
+
+#endif